@@ -0,0 +1,451 @@
+//
+//  VkSkeletonBenchmark.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/9/21.
+//
+//  Drives VulkanComputeProgram with synthetic frames and prints one JSON line per
+//  configuration (shader x pixel format x frame size x input mode) to stdout.
+//  A readable summary goes to stderr.
+//
+//  usage: vkskeleton_benchmark [--frames N] [--warmup N] [--sizes 720p,1080p,...]
+//                              [--shader-dir DIR] [--label NAME]
+//
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "VulkanComputeProgram.hpp"
+
+// MARK: - Configuration
+
+struct FrameSize {
+    std::string name;
+    uint32_t    width;
+    uint32_t    height;
+};
+
+const std::vector<FrameSize> allFrameSizes = {
+    { "720p",   1280,   720     },
+    { "1080p",  1920,   1080    },
+    { "4K",     3840,   2160    },
+    { "8K",     7680,   4320    },
+    { "16K",    15360,  8640    },
+};
+
+const std::vector<std::pair<std::string, PixelFormat>> allPixelFormats = {
+    { "ARGB32",     ARGB32  },
+    { "ARGB64",     ARGB64  },
+    { "ARGB128",    ARGB128 },
+};
+
+const std::vector<std::string> allShaders = {
+    "invert.comp",
+    "simple.comp",
+};
+
+enum InputMode {
+    // Only the uniforms change between frames, the input pixels are left as they are
+    ParameterOnly,
+    // Every frame brings a full new input image
+    NewInput,
+};
+
+struct BenchmarkOptions {
+    uint32_t                frameCount  = 30;
+    uint32_t                warmupCount = 3;
+    std::vector<FrameSize>  frameSizes  = allFrameSizes;
+    std::string             shaderDir   = VKSKELETON_SHADER_DIR;
+    std::string             label       = "";
+};
+
+// MARK: - Statistics
+
+struct LatencyStats {
+    double meanMs;
+    double p50Ms;
+    double p90Ms;
+    double p99Ms;
+    double minMs;
+    double maxMs;
+};
+
+LatencyStats getLatencyStats(std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+    for (auto sample : samples)
+    {
+        sum += sample;
+    }
+
+    auto percentile = [&](double p) {
+        return samples[static_cast<size_t>(p * static_cast<double>(samples.size() - 1) + 0.5)];
+    };
+
+    return {
+        .meanMs = sum / static_cast<double>(samples.size()),
+        .p50Ms = percentile(0.50),
+        .p90Ms = percentile(0.90),
+        .p99Ms = percentile(0.99),
+        .minMs = samples.front(),
+        .maxMs = samples.back(),
+    };
+}
+
+double getElapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// MARK: - Synthetic Frames
+
+// Noise in every channel, so neither the GPU nor the copies can take shortcuts on uniform data
+void fillSyntheticFrame(std::vector<char>& frame, PixelFormat pixelFormat)
+{
+    std::mt19937 random(1234);
+
+    if (pixelFormat == ARGB128)
+    {
+        std::uniform_real_distribution<float> distribution(0.f, 1.f);
+        auto pixels = reinterpret_cast<float*>(frame.data());
+        for (size_t i = 0; i < frame.size() / sizeof(float); ++i)
+        {
+            pixels[i] = distribution(random);
+        }
+    }
+    else
+    {
+        auto words = reinterpret_cast<uint32_t*>(frame.data());
+        for (size_t i = 0; i < frame.size() / sizeof(uint32_t); ++i)
+        {
+            words[i] = random();
+        }
+    }
+}
+
+// MARK: - Benchmark
+
+struct ConfigurationResult {
+    uint32_t        frameCount;
+    LatencyStats    latency;
+    double          firstFrameMs;
+    std::vector<GpuTimingReport> gpuTimings;
+
+    // The driver's host allocations while regenerating for the new size, and per frame after that
+    HostAllocationSnapshot firstFrameHostAllocations;
+    HostAllocationSnapshot frameHostAllocations;
+};
+
+// How many allocations each scope made between two snapshots
+HostAllocationSnapshot getHostAllocationsSince(const HostAllocationSnapshot& before, const HostAllocationSnapshot& after)
+{
+    auto difference = after;
+    for (size_t scope = 0; scope < HostAllocationScopeCount; ++scope)
+    {
+        difference.scopes[scope].allocations -= before.scopes[scope].allocations;
+    }
+
+    return difference;
+}
+
+ConfigurationResult runConfiguration(VulkanComputeProgram& program,
+                                     ImageInfo imageInfo,
+                                     InputMode inputMode,
+                                     const BenchmarkOptions& options)
+{
+    std::vector<char> inputFrame(imageInfo.size());
+    std::vector<char> outputFrame(imageInfo.size());
+
+    fillSyntheticFrame(inputFrame, imageInfo.pixelFormat);
+
+    bool isFirstFrame = true;
+
+    auto writeInputPixels = [&](void* buffer) {
+        if (inputMode == NewInput || isFirstFrame)
+        {
+            memcpy(buffer, inputFrame.data(), inputFrame.size());
+        }
+    };
+
+    auto readOutputPixels = [&](void* buffer) {
+        memcpy(outputFrame.data(), buffer, outputFrame.size());
+    };
+
+    ConfigurationResult result;
+
+    // The first frame at a new size pays for regenerating every image resource
+    auto hostAllocations = program.getHostAllocationSnapshot();
+    auto start = std::chrono::steady_clock::now();
+    program.process(imageInfo, { .pivot = 0.f }, writeInputPixels, readOutputPixels);
+    result.firstFrameMs = getElapsedMs(start);
+    result.firstFrameHostAllocations = getHostAllocationsSince(hostAllocations, program.getHostAllocationSnapshot());
+    isFirstFrame = false;
+
+    for (uint32_t i = 0; i < options.warmupCount; ++i)
+    {
+        program.process(imageInfo, { .pivot = 0.5f }, writeInputPixels, readOutputPixels);
+    }
+
+    program.resetGpuTimingStats();
+
+    std::vector<double> frameMs;
+    frameMs.reserve(options.frameCount);
+
+    hostAllocations = program.getHostAllocationSnapshot();
+
+    for (uint32_t i = 0; i < options.frameCount; ++i)
+    {
+        // The parameter changes every frame, like scrubbing a slider
+        UniformBufferObject ubo {
+            .pivot = static_cast<float>(i % 100) / 100.f,
+        };
+
+        start = std::chrono::steady_clock::now();
+        program.process(imageInfo, ubo, writeInputPixels, readOutputPixels);
+        frameMs.push_back(getElapsedMs(start));
+    }
+
+    result.frameHostAllocations = getHostAllocationsSince(hostAllocations, program.getHostAllocationSnapshot());
+    result.frameCount = options.frameCount;
+    result.latency = getLatencyStats(frameMs);
+    result.gpuTimings = program.getGpuTimingStats();
+
+    return result;
+}
+
+std::string toJSON(const std::string& label,
+                   const std::string& shader,
+                   const std::string& pixelFormatName,
+                   const FrameSize& frameSize,
+                   InputMode inputMode,
+                   ImageInfo imageInfo,
+                   const ConfigurationResult& result)
+{
+    auto megapixels = static_cast<double>(imageInfo.width) * static_cast<double>(imageInfo.height) / 1e6;
+
+    // Host bytes through process(): the input upload and the output readback
+    auto gigabytes = 2.0 * static_cast<double>(imageInfo.size()) / 1e9;
+    auto meanSeconds = result.latency.meanMs / 1000.0;
+
+    std::ostringstream json;
+    json << "{\"label\":\"" << label << "\""
+         << ",\"shader\":\"" << shader << "\""
+         << ",\"pixelFormat\":\"" << pixelFormatName << "\""
+         << ",\"size\":\"" << frameSize.name << "\""
+         << ",\"width\":" << imageInfo.width
+         << ",\"height\":" << imageInfo.height
+         << ",\"inputMode\":\"" << (inputMode == NewInput ? "newInput" : "parameterOnly") << "\""
+         << ",\"frames\":" << result.frameCount
+         << ",\"meanMs\":" << result.latency.meanMs
+         << ",\"p50Ms\":" << result.latency.p50Ms
+         << ",\"p90Ms\":" << result.latency.p90Ms
+         << ",\"p99Ms\":" << result.latency.p99Ms
+         << ",\"minMs\":" << result.latency.minMs
+         << ",\"maxMs\":" << result.latency.maxMs
+         << ",\"megapixelsPerSecond\":" << megapixels / meanSeconds
+         << ",\"gigabytesPerSecond\":" << gigabytes / meanSeconds
+         << ",\"firstFrameMs\":" << result.firstFrameMs
+         << ",\"regenerationMs\":" << std::max(0.0, result.firstFrameMs - result.latency.p50Ms);
+
+    for (const auto& report : result.gpuTimings)
+    {
+        if (report.width == imageInfo.width && report.height == imageInfo.height && report.pixelFormat == imageInfo.pixelFormat)
+        {
+            json << ",\"gpuUploadP50Ms\":" << report.stages[Upload].p50Ms
+                 << ",\"gpuDispatchP50Ms\":" << report.stages[Dispatch].p50Ms
+                 << ",\"gpuReadbackP50Ms\":" << report.stages[Readback].p50Ms;
+        }
+    }
+
+    // Object creation against command recording, which is where a resize's churn shows up
+    auto frameCount = static_cast<double>(result.frameCount);
+    for (auto scope : { VK_SYSTEM_ALLOCATION_SCOPE_OBJECT, VK_SYSTEM_ALLOCATION_SCOPE_COMMAND })
+    {
+        std::string name = getHostAllocationScopeName(scope);
+        name[0] = toupper(name[0]);
+
+        json << ",\"host" << name << "AllocationsFirstFrame\":" << result.firstFrameHostAllocations.scopes[scope].allocations
+             << ",\"host" << name << "AllocationsPerFrame\":" << static_cast<double>(result.frameHostAllocations.scopes[scope].allocations) / frameCount;
+    }
+
+    uint64_t hostLiveBytes = 0;
+    for (const auto& stats : result.frameHostAllocations.scopes)
+    {
+        hostLiveBytes += stats.liveBytes;
+    }
+
+    json << ",\"hostLiveBytes\":" << hostLiveBytes
+         << ",\"hostArenaBytes\":" << result.frameHostAllocations.arenaBytes
+         << "}";
+
+    return json.str();
+}
+
+// MARK: - Command Line
+
+std::vector<FrameSize> parseFrameSizes(const std::string& list)
+{
+    std::vector<FrameSize> frameSizes;
+    std::istringstream stream(list);
+    std::string name;
+
+    while (std::getline(stream, name, ','))
+    {
+        auto frameSize = std::find_if(allFrameSizes.begin(), allFrameSizes.end(), [&](const FrameSize& size) {
+            return size.name == name;
+        });
+
+        if (frameSize == allFrameSizes.end())
+        {
+            throw std::runtime_error("Unknown frame size " + name + " (expected 720p, 1080p, 4K, 8K or 16K)");
+        }
+
+        frameSizes.push_back(*frameSize);
+    }
+
+    return frameSizes;
+}
+
+BenchmarkOptions parseOptions(int argc, char* argv[])
+{
+    BenchmarkOptions options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (i + 1 >= argc)
+        {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+
+        std::string value = argv[++i];
+
+        if (arg == "--frames")
+        {
+            options.frameCount = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--warmup")
+        {
+            options.warmupCount = std::max(0, std::stoi(value));
+        }
+        else if (arg == "--sizes")
+        {
+            options.frameSizes = parseFrameSizes(value);
+        }
+        else if (arg == "--shader-dir")
+        {
+            options.shaderDir = value.back() == '/' ? value : value + "/";
+        }
+        else if (arg == "--label")
+        {
+            options.label = value;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg);
+        }
+    }
+
+    return options;
+}
+
+// MARK: - Main
+
+int main(int argc, char* argv[])
+{
+    BenchmarkOptions options;
+
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+
+    int exitCode = 0;
+
+    for (const auto& shader : allShaders)
+    {
+        // A fresh program per shader, so every shader starts from the same cold state
+        std::unique_ptr<VulkanComputeProgram> program;
+
+        auto setUpProgram = [&]() {
+            program = std::make_unique<VulkanComputeProgram>();
+            program->setUp(options.shaderDir + shader);
+        };
+
+        try
+        {
+            setUpProgram();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << shader << ": setUp failed: " << e.what() << std::endl;
+            return 1;
+        }
+
+        for (const auto& [pixelFormatName, pixelFormat] : allPixelFormats)
+        {
+            for (const auto& frameSize : options.frameSizes)
+            {
+                for (auto inputMode : { NewInput, ParameterOnly })
+                {
+                    ImageInfo imageInfo {
+                        .width = frameSize.width,
+                        .height = frameSize.height,
+                        .pixelFormat = pixelFormat,
+                    };
+
+                    try
+                    {
+                        auto result = runConfiguration(*program, imageInfo, inputMode, options);
+                        auto json = toJSON(options.label, shader, pixelFormatName, frameSize, inputMode, imageInfo, result);
+
+                        std::cout << json << std::endl;
+
+                        std::cerr << shader << " " << pixelFormatName << " " << frameSize.name
+                                  << (inputMode == NewInput ? " new input" : " parameter only")
+                                  << ": p50 " << result.latency.p50Ms << " ms"
+                                  << ", p99 " << result.latency.p99Ms << " ms"
+                                  << ", first frame " << result.firstFrameMs << " ms" << std::endl;
+                    }
+                    catch (const std::exception& e)
+                    {
+                        // Usually out of memory at the largest sizes. The half-regenerated program can't be
+                        // trusted after that, so it is abandoned (not torn down) and the sweep goes on with a new one.
+                        std::cerr << shader << " " << pixelFormatName << " " << frameSize.name << ": " << e.what() << std::endl;
+                        exitCode = 1;
+
+                        program.release();
+                        setUpProgram();
+                        continue;
+                    }
+
+                    // Force the next configuration to regenerate, so firstFrameMs always includes it
+                    program->process({ .width = 1, .height = 1, .pixelFormat = pixelFormat },
+                                     { .pivot = 0.f },
+                                     [](void*) {},
+                                     [](void*) {});
+                }
+            }
+        }
+
+        program->tearDown();
+    }
+
+    return exitCode;
+}
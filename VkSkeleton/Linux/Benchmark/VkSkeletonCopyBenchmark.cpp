@@ -0,0 +1,404 @@
+//
+//  VkSkeletonCopyBenchmark.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/11/21.
+//
+//  Measures AEUtils::copyImageData and copyRowByRow on their own, through the mock host's
+//  worlds and suites, against a memcpy of the same payload. One JSON line per configuration
+//  (bit depth x direction x frame size x rowbytes padding x thread count) goes to stdout.
+//  The thread count sets both the TaskScheduler pool (the 8 and 16bpc row copies) and the mock
+//  Iterate suite (the 32bpc path). scalingEfficiency compares copyRowByRow against the first
+//  thread count in the list, per thread; schedulerEfficiency is the pool's own busy fraction.
+//
+//  usage: vkskeleton_copy_benchmark [--iterations N] [--threads 1,2,4,...] [--paddings 0,64,...]
+//                                   [--regimes L2,LLC,DRAM] [--label NAME]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AEUtils.hpp"
+#include "MockHost.hpp"
+#include "TaskScheduler.hpp"
+
+// MARK: - Configuration
+
+// Frame sizes are picked by payload bytes, so every bit depth lands in the same cache level
+struct CacheRegime {
+    std::string name;
+    size_t      payloadBytes;
+};
+
+const std::vector<CacheRegime> allCacheRegimes = {
+    { "L2",     512 * 1024          },
+    { "LLC",    8 * 1024 * 1024     },
+    { "DRAM",   256 * 1024 * 1024   },
+};
+
+const std::vector<std::pair<std::string, PF_PixelFormat>> allPixelFormats = {
+    { "ARGB32",     PF_PixelFormat_ARGB32   },
+    { "ARGB64",     PF_PixelFormat_ARGB64   },
+    { "ARGB128",    PF_PixelFormat_ARGB128  },
+};
+
+const std::vector<std::pair<std::string, AEUtils::CopyCommand>> allCopyCommands = {
+    { "InputWorldToBuffer",     AEUtils::InputWorldToBuffer     },
+    { "BufferToOutputWorld",    AEUtils::BufferToOutputWorld    },
+};
+
+struct CopyBenchmarkOptions {
+    uint32_t                    iterationCount  = 20;
+    std::vector<uint32_t>       threadCounts    = { 1, std::max(1u, std::thread::hardware_concurrency()) };
+    std::vector<A_long>         rowPaddings     = { 0, 64, 1000 };
+    std::vector<CacheRegime>    cacheRegimes    = allCacheRegimes;
+    std::string                 label           = "";
+};
+
+static size_t getPixelSize(PF_PixelFormat pixelFormat)
+{
+    switch (pixelFormat)
+    {
+        case PF_PixelFormat_ARGB128:
+            return sizeof(PF_PixelFloat);
+        case PF_PixelFormat_ARGB64:
+            return sizeof(PF_Pixel16);
+        default:
+            return sizeof(PF_Pixel8);
+    }
+}
+
+// 16:9 frame holding about payloadBytes of pixels
+static std::pair<A_long, A_long> getFrameSize(size_t payloadBytes, PF_PixelFormat pixelFormat)
+{
+    auto pixelCount = static_cast<double>(payloadBytes / getPixelSize(pixelFormat));
+    auto height = static_cast<A_long>(std::sqrt(pixelCount * 9.0 / 16.0));
+    auto width = static_cast<A_long>(pixelCount / static_cast<double>(height));
+
+    return { width, height };
+}
+
+// MARK: - Measurement
+
+static double getElapsedSeconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Median of iterationCount runs of fn, in seconds
+template <typename Function>
+static double measure(uint32_t iterationCount, Function fn)
+{
+    // One untimed run to fault in the pages and warm the caches
+    fn();
+
+    std::vector<double> seconds;
+    seconds.reserve(iterationCount);
+
+    for (uint32_t i = 0; i < iterationCount; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        seconds.push_back(getElapsedSeconds(start));
+    }
+
+    std::sort(seconds.begin(), seconds.end());
+    return seconds[seconds.size() / 2];
+}
+
+// The roofline: one contiguous memcpy of the payload, split across threadCount threads
+static void parallelMemcpy(char* dst, const char* src, size_t size, uint32_t threadCount)
+{
+    if (threadCount <= 1)
+    {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    auto chunkSize = (size + threadCount - 1) / threadCount;
+    std::vector<std::thread> threads;
+
+    for (uint32_t i = 0; i < threadCount; ++i)
+    {
+        auto offset = std::min(size, i * chunkSize);
+        auto length = std::min(chunkSize, size - offset);
+
+        threads.emplace_back([=]() {
+            memcpy(dst + offset, src + offset, length);
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+struct CopyResult {
+    double  copyImageDataGBps;
+    double  copyRowByRowGBps;
+    double  memcpyGBps;
+    double  memcpySingleThreadGBps;
+    double  schedulerEfficiency;
+
+    // The better of memcpy on one thread and on threadCount threads;
+    // spawning threads costs more than it saves at the smaller sizes.
+    double getRooflineGBps() const
+    {
+        return std::max(memcpyGBps, memcpySingleThreadGBps);
+    }
+};
+
+static CopyResult runConfiguration(MockHost& host,
+                                   const MockRenderRequest& request,
+                                   AEUtils::CopyCommand copyCommand,
+                                   uint32_t threadCount,
+                                   uint32_t iterationCount)
+{
+    auto payloadBytes = static_cast<size_t>(request.width) * static_cast<size_t>(request.height) * getPixelSize(request.pixelFormat);
+
+    std::vector<char> buffer(payloadBytes);
+    std::vector<char> memcpySource(payloadBytes);
+
+    CopyResult result{};
+
+    MockHost::setIterateThreadCount(threadCount);
+    TaskScheduler::setThreadCount(threadCount);
+
+    PF_Err err = host.withRenderContext(request, [&](PF_InData* in_data, PF_EffectWorld* inputWorld, PF_EffectWorld* outputWorld) {
+        // Held across the iterations, like the plugin holds it from GlobalSetup
+        const void* suite = nullptr;
+        in_data->pica_basicP->AcquireSuite(kPFIterateFloatSuite, kPFIterateFloatSuiteVersion1, &suite);
+        auto iterateFloatSuite = static_cast<const PF_IterateFloatSuite1*>(suite);
+
+        auto copyImageDataSeconds = measure(iterationCount, [&]() {
+            AEUtils::copyImageData(iterateFloatSuite, in_data, inputWorld, outputWorld, copyCommand, request.pixelFormat, buffer.data());
+        });
+
+        in_data->pica_basicP->ReleaseSuite(kPFIterateFloatSuite, kPFIterateFloatSuiteVersion1);
+
+        // The bare row copy the 8 and 16bpc paths come down to, without the suite lookups
+        auto bufferRowBytes = static_cast<size_t>(request.width) * getPixelSize(request.pixelFormat);
+        TaskScheduler::resetStats();
+        auto copyRowByRowSeconds = measure(iterationCount, [&]() {
+            if (copyCommand == AEUtils::InputWorldToBuffer)
+            {
+                AEUtils::copyRowByRow(buffer.data(), inputWorld->data, bufferRowBytes, inputWorld->rowbytes, inputWorld->height);
+            }
+            else
+            {
+                AEUtils::copyRowByRow(outputWorld->data, buffer.data(), outputWorld->rowbytes, bufferRowBytes, outputWorld->height);
+            }
+        });
+
+        auto schedulerStats = TaskScheduler::getStats();
+
+        auto memcpySeconds = measure(iterationCount, [&]() {
+            parallelMemcpy(buffer.data(), memcpySource.data(), payloadBytes, threadCount);
+        });
+
+        auto memcpySingleThreadSeconds = measure(iterationCount, [&]() {
+            parallelMemcpy(buffer.data(), memcpySource.data(), payloadBytes, 1);
+        });
+
+        auto gigabytes = static_cast<double>(payloadBytes) / 1e9;
+
+        result = {
+            .copyImageDataGBps = gigabytes / copyImageDataSeconds,
+            .copyRowByRowGBps = gigabytes / copyRowByRowSeconds,
+            .memcpyGBps = gigabytes / memcpySeconds,
+            .memcpySingleThreadGBps = gigabytes / memcpySingleThreadSeconds,
+            .schedulerEfficiency = schedulerStats.getScalingEfficiency(),
+        };
+
+        return PF_Err_NONE;
+    });
+
+    if (err != PF_Err_NONE)
+    {
+        throw std::runtime_error("Mock render context failed with PF_Err " + std::to_string(err));
+    }
+
+    return result;
+}
+
+// MARK: - Command Line
+
+template <typename Value, typename Parse>
+static std::vector<Value> parseList(const std::string& list, Parse parse)
+{
+    std::vector<Value> values;
+    std::istringstream stream(list);
+    std::string item;
+
+    while (std::getline(stream, item, ','))
+    {
+        values.push_back(parse(item));
+    }
+
+    return values;
+}
+
+static CopyBenchmarkOptions parseOptions(int argc, char* argv[])
+{
+    CopyBenchmarkOptions options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (i + 1 >= argc)
+        {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+
+        std::string value = argv[++i];
+
+        if (arg == "--iterations")
+        {
+            options.iterationCount = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--threads")
+        {
+            options.threadCounts = parseList<uint32_t>(value, [](const std::string& item) {
+                return static_cast<uint32_t>(std::max(1, std::stoi(item)));
+            });
+        }
+        else if (arg == "--paddings")
+        {
+            options.rowPaddings = parseList<A_long>(value, [](const std::string& item) {
+                return static_cast<A_long>(std::max(0, std::stoi(item)));
+            });
+        }
+        else if (arg == "--regimes")
+        {
+            options.cacheRegimes = parseList<CacheRegime>(value, [](const std::string& item) {
+                auto regime = std::find_if(allCacheRegimes.begin(), allCacheRegimes.end(), [&](const CacheRegime& r) {
+                    return r.name == item;
+                });
+
+                if (regime == allCacheRegimes.end())
+                {
+                    throw std::runtime_error("Unknown regime " + item + " (expected L2, LLC or DRAM)");
+                }
+
+                return *regime;
+            });
+        }
+        else if (arg == "--label")
+        {
+            options.label = value;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg);
+        }
+    }
+
+    return options;
+}
+
+// MARK: - Main
+
+int main(int argc, char* argv[])
+{
+    CopyBenchmarkOptions options;
+
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+
+    // No EffectMain: the worlds and suites are all this needs from the host
+    MockHost host(nullptr, "");
+
+    for (const auto& [pixelFormatName, pixelFormat] : allPixelFormats)
+    {
+        for (const auto& [copyCommandName, copyCommand] : allCopyCommands)
+        {
+            for (const auto& regime : options.cacheRegimes)
+            {
+                auto [width, height] = getFrameSize(regime.payloadBytes, pixelFormat);
+
+                for (auto rowPadding : options.rowPaddings)
+                {
+                    double baselineGBps = 0.0;
+                    uint32_t baselineThreadCount = 0;
+
+                    for (auto threadCount : options.threadCounts)
+                    {
+                        MockRenderRequest request {
+                            .width = width,
+                            .height = height,
+                            .pixelFormat = pixelFormat,
+                            .rowPadding = rowPadding,
+                        };
+
+                        CopyResult result;
+
+                        try
+                        {
+                            result = runConfiguration(host, request, copyCommand, threadCount, options.iterationCount);
+                        }
+                        catch (const std::exception& e)
+                        {
+                            std::cerr << pixelFormatName << " " << copyCommandName << " " << regime.name << ": " << e.what() << std::endl;
+                            return 1;
+                        }
+                        catch (PF_Err err)
+                        {
+                            std::cerr << pixelFormatName << " " << copyCommandName << " " << regime.name << ": PF_Err " << err << std::endl;
+                            return 1;
+                        }
+
+                        if (baselineThreadCount == 0)
+                        {
+                            baselineGBps = result.copyRowByRowGBps;
+                            baselineThreadCount = threadCount;
+                        }
+
+                        // Speedup over the first thread count, divided by how many times the threads it had
+                        auto scalingEfficiency = (result.copyRowByRowGBps / baselineGBps)
+                            * static_cast<double>(baselineThreadCount) / static_cast<double>(threadCount);
+
+                        std::cout << "{\"label\":\"" << options.label << "\""
+                                  << ",\"pixelFormat\":\"" << pixelFormatName << "\""
+                                  << ",\"copyCommand\":\"" << copyCommandName << "\""
+                                  << ",\"regime\":\"" << regime.name << "\""
+                                  << ",\"width\":" << width
+                                  << ",\"height\":" << height
+                                  << ",\"rowPadding\":" << rowPadding
+                                  << ",\"threads\":" << threadCount
+                                  << ",\"copyImageDataGBps\":" << result.copyImageDataGBps
+                                  << ",\"copyRowByRowGBps\":" << result.copyRowByRowGBps
+                                  << ",\"memcpyGBps\":" << result.memcpyGBps
+                                  << ",\"memcpySingleThreadGBps\":" << result.memcpySingleThreadGBps
+                                  << ",\"fractionOfRoofline\":" << result.copyImageDataGBps / result.getRooflineGBps()
+                                  << ",\"scalingEfficiency\":" << scalingEfficiency
+                                  << ",\"schedulerEfficiency\":" << result.schedulerEfficiency
+                                  << "}" << std::endl;
+
+                        std::cerr << pixelFormatName << " " << copyCommandName << " " << regime.name
+                                  << " padding " << rowPadding << " threads " << threadCount
+                                  << ": " << result.copyImageDataGBps << " GB/s"
+                                  << " (roofline " << result.getRooflineGBps() << " GB/s)" << std::endl;
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+//
+//  AllocationCounter.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "AllocationCounter.hpp"
+
+// A thread_local of a trivial type, so checking it never allocates itself
+static thread_local bool        isCounting      = false;
+static std::atomic<uint64_t>    count{0};
+
+static void countAllocation()
+{
+    if (isCounting)
+    {
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+uint64_t AllocationCounter::getCount()
+{
+    return count.load(std::memory_order_relaxed);
+}
+
+void AllocationCounter::reset()
+{
+    count.store(0, std::memory_order_relaxed);
+}
+
+AllocationCounter::CountingScope::CountingScope()
+: wasCounting(isCounting)
+{
+    isCounting = true;
+}
+
+AllocationCounter::CountingScope::~CountingScope()
+{
+    isCounting = wasCounting;
+}
+
+AllocationCounter::PausedScope::PausedScope()
+: wasCounting(isCounting)
+{
+    isCounting = false;
+}
+
+AllocationCounter::PausedScope::~PausedScope()
+{
+    isCounting = wasCounting;
+}
+
+// MARK: - Replaced operator new and delete
+
+// The array and nothrow forms all end up in these two
+
+void* operator new(std::size_t size)
+{
+    countAllocation();
+
+    if (void* p = std::malloc(size != 0 ? size : 1))
+    {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    countAllocation();
+
+    auto alignmentBytes = static_cast<std::size_t>(alignment);
+    auto roundedSize = (std::max<std::size_t>(size, 1) + alignmentBytes - 1) / alignmentBytes * alignmentBytes;
+
+    if (void* p = std::aligned_alloc(alignmentBytes, roundedSize))
+    {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
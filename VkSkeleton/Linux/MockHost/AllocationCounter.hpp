@@ -0,0 +1,56 @@
+//
+//  AllocationCounter.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+//  Counts the heap allocations the plugin makes while it renders. The mock host replaces the global
+//  operator new, and counts a call only on a thread that is inside a CountingScope and not inside a
+//  PausedScope, so the host's own work (setting up worlds, spawning iterate threads) stays out of it.
+//  The plugin's own worker threads are never inside a scope, so only the threads the host calls the
+//  plugin on are covered.
+//
+
+#ifndef AllocationCounter_hpp
+#define AllocationCounter_hpp
+
+#include <cstdint>
+
+namespace AllocationCounter
+{
+
+// Allocations counted on every thread since the last reset
+uint64_t getCount();
+void reset();
+
+// Around the plugin's code
+class CountingScope
+{
+public:
+    CountingScope();
+    ~CountingScope();
+
+    CountingScope(const CountingScope&) = delete;
+    CountingScope& operator=(const CountingScope&) = delete;
+
+private:
+    bool wasCounting;
+};
+
+// Around host code the plugin calls back into
+class PausedScope
+{
+public:
+    PausedScope();
+    ~PausedScope();
+
+    PausedScope(const PausedScope&) = delete;
+    PausedScope& operator=(const PausedScope&) = delete;
+
+private:
+    bool wasCounting;
+};
+
+}
+
+#endif /* AllocationCounter_hpp */
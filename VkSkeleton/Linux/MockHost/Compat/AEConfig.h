@@ -0,0 +1,37 @@
+//
+//  AEConfig.h
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/10/21.
+//
+//  Stand-in for the SDK's AEConfig.h when building the plugin against the mock host on Linux.
+//  The SDK header only knows about Mac and Windows and stops the build with #error anywhere else,
+//  so this one is force-included (-include) ahead of every plugin and SDK source file; its include
+//  guard then keeps the SDK's version out.
+//
+
+#ifndef AECONFIG_H
+#define AECONFIG_H
+
+#include <stdint.h>
+
+#define AE_OS_LINUX
+
+#if defined(__x86_64__)
+    #define AE_PROC_INTELx64
+#elif defined(__aarch64__)
+    #define AE_PROC_ARM64
+#else
+    #error "unrecognized AE processor"
+#endif
+
+#define AE_LITTLE_ENDIAN
+
+// MacTypes.h equivalents that AE_Effect.h expects on anything that isn't Windows
+typedef int32_t         Fixed;
+typedef unsigned char   Boolean;
+typedef char**          Handle;
+
+#define DllExport   __attribute__ ((visibility ("default")))
+
+#endif
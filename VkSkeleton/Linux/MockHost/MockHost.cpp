@@ -0,0 +1,687 @@
+//
+//  MockHost.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/10/21.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "AE_EffectVers.h"
+#include "AE_Macros.h"
+#include "SPBasic.h"
+#include "SPErrorCodes.h"
+
+#include "AllocationCounter.hpp"
+#include "MockHost.hpp"
+
+struct MockHost::Context {
+    const std::string*          pluginPath;
+    const std::atomic<bool>*    isCancelled;
+    MockRenderRequest           request;
+
+    PF_InData                   in_data;
+    PF_OutData                  out_data;
+
+    PF_EffectWorld              inputWorld;
+    PF_EffectWorld              outputWorld;
+};
+
+// Callbacks like get_pixel_data8 and PF_GetPixelFormat don't get an effect_ref,
+// so the context of the command running on this thread is kept here.
+thread_local MockHost::Context* currentContext = nullptr;
+
+static MockHost::Context* getContext(PF_ProgPtr effect_ref)
+{
+    return reinterpret_cast<MockHost::Context*>(effect_ref);
+}
+
+static std::atomic<uint64_t> missingSuiteCount{0};
+static std::atomic<uint32_t> iterateThreadCount{0};
+
+// MARK: - Worlds
+
+static size_t getPixelSize(PF_PixelFormat pixelFormat)
+{
+    switch (pixelFormat)
+    {
+        case PF_PixelFormat_ARGB128:
+            return sizeof(PF_PixelFloat);
+        case PF_PixelFormat_ARGB64:
+            return sizeof(PF_Pixel16);
+        default:
+            return sizeof(PF_Pixel8);
+    }
+}
+
+static short getBitDepth(PF_PixelFormat pixelFormat)
+{
+    switch (pixelFormat)
+    {
+        case PF_PixelFormat_ARGB128:
+            return 32;
+        case PF_PixelFormat_ARGB64:
+            return 16;
+        default:
+            return 8;
+    }
+}
+
+static void setUpWorld(PF_EffectWorld& world, std::vector<char>& pixels, const MockRenderRequest& request)
+{
+    // AE aligns rows to 16 bytes, and often hands out wider rows than that
+    auto rowBytes = ((static_cast<size_t>(request.width) * getPixelSize(request.pixelFormat) + 15) & ~size_t(15))
+                  + static_cast<size_t>(request.rowPadding);
+
+    pixels.resize(rowBytes * static_cast<size_t>(request.height));
+
+    AEFX_CLR_STRUCT(world);
+    world.world_flags = request.pixelFormat == PF_PixelFormat_ARGB32 ? 0 : static_cast<PF_WorldFlags>(PF_WorldFlag_DEEP);
+    world.data = reinterpret_cast<PF_PixelPtr>(pixels.data());
+    world.rowbytes = static_cast<A_long>(rowBytes);
+    world.width = request.width;
+    world.height = request.height;
+    world.extent_hint = { 0, 0, request.width, request.height };
+    world.pix_aspect_ratio = { 1, 1 };
+}
+
+// A gradient, so the output isn't trivially constant
+static void fillWorld(PF_EffectWorld& world, PF_PixelFormat pixelFormat)
+{
+    for (A_long y = 0; y < world.height; ++y)
+    {
+        auto row = reinterpret_cast<char*>(world.data) + static_cast<size_t>(y) * world.rowbytes;
+
+        for (A_long x = 0; x < world.width; ++x)
+        {
+            float value = static_cast<float>(x + y) / static_cast<float>(world.width + world.height);
+
+            switch (pixelFormat)
+            {
+                case PF_PixelFormat_ARGB128:
+                    reinterpret_cast<PF_PixelFloat*>(row)[x] = { 1.f, value, 1.f - value, value };
+                    break;
+                case PF_PixelFormat_ARGB64:
+                {
+                    auto v = static_cast<A_u_short>(value * PF_MAX_CHAN16);
+                    reinterpret_cast<PF_Pixel16*>(row)[x] = { PF_MAX_CHAN16, v, static_cast<A_u_short>(PF_MAX_CHAN16 - v), v };
+                    break;
+                }
+                default:
+                {
+                    auto v = static_cast<A_u_char>(value * PF_MAX_CHAN8);
+                    reinterpret_cast<PF_Pixel8*>(row)[x] = { PF_MAX_CHAN8, v, static_cast<A_u_char>(PF_MAX_CHAN8 - v), v };
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static PF_PixelFormat getWorldPixelFormat(const PF_EffectWorld* worldP)
+{
+    if (currentContext != nullptr
+        && (worldP == &currentContext->inputWorld || worldP == &currentContext->outputWorld))
+    {
+        return currentContext->request.pixelFormat;
+    }
+
+    return PF_PixelFormat_INVALID;
+}
+
+// MARK: - Interact Callbacks
+
+static PF_Err checkoutParam(PF_ProgPtr effect_ref, PF_ParamIndex index, A_long, A_long, A_u_long, PF_ParamDef* param)
+{
+    auto context = getContext(effect_ref);
+
+    AEFX_CLR_STRUCT(*param);
+
+    if (index == 0)
+    {
+        param->param_type = PF_Param_LAYER;
+        param->u.ld = context->inputWorld;
+        return PF_Err_NONE;
+    }
+
+    // VkSkeleton only has the one slider; every other index gets the same value
+    param->param_type = PF_Param_FLOAT_SLIDER;
+    param->u.fs_d.value = context->request.sliderValue;
+    param->u.fs_d.dephault = context->request.sliderValue;
+
+    return PF_Err_NONE;
+}
+
+static PF_Err checkinParam(PF_ProgPtr, PF_ParamDef*)
+{
+    return PF_Err_NONE;
+}
+
+static PF_Err addParam(PF_ProgPtr, PF_ParamIndex, PF_ParamDefPtr)
+{
+    return PF_Err_NONE;
+}
+
+static PF_Err abortCallback(PF_ProgPtr effect_ref)
+{
+    return getContext(effect_ref)->isCancelled->load(std::memory_order_relaxed) ? PF_Interrupt_CANCEL : PF_Err_NONE;
+}
+
+static PF_Err progressCallback(PF_ProgPtr effect_ref, A_long, A_long)
+{
+    return abortCallback(effect_ref);
+}
+
+// MARK: - Util Callbacks
+
+static PF_Err getPlatformData(PF_ProgPtr effect_ref, PF_PlatDataID which, void* data)
+{
+    auto context = getContext(effect_ref);
+
+    if (which != PF_PlatData_EXE_FILE_PATH_W && which != PF_PlatData_RES_FILE_PATH_W)
+    {
+        return PF_Err_BAD_CALLBACK_PARAM;
+    }
+
+    auto path = reinterpret_cast<A_UTF16Char*>(data);
+    const auto& pluginPath = *context->pluginPath;
+    auto length = std::min(pluginPath.size(), static_cast<size_t>(AEFX_MAX_PATH - 1));
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        path[i] = static_cast<A_UTF16Char>(static_cast<unsigned char>(pluginPath[i]));
+    }
+    path[length] = 0;
+
+    return PF_Err_NONE;
+}
+
+static PF_Err getPixelData8(PF_EffectWorld* worldP, PF_PixelPtr pixelsP0, PF_Pixel8** pixPP)
+{
+    *pixPP = getWorldPixelFormat(worldP) == PF_PixelFormat_ARGB32
+        ? reinterpret_cast<PF_Pixel8*>(pixelsP0 != nullptr ? pixelsP0 : worldP->data)
+        : nullptr;
+
+    return PF_Err_NONE;
+}
+
+static PF_Err getPixelData16(PF_EffectWorld* worldP, PF_PixelPtr pixelsP0, PF_Pixel16** pixPP)
+{
+    *pixPP = getWorldPixelFormat(worldP) == PF_PixelFormat_ARGB64
+        ? reinterpret_cast<PF_Pixel16*>(pixelsP0 != nullptr ? pixelsP0 : worldP->data)
+        : nullptr;
+
+    return PF_Err_NONE;
+}
+
+static PF_UtilCallbacks makeUtilCallbacks()
+{
+    PF_UtilCallbacks utils;
+    AEFX_CLR_STRUCT(utils);
+
+    utils.get_platform_data = getPlatformData;
+    utils.get_pixel_data8 = getPixelData8;
+    utils.get_pixel_data16 = getPixelData16;
+
+    return utils;
+}
+
+static PF_UtilCallbacks utilCallbacks = makeUtilCallbacks();
+
+// MARK: - Suites
+
+static PF_Err getPixelFormat(const PF_EffectWorld* worldP, PF_PixelFormat* pixel_formatP)
+{
+    *pixel_formatP = getWorldPixelFormat(worldP);
+    return *pixel_formatP == PF_PixelFormat_INVALID ? PF_Err_BAD_CALLBACK_PARAM : PF_Err_NONE;
+}
+
+static PF_WorldSuite2 worldSuite2 {
+    .PF_NewWorld = nullptr,
+    .PF_DisposeWorld = nullptr,
+    .PF_GetPixelFormat = getPixelFormat,
+};
+
+// Splits the rows across every core like AE does; the pixel function may be called from any of them.
+template <typename Pixel>
+static PF_Err iteratePixels(PF_InData*          in_data,
+                            A_long              progress_base,
+                            A_long              progress_final,
+                            PF_EffectWorld*     src,
+                            const PF_Rect*      area,
+                            void*               refcon,
+                            PF_Err              (*pix_fn)(void* refcon, A_long x, A_long y, Pixel* in, Pixel* out),
+                            PF_EffectWorld*     dst)
+{
+    // Spawning the threads allocates, and that's the host's cost, not the plugin's
+    AllocationCounter::PausedScope pausedScope;
+
+    PF_Rect rect = area != nullptr ? *area : PF_Rect { 0, 0, src->width, src->height };
+
+    auto threadCount = iterateThreadCount.load(std::memory_order_relaxed);
+    if (threadCount == 0)
+    {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto rowCount = static_cast<unsigned>(std::max<A_long>(0, rect.bottom - rect.top));
+    auto rowsPerThread = (rowCount + threadCount - 1) / threadCount;
+
+    std::atomic<PF_Err> firstErr{PF_Err_NONE};
+    auto context = currentContext;
+
+    auto iterateRows = [&](A_long top, A_long bottom) {
+        // Pixel functions may call back into the host from here
+        currentContext = context;
+
+        // The pixel function is the plugin's again
+        AllocationCounter::CountingScope countingScope;
+
+        for (A_long y = top; y < bottom && firstErr.load(std::memory_order_relaxed) == PF_Err_NONE; ++y)
+        {
+            auto srcRow = reinterpret_cast<Pixel*>(reinterpret_cast<char*>(src->data) + static_cast<size_t>(y) * src->rowbytes);
+            auto dstRow = dst != nullptr
+                ? reinterpret_cast<Pixel*>(reinterpret_cast<char*>(dst->data) + static_cast<size_t>(y) * dst->rowbytes)
+                : nullptr;
+
+            for (A_long x = rect.left; x < rect.right; ++x)
+            {
+                PF_Err err = pix_fn(refcon, x, y, srcRow + x, dstRow != nullptr ? dstRow + x : nullptr);
+                if (err != PF_Err_NONE)
+                {
+                    PF_Err expected = PF_Err_NONE;
+                    firstErr.compare_exchange_strong(expected, err);
+                    return;
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadCount; ++i)
+    {
+        auto top = rect.top + static_cast<A_long>(i * rowsPerThread);
+        auto bottom = std::min(rect.bottom, top + static_cast<A_long>(rowsPerThread));
+
+        if (top < bottom)
+        {
+            threads.emplace_back(iterateRows, top, bottom);
+        }
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (firstErr != PF_Err_NONE)
+    {
+        return firstErr;
+    }
+
+    return in_data != nullptr ? PF_PROGRESS(in_data, progress_final, progress_final) : PF_Err_NONE;
+}
+
+// Only `iterate` is served; VkSkeleton doesn't use the other entry points.
+static PF_Iterate8Suite1 iterate8Suite1 {
+    .iterate = iteratePixels<PF_Pixel8>,
+};
+
+static PF_Iterate16Suite1 iterate16Suite1 {
+    .iterate = iteratePixels<PF_Pixel16>,
+};
+
+static PF_IterateFloatSuite1 iterateFloatSuite1 {
+    .iterate = iteratePixels<PF_PixelFloat>,
+};
+
+static PF_ANSICallbacksSuite1 ansiCallbacksSuite1 {
+    .atan = atan,
+    .atan2 = atan2,
+    .ceil = ceil,
+    .cos = cos,
+    .exp = exp,
+    .fabs = fabs,
+    .floor = floor,
+    .fmod = fmod,
+    .hypot = hypot,
+    .log = log,
+    .log10 = log10,
+    .pow = pow,
+    .sin = sin,
+    .sqrt = sqrt,
+    .tan = tan,
+    .sprintf = sprintf,
+    .strcpy = strcpy,
+    .asin = asin,
+    .acos = acos,
+};
+
+struct MockSuite {
+    const char* name;
+    int32       version;
+    const void* suite;
+};
+
+static const MockSuite mockSuites[] = {
+    { kPFWorldSuite,        kPFWorldSuiteVersion2,          &worldSuite2            },
+    { kPFIterate8Suite,     kPFIterate8SuiteVersion1,       &iterate8Suite1         },
+    { kPFIterate16Suite,    kPFIterate16SuiteVersion1,      &iterate16Suite1        },
+    { kPFIterateFloatSuite, kPFIterateFloatSuiteVersion1,   &iterateFloatSuite1     },
+    { kPFANSISuite,         kPFANSISuiteVersion1,           &ansiCallbacksSuite1    },
+};
+
+static SPErr acquireSuite(const char* name, int32 version, const void** suite)
+{
+    for (const auto& mockSuite : mockSuites)
+    {
+        if (strcmp(mockSuite.name, name) == 0 && mockSuite.version == version)
+        {
+            *suite = mockSuite.suite;
+            return kSPNoError;
+        }
+    }
+
+    missingSuiteCount.fetch_add(1, std::memory_order_relaxed);
+    fprintf(stderr, "mock host: suite \"%s\" version %d is not served\n", name, version);
+
+    *suite = nullptr;
+    return kSPSuiteNotFoundError;
+}
+
+static SPErr releaseSuite(const char*, int32)
+{
+    return kSPNoError;
+}
+
+static SPBoolean isEqual(const char* token1, const char* token2)
+{
+    return strcmp(token1, token2) == 0;
+}
+
+static SPErr allocateBlock(size_t size, void** block)
+{
+    *block = malloc(size);
+    return *block != nullptr ? kSPNoError : kSPOutOfMemoryError;
+}
+
+static SPErr freeBlock(void* block)
+{
+    free(block);
+    return kSPNoError;
+}
+
+static SPErr reallocateBlock(void* block, size_t newSize, void** newblock)
+{
+    *newblock = realloc(block, newSize);
+    return *newblock != nullptr ? kSPNoError : kSPOutOfMemoryError;
+}
+
+static SPErr undefined()
+{
+    return kSPUnimplementedError;
+}
+
+static SPBasicSuite basicSuite {
+    .AcquireSuite = acquireSuite,
+    .ReleaseSuite = releaseSuite,
+    .IsEqual = isEqual,
+    .AllocateBlock = allocateBlock,
+    .FreeBlock = freeBlock,
+    .ReallocateBlock = reallocateBlock,
+    .Undefined = undefined,
+};
+
+// MARK: - SmartFX Callbacks
+
+static PF_Err checkoutLayer(PF_ProgPtr              effect_ref,
+                            PF_ParamIndex,
+                            A_long,
+                            const PF_RenderRequest*,
+                            A_long,
+                            A_long,
+                            A_u_long,
+                            PF_CheckoutResult*      checkout_result)
+{
+    auto context = getContext(effect_ref);
+
+    AEFX_CLR_STRUCT(*checkout_result);
+    checkout_result->result_rect = { 0, 0, context->request.width, context->request.height };
+    checkout_result->max_result_rect = checkout_result->result_rect;
+    checkout_result->par = { 1, 1 };
+    checkout_result->ref_width = context->request.width;
+    checkout_result->ref_height = context->request.height;
+
+    return PF_Err_NONE;
+}
+
+static PF_Err guidMixIn(PF_ProgPtr, A_u_long, const void*)
+{
+    return PF_Err_NONE;
+}
+
+static PF_Err checkoutLayerPixels(PF_ProgPtr effect_ref, A_long, PF_EffectWorld** pixels)
+{
+    *pixels = &getContext(effect_ref)->inputWorld;
+    return PF_Err_NONE;
+}
+
+static PF_Err checkinLayerPixels(PF_ProgPtr, A_long)
+{
+    return PF_Err_NONE;
+}
+
+static PF_Err checkoutOutput(PF_ProgPtr effect_ref, PF_EffectWorld** output)
+{
+    *output = &getContext(effect_ref)->outputWorld;
+    return PF_Err_NONE;
+}
+
+// MARK: - Mock Host
+
+MockHost::MockHost(EffectMainFunc effectMain, std::string pluginPath)
+: effectMain(effectMain)
+, pluginPath(pluginPath)
+{
+}
+
+void MockHost::initializeContext(Context& context)
+{
+    context.pluginPath = &pluginPath;
+    context.isCancelled = &isCancelled;
+
+    AEFX_CLR_STRUCT(context.in_data);
+    AEFX_CLR_STRUCT(context.out_data);
+
+    auto& in_data = context.in_data;
+    in_data.inter.checkout_param = checkoutParam;
+    in_data.inter.checkin_param = checkinParam;
+    in_data.inter.add_param = addParam;
+    in_data.inter.abort = abortCallback;
+    in_data.inter.progress = progressCallback;
+    in_data.utils = &utilCallbacks;
+    in_data.effect_ref = reinterpret_cast<PF_ProgPtr>(&context);
+    in_data.quality = context.request.quality;
+    in_data.version = { PF_PLUG_IN_VERSION, PF_PLUG_IN_SUBVERS };
+    in_data.appl_id = 'FXTC';
+    in_data.num_params = numParams;
+    in_data.current_time = context.request.currentTime;
+    in_data.time_step = 1;
+    in_data.time_scale = 24;
+    in_data.width = context.request.width;
+    in_data.height = context.request.height;
+    in_data.extent_hint = { 0, 0, context.request.width, context.request.height };
+    in_data.downsample_x = { 1, static_cast<A_u_long>(std::max<A_long>(1, context.request.downsample)) };
+    in_data.downsample_y = in_data.downsample_x;
+    in_data.pixel_aspect_ratio = { 1, 1 };
+    in_data.pica_basicP = &basicSuite;
+}
+
+PF_Err MockHost::callEffectMain(Context& context, PF_Cmd cmd, void* extra)
+{
+    auto previousContext = currentContext;
+    currentContext = &context;
+
+    PF_Err err = PF_Err_NONE;
+    if (cmd == PF_Cmd_SMART_PRE_RENDER || cmd == PF_Cmd_SMART_RENDER)
+    {
+        AllocationCounter::CountingScope countingScope;
+        err = effectMain(cmd, &context.in_data, &context.out_data, nullptr, nullptr, extra);
+    }
+    else
+    {
+        err = effectMain(cmd, &context.in_data, &context.out_data, nullptr, nullptr, extra);
+    }
+
+    currentContext = previousContext;
+    return err;
+}
+
+PF_Err MockHost::globalSetup()
+{
+    Context context{};
+    initializeContext(context);
+    return callEffectMain(context, PF_Cmd_GLOBAL_SETUP, nullptr);
+}
+
+PF_Err MockHost::paramsSetup()
+{
+    Context context{};
+    initializeContext(context);
+
+    PF_Err err = callEffectMain(context, PF_Cmd_PARAMS_SETUP, nullptr);
+    numParams = context.out_data.num_params;
+
+    return err;
+}
+
+PF_Err MockHost::globalSetdown()
+{
+    Context context{};
+    initializeContext(context);
+    return callEffectMain(context, PF_Cmd_GLOBAL_SETDOWN, nullptr);
+}
+
+PF_Err MockHost::withRenderContext(const MockRenderRequest& request,
+                                   const std::function<PF_Err(PF_InData*, PF_EffectWorld*, PF_EffectWorld*)>& body)
+{
+    // Worlds are kept per thread, like AE's world cache, so steady-state frames don't pay for allocation
+    thread_local std::vector<char> inputPixels;
+    thread_local std::vector<char> outputPixels;
+    thread_local MockRenderRequest filledRequest{};
+
+    Context context{};
+    context.request = request;
+    initializeContext(context);
+
+    setUpWorld(context.inputWorld, inputPixels, request);
+    setUpWorld(context.outputWorld, outputPixels, request);
+
+    if (request.width != filledRequest.width
+        || request.height != filledRequest.height
+        || request.pixelFormat != filledRequest.pixelFormat
+        || request.rowPadding != filledRequest.rowPadding)
+    {
+        fillWorld(context.inputWorld, request.pixelFormat);
+        filledRequest = request;
+    }
+
+    auto previousContext = currentContext;
+    currentContext = &context;
+
+    PF_Err err = body(&context.in_data, &context.inputWorld, &context.outputWorld);
+
+    currentContext = previousContext;
+    return err;
+}
+
+PF_Err MockHost::renderFrame(const MockRenderRequest& request)
+{
+    return withRenderContext(request, [&](PF_InData* in_data, PF_EffectWorld*, PF_EffectWorld*) {
+        return renderFrame(*getContext(in_data->effect_ref));
+    });
+}
+
+PF_Err MockHost::renderFrame(Context& context)
+{
+    const auto& request = context.request;
+
+    // MARK: Pre-render
+
+    PF_RenderRequest renderRequest;
+    AEFX_CLR_STRUCT(renderRequest);
+    renderRequest.rect = { 0, 0, request.width, request.height };
+    renderRequest.field = PF_Field_FRAME;
+    renderRequest.channel_mask = PF_ChannelMask_ARGB;
+
+    PF_PreRenderInput preRenderInput;
+    AEFX_CLR_STRUCT(preRenderInput);
+    preRenderInput.output_request = renderRequest;
+    preRenderInput.bitdepth = getBitDepth(request.pixelFormat);
+
+    PF_PreRenderOutput preRenderOutput;
+    AEFX_CLR_STRUCT(preRenderOutput);
+
+    PF_PreRenderCallbacks preRenderCallbacks {
+        .checkout_layer = checkoutLayer,
+        .GuidMixInPtr = guidMixIn,
+    };
+
+    PF_PreRenderExtra preRenderExtra {
+        .input = &preRenderInput,
+        .output = &preRenderOutput,
+        .cb = &preRenderCallbacks,
+    };
+
+    PF_Err err = callEffectMain(context, PF_Cmd_SMART_PRE_RENDER, &preRenderExtra);
+
+    // MARK: Render
+
+    if (err == PF_Err_NONE)
+    {
+        PF_SmartRenderInput smartRenderInput;
+        AEFX_CLR_STRUCT(smartRenderInput);
+        smartRenderInput.output_request = renderRequest;
+        smartRenderInput.bitdepth = preRenderInput.bitdepth;
+        smartRenderInput.pre_render_data = preRenderOutput.pre_render_data;
+
+        PF_SmartRenderCallbacks smartRenderCallbacks {
+            .checkout_layer_pixels = checkoutLayerPixels,
+            .checkin_layer_pixels = checkinLayerPixels,
+            .checkout_output = checkoutOutput,
+        };
+
+        PF_SmartRenderExtra smartRenderExtra {
+            .input = &smartRenderInput,
+            .cb = &smartRenderCallbacks,
+        };
+
+        err = callEffectMain(context, PF_Cmd_SMART_RENDER, &smartRenderExtra);
+    }
+
+    if (preRenderOutput.pre_render_data != nullptr && preRenderOutput.delete_pre_render_data_func != nullptr)
+    {
+        preRenderOutput.delete_pre_render_data_func(preRenderOutput.pre_render_data);
+    }
+
+    return err;
+}
+
+void MockHost::setIterateThreadCount(uint32_t threadCount)
+{
+    iterateThreadCount.store(threadCount, std::memory_order_relaxed);
+}
+
+void MockHost::setCancelled(bool isCancelled)
+{
+    this->isCancelled.store(isCancelled, std::memory_order_relaxed);
+}
+
+uint64_t MockHost::getMissingSuiteCount() const
+{
+    return missingSuiteCount.load(std::memory_order_relaxed);
+}
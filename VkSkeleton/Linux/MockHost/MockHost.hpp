@@ -0,0 +1,92 @@
+//
+//  MockHost.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/10/21.
+//
+//  Just enough of an After Effects host to drive EffectMain headlessly: PF_InData / PF_OutData,
+//  a PICA basic suite serving the suites VkSkeleton uses, the SmartFX pre-render and render
+//  callbacks, and PF_EffectWorlds with padded rowbytes like AE hands out.
+//
+
+#ifndef MockHost_hpp
+#define MockHost_hpp
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "AE_Effect.h"
+#include "AE_EffectCB.h"
+#include "AE_EffectCBSuites.h"
+
+typedef PF_Err (*EffectMainFunc)(PF_Cmd         cmd,
+                                 PF_InData*     in_data,
+                                 PF_OutData*    out_data,
+                                 PF_ParamDef*   params[],
+                                 PF_LayerDef*   output,
+                                 void*          extra);
+
+struct MockRenderRequest {
+    A_long          width;
+    A_long          height;
+    PF_PixelFormat  pixelFormat;
+
+    // Bytes added to the end of every row, on top of AE's 16 byte row alignment
+    A_long          rowPadding;
+
+    PF_FpLong       sliderValue;
+    A_long          currentTime;
+
+    // AE's preview resolution, 2 for half and 4 for quarter. Only sets in_data's downsample factors:
+    // width and height are the worlds' size, so already divided by it.
+    A_long          downsample      = 1;
+    PF_Quality      quality         = PF_Quality_HI;
+};
+
+class MockHost
+{
+public:
+
+    // pluginPath is what the plugin gets back for PF_PlatData_EXE_FILE_PATH_W;
+    // the plugin looks for its shaders/ folder next to it.
+    MockHost(EffectMainFunc effectMain, std::string pluginPath);
+
+    PF_Err globalSetup();
+    PF_Err paramsSetup();
+    PF_Err globalSetdown();
+
+    // SMART_PRE_RENDER followed by SMART_RENDER on freshly filled worlds. Safe to call from many threads at once.
+    PF_Err renderFrame(const MockRenderRequest& request);
+
+    // Sets up the same context and worlds as renderFrame, then hands them to body instead of calling
+    // EffectMain. For exercising plugin helpers like AEUtils::copyImageData on their own.
+    PF_Err withRenderContext(const MockRenderRequest& request,
+                             const std::function<PF_Err(PF_InData*, PF_EffectWorld*, PF_EffectWorld*)>& body);
+
+    // Threads the Iterate suites split rows across, 0 for one per core (the default, like AE)
+    static void setIterateThreadCount(uint32_t threadCount);
+
+    // Every call to abort / progress returns PF_Interrupt_CANCEL once this is set
+    void setCancelled(bool isCancelled);
+
+    // Number of times the plugin asked for a suite this host doesn't serve
+    uint64_t getMissingSuiteCount() const;
+
+    // Internal state for the C callbacks, which only get an effect_ref to work with
+    struct Context;
+
+private:
+    EffectMainFunc          effectMain;
+    std::string             pluginPath;
+    std::atomic<bool>       isCancelled{false};
+
+    A_long                  numParams       = 0;
+
+    PF_Err callEffectMain(Context& context, PF_Cmd cmd, void* extra);
+    PF_Err renderFrame(Context& context);
+    void initializeContext(Context& context);
+};
+
+#endif /* MockHost_hpp */
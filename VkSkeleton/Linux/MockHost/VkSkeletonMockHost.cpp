@@ -0,0 +1,298 @@
+//
+//  VkSkeletonMockHost.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/10/21.
+//
+//  Loads VkSkeleton's EffectMain into the mock host and renders frames through the full
+//  GLOBAL_SETUP -> SMART_PRE_RENDER -> SMART_RENDER path, from several threads at once.
+//  Prints one JSON line with the latency summary to stdout.
+//
+//  usage: vkskeleton_mockhost [--threads N] [--frames N] [--size WxH] [--bpc 8|16|32]
+//                             [--padding BYTES] [--slider VALUE] [--downsample 1|2|4|8]
+//                             [--quality high|draft] [--warmup N] [--max-allocations N]
+//                             [--plugin-path PATH]
+//
+//  --size is the full-resolution frame; with --downsample the worlds are that divided by the factor,
+//  like AE's half and quarter resolution previews.
+//
+//  Each thread first renders --warmup untimed frames. The heap allocations EffectMain makes during the
+//  timed frames are reported as steadyStateAllocations, and with --max-allocations the run fails if there
+//  are more than that. `--warmup 2 --max-allocations 0` checks that warm frames don't allocate.
+//
+
+#include <algorithm>
+#include <barrier>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AllocationCounter.hpp"
+#include "MockHost.hpp"
+#include "VkSkeleton.hpp"
+
+// MARK: - Configuration
+
+struct MockHostOptions {
+    uint32_t        threadCount     = 4;
+    uint32_t        frameCount      = 100;
+    A_long          width           = 1920;
+    A_long          height          = 1080;
+    PF_PixelFormat  pixelFormat     = PF_PixelFormat_ARGB32;
+    A_long          rowPadding      = 64;
+    PF_FpLong       sliderValue     = 50.0;
+    A_long          downsample      = 1;
+    PF_Quality      quality         = PF_Quality_HI;
+    uint32_t        warmupFrameCount = 0;
+    int64_t         maxAllocations  = -1;   // no limit
+    std::string     pluginPath      = VKSKELETON_MOCK_PLUGIN_PATH;
+};
+
+PF_PixelFormat parsePixelFormat(const std::string& bitsPerChannel)
+{
+    if (bitsPerChannel == "8")
+    {
+        return PF_PixelFormat_ARGB32;
+    }
+    if (bitsPerChannel == "16")
+    {
+        return PF_PixelFormat_ARGB64;
+    }
+    if (bitsPerChannel == "32")
+    {
+        return PF_PixelFormat_ARGB128;
+    }
+
+    throw std::runtime_error("Unknown bit depth " + bitsPerChannel + " (expected 8, 16 or 32)");
+}
+
+MockHostOptions parseOptions(int argc, char* argv[])
+{
+    MockHostOptions options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (i + 1 >= argc)
+        {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+
+        std::string value = argv[++i];
+
+        if (arg == "--threads")
+        {
+            options.threadCount = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--frames")
+        {
+            options.frameCount = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--size")
+        {
+            auto separator = value.find('x');
+            if (separator == std::string::npos)
+            {
+                throw std::runtime_error("Expected --size WxH, got " + value);
+            }
+            options.width = std::max(1, std::stoi(value.substr(0, separator)));
+            options.height = std::max(1, std::stoi(value.substr(separator + 1)));
+        }
+        else if (arg == "--bpc")
+        {
+            options.pixelFormat = parsePixelFormat(value);
+        }
+        else if (arg == "--padding")
+        {
+            options.rowPadding = std::max(0, std::stoi(value));
+        }
+        else if (arg == "--slider")
+        {
+            options.sliderValue = std::stod(value);
+        }
+        else if (arg == "--downsample")
+        {
+            options.downsample = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--quality")
+        {
+            if (value != "high" && value != "draft")
+            {
+                throw std::runtime_error("Unknown quality " + value + " (expected high or draft)");
+            }
+            options.quality = value == "draft" ? PF_Quality_LO : PF_Quality_HI;
+        }
+        else if (arg == "--warmup")
+        {
+            options.warmupFrameCount = std::max(0, std::stoi(value));
+        }
+        else if (arg == "--max-allocations")
+        {
+            options.maxAllocations = std::max<int64_t>(0, std::stoll(value));
+        }
+        else if (arg == "--plugin-path")
+        {
+            options.pluginPath = value;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg);
+        }
+    }
+
+    return options;
+}
+
+// MARK: - Main
+
+int main(int argc, char* argv[])
+{
+    MockHostOptions options;
+
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+
+    MockHost host(EffectMain, options.pluginPath);
+
+    auto setupStart = std::chrono::steady_clock::now();
+
+    PF_Err err = host.globalSetup();
+    if (err == PF_Err_NONE)
+    {
+        err = host.paramsSetup();
+    }
+
+    auto setupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - setupStart).count();
+
+    if (err != PF_Err_NONE)
+    {
+        std::cerr << "Setup failed with PF_Err " << err << std::endl;
+        host.globalSetdown();
+        return 1;
+    }
+
+    std::mutex resultMutex;
+    std::vector<double> frameMs;
+    uint32_t failedFrameCount = 0;
+
+    frameMs.reserve(options.frameCount * options.threadCount);
+
+    // Every thread is done warming up before any allocation is counted
+    std::barrier warmedUp(options.threadCount, []() noexcept {
+        AllocationCounter::reset();
+    });
+
+    auto renderStart = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < options.threadCount; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            std::vector<double> threadFrameMs;
+            uint32_t threadFailedFrameCount = 0;
+
+            threadFrameMs.reserve(options.frameCount);
+
+            for (uint32_t i = 0; i < options.warmupFrameCount + options.frameCount; ++i)
+            {
+                if (i == options.warmupFrameCount)
+                {
+                    warmedUp.arrive_and_wait();
+                }
+
+                MockRenderRequest request {
+                    .width = (options.width + options.downsample - 1) / options.downsample,
+                    .height = (options.height + options.downsample - 1) / options.downsample,
+                    .pixelFormat = options.pixelFormat,
+                    .rowPadding = options.rowPadding,
+                    .sliderValue = options.sliderValue,
+                    .currentTime = static_cast<A_long>(t * options.frameCount + i),
+                    .downsample = options.downsample,
+                    .quality = options.quality,
+                };
+
+                auto start = std::chrono::steady_clock::now();
+                PF_Err frameErr = host.renderFrame(request);
+
+                if (i >= options.warmupFrameCount)
+                {
+                    threadFrameMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+                }
+
+                if (frameErr != PF_Err_NONE)
+                {
+                    threadFailedFrameCount += 1;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(resultMutex);
+            frameMs.insert(frameMs.end(), threadFrameMs.begin(), threadFrameMs.end());
+            failedFrameCount += threadFailedFrameCount;
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    auto renderSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+    auto steadyStateAllocations = AllocationCounter::getCount();
+    bool isOverAllocationLimit = options.maxAllocations >= 0 && steadyStateAllocations > static_cast<uint64_t>(options.maxAllocations);
+
+    err = host.globalSetdown();
+
+    std::sort(frameMs.begin(), frameMs.end());
+
+    auto percentile = [&](double p) {
+        return frameMs[static_cast<size_t>(p * static_cast<double>(frameMs.size() - 1) + 0.5)];
+    };
+
+    std::ostringstream json;
+    json << "{\"threads\":" << options.threadCount
+         << ",\"framesPerThread\":" << options.frameCount
+         << ",\"width\":" << options.width
+         << ",\"height\":" << options.height
+         << ",\"pixelFormat\":" << options.pixelFormat
+         << ",\"rowPadding\":" << options.rowPadding
+         << ",\"downsample\":" << options.downsample
+         << ",\"quality\":\"" << (options.quality == PF_Quality_LO ? "draft" : "high") << "\""
+         << ",\"setupMs\":" << setupMs
+         << ",\"p50Ms\":" << percentile(0.50)
+         << ",\"p90Ms\":" << percentile(0.90)
+         << ",\"p99Ms\":" << percentile(0.99)
+         << ",\"maxMs\":" << frameMs.back()
+         << ",\"framesPerSecond\":" << static_cast<double>(frameMs.size()) / renderSeconds
+         << ",\"failedFrames\":" << failedFrameCount
+         << ",\"missingSuites\":" << host.getMissingSuiteCount()
+         << ",\"warmupFrames\":" << options.warmupFrameCount
+         << ",\"steadyStateAllocations\":" << steadyStateAllocations
+         << "}";
+
+    std::cout << json.str() << std::endl;
+
+    if (err != PF_Err_NONE)
+    {
+        std::cerr << "GLOBAL_SETDOWN failed with PF_Err " << err << std::endl;
+    }
+
+    if (isOverAllocationLimit)
+    {
+        std::cerr << "Warm frames made " << steadyStateAllocations << " heap allocations, more than the "
+                  << options.maxAllocations << " allowed" << std::endl;
+    }
+
+    return err == PF_Err_NONE && failedFrameCount == 0 && host.getMissingSuiteCount() == 0 && !isOverAllocationLimit ? 0 : 1;
+}
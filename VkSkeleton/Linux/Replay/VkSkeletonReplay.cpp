@@ -0,0 +1,264 @@
+//
+//  VkSkeletonReplay.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/11/21.
+//
+//  Streams the frames of a capture file (see FrameCapture.hpp) through VulkanComputeProgram as
+//  fast as it will take them, in capture order. Input pixels are copied straight out of the
+//  mapped file. One JSON line per kernel x frame size x pixel format goes to stdout.
+//
+//  usage: vkskeleton_replay CAPTURE [--loops N] [--shader-dir DIR] [--label NAME]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "FrameCapture.hpp"
+#include "KernelFusion.hpp"
+#include "VulkanComputeProgram.hpp"
+
+// MARK: - Configuration
+
+struct ReplayOptions {
+    std::string     capturePath;
+    uint32_t        loopCount       = 1;
+    std::string     shaderDir       = VKSKELETON_SHADER_DIR;
+    std::string     label           = "";
+};
+
+// Pointwise kernels a fused chain's kernel ID can name
+const std::vector<PointwiseKernel> knownPointwiseKernels = {
+    PointwiseKernels::invert,
+};
+
+static const char* getPixelFormatName(PixelFormat pixelFormat)
+{
+    switch (pixelFormat)
+    {
+        case ARGB128:
+            return "ARGB128";
+        case ARGB64:
+            return "ARGB64";
+        default:
+            return "ARGB32";
+    }
+}
+
+// MARK: - Programs
+
+// A shader file name sets the program up from shaderDir, anything else is a '+' separated fused chain
+static std::unique_ptr<VulkanComputeProgram> makeProgram(const std::string& kernelId, const ReplayOptions& options)
+{
+    auto program = std::make_unique<VulkanComputeProgram>();
+
+    if (kernelId.size() > 5 && kernelId.compare(kernelId.size() - 5, 5, ".comp") == 0)
+    {
+        program->setUp(options.shaderDir + kernelId);
+        return program;
+    }
+
+    std::vector<PointwiseKernel> kernels;
+    std::istringstream stream(kernelId);
+    std::string name;
+
+    while (std::getline(stream, name, '+'))
+    {
+        auto kernel = std::find_if(knownPointwiseKernels.begin(), knownPointwiseKernels.end(), [&](const PointwiseKernel& k) {
+            return k.name == name;
+        });
+
+        if (kernel == knownPointwiseKernels.end())
+        {
+            throw std::runtime_error("Capture uses unknown kernel " + name);
+        }
+
+        kernels.push_back(*kernel);
+    }
+
+    program->setUp(kernels);
+    return program;
+}
+
+// MARK: - Statistics
+
+struct ReplayGroup {
+    std::string         kernelId;
+    ImageInfo           imageInfo;
+    std::vector<double> frameMs;
+};
+
+static std::string toJSON(const std::string& label, ReplayGroup& group)
+{
+    auto& frameMs = group.frameMs;
+    std::sort(frameMs.begin(), frameMs.end());
+
+    double sum = 0.0;
+    for (auto ms : frameMs)
+    {
+        sum += ms;
+    }
+
+    auto percentile = [&](double p) {
+        return frameMs[static_cast<size_t>(p * static_cast<double>(frameMs.size() - 1) + 0.5)];
+    };
+
+    auto meanMs = sum / static_cast<double>(frameMs.size());
+    auto megapixels = static_cast<double>(group.imageInfo.width) * static_cast<double>(group.imageInfo.height) / 1e6;
+
+    std::ostringstream json;
+    json << "{\"label\":\"" << label << "\""
+         << ",\"kernel\":\"" << group.kernelId << "\""
+         << ",\"pixelFormat\":\"" << getPixelFormatName(group.imageInfo.pixelFormat) << "\""
+         << ",\"width\":" << group.imageInfo.width
+         << ",\"height\":" << group.imageInfo.height
+         << ",\"frames\":" << frameMs.size()
+         << ",\"meanMs\":" << meanMs
+         << ",\"p50Ms\":" << percentile(0.50)
+         << ",\"p90Ms\":" << percentile(0.90)
+         << ",\"p99Ms\":" << percentile(0.99)
+         << ",\"maxMs\":" << frameMs.back()
+         << ",\"megapixelsPerSecond\":" << megapixels / (meanMs / 1000.0)
+         << "}";
+
+    return json.str();
+}
+
+// MARK: - Command Line
+
+static ReplayOptions parseOptions(int argc, char* argv[])
+{
+    ReplayOptions options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (arg.rfind("--", 0) != 0)
+        {
+            options.capturePath = arg;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+
+        std::string value = argv[++i];
+
+        if (arg == "--loops")
+        {
+            options.loopCount = std::max(1, std::stoi(value));
+        }
+        else if (arg == "--shader-dir")
+        {
+            options.shaderDir = value.back() == '/' ? value : value + "/";
+        }
+        else if (arg == "--label")
+        {
+            options.label = value;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg);
+        }
+    }
+
+    if (options.capturePath.empty())
+    {
+        throw std::runtime_error("usage: vkskeleton_replay CAPTURE [--loops N] [--shader-dir DIR] [--label NAME]");
+    }
+
+    return options;
+}
+
+// MARK: - Main
+
+int main(int argc, char* argv[])
+{
+    ReplayOptions options;
+
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+
+    try
+    {
+        FrameCaptureReader reader(options.capturePath);
+        const auto& frames = reader.getFrames();
+
+        if (frames.empty())
+        {
+            std::cerr << options.capturePath << " has no complete frames" << std::endl;
+            return 1;
+        }
+
+        std::map<std::string, std::unique_ptr<VulkanComputeProgram>> programs;
+        std::map<std::tuple<std::string, uint32_t, uint32_t, PixelFormat>, ReplayGroup> groups;
+        std::vector<char> outputFrame;
+
+        for (uint32_t loop = 0; loop < options.loopCount; ++loop)
+        {
+            for (const auto& frame : frames)
+            {
+                auto& program = programs[frame.kernelId];
+                if (!program)
+                {
+                    program = makeProgram(frame.kernelId, options);
+                }
+
+                auto imageInfo = frame.imageInfo;
+                outputFrame.resize(imageInfo.size());
+
+                auto start = std::chrono::steady_clock::now();
+
+                program->process(imageInfo,
+                                 frame.uniformBufferObject,
+                                 [&](void* buffer) { memcpy(buffer, frame.pixels, imageInfo.size()); },
+                                 [&](void* buffer) { memcpy(outputFrame.data(), buffer, outputFrame.size()); },
+                                 frame.parameterBlock);
+
+                auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+                auto& group = groups[{frame.kernelId, imageInfo.width, imageInfo.height, imageInfo.pixelFormat}];
+                group.kernelId = frame.kernelId;
+                group.imageInfo = imageInfo;
+                group.frameMs.push_back(ms);
+            }
+        }
+
+        for (auto& [key, group] : groups)
+        {
+            std::cout << toJSON(options.label, group) << std::endl;
+        }
+
+        for (auto& [kernelId, program] : programs)
+        {
+            program->tearDown();
+        }
+
+        std::cerr << "Replayed " << frames.size() << " captured frames x " << options.loopCount << " loops" << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,367 @@
+//
+//  VkSkeletonCpuVerify.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/12/21.
+//
+//  Renders the same frames through the GPU round trip and CPU SIMD strategies of ComputeDispatcher and checks
+//  that they agree. Prints one JSON line per shader or fused chain x frame pattern x pixel format x frame size
+//  x pivot x quality and exits non-zero if any configuration is out of tolerance.
+//
+//  Tolerances are in normalized channel units. The GPU is only required to filter with
+//  subTexelPrecisionBits (as few as 4) of weight precision, so the warp gets some slack on
+//  top of UNORM rounding; a handful of channels on the warp's quadrant seams may land on
+//  the other side of a comparison and are allowed through by --outlier-fraction.
+//
+//  usage: vkskeleton_cpu_verify [--tolerance T] [--outlier-fraction F] [--shader-dir DIR]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ComputeDispatcher.hpp"
+#include "KernelFusion.hpp"
+
+// MARK: - Configuration
+
+struct VerifyOptions {
+    double          tolerance           = 3.0 / 255.0;
+    double          outlierFraction     = 1e-4;
+    std::string     shaderDir           = VKSKELETON_SHADER_DIR;
+};
+
+struct FrameSize {
+    uint32_t width;
+    uint32_t height;
+};
+
+// Odd sizes catch edge handling, the large one catches banding across threads
+const std::vector<FrameSize> frameSizes = {
+    { 97,   61      },
+    { 640,  360     },
+    { 1920, 1080    },
+};
+
+const std::vector<std::pair<std::string, PixelFormat>> pixelFormats = {
+    { "ARGB32",     ARGB32  },
+    { "ARGB64",     ARGB64  },
+    { "ARGB128",    ARGB128 },
+};
+
+enum FramePattern {
+    GradientFrame,
+    CheckerboardFrame,
+};
+
+static const char* getFramePatternName(FramePattern pattern)
+{
+    switch (pattern)
+    {
+        case GradientFrame:
+            return "gradient";
+        case CheckerboardFrame:
+            return "checkerboard";
+    }
+
+    return "unknown";
+}
+
+struct VerifyCase {
+    std::string                                                         name;
+    std::function<void(ComputeDispatcher&, const std::string&)>         setUp;      // dispatcher, shader dir
+    std::vector<FramePattern>                                           patterns;
+};
+
+// The warp resamples between texels, so on hard edges it would mostly measure the GPU's subtexel precision.
+// Pointwise kernels must reproduce every texel exactly, and a one pixel checkerboard turns any filtering
+// or half texel offset into a full scale error. The fused invert runs against the same CPU kernel as
+// simple.comp, so it also checks that fused and unfused chains agree.
+const std::vector<VerifyCase> verifyCases = {
+    {
+        .name = "invert.comp",
+        .setUp = [](ComputeDispatcher& dispatcher, const std::string& shaderDir) { dispatcher.setUp(shaderDir + "invert.comp"); },
+        .patterns = { GradientFrame },
+    },
+    {
+        .name = "simple.comp",
+        .setUp = [](ComputeDispatcher& dispatcher, const std::string& shaderDir) { dispatcher.setUp(shaderDir + "simple.comp"); },
+        .patterns = { GradientFrame, CheckerboardFrame },
+    },
+    {
+        .name = "fused:invert",
+        .setUp = [](ComputeDispatcher& dispatcher, const std::string&) { dispatcher.setUp({ PointwiseKernels::invert }); },
+        .patterns = { GradientFrame, CheckerboardFrame },
+    },
+};
+
+// MARK: - Frames
+
+// Integer hash of a pixel position, in [0, 1]
+static float getNoise(uint32_t x, uint32_t y)
+{
+    uint32_t h = x * 0x9E3779B1u ^ y * 0x85EBCA77u;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+
+    return static_cast<float>(h & 0xFFFF) / 65535.f;
+}
+
+// Gradients are smooth with a low frequency ripple, so the warp samples something that varies
+// without every bilinear tap landing on a hard edge. Checkerboards alternate every pixel, with noise in blue.
+static void fillFrame(std::vector<char>& frame, ImageInfo imageInfo, FramePattern pattern)
+{
+    for (uint32_t y = 0; y < imageInfo.height; ++y)
+    {
+        for (uint32_t x = 0; x < imageInfo.width; ++x)
+        {
+            float u = static_cast<float>(x) / static_cast<float>(imageInfo.width);
+            float v = static_cast<float>(y) / static_cast<float>(imageInfo.height);
+            float checker = ((x ^ y) & 1) ? 1.f : 0.f;
+
+            float channels[4] = {
+                1.f,
+                pattern == CheckerboardFrame ? checker : u,
+                pattern == CheckerboardFrame ? 1.f - checker : v,
+                pattern == CheckerboardFrame ? getNoise(x, y) : 0.5f + 0.5f * std::sin(6.f * u + 4.f * v),
+            };
+
+            auto index = (static_cast<size_t>(y) * imageInfo.width + x) * 4;
+
+            for (size_t c = 0; c < 4; ++c)
+            {
+                switch (imageInfo.pixelFormat)
+                {
+                    case ARGB32:
+                        reinterpret_cast<uint8_t*>(frame.data())[index + c] = static_cast<uint8_t>(channels[c] * 255.f + 0.5f);
+                        break;
+                    case ARGB64:
+                        reinterpret_cast<uint16_t*>(frame.data())[index + c] = static_cast<uint16_t>(channels[c] * 65535.f + 0.5f);
+                        break;
+                    case ARGB128:
+                        reinterpret_cast<float*>(frame.data())[index + c] = channels[c];
+                        break;
+                }
+            }
+        }
+    }
+}
+
+static double getChannel(const std::vector<char>& frame, PixelFormat pixelFormat, size_t index)
+{
+    switch (pixelFormat)
+    {
+        case ARGB32:
+            return reinterpret_cast<const uint8_t*>(frame.data())[index] / 255.0;
+        case ARGB64:
+            return reinterpret_cast<const uint16_t*>(frame.data())[index] / 65535.0;
+        case ARGB128:
+            return reinterpret_cast<const float*>(frame.data())[index];
+    }
+
+    return 0.0;
+}
+
+// MARK: - Verification
+
+struct Comparison {
+    double      maxError;
+    double      meanError;
+    uint64_t    outlierCount;
+    uint64_t    channelCount;
+    double      gpuMs;
+    double      cpuMs;
+};
+
+static double render(ComputeDispatcher& dispatcher,
+                     ComputeStrategy strategy,
+                     ImageInfo imageInfo,
+                     UniformBufferObject ubo,
+                     const std::vector<char>& input,
+                     std::vector<char>& output)
+{
+    dispatcher.setForcedStrategy(strategy);
+
+    auto start = std::chrono::steady_clock::now();
+    dispatcher.process(imageInfo,
+                       ubo,
+                       [&](void* buffer) { memcpy(buffer, input.data(), input.size()); },
+                       [&](void* buffer) { memcpy(output.data(), buffer, output.size()); });
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static Comparison compare(ComputeDispatcher& dispatcher,
+                          ImageInfo imageInfo,
+                          UniformBufferObject ubo,
+                          FramePattern pattern,
+                          const VerifyOptions& options)
+{
+    std::vector<char> input(imageInfo.size());
+    std::vector<char> gpuOutput(imageInfo.size());
+    std::vector<char> cpuOutput(imageInfo.size());
+
+    fillFrame(input, imageInfo, pattern);
+
+    Comparison comparison{};
+    comparison.gpuMs = render(dispatcher, GpuRoundTripStrategy, imageInfo, ubo, input, gpuOutput);
+    comparison.cpuMs = render(dispatcher, CpuSimdStrategy, imageInfo, ubo, input, cpuOutput);
+    comparison.channelCount = static_cast<uint64_t>(imageInfo.width) * imageInfo.height * 4;
+
+    double totalError = 0.0;
+
+    for (size_t i = 0; i < comparison.channelCount; ++i)
+    {
+        double error = std::fabs(getChannel(gpuOutput, imageInfo.pixelFormat, i) - getChannel(cpuOutput, imageInfo.pixelFormat, i));
+
+        totalError += error;
+        comparison.maxError = std::max(comparison.maxError, error);
+
+        if (error > options.tolerance)
+        {
+            comparison.outlierCount += 1;
+        }
+    }
+
+    comparison.meanError = totalError / static_cast<double>(comparison.channelCount);
+
+    return comparison;
+}
+
+// MARK: - Command Line
+
+static VerifyOptions parseOptions(int argc, char* argv[])
+{
+    VerifyOptions options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (i + 1 >= argc)
+        {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+
+        std::string value = argv[++i];
+
+        if (arg == "--tolerance")
+        {
+            options.tolerance = std::stod(value);
+        }
+        else if (arg == "--outlier-fraction")
+        {
+            options.outlierFraction = std::stod(value);
+        }
+        else if (arg == "--shader-dir")
+        {
+            options.shaderDir = value.back() == '/' ? value : value + "/";
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg);
+        }
+    }
+
+    return options;
+}
+
+// MARK: - Main
+
+int main(int argc, char* argv[])
+{
+    VerifyOptions options;
+
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+
+    int exitCode = 0;
+
+    for (const auto& verifyCase : verifyCases)
+    {
+        ComputeDispatcher dispatcher;
+
+        try
+        {
+            verifyCase.setUp(dispatcher, options.shaderDir);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << verifyCase.name << ": setUp failed: " << e.what() << std::endl;
+            return 1;
+        }
+
+        if (!dispatcher.isStrategyAvailable(GpuRoundTripStrategy))
+        {
+            std::cerr << "No Vulkan device; nothing to verify the CPU kernels against" << std::endl;
+            return 1;
+        }
+
+        for (FramePattern pattern : verifyCase.patterns)
+        {
+            for (const auto& [pixelFormatName, pixelFormat] : pixelFormats)
+            {
+                for (const auto& frameSize : frameSizes)
+                {
+                    for (float pivot : { 0.f, 0.35f, 1.f })
+                    {
+                        for (uint32_t isDraftQuality : { 0u, 1u })
+                        {
+                            ImageInfo imageInfo {
+                                .width = frameSize.width,
+                                .height = frameSize.height,
+                                .pixelFormat = pixelFormat,
+                            };
+
+                            auto comparison = compare(dispatcher,
+                                                      imageInfo,
+                                                      { .pivot = pivot, .isDraftQuality = isDraftQuality },
+                                                      pattern,
+                                                      options);
+
+                            auto allowedOutliers = static_cast<uint64_t>(options.outlierFraction * static_cast<double>(comparison.channelCount));
+                            bool isPassing = comparison.outlierCount <= allowedOutliers;
+
+                            std::cout << "{\"shader\":\"" << verifyCase.name << "\""
+                                      << ",\"pattern\":\"" << getFramePatternName(pattern) << "\""
+                                      << ",\"pixelFormat\":\"" << pixelFormatName << "\""
+                                      << ",\"width\":" << imageInfo.width
+                                      << ",\"height\":" << imageInfo.height
+                                      << ",\"pivot\":" << pivot
+                                      << ",\"quality\":\"" << (isDraftQuality ? "draft" : "high") << "\""
+                                      << ",\"maxError\":" << comparison.maxError
+                                      << ",\"meanError\":" << comparison.meanError
+                                      << ",\"outliers\":" << comparison.outlierCount
+                                      << ",\"gpuMs\":" << comparison.gpuMs
+                                      << ",\"cpuMs\":" << comparison.cpuMs
+                                      << ",\"pass\":" << (isPassing ? "true" : "false")
+                                      << "}" << std::endl;
+
+                            if (!isPassing)
+                            {
+                                exitCode = 1;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        dispatcher.tearDown();
+    }
+
+    return exitCode;
+}
@@ -5,10 +5,17 @@
 //  Created by James Perlman on 10/25/21.
 //
 
+#include <algorithm>
+#include <cstring>
+
 #include "AEUtils.hpp"
+#include "TaskScheduler.hpp"
 
 using namespace AEUtils;
 
+// Copies split into bands of at least this much, so a small frame doesn't wake the pool for nothing
+static const size_t minCopyBandBytes = 256 * 1024;
+
 // MARK: - Get Resources Path
 
 #ifdef AE_OS_WIN
@@ -52,9 +59,31 @@ std::string AEUtils::getResourcePath(PF_InData* in_data)
     resourcePath += "/Contents/Resources/";
 #endif
     
+#ifdef AE_OS_LINUX
+    // Only the Linux mock host gets here, and it only hands out ASCII paths
+    for (A_UTF16Char* c = pluginFolderPath; *c != 0; ++c)
+    {
+        resourcePath += static_cast<char>(*c);
+    }
+    resourcePath = resourcePath.substr(0, resourcePath.rfind("/")) + "/";
+#endif
+    
     return resourcePath;
 }
 
+std::string AEUtils::getPluginFolderPath(PF_InData* in_data)
+{
+    auto pluginFolderPath = getResourcePath(in_data);
+    
+#ifdef AE_OS_MAC
+    // Step out of VkSkeleton.plugin/Contents/Resources/
+    pluginFolderPath = pluginFolderPath.substr(0, pluginFolderPath.rfind(".plugin/"));
+    pluginFolderPath = pluginFolderPath.substr(0, pluginFolderPath.rfind("/") + 1);
+#endif
+    
+    return pluginFolderPath;
+}
+
 
 // MARK: - RGBA32 Pixel Copy
 
@@ -105,32 +134,40 @@ CopyPixelFloatFromBufferToOutputWorld(void*             refcon,
 }
 
 // Copy row-by-row helper
-void copyRowByRow(void*     dst,
-                  void*     src,
-                  size_t    dstRowBytes,
-                  size_t    srcRowBytes,
-                  uint32_t  numRows)
+void AEUtils::copyRowByRow(void*     dst,
+                           void*     src,
+                           size_t    dstRowBytes,
+                           size_t    srcRowBytes,
+                           uint32_t  numRows)
 {
     auto dstAsChar = static_cast<char*>(dst);
     auto srcAsChar = static_cast<char*>(src);
-    auto copyRowBytes = MIN(dstRowBytes, srcRowBytes);
+    auto copyRowBytes = std::min(dstRowBytes, srcRowBytes);
     
-    for (uint32_t i = 0; i < numRows; ++i)
-    {
-        memcpy(dstAsChar + i * dstRowBytes,
-               srcAsChar + i * srcRowBytes,
-               copyRowBytes);
-    }
+    // Bands of at least minCopyBandBytes; anything smaller is copied on the calling thread
+    auto rowsPerBand = std::max<size_t>(1, minCopyBandBytes / std::max<size_t>(1, copyRowBytes));
+    
+    auto copyRows = [&](size_t top, size_t bottom) {
+        for (size_t i = top; i < bottom; ++i)
+        {
+            memcpy(dstAsChar + i * dstRowBytes,
+                   srcAsChar + i * srcRowBytes,
+                   copyRowBytes);
+        }
+    };
+    
+    // By reference, so the std::function parameter doesn't copy the captures to the heap every frame
+    TaskScheduler::parallelFor(0, numRows, rowsPerBand, std::cref(copyRows));
 }
 
 // Image Data Copy Function
-void AEUtils::copyImageData(AEGP_SuiteHandler&  suites,
-                            PF_InData*          in_data,
-                            PF_EffectWorld*     input_worldP,
-                            PF_EffectWorld*     output_worldP,
-                            CopyCommand         copyCommand,
-                            PF_PixelFormat      pixelFormat,
-                            void*               bufferP)
+void AEUtils::copyImageData(const PF_IterateFloatSuite1*  iterateFloatSuite,
+                            PF_InData*                    in_data,
+                            PF_EffectWorld*               input_worldP,
+                            PF_EffectWorld*               output_worldP,
+                            CopyCommand                   copyCommand,
+                            PF_PixelFormat                pixelFormat,
+                            void*                         bufferP)
 {
     // ARGB128 contains 32 bits per color component
     // This one is special since we need to use a custom float iterator
@@ -160,14 +197,14 @@ void AEUtils::copyImageData(AEGP_SuiteHandler&  suites,
                 }
             }
             
-            CHECK(suites.IterateFloatSuite1()->iterate(in_data,
-                                                       0,
-                                                       input_worldP->height,
-                                                       input_worldP,
-                                                       nullptr,
-                                                       reinterpret_cast<void*>(&refcon),
-                                                       copyFunction,
-                                                       output_worldP));
+            CHECK(iterateFloatSuite->iterate(in_data,
+                                             0,
+                                             input_worldP->height,
+                                             input_worldP,
+                                             nullptr,
+                                             reinterpret_cast<void*>(&refcon),
+                                             copyFunction,
+                                             output_worldP));
             
             break;
         }
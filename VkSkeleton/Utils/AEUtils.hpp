@@ -24,18 +24,29 @@ namespace AEUtils
 
 std::string getResourcePath(PF_InData* in_data);
 
+// Folder the plugin itself sits in, with a trailing separator
+std::string getPluginFolderPath(PF_InData* in_data);
+
 enum CopyCommand {
     InputWorldToBuffer,
     BufferToOutputWorld,
 };
 
-void copyImageData(AEGP_SuiteHandler&   suites,
-                   PF_InData*           in_data,
-                   PF_EffectWorld*      input_worldP,
-                   PF_EffectWorld*      output_worldP,
-                   CopyCommand          copyCommand,
-                   PF_PixelFormat       pixelFormat,
-                   void*                bufferP);
+// Copies numRows rows of min(dstRowBytes, srcRowBytes) bytes each, in bands across the TaskScheduler pool
+void copyRowByRow(void*     dst,
+                  void*     src,
+                  size_t    dstRowBytes,
+                  size_t    srcRowBytes,
+                  uint32_t  numRows);
+
+// iterateFloatSuite is only used for ARGB128, and is acquired once by the caller rather than per copy
+void copyImageData(const PF_IterateFloatSuite1*  iterateFloatSuite,
+                   PF_InData*                    in_data,
+                   PF_EffectWorld*               input_worldP,
+                   PF_EffectWorld*               output_worldP,
+                   CopyCommand                   copyCommand,
+                   PF_PixelFormat                pixelFormat,
+                   void*                         bufferP);
 
 
 }
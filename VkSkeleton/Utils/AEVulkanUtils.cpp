@@ -5,6 +5,8 @@
 //  Created by James Perlman on 11/2/21.
 //
 
+#include <stdexcept>
+
 #include "AEVulkanUtils.hpp"
 
 using namespace AEVulkanUtils;
@@ -0,0 +1,104 @@
+//
+//  ContentHash.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include "ContentHash.hpp"
+#include "TaskScheduler.hpp"
+
+// Hashes split into bands of at least this much, like the pixel copies
+static const size_t minHashBandBytes = 256 * 1024;
+
+static const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+
+static uint64_t rotateLeft(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Spreads every input bit over the whole result
+static uint64_t finalize(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t accumulate(uint64_t h, uint64_t word)
+{
+    return rotateLeft(h + word * prime2, 31) * prime1;
+}
+
+static uint64_t loadWord(const unsigned char* bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// One row, seeded with its index so the same row elsewhere in the image hashes differently
+static uint64_t hashRow(const unsigned char* row, size_t rowBytes, uint64_t seed)
+{
+    // Four independent lanes, so the multiplies of consecutive words overlap instead of waiting on each other
+    uint64_t lanes[4] = { seed + prime1 + prime2, seed + prime2, seed, seed - prime1 };
+
+    size_t i = 0;
+    for (; i + 32 <= rowBytes; i += 32)
+    {
+        lanes[0] = accumulate(lanes[0], loadWord(row + i));
+        lanes[1] = accumulate(lanes[1], loadWord(row + i + 8));
+        lanes[2] = accumulate(lanes[2], loadWord(row + i + 16));
+        lanes[3] = accumulate(lanes[3], loadWord(row + i + 24));
+    }
+
+    auto h = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+
+    for (; i + 8 <= rowBytes; i += 8)
+    {
+        h = accumulate(h, loadWord(row + i));
+    }
+
+    // An 8 bpc row of odd width ends on half a word
+    if (i < rowBytes)
+    {
+        uint64_t word = 0;
+        memcpy(&word, row + i, rowBytes - i);
+        h = accumulate(h, word);
+    }
+
+    return finalize(h + rowBytes);
+}
+
+uint64_t ContentHash::hashRows(const void* data, size_t rowBytes, size_t rowStride, uint32_t rowCount)
+{
+    auto bytes = static_cast<const unsigned char*>(data);
+    auto rowsPerBand = std::max<size_t>(1, minHashBandBytes / std::max<size_t>(1, rowBytes));
+
+    // Rows combine by XOR, so the bands can finish in any order
+    std::atomic<uint64_t> combined{0};
+
+    auto hashBand = [&](size_t top, size_t bottom) {
+        uint64_t bandHash = 0;
+        for (size_t y = top; y < bottom; ++y)
+        {
+            bandHash ^= hashRow(bytes + y * rowStride, rowBytes, y);
+        }
+
+        combined.fetch_xor(bandHash, std::memory_order_relaxed);
+    };
+
+    TaskScheduler::parallelFor(0, rowCount, rowsPerBand, std::cref(hashBand));
+
+    auto hash = finalize(combined.load(std::memory_order_relaxed) ^ (rowBytes * prime1) ^ rowCount);
+    return hash != 0 ? hash : 1;
+}
@@ -0,0 +1,26 @@
+//
+//  ContentHash.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#ifndef ContentHash_hpp
+#define ContentHash_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 64-bit content hashes of images, for telling whether two frames hold the same pixels without comparing
+// them. Not cryptographic: good against accidental matches, not against anyone crafting one.
+namespace ContentHash
+{
+
+// Hashes rowCount rows of rowBytes bytes each, rowStride bytes apart, across the TaskScheduler pool.
+// Only the rows' bytes count, not the padding between them, so an AE world and a packed buffer holding
+// the same image hash alike. Never returns 0, so 0 can stand for no hash.
+uint64_t hashRows(const void* data, size_t rowBytes, size_t rowStride, uint32_t rowCount);
+
+}
+
+#endif /* ContentHash_hpp */
@@ -5,7 +5,8 @@
 //  Created by James Perlman on 10/23/21.
 //
 
-#include "AEUtils.hpp"
+#include <stdexcept>
+
 #include "FileUtils.hpp"
 
 using namespace FileUtils;
@@ -0,0 +1,49 @@
+//
+//  ShaderCompilerUtils.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/4/21.
+//
+
+#include <shaderc/shaderc.h>
+#include <stdexcept>
+
+#include "ShaderCompilerUtils.hpp"
+
+using namespace ShaderCompilerUtils;
+
+std::vector<char> ShaderCompilerUtils::compileComputeShader(const std::string& source, const std::string& sourceName)
+{
+    shaderc_compiler_t compiler = shaderc_compiler_initialize();
+    shaderc_compile_options_t options = shaderc_compile_options_initialize();
+
+    shaderc_compile_options_set_optimization_level(options, shaderc_optimization_level_performance);
+
+    shaderc_compilation_result_t result = shaderc_compile_into_spv(compiler,
+                                                                   source.c_str(),
+                                                                   source.size(),
+                                                                   shaderc_compute_shader,
+                                                                   sourceName.c_str(),
+                                                                   "main",
+                                                                   options);
+
+    if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success)
+    {
+        std::string message = shaderc_result_get_error_message(result);
+
+        shaderc_result_release(result);
+        shaderc_compile_options_release(options);
+        shaderc_compiler_release(compiler);
+
+        throw std::runtime_error("Failed to compile shader " + sourceName + ": " + message);
+    }
+
+    const char* bytes = shaderc_result_get_bytes(result);
+    std::vector<char> code(bytes, bytes + shaderc_result_get_length(result));
+
+    shaderc_result_release(result);
+    shaderc_compile_options_release(options);
+    shaderc_compiler_release(compiler);
+
+    return code;
+}
@@ -0,0 +1,23 @@
+//
+//  ShaderCompilerUtils.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/4/21.
+//
+
+#ifndef ShaderCompilerUtils_hpp
+#define ShaderCompilerUtils_hpp
+
+#include <string>
+#include <vector>
+
+namespace ShaderCompilerUtils
+{
+
+// Compiles GLSL compute shader source into SPIR-V at runtime.
+// The returned bytes are laid out exactly like a .comp file compiled by glslc at build time.
+std::vector<char> compileComputeShader(const std::string& source, const std::string& sourceName);
+
+}
+
+#endif /* ShaderCompilerUtils_hpp */
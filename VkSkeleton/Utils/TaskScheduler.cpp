@@ -0,0 +1,643 @@
+//
+//  TaskScheduler.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/13/21.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "TaskScheduler.hpp"
+
+// Each call is cut into up to this many tasks per thread it gets, so a slow chunk can be
+// balanced by the others stealing the rest
+static const size_t tasksPerThread = 4;
+
+// MARK: - Jobs and Tasks
+
+struct SchedulerJob {
+    const std::function<void(size_t, size_t)>*     body;
+    std::atomic<size_t>                             remainingTaskCount{0};
+    std::atomic<bool>                               isFailed{false};
+
+    // Guards exception and isDone. The caller owns the job (on its stack) and only returns
+    // once it has seen isDone under this mutex, so whoever sets isDone is the last to touch it.
+    std::mutex                                      mutex;
+    std::condition_variable                         doneCondition;
+    std::exception_ptr                              exception;
+    bool                                            isDone = false;
+};
+
+struct SchedulerTask {
+    SchedulerJob*   job;
+    size_t          begin;
+    size_t          end;
+};
+
+// A worker's queue: pushed and popped at the back by its owner, stolen from the front by the others.
+// Unlike std::deque, which frees and reallocates its blocks as the ends move, it keeps its storage, so once
+// it has held the most tasks it will ever hold a render never allocates here.
+class TaskQueue
+{
+public:
+
+    static const size_t initialCapacity = 64;
+
+    TaskQueue() : storage(initialCapacity) {}
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    SchedulerTask& operator[](size_t i) { return storage[(head + i) % storage.size()]; }
+    SchedulerTask& front() { return (*this)[0]; }
+    SchedulerTask& back() { return (*this)[count - 1]; }
+
+    void push_back(const SchedulerTask& task)
+    {
+        if (count == storage.size())
+        {
+            grow();
+        }
+        
+        count += 1;
+        back() = task;
+    }
+
+    void pop_back() { count -= 1; }
+
+    void pop_front()
+    {
+        head = (head + 1) % storage.size();
+        count -= 1;
+    }
+
+    // Keeps the order of the rest
+    void erase(size_t i)
+    {
+        for (; i + 1 < count; ++i)
+        {
+            (*this)[i] = (*this)[i + 1];
+        }
+        
+        count -= 1;
+    }
+
+private:
+
+    std::vector<SchedulerTask>  storage;
+    size_t                      head    = 0;
+    size_t                      count   = 0;
+
+    void grow()
+    {
+        std::vector<SchedulerTask> grown(storage.size() * 2);
+        for (size_t i = 0; i < count; ++i)
+        {
+            grown[i] = (*this)[i];
+        }
+        
+        storage.swap(grown);
+        head = 0;
+    }
+};
+
+static uint64_t getNowNs()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// MARK: - Worker Pool
+
+class WorkerPool
+{
+public:
+
+    ~WorkerPool()
+    {
+        stop();
+    }
+
+    void ensureStarted();
+    void stop();
+    void setThreadCount(uint32_t threadCount);
+    uint32_t getThreadCount();
+
+    void parallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& body);
+
+    TaskScheduler::Stats getStats();
+    void resetStats();
+
+private:
+
+    struct Worker {
+        std::mutex                  mutex;
+        TaskQueue                   tasks;
+        std::thread                 thread;
+    };
+
+    // Start and stop only; parallelFor reads the workers without it (see setThreadCount)
+    std::mutex                              lifecycleMutex;
+    std::atomic<bool>                       isRunning{false};
+    uint32_t                                requestedThreadCount = 0;
+    std::atomic<uint32_t>                   threadCount{1};
+    std::vector<std::unique_ptr<Worker>>    workers;
+
+    // Workers sleep here while there's nothing they're allowed to run
+    std::mutex                              sleepMutex;
+    std::condition_variable                 wakeCondition;
+    bool                                    isStopping = false;
+
+    std::atomic<size_t>                     queuedTaskCount{0};
+    std::atomic<uint32_t>                   externalCallerCount{0};
+    std::atomic<uint32_t>                   runningWorkerCount{0};
+    std::atomic<uint32_t>                   nextWorkerIndex{0};
+
+    std::atomic<uint64_t>                   jobCount{0};
+    std::atomic<uint64_t>                   inlineJobCount{0};
+    std::atomic<uint64_t>                   taskCount{0};
+    std::atomic<uint64_t>                   stealCount{0};
+    std::atomic<uint64_t>                   busyNs{0};
+    std::atomic<uint64_t>                   availableNs{0};
+
+    static thread_local int                 currentWorkerIndex;
+
+    void runWorker(size_t workerIndex);
+
+    bool hasWorkerSlot();
+    bool acquireWorkerSlot();
+    void releaseWorkerSlot();
+
+    void pushTask(SchedulerTask task, size_t workerIndex);
+    bool takeAnyTask(size_t workerIndex, SchedulerTask& task);
+    bool takeTaskOfJob(SchedulerJob* job, SchedulerTask& task);
+    void runTask(SchedulerTask task);
+
+    void wakeWorkers();
+};
+
+thread_local int WorkerPool::currentWorkerIndex = -1;
+
+static WorkerPool pool;
+
+void WorkerPool::ensureStarted()
+{
+    if (isRunning.load(std::memory_order_acquire))
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+
+    if (isRunning.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    uint32_t count = requestedThreadCount != 0
+        ? requestedThreadCount
+        : std::max(1u, std::thread::hardware_concurrency());
+
+    {
+        std::lock_guard<std::mutex> sleepLock(sleepMutex);
+        isStopping = false;
+    }
+
+    // The caller is always one of the threads, so one fewer worker
+    workers.clear();
+    for (uint32_t i = 1; i < count; ++i)
+    {
+        workers.push_back(std::make_unique<Worker>());
+    }
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i]->thread = std::thread(&WorkerPool::runWorker, this, i);
+    }
+
+    threadCount.store(count, std::memory_order_relaxed);
+    isRunning.store(true, std::memory_order_release);
+}
+
+void WorkerPool::stop()
+{
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+
+    if (!isRunning.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> sleepLock(sleepMutex);
+        isStopping = true;
+    }
+    wakeCondition.notify_all();
+
+    for (auto& worker : workers)
+    {
+        worker->thread.join();
+    }
+
+    workers.clear();
+    isRunning.store(false, std::memory_order_release);
+}
+
+void WorkerPool::setThreadCount(uint32_t count)
+{
+    stop();
+
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+    requestedThreadCount = count;
+}
+
+uint32_t WorkerPool::getThreadCount()
+{
+    ensureStarted();
+    return threadCount.load(std::memory_order_relaxed);
+}
+
+// MARK: - Workers
+
+void WorkerPool::runWorker(size_t workerIndex)
+{
+    currentWorkerIndex = static_cast<int>(workerIndex);
+
+    while (true)
+    {
+        if (acquireWorkerSlot())
+        {
+            SchedulerTask task;
+            bool hasTask = takeAnyTask(workerIndex, task);
+
+            if (hasTask)
+            {
+                runTask(task);
+            }
+
+            releaseWorkerSlot();
+
+            if (hasTask)
+            {
+                continue;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeCondition.wait(lock, [&]() {
+            return isStopping || (queuedTaskCount.load(std::memory_order_acquire) > 0 && hasWorkerSlot());
+        });
+
+        // Nothing may be running on the pool when it stops, so there's nothing left to drain
+        if (isStopping)
+        {
+            return;
+        }
+    }
+}
+
+// The AE threads inside parallelFor are running tasks too, so the workers get what's left of the thread count
+bool WorkerPool::hasWorkerSlot()
+{
+    auto callers = externalCallerCount.load(std::memory_order_relaxed);
+    auto count = threadCount.load(std::memory_order_relaxed);
+
+    return callers < count && runningWorkerCount.load(std::memory_order_relaxed) < count - callers;
+}
+
+bool WorkerPool::acquireWorkerSlot()
+{
+    auto running = runningWorkerCount.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        auto callers = externalCallerCount.load(std::memory_order_relaxed);
+        auto count = threadCount.load(std::memory_order_relaxed);
+
+        if (callers >= count || running >= count - callers)
+        {
+            return false;
+        }
+
+        if (runningWorkerCount.compare_exchange_weak(running, running + 1, std::memory_order_acquire))
+        {
+            return true;
+        }
+    }
+}
+
+void WorkerPool::releaseWorkerSlot()
+{
+    runningWorkerCount.fetch_sub(1, std::memory_order_release);
+}
+
+void WorkerPool::wakeWorkers()
+{
+    // Taking the mutex orders this against a worker checking its wait predicate
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    wakeCondition.notify_all();
+}
+
+// MARK: - Deques
+
+void WorkerPool::pushTask(SchedulerTask task, size_t workerIndex)
+{
+    auto& worker = *workers[workerIndex];
+
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.tasks.push_back(task);
+    queuedTaskCount.fetch_add(1, std::memory_order_release);
+}
+
+// Newest from our own deque, otherwise the oldest from someone else's
+bool WorkerPool::takeAnyTask(size_t workerIndex, SchedulerTask& task)
+{
+    {
+        auto& worker = *workers[workerIndex];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+
+        if (!worker.tasks.empty())
+        {
+            task = worker.tasks.back();
+            worker.tasks.pop_back();
+            queuedTaskCount.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < workers.size(); ++i)
+    {
+        auto& victim = *workers[(workerIndex + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            queuedTaskCount.fetch_sub(1, std::memory_order_relaxed);
+            stealCount.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// A caller waiting on its job only helps with that job, so one frame's render thread
+// never ends up stuck behind another frame's work
+bool WorkerPool::takeTaskOfJob(SchedulerJob* job, SchedulerTask& task)
+{
+    for (auto& worker : workers)
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+
+        for (size_t i = worker->tasks.size(); i-- > 0;)
+        {
+            if (worker->tasks[i].job == job)
+            {
+                task = worker->tasks[i];
+                worker->tasks.erase(i);
+                queuedTaskCount.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void WorkerPool::runTask(SchedulerTask task)
+{
+    auto job = task.job;
+
+    if (!job->isFailed.load(std::memory_order_relaxed))
+    {
+        auto startNs = getNowNs();
+
+        try
+        {
+            (*job->body)(task.begin, task.end);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+
+            if (!job->exception)
+            {
+                job->exception = std::current_exception();
+            }
+            job->isFailed.store(true, std::memory_order_relaxed);
+        }
+
+        busyNs.fetch_add(getNowNs() - startNs, std::memory_order_relaxed);
+    }
+
+    taskCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (job->remainingTaskCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->isDone = true;
+        job->doneCondition.notify_all();
+    }
+}
+
+// MARK: - Parallel For
+
+void WorkerPool::parallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& body)
+{
+    if (end <= begin)
+    {
+        return;
+    }
+
+    ensureStarted();
+
+    bool isExternalCaller = currentWorkerIndex < 0;
+
+    if (isExternalCaller)
+    {
+        externalCallerCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Leaving frees a thread for the workers
+    struct ExternalCallerGuard {
+        WorkerPool* pool;
+        bool        isExternalCaller;
+
+        ~ExternalCallerGuard()
+        {
+            if (isExternalCaller)
+            {
+                pool->externalCallerCount.fetch_sub(1, std::memory_order_relaxed);
+                pool->wakeWorkers();
+            }
+        }
+    } guard { this, isExternalCaller };
+
+    jobCount.fetch_add(1, std::memory_order_relaxed);
+
+    auto count = end - begin;
+    auto maxChunkCount = (count + std::max<size_t>(1, grainSize) - 1) / std::max<size_t>(1, grainSize);
+
+    // Split for this call's share of the threads, not all of them
+    auto callers = std::max(1u, externalCallerCount.load(std::memory_order_relaxed));
+    size_t parallelism = std::max(1u, threadCount.load(std::memory_order_relaxed) / callers);
+    auto chunkCount = std::min(maxChunkCount, parallelism * tasksPerThread);
+
+    if (workers.empty() || parallelism <= 1 || chunkCount <= 1)
+    {
+        inlineJobCount.fetch_add(1, std::memory_order_relaxed);
+        body(begin, end);
+        return;
+    }
+
+    auto startNs = getNowNs();
+
+    SchedulerJob job;
+    job.body = &body;
+    job.remainingTaskCount.store(chunkCount, std::memory_order_relaxed);
+
+    auto getChunkBegin = [&](size_t i) {
+        return begin + count * i / chunkCount;
+    };
+
+    // Nested calls from a worker go on its own deque, where it pops them newest-first and the others steal;
+    // AE threads have no deque and deal theirs round-robin
+    auto firstWorker = isExternalCaller
+        ? nextWorkerIndex.fetch_add(1, std::memory_order_relaxed) % workers.size()
+        : static_cast<size_t>(currentWorkerIndex);
+
+    for (size_t i = 1; i < chunkCount; ++i)
+    {
+        auto workerIndex = isExternalCaller ? (firstWorker + i) % workers.size() : firstWorker;
+        pushTask({ &job, getChunkBegin(i), getChunkBegin(i + 1) }, workerIndex);
+    }
+
+    wakeWorkers();
+
+    // The caller takes the first chunk, then helps with whatever of the rest is still queued
+    runTask({ &job, getChunkBegin(0), getChunkBegin(1) });
+
+    SchedulerTask task;
+    while (job.remainingTaskCount.load(std::memory_order_acquire) > 0 && takeTaskOfJob(&job, task))
+    {
+        runTask(task);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(job.mutex);
+        job.doneCondition.wait(lock, [&]() { return job.isDone; });
+    }
+
+    auto threadsUsed = std::min(parallelism, chunkCount);
+    availableNs.fetch_add((getNowNs() - startNs) * threadsUsed, std::memory_order_relaxed);
+
+    if (job.exception)
+    {
+        std::rethrow_exception(job.exception);
+    }
+}
+
+// MARK: - Stats
+
+TaskScheduler::Stats WorkerPool::getStats()
+{
+    return {
+        .jobCount = jobCount.load(std::memory_order_relaxed),
+        .inlineJobCount = inlineJobCount.load(std::memory_order_relaxed),
+        .taskCount = taskCount.load(std::memory_order_relaxed),
+        .stealCount = stealCount.load(std::memory_order_relaxed),
+        .busyNs = busyNs.load(std::memory_order_relaxed),
+        .availableNs = availableNs.load(std::memory_order_relaxed),
+    };
+}
+
+void WorkerPool::resetStats()
+{
+    jobCount.store(0, std::memory_order_relaxed);
+    inlineJobCount.store(0, std::memory_order_relaxed);
+    taskCount.store(0, std::memory_order_relaxed);
+    stealCount.store(0, std::memory_order_relaxed);
+    busyNs.store(0, std::memory_order_relaxed);
+    availableNs.store(0, std::memory_order_relaxed);
+}
+
+// MARK: - TaskScheduler
+
+void TaskScheduler::parallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& body)
+{
+    pool.parallelFor(begin, end, grainSize, body);
+}
+
+void TaskScheduler::parallelForRows(uint32_t width,
+                                    uint32_t height,
+                                    size_t minPixelsPerBand,
+                                    const std::function<void(uint32_t top, uint32_t bottom)>& body)
+{
+    auto rowsPerBand = std::max<size_t>(1, minPixelsPerBand / std::max(1u, width));
+
+    auto bodyOfRows = [&](size_t top, size_t bottom) {
+        body(static_cast<uint32_t>(top), static_cast<uint32_t>(bottom));
+    };
+
+    pool.parallelFor(0, height, rowsPerBand, std::cref(bodyOfRows));
+}
+
+void TaskScheduler::parallelForTiles(uint32_t width,
+                                     uint32_t height,
+                                     uint32_t tileSize,
+                                     const std::function<void(uint32_t left, uint32_t top, uint32_t right, uint32_t bottom)>& body)
+{
+    tileSize = std::max(1u, tileSize);
+
+    size_t columns = (width + tileSize - 1) / tileSize;
+    size_t rows = (height + tileSize - 1) / tileSize;
+
+    auto bodyOfTiles = [&](size_t first, size_t last) {
+        for (size_t tile = first; tile < last; ++tile)
+        {
+            auto left = static_cast<uint32_t>(tile % columns) * tileSize;
+            auto top = static_cast<uint32_t>(tile / columns) * tileSize;
+
+            body(left, top, std::min(width, left + tileSize), std::min(height, top + tileSize));
+        }
+    };
+
+    pool.parallelFor(0, columns * rows, 1, std::cref(bodyOfTiles));
+}
+
+void TaskScheduler::setThreadCount(uint32_t threadCount)
+{
+    pool.setThreadCount(threadCount);
+}
+
+uint32_t TaskScheduler::getThreadCount()
+{
+    return pool.getThreadCount();
+}
+
+void TaskScheduler::shutDown()
+{
+    pool.stop();
+}
+
+TaskScheduler::Stats TaskScheduler::getStats()
+{
+    return pool.getStats();
+}
+
+void TaskScheduler::resetStats()
+{
+    pool.resetStats();
+}
@@ -0,0 +1,72 @@
+//
+//  TaskScheduler.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/13/21.
+//
+
+#ifndef TaskScheduler_hpp
+#define TaskScheduler_hpp
+
+#include <functional>
+#include <stdint.h>
+
+// One work-stealing thread pool for every CPU-side stage of a render: pixel copies, CPU kernels, and
+// anything else that splits into independent ranges. Each worker owns a deque of tasks, pops its own
+// newest task first and steals the oldest from the others when it runs dry.
+//
+// AE renders several frames at once on its own threads. Every AE thread inside parallelFor counts
+// against the pool, so the workers plus the AE threads waiting on them never exceed the thread count,
+// and each call is split for its share of the pool rather than the whole of it.
+namespace TaskScheduler
+{
+
+struct Stats {
+    uint64_t    jobCount;           // parallelFor calls
+    uint64_t    inlineJobCount;     // calls too small (or too crowded) to split, run on the caller
+    uint64_t    taskCount;
+    uint64_t    stealCount;         // tasks a worker took from another worker's deque
+    uint64_t    busyNs;             // time spent inside task bodies, summed over threads
+    uint64_t    availableNs;        // wall time of each split call times the threads it was split for
+
+    // Fraction of the threads each call was given that was actually spent working.
+    // 1.0 is perfect scaling; imbalance, stealing and wake-up latency all pull it down.
+    double getScalingEfficiency() const
+    {
+        return availableNs == 0 ? 1.0 : static_cast<double>(busyNs) / static_cast<double>(availableNs);
+    }
+};
+
+// Calls body(chunkBegin, chunkEnd) over [begin, end) in chunks of at least grainSize, on the calling
+// thread and the pool, and returns once every chunk has run. Calls may nest and may come from many
+// threads at once. If a chunk throws, the remaining chunks are skipped and the first exception is
+// rethrown here.
+void parallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& body);
+
+// Row bands of an image, at least minPixelsPerBand pixels each
+void parallelForRows(uint32_t width,
+                     uint32_t height,
+                     size_t minPixelsPerBand,
+                     const std::function<void(uint32_t top, uint32_t bottom)>& body);
+
+// tileSize x tileSize tiles (smaller at the right and bottom edges), one task per tile
+void parallelForTiles(uint32_t width,
+                      uint32_t height,
+                      uint32_t tileSize,
+                      const std::function<void(uint32_t left, uint32_t top, uint32_t right, uint32_t bottom)>& body);
+
+// Threads a call may use including the caller; 0 for one per core (the default).
+// Restarts the workers, so only call it while nothing is running on the pool.
+void setThreadCount(uint32_t threadCount);
+uint32_t getThreadCount();
+
+// Joins the workers. The next parallelFor starts them again.
+// Call before the plugin is unloaded; joining threads from a DLL's static destructors can deadlock.
+void shutDown();
+
+Stats getStats();
+void resetStats();
+
+}
+
+#endif /* TaskScheduler_hpp */
@@ -0,0 +1,176 @@
+//
+//  TraceUtils.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/7/21.
+//
+
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "TraceUtils.hpp"
+
+using namespace TraceUtils;
+
+std::atomic<bool> TraceUtils::isTracingEnabled{false};
+
+void TraceUtils::setTracingEnabled(bool enabled)
+{
+    isTracingEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+uint64_t TraceUtils::getTimestampNs()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+}
+
+// MARK: - Per-thread Ring Buffers
+
+struct TraceEvent {
+    const char* name;
+    uint64_t    beginNs;
+    uint64_t    endNs;
+};
+
+// Single producer (the owning thread), single consumer (whoever writes the trace).
+// When the buffer is full, new zones are dropped rather than blocking the render thread.
+class ThreadTraceBuffer
+{
+public:
+    static const size_t capacity = 8192;
+    
+    const uint32_t threadId;
+    
+    ThreadTraceBuffer(uint32_t threadId) : threadId(threadId) {}
+    
+    void push(const TraceEvent& event)
+    {
+        auto head = writeIndex.load(std::memory_order_relaxed);
+        auto tail = readIndex.load(std::memory_order_acquire);
+        
+        if (head - tail == capacity)
+        {
+            droppedCount.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        
+        events[head % capacity] = event;
+        writeIndex.store(head + 1, std::memory_order_release);
+    }
+    
+    template <typename F>
+    void drain(F&& consume)
+    {
+        auto tail = readIndex.load(std::memory_order_relaxed);
+        auto head = writeIndex.load(std::memory_order_acquire);
+        
+        for (auto i = tail; i != head; ++i)
+        {
+            consume(events[i % capacity]);
+        }
+        
+        readIndex.store(head, std::memory_order_release);
+    }
+    
+    uint64_t takeDroppedCount()
+    {
+        return droppedCount.exchange(0, std::memory_order_relaxed);
+    }
+    
+private:
+    std::array<TraceEvent, capacity>    events;
+    std::atomic<size_t>                 writeIndex{0};
+    std::atomic<size_t>                 readIndex{0};
+    std::atomic<uint64_t>               droppedCount{0};
+};
+
+// Buffers are shared so that events from threads that have already exited can still be written out.
+static std::mutex                                       threadBuffersMutex;
+static std::vector<std::shared_ptr<ThreadTraceBuffer>>  threadBuffers;
+
+static ThreadTraceBuffer* getThreadBuffer()
+{
+    thread_local std::shared_ptr<ThreadTraceBuffer> threadBuffer;
+    
+    if (!threadBuffer)
+    {
+        std::lock_guard<std::mutex> lock(threadBuffersMutex);
+        threadBuffer = std::make_shared<ThreadTraceBuffer>(static_cast<uint32_t>(threadBuffers.size() + 1));
+        threadBuffers.push_back(threadBuffer);
+    }
+    
+    return threadBuffer.get();
+}
+
+void TraceUtils::recordZone(const char* name, uint64_t beginNs, uint64_t endNs)
+{
+    getThreadBuffer()->push({
+        .name = name,
+        .beginNs = beginNs,
+        .endNs = endNs,
+    });
+}
+
+// MARK: - Chrome Trace Export
+
+static void writeEscapedString(std::ofstream& file, const char* string)
+{
+    file << '"';
+    for (const char* c = string; *c != '\0'; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            file << '\\';
+        }
+        file << *c;
+    }
+    file << '"';
+}
+
+void TraceUtils::writeChromeTrace(const std::string& filePath)
+{
+    std::ofstream file(filePath, std::ios::trunc);
+    
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Failed to open trace file!");
+    }
+    
+    std::lock_guard<std::mutex> lock(threadBuffersMutex);
+    
+    // Chrome trace timestamps are in microseconds, keep nanosecond resolution
+    file << std::fixed << std::setprecision(3);
+    
+    bool isFirstEvent = true;
+    file << "{\"traceEvents\":[\n";
+    
+    for (auto& threadBuffer : threadBuffers)
+    {
+        threadBuffer->drain([&](const TraceEvent& event) {
+            file << (isFirstEvent ? "" : ",\n") << "{\"name\":";
+            writeEscapedString(file, event.name);
+            file << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << threadBuffer->threadId
+                 << ",\"ts\":" << static_cast<double>(event.beginNs) / 1000.0
+                 << ",\"dur\":" << static_cast<double>(event.endNs - event.beginNs) / 1000.0 << "}";
+            isFirstEvent = false;
+        });
+        
+        auto droppedCount = threadBuffer->takeDroppedCount();
+        if (droppedCount > 0)
+        {
+            file << (isFirstEvent ? "" : ",\n")
+                 << "{\"name\":\"dropped_zones\",\"ph\":\"C\",\"pid\":1,\"tid\":" << threadBuffer->threadId
+                 << ",\"ts\":0,\"args\":{\"count\":" << droppedCount << "}}";
+            isFirstEvent = false;
+        }
+    }
+    
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
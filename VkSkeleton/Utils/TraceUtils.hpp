@@ -0,0 +1,72 @@
+//
+//  TraceUtils.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/7/21.
+//
+
+#ifndef TraceUtils_hpp
+#define TraceUtils_hpp
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+// Build with VKSKELETON_TRACING=0 to compile every TRACE_ZONE out entirely.
+#ifndef VKSKELETON_TRACING
+#define VKSKELETON_TRACING 1
+#endif
+
+namespace TraceUtils
+{
+
+// Checked once per zone; zones cost a single branch while tracing is off.
+extern std::atomic<bool> isTracingEnabled;
+
+void setTracingEnabled(bool enabled);
+
+uint64_t getTimestampNs();
+
+// Appends a completed zone to the calling thread's ring buffer. `name` must outlive the trace (use string literals).
+void recordZone(const char* name, uint64_t beginNs, uint64_t endNs);
+
+// Drains every thread's ring buffer into a Chrome / Perfetto trace JSON file.
+void writeChromeTrace(const std::string& filePath);
+
+class TraceZone
+{
+public:
+    TraceZone(const char* name)
+    : name(name)
+    , beginNs(isTracingEnabled.load(std::memory_order_relaxed) ? getTimestampNs() : 0)
+    {
+    }
+    
+    ~TraceZone()
+    {
+        if (beginNs != 0)
+        {
+            recordZone(name, beginNs, getTimestampNs());
+        }
+    }
+    
+    TraceZone(const TraceZone&) = delete;
+    TraceZone& operator=(const TraceZone&) = delete;
+    
+private:
+    const char* name;
+    uint64_t    beginNs;
+};
+
+}
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+
+#if VKSKELETON_TRACING
+#define TRACE_ZONE(name) TraceUtils::TraceZone TRACE_CONCAT(traceZone_, __LINE__)(name)
+#else
+#define TRACE_ZONE(name)
+#endif
+
+#endif /* TraceUtils_hpp */
@@ -6,6 +6,7 @@
 //
 
 #include "VulkanDebugUtils.hpp"
+#include <cstring>
 #include <iostream>
 
 using namespace VulkanDebugUtils;
@@ -11,7 +11,7 @@ using namespace VulkanUtils;
 
 // MARK: - Sampler
 
-void VulkanUtils::createSampler(VkDevice logicalDevice, VkFilter filter, VkSampler& sampler)
+void VulkanUtils::createSampler(VkDevice logicalDevice, const VkAllocationCallbacks* allocator, VkFilter filter, VkSampler& sampler)
 {
     VkSamplerCreateInfo createInfo {
         .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
@@ -34,7 +34,7 @@ void VulkanUtils::createSampler(VkDevice logicalDevice, VkFilter filter, VkSampl
         .unnormalizedCoordinates = VK_FALSE,
     };
     
-    VK_ASSERT_SUCCESS(vkCreateSampler(logicalDevice, &createInfo, nullptr, &sampler),
+    VK_ASSERT_SUCCESS(vkCreateSampler(logicalDevice, &createInfo, allocator, &sampler),
                       "Failed to create sampler!");
 }
 
@@ -42,6 +42,7 @@ void VulkanUtils::createSampler(VkDevice logicalDevice, VkFilter filter, VkSampl
 
 void VulkanUtils::createBuffer(VkPhysicalDevice physicalDevice,
                   VkDevice logicalDevice,
+                  const VkAllocationCallbacks* allocator,
                   VkDeviceSize bufferSize,
                   VkBufferUsageFlags usageFlags,
                   uint32_t queueFamilyIndex,
@@ -59,7 +60,7 @@ void VulkanUtils::createBuffer(VkPhysicalDevice physicalDevice,
         .pQueueFamilyIndices = &queueFamilyIndex,
     };
     
-    VK_ASSERT_SUCCESS(vkCreateBuffer(logicalDevice, &createInfo, nullptr, &buffer),
+    VK_ASSERT_SUCCESS(vkCreateBuffer(logicalDevice, &createInfo, allocator, &buffer),
                       "Failed to create buffer!");
 }
 
@@ -67,6 +68,7 @@ void VulkanUtils::createBuffer(VkPhysicalDevice physicalDevice,
 
 void VulkanUtils::allocateBufferMemory(VkPhysicalDevice physicalDevice,
                           VkDevice logicalDevice,
+                          const VkAllocationCallbacks* allocator,
                           VkDeviceSize bufferSize,
                           VkMemoryPropertyFlags propertyFlags,
                           VkBuffer& buffer,
@@ -77,7 +79,6 @@ void VulkanUtils::allocateBufferMemory(VkPhysicalDevice physicalDevice,
     
     VkPhysicalDeviceMemoryProperties memoryProperties;
     vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
-    VkDeviceSize availableMemorySize;
     uint32_t memoryTypeIndex = VK_MAX_MEMORY_TYPES;
     
     for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i)
@@ -90,7 +91,6 @@ void VulkanUtils::allocateBufferMemory(VkPhysicalDevice physicalDevice,
             && bufferSize <= memoryHeap.size)
         {
             memoryTypeIndex = i;
-            availableMemorySize = memoryHeap.size;
             break;
         }
     }
@@ -107,7 +107,7 @@ void VulkanUtils::allocateBufferMemory(VkPhysicalDevice physicalDevice,
         .memoryTypeIndex = memoryTypeIndex,
     };
     
-    VK_ASSERT_SUCCESS(vkAllocateMemory(logicalDevice, &allocInfo, nullptr, &memory),
+    VK_ASSERT_SUCCESS(vkAllocateMemory(logicalDevice, &allocInfo, allocator, &memory),
                       "Failed to allocate device memory!");
 }
 
@@ -137,7 +137,9 @@ VkExtent3D VulkanUtils::getImageExtent(ImageInfo imageInfo)
 }
 
 void VulkanUtils::createImage(VkDevice logicalDevice,
+                 const VkAllocationCallbacks* allocator,
                  ImageInfo imageInfo,
+                 uint32_t arrayLayers,
                  VkImageUsageFlags usageFlags,
                  VkImage& image)
 {
@@ -154,7 +156,7 @@ void VulkanUtils::createImage(VkDevice logicalDevice,
         .format = imageFormat,
         .extent = imageExtent,
         .mipLevels = 1,
-        .arrayLayers = 1,
+        .arrayLayers = arrayLayers,
         .samples = VK_SAMPLE_COUNT_1_BIT,
         .tiling = VK_IMAGE_TILING_OPTIMAL,
         .usage = usageFlags,
@@ -164,7 +166,7 @@ void VulkanUtils::createImage(VkDevice logicalDevice,
         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     };
     
-    VK_ASSERT_SUCCESS(vkCreateImage(logicalDevice, &createInfo, nullptr, &image),
+    VK_ASSERT_SUCCESS(vkCreateImage(logicalDevice, &createInfo, allocator, &image),
                       "Failed to create image!");
 }
 
@@ -172,19 +174,20 @@ void VulkanUtils::createImage(VkDevice logicalDevice,
 
 void VulkanUtils::allocateImageMemory(VkPhysicalDevice physicalDevice,
                          VkDevice logicalDevice,
+                         const VkAllocationCallbacks* allocator,
                          ImageInfo imageInfo,
                          VkMemoryPropertyFlags propertyFlags,
                          VkImage& image,
                          VkDeviceMemory& memory)
 {
-    auto imageSize = static_cast<VkDeviceSize>(imageInfo.size());
-    
     VkMemoryRequirements memoryRequirements;
     vkGetImageMemoryRequirements(logicalDevice, image, &memoryRequirements);
     
+    // What the driver needs, which covers every array layer; imageInfo alone only knows one
+    auto imageSize = memoryRequirements.size;
+    
     VkPhysicalDeviceMemoryProperties memoryProperties;
     vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
-    VkDeviceSize availableMemorySize;
     uint32_t memoryTypeIndex = VK_MAX_MEMORY_TYPES;
     
     for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i)
@@ -197,7 +200,6 @@ void VulkanUtils::allocateImageMemory(VkPhysicalDevice physicalDevice,
             && imageSize <= memoryHeap.size)
         {
             memoryTypeIndex = i;
-            availableMemorySize = memoryHeap.size;
             break;
         }
     }
@@ -214,61 +216,62 @@ void VulkanUtils::allocateImageMemory(VkPhysicalDevice physicalDevice,
         .memoryTypeIndex = memoryTypeIndex,
     };
     
-    VK_ASSERT_SUCCESS(vkAllocateMemory(logicalDevice, &allocInfo, nullptr, &memory),
+    VK_ASSERT_SUCCESS(vkAllocateMemory(logicalDevice, &allocInfo, allocator, &memory),
                       "Failed to allocate device memory!");
 }
 
 // MARK: - Image Views
 
-void VulkanUtils::createImageView(VkDevice logicalDevice, VkFormat format, VkImage& image, VkImageView& imageView)
+void VulkanUtils::createImageView(VkDevice logicalDevice,
+                                  const VkAllocationCallbacks* allocator,
+                                  VkFormat format,
+                                  VkImageViewType viewType,
+                                  uint32_t layerCount,
+                                  VkImage& image,
+                                  VkImageView& imageView)
 {
     VkImageViewCreateInfo createInfo {
         createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
         createInfo.pNext = nullptr,
         createInfo.flags = 0,
         createInfo.image = image,
-        createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D,
+        createInfo.viewType = viewType,
         createInfo.format = format,
         createInfo.components = {
             // TODO: We might need to swizzle
-            .a = VK_COMPONENT_SWIZZLE_A,
             .r = VK_COMPONENT_SWIZZLE_R,
             .g = VK_COMPONENT_SWIZZLE_G,
             .b = VK_COMPONENT_SWIZZLE_B,
+            .a = VK_COMPONENT_SWIZZLE_A,
         },
         createInfo.subresourceRange = {
             .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
             .baseMipLevel   = 0,
             .levelCount     = 1,
             .baseArrayLayer = 0,
-            .layerCount     = 1,
+            .layerCount     = layerCount,
         },
     };
     
-    VK_ASSERT_SUCCESS(vkCreateImageView(logicalDevice, &createInfo, nullptr, &imageView),
+    VK_ASSERT_SUCCESS(vkCreateImageView(logicalDevice, &createInfo, allocator, &imageView),
                       "Failed to create image view!");
 }
 
-// Returns the nearest power-of-two greater than or equal to x
-uint32_t potGTE(uint32_t x)
+// Returns the nearest power-of-two greater than or equal to x. 64 bits wide so it can round VkDeviceSizes.
+uint64_t VulkanUtils::potGTE(uint64_t x)
 {
-    for (char i = 0; i < 32; ++i)
+    // Past 2^63 there's no power of two left to round up to
+    if (x > (uint64_t(1) << 63))
     {
-        // if (x shifted right by i) is the rightmost bit...
-        if ((x >> i) == 1)
-        {
-            // then we know i is the greatest power of two less than or equal to x
-            if (1 << i == x) {
-                // this covers the equal-to case
-                return x;
-            } else {
-                // if ((1 << i) != x), we can assume (1 << i) is less than x
-                // so we just return the next power of two
-                return 1 << (i + 1);
-            }
-        }
+        throw std::runtime_error("No power of two is large enough!");
+    }
+    
+    uint64_t pot = 1;
+    
+    while (pot < x)
+    {
+        pot <<= 1;
     }
     
-    // x must be zero
-    return 1;
+    return pot;
 }
@@ -15,10 +15,11 @@
 
 namespace VulkanUtils {
 
-void createSampler(VkDevice logicalDevice, VkFilter filter, VkSampler& sampler);
+void createSampler(VkDevice logicalDevice, const VkAllocationCallbacks* allocator, VkFilter filter, VkSampler& sampler);
 
 void createBuffer(VkPhysicalDevice physicalDevice,
                   VkDevice logicalDevice,
+                  const VkAllocationCallbacks* allocator,
                   VkDeviceSize bufferSize,
                   VkBufferUsageFlags usageFlags,
                   uint32_t queueFamilyIndex,
@@ -26,6 +27,7 @@ void createBuffer(VkPhysicalDevice physicalDevice,
 
 void allocateBufferMemory(VkPhysicalDevice physicalDevice,
                           VkDevice logicalDevice,
+                          const VkAllocationCallbacks* allocator,
                           VkDeviceSize bufferSize,
                           VkMemoryPropertyFlags propertyFlags,
                           VkBuffer& buffer,
@@ -35,21 +37,31 @@ VkFormat getImageFormat(ImageInfo imageInfo);
 
 VkExtent3D getImageExtent(ImageInfo imageInfo);
 
+// arrayLayers images of imageInfo's size and format in one, for kernels that render several frames at once
 void createImage(VkDevice logicalDevice,
+                 const VkAllocationCallbacks* allocator,
                  ImageInfo imageInfo,
+                 uint32_t arrayLayers,
                  VkImageUsageFlags usageFlags,
                  VkImage& image);
 
 void allocateImageMemory(VkPhysicalDevice physicalDevice,
                          VkDevice logicalDevice,
+                         const VkAllocationCallbacks* allocator,
                          ImageInfo imageInfo,
                          VkMemoryPropertyFlags propertyFlags,
                          VkImage& image,
                          VkDeviceMemory& memory);
 
-void createImageView(VkDevice logicalDevice, VkFormat format, VkImage& image, VkImageView& imageView);
+void createImageView(VkDevice logicalDevice,
+                     const VkAllocationCallbacks* allocator,
+                     VkFormat format,
+                     VkImageViewType viewType,
+                     uint32_t layerCount,
+                     VkImage& image,
+                     VkImageView& imageView);
 
-uint32_t potGTE(uint32_t x);
+uint64_t potGTE(uint64_t x);
 
 }
 
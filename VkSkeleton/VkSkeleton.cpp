@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <atomic>
+#include <cstdlib>
+#include <cstring>
 #include <map>
 #include <mutex>
 #include <thread>
@@ -7,7 +9,11 @@
 #include "AEFX_SuiteHelper.h"
 #include "AEUtils.hpp"
 #include "AEVulkanUtils.hpp"
+#include "ComputeDispatcher.hpp"
+#include "ContentHash.hpp"
 #include "Smart_Utils.h"
+#include "TaskScheduler.hpp"
+#include "TraceUtils.hpp"
 #include "VulkanComputeDataTypes.hpp"
 #include "VulkanComputeProgram.hpp"
 
@@ -15,9 +21,27 @@
 
 // MARK: - Globals
 
-VulkanComputeProgram  computeProgram{};
+// Only GlobalSetup and GlobalSetdown write these, and AE never sends those alongside another selector.
+// Renders on several threads at once only read them, and the dispatcher locks its own state.
+ComputeDispatcher     computeDispatcher{};
 std::string           resourcePath;
 
+// Acquired in GlobalSetup and released in GlobalSetdown, so SmartRender never looks a suite up per frame
+PF_WorldSuite2*         worldSuite = nullptr;
+PF_IterateFloatSuite1*  iterateFloatSuite = nullptr;
+
+// Set VKSKELETON_TRACE_PATH to a writable .json path to record a Chrome / Perfetto trace.
+// The trace is written at GlobalSetdown, or whenever dumpTrace() is called.
+std::string           tracePath;
+
+static void dumpTrace()
+{
+    if (!tracePath.empty())
+    {
+        TraceUtils::writeChromeTrace(tracePath);
+    }
+}
+
 // MARK: - About
 
 static PF_Err 
@@ -55,19 +79,70 @@ GlobalSetup (
     
     out_data->out_flags = 	PF_OutFlag_DEEP_COLOR_AWARE;
     
+    // Threaded rendering is what lets concurrent frames share a batched dispatch.
+    // Must match AE_Effect_Global_OutFlags_2 in VkSkeletonPiPL.r.
     out_data->out_flags2
     = PF_OutFlag2_FLOAT_COLOR_AWARE
-    | PF_OutFlag2_SUPPORTS_SMART_RENDER;
-    // TODO: | PF_OutFlag2_SUPPORTS_THREADED_RENDERING;
+    | PF_OutFlag2_SUPPORTS_SMART_RENDER
+    | PF_OutFlag2_SUPPORTS_THREADED_RENDERING;
     
     PF_Err err = PF_Err_NONE;
     try
     {
+        CHECK(AEFX_AcquireSuite(in_data,
+                                out_data,
+                                kPFWorldSuite,
+                                kPFWorldSuiteVersion2,
+                                "Couldn't load suite.",
+                                reinterpret_cast<void**>(&worldSuite)));
+        
+        CHECK(AEFX_AcquireSuite(in_data,
+                                out_data,
+                                kPFIterateFloatSuite,
+                                kPFIterateFloatSuiteVersion1,
+                                "Couldn't load suite.",
+                                reinterpret_cast<void**>(&iterateFloatSuite)));
+        
         resourcePath = AEUtils::getResourcePath(in_data);
         
+        if (const char* tracePathEnv = getenv("VKSKELETON_TRACE_PATH"))
+        {
+            tracePath = tracePathEnv;
+            TraceUtils::setTracingEnabled(true);
+        }
+        
+        computeDispatcher.getGpuProgram().setMetricsLogPath(AEUtils::getPluginFolderPath(in_data) + "VkSkeleton_metrics.jsonl");
+        computeDispatcher.setDecisionLogPath(AEUtils::getPluginFolderPath(in_data) + "VkSkeleton_scheduler.jsonl");
+        
+        // Set VKSKELETON_CAPTURE_PATH to record render inputs for vkskeleton_replay,
+        // one render in every VKSKELETON_CAPTURE_INTERVAL (every render if unset).
+        if (const char* capturePathEnv = getenv("VKSKELETON_CAPTURE_PATH"))
+        {
+            const char* captureIntervalEnv = getenv("VKSKELETON_CAPTURE_INTERVAL");
+            auto captureInterval = captureIntervalEnv != nullptr ? static_cast<uint32_t>(atoi(captureIntervalEnv)) : 1;
+            
+            try
+            {
+                computeDispatcher.getGpuProgram().setFrameCapturePath(capturePathEnv, captureInterval);
+            }
+            catch (...)
+            {
+                // A capture file that can't be created shouldn't stop the plugin from loading
+            }
+        }
+        
+        // Set VKSKELETON_BATCH_LAYERS to how many concurrent frames may share one dispatch, 1 to never batch
+        if (const char* batchLayersEnv = getenv("VKSKELETON_BATCH_LAYERS"))
+        {
+            computeDispatcher.getGpuProgram().setMaxBatchLayers(static_cast<uint32_t>(atoi(batchLayersEnv)));
+        }
+        
         auto computeShaderPath = resourcePath + "shaders/invert.comp";
         
-        computeProgram.setUp(computeShaderPath);
+        // Picks the GPU or the CPU kernels per frame, and falls back to the CPU if there's no usable Vulkan device.
+        // Vulkan starts up on a background thread, so loading the plugin doesn't wait for the driver; renders
+        // before it's ready go to the CPU. The time each step took goes to the metrics log.
+        computeDispatcher.setUpInBackground(computeShaderPath);
     }
     catch(PF_Err& thrown_err)
     {
@@ -92,7 +167,37 @@ GlobalSetdown (
 {
     PF_Err err = PF_Err_NONE;
     
-    computeProgram.tearDown();
+    computeDispatcher.tearDown();
+    TaskScheduler::shutDown();
+    
+    if (worldSuite != nullptr)
+    {
+        ERR(AEFX_ReleaseSuite(in_data,
+                              out_data,
+                              kPFWorldSuite,
+                              kPFWorldSuiteVersion2,
+                              "Couldn't release suite."));
+        worldSuite = nullptr;
+    }
+    
+    if (iterateFloatSuite != nullptr)
+    {
+        ERR(AEFX_ReleaseSuite(in_data,
+                              out_data,
+                              kPFIterateFloatSuite,
+                              kPFIterateFloatSuiteVersion1,
+                              "Couldn't release suite."));
+        iterateFloatSuite = nullptr;
+    }
+    
+    try
+    {
+        dumpTrace();
+    }
+    catch (...)
+    {
+        // A trace that can't be written shouldn't fail shutdown
+    }
     
     return err;
 }
@@ -129,11 +234,35 @@ ParamsSetup (
 
 // MARK: - PreRender
 
+// What PreRender hands SmartRender through pre_render_data. It's stored in the pointer itself rather than
+// pointed to, so there's nothing to allocate per frame and no delete function to give AE.
+struct PreRenderData {
+    float pivot;
+};
+
+static_assert(sizeof(PreRenderData) <= sizeof(void*), "PreRenderData has to fit in pre_render_data");
+
+static void* packPreRenderData(PreRenderData preRenderData)
+{
+    void* packed = nullptr;
+    memcpy(&packed, &preRenderData, sizeof(preRenderData));
+    return packed;
+}
+
+static PreRenderData unpackPreRenderData(void* packed)
+{
+    PreRenderData preRenderData;
+    memcpy(&preRenderData, &packed, sizeof(preRenderData));
+    return preRenderData;
+}
+
 static PF_Err
 PreRender(PF_InData*            in_data,
           PF_OutData*           out_data,
           PF_PreRenderExtra*    extra)
 {
+    TRACE_ZONE("PreRender");
+    
     PF_Err	err = PF_Err_NONE,
     err2 = PF_Err_NONE;
     
@@ -144,25 +273,36 @@ PreRender(PF_InData*            in_data,
     
     AEFX_CLR_STRUCT(slider_param);
     
-    ERR(PF_CHECKOUT_PARAM(in_data,
-                          VKSKELETON_SLIDER,
-                          in_data->current_time,
-                          in_data->time_step,
-                          in_data->time_scale,
-                          &slider_param));
-    
-    ERR(extra->cb->checkout_layer(in_data->effect_ref,
-                                  VKSKELETON_INPUT,
-                                  VKSKELETON_INPUT,
-                                  &req,
-                                  in_data->current_time,
-                                  in_data->time_step,
-                                  in_data->time_scale,
-                                  &in_result));
+    {
+        TRACE_ZONE("PreRender/checkoutParam");
+        ERR(PF_CHECKOUT_PARAM(in_data,
+                              VKSKELETON_SLIDER,
+                              in_data->current_time,
+                              in_data->time_step,
+                              in_data->time_scale,
+                              &slider_param));
+    }
+    
+    {
+        TRACE_ZONE("PreRender/checkoutLayer");
+        ERR(extra->cb->checkout_layer(in_data->effect_ref,
+                                      VKSKELETON_INPUT,
+                                      VKSKELETON_INPUT,
+                                      &req,
+                                      in_data->current_time,
+                                      in_data->time_step,
+                                      in_data->time_scale,
+                                      &in_result));
+    }
     
     if (!err){
         UnionLRect(&in_result.result_rect, &extra->output->result_rect);
         UnionLRect(&in_result.max_result_rect, &extra->output->max_result_rect);
+        
+        // SmartRender reads the slider from here instead of checking it out a second time
+        extra->output->pre_render_data = packPreRenderData({
+            .pivot = static_cast<float>(slider_param.u.fs_d.value),
+        });
     }
     ERR2(PF_CHECKIN_PARAM(in_data, &slider_param));
     return err;
@@ -175,56 +315,37 @@ SmartRender(PF_InData*			    in_data,
             PF_OutData*			    out_data,
             PF_SmartRenderExtra*	extra)
 {
+    TRACE_ZONE("SmartRender");
+    
     PF_Err				err = PF_Err_NONE,
     err2 = PF_Err_NONE;
     
     PF_EffectWorld*     input_worldP = NULL;
     PF_EffectWorld*     output_worldP = NULL;
-    PF_WorldSuite2*     wsP = NULL;
     PF_PixelFormat		pfPixelFormat = PF_PixelFormat_INVALID;
-    PF_FpLong			sliderVal = 0;
-    PF_ParamDef         slider_param;
-    AEGP_SuiteHandler   suites(in_data->pica_basicP);
     
-    ERR(AEFX_AcquireSuite(in_data,
-                          out_data,
-                          kPFWorldSuite,
-                          kPFWorldSuiteVersion2,
-                          "Couldn't load suite.",
-                          (void**)&wsP));
+    auto preRenderData = unpackPreRenderData(extra->input->pre_render_data);
     
-    AEFX_CLR_STRUCT(slider_param);
-    
-    ERR(PF_CHECKOUT_PARAM(in_data,
-                          VKSKELETON_SLIDER,
-                          in_data->current_time,
-                          in_data->time_step,
-                          in_data->time_scale,
-                          &slider_param));
-    
-    if (!err){
-        sliderVal = slider_param.u.fd.value / 100.0f;
+    {
+        TRACE_ZONE("SmartRender/checkoutLayer");
+        ERR(extra->cb->checkout_layer_pixels(in_data->effect_ref, VKSKELETON_INPUT, &input_worldP));
+        
+        ERR(extra->cb->checkout_output(in_data->effect_ref, &output_worldP));
     }
     
-    ERR(extra->cb->checkout_layer_pixels(in_data->effect_ref, VKSKELETON_INPUT, &input_worldP));
-    
-    ERR(extra->cb->checkout_output(in_data->effect_ref, &output_worldP));
-    
-    ERR(AEFX_AcquireSuite(in_data,
-                          out_data,
-                          kPFWorldSuite,
-                          kPFWorldSuiteVersion2,
-                          "Couldn't load suite.",
-                          (void**)&wsP));
-    
+    // At a preview resolution AE hands over smaller worlds, so the kernel only pays for the pixels it gets;
+    // it scales its pixel-sized parameters by the downsample factors to keep the look of the full render.
     UniformBufferObject ubo {
-        .pivot = static_cast<float>(slider_param.u.fs_d.value),
+        .pivot = preRenderData.pivot,
+        .downsampleX = static_cast<float>(in_data->downsample_x.num) / static_cast<float>(in_data->downsample_x.den),
+        .downsampleY = static_cast<float>(in_data->downsample_y.num) / static_cast<float>(in_data->downsample_y.den),
+        .isDraftQuality = in_data->quality == PF_Quality_LO ? 1u : 0u,
     };
     
     if (!err){
         try
         {
-            CHECK(wsP->PF_GetPixelFormat(input_worldP, &pfPixelFormat));
+            CHECK(worldSuite->PF_GetPixelFormat(input_worldP, &pfPixelFormat));
             
             ImageInfo imageInfo{};
             imageInfo.width = input_worldP->width;
@@ -233,7 +354,8 @@ SmartRender(PF_InData*			    in_data,
             
             auto copyInputWorldToBuffer = [&](void* buffer)
             {
-                AEUtils::copyImageData(suites,
+                TRACE_ZONE("SmartRender/copyImageData/input");
+                AEUtils::copyImageData(iterateFloatSuite,
                                        in_data,
                                        input_worldP,
                                        output_worldP,
@@ -244,7 +366,8 @@ SmartRender(PF_InData*			    in_data,
             
             auto copyBufferToOutputWorld = [&](void* buffer)
             {
-                AEUtils::copyImageData(suites,
+                TRACE_ZONE("SmartRender/copyImageData/output");
+                AEUtils::copyImageData(iterateFloatSuite,
                                        in_data,
                                        input_worldP,
                                        output_worldP,
@@ -253,15 +376,43 @@ SmartRender(PF_InData*			    in_data,
                                        buffer);
             };
             
-            computeProgram.process(imageInfo,
-                                   ubo,
-                                   copyInputWorldToBuffer,
-                                   copyBufferToOutputWorld);
+            // Polled between every GPU submission, so a frame AE no longer wants (the user scrubbed past it)
+            // stops within one band of transfer instead of rendering to the end
+            auto reportProgress = [&](uint64_t stepsDone, uint64_t stepCount)
+            {
+                return PF_ABORT(in_data) == PF_Err_NONE &&
+                       PF_PROGRESS(in_data, static_cast<A_long>(stepsDone), static_cast<A_long>(stepCount)) == PF_Err_NONE;
+            };
+            
+            // In a stack of these effects, the input is usually the output the GPU still holds from the effect
+            // below. Only hashed when there is such an output, since hashing costs about as much as the copy.
+            uint64_t inputHash = 0;
+            if (computeDispatcher.getResidentOutputHash(imageInfo) != 0)
+            {
+                TRACE_ZONE("SmartRender/hashInput");
+                inputHash = ContentHash::hashRows(input_worldP->data,
+                                                  static_cast<size_t>(imageInfo.pixelFormat) * imageInfo.width,
+                                                  input_worldP->rowbytes,
+                                                  imageInfo.height);
+            }
+            
+            // Passed by reference: wrapping the lambdas themselves would copy their captures to the heap
+            computeDispatcher.process(imageInfo,
+                                      ubo,
+                                      std::cref(copyInputWorldToBuffer),
+                                      std::cref(copyBufferToOutputWorld),
+                                      {},
+                                      std::cref(reportProgress),
+                                      inputHash);
         }
         catch (PF_Err& thrown_err)
         {
             err = thrown_err;
         }
+        catch (const RenderCancelledError&)
+        {
+            err = PF_Interrupt_CANCEL;
+        }
         catch (...)
         {
             err = PF_Err_OUT_OF_MEMORY;
@@ -273,12 +424,6 @@ SmartRender(PF_InData*			    in_data,
     // if you want to call some more OpenGL.
     ERR(PF_ABORT(in_data));
     
-    ERR2(AEFX_ReleaseSuite(in_data,
-                           out_data,
-                           kPFWorldSuite,
-                           kPFWorldSuiteVersion2,
-                           "Couldn't release suite."));
-    ERR2(PF_CHECKIN_PARAM(in_data, &slider_param));
     ERR2(extra->cb->checkin_layer_pixels(in_data->effect_ref, VKSKELETON_INPUT));
     
     return err;
@@ -298,6 +443,8 @@ EffectMain(PF_Cmd		cmd,
 {
     PF_Err		err = PF_Err_NONE;
     
+    TRACE_ZONE("EffectMain");
+    
     try {
         switch (cmd) {
             case PF_Cmd_ABOUT:
@@ -357,12 +504,13 @@ PF_Err PluginDataEntryFunction(PF_PluginDataPtr inPtr,
 {
     PF_Err result = PF_Err_INVALID_CALLBACK;
     
-    result = PF_REGISTER_EFFECT(inPtr,
-                                inPluginDataCallBackPtr,
-                                "VkSkeleton", // Name
-                                "JPERL VkSkeleton", // Match Name
-                                "jperl", // Category
-                                AE_RESERVED_INFO); // Reserved Info
+    // The macro assigns result itself
+    PF_REGISTER_EFFECT(inPtr,
+                       inPluginDataCallBackPtr,
+                       "VkSkeleton", // Name
+                       "JPERL VkSkeleton", // Match Name
+                       "jperl", // Category
+                       AE_RESERVED_INFO); // Reserved Info
     
     return result;
 }
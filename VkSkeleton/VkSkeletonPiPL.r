@@ -53,7 +53,7 @@ resource 'PiPL' (16000) {
 
 		},
 		AE_Effect_Global_OutFlags_2 {
-			0x00001400
+			0x08001400
 		},
 		/* [11] */
 		AE_Effect_Match_Name {
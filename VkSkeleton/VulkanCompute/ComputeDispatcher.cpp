@@ -0,0 +1,600 @@
+//
+//  ComputeDispatcher.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/12/21.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+
+#include "ComputeDispatcher.hpp"
+
+#include "TaskScheduler.hpp"
+#include "TraceUtils.hpp"
+
+const char* getComputeStrategyName(ComputeStrategy strategy)
+{
+    switch (strategy)
+    {
+        case GpuRoundTripStrategy:
+            return "gpuRoundTrip";
+        case CpuSimdStrategy:
+            return "cpuSimd";
+        default:
+            return "unknown";
+    }
+}
+
+static const char* getPixelFormatName(PixelFormat pixelFormat)
+{
+    switch (pixelFormat)
+    {
+        case ARGB32:
+            return "ARGB32";
+        case ARGB64:
+            return "ARGB64";
+        case ARGB128:
+            return "ARGB128";
+    }
+
+    return "unknown";
+}
+
+static uint64_t getPixelCount(ImageInfo imageInfo)
+{
+    return static_cast<uint64_t>(imageInfo.width) * imageInfo.height;
+}
+
+// MARK: - Setup
+
+void ComputeDispatcher::setUp(std::string shaderFilePath)
+{
+    cpuKernel = CpuKernels::getKernelForShader(shaderFilePath);
+    kernelId = shaderFilePath.substr(shaderFilePath.find_last_of("/\\") + 1);
+    setUpGpu([&]() { gpuProgram.setUp(shaderFilePath); });
+}
+
+void ComputeDispatcher::setUpInBackground(std::string shaderFilePath)
+{
+    cpuKernel = CpuKernels::getKernelForShader(shaderFilePath);
+    kernelId = shaderFilePath.substr(shaderFilePath.find_last_of("/\\") + 1);
+    setDeviceName(CpuSimdStrategy, "cpu x" + std::to_string(TaskScheduler::getThreadCount()));
+
+    gpuState = GpuStarting;
+    gpuSetUp = std::async(std::launch::async, [this, shaderFilePath]()
+    {
+        TRACE_ZONE("ComputeDispatcher::setUpInBackground");
+        setUpGpu([&]() { gpuProgram.setUp(shaderFilePath); });
+    }).share();
+}
+
+void ComputeDispatcher::setUp(std::vector<PointwiseKernel> pointwiseKernels)
+{
+    cpuKernel = CpuKernels::getKernelForChain(pointwiseKernels);
+
+    kernelId.clear();
+    for (const auto& kernel : pointwiseKernels)
+    {
+        kernelId += (kernelId.empty() ? "" : "+") + kernel.name;
+    }
+
+    setUpGpu([&]() { gpuProgram.setUp(pointwiseKernels); });
+}
+
+// On a background setUp this runs on its own thread while frames already render on the CPU
+void ComputeDispatcher::setUpGpu(std::function<void()> setUpGpuProgram)
+{
+    setDeviceName(CpuSimdStrategy, "cpu x" + std::to_string(TaskScheduler::getThreadCount()));
+
+    try
+    {
+        setUpGpuProgram();
+
+        setDeviceName(GpuRoundTripStrategy, gpuProgram.getDeviceName());
+        gpuState = GpuReady;
+    }
+    catch (...)
+    {
+        // Usually no Vulkan device at all. The program has already destroyed whatever it got
+        // through before throwing, and let go of the shared context.
+        gpuState = GpuUnavailable;
+
+        if (cpuKernel == CpuKernelNone)
+        {
+            throw;
+        }
+    }
+}
+
+// Under schedulingMutex, because the decision log reads the names on render threads
+void ComputeDispatcher::setDeviceName(ComputeStrategy strategy, const std::string& deviceName)
+{
+    std::lock_guard<std::mutex> lock(schedulingMutex);
+    deviceNames[strategy] = deviceName;
+}
+
+void ComputeDispatcher::waitForGpuSetUp()
+{
+    if (gpuSetUp.valid())
+    {
+        TRACE_ZONE("ComputeDispatcher::waitForGpuSetUp");
+
+        // Rethrows setUpGpu's exception, on every call, if neither strategy can run the kernel
+        gpuSetUp.get();
+    }
+}
+
+void ComputeDispatcher::tearDown()
+{
+    // Whatever the background setUp threw has already been reported to the renders that waited for it
+    if (gpuSetUp.valid())
+    {
+        gpuSetUp.wait();
+        gpuSetUp = {};
+    }
+
+    if (gpuState == GpuReady)
+    {
+        gpuProgram.tearDown();
+    }
+    gpuState = GpuUnavailable;
+
+    {
+        std::lock_guard<std::mutex> lock(schedulingMutex);
+        costModels.clear();
+        histories.clear();
+    }
+
+    std::lock_guard<std::mutex> lock(cpuFramesMutex);
+    freeCpuFrames.clear();
+    cpuFrameCount = 0;
+}
+
+// MARK: - Run
+
+void ComputeDispatcher::process(ImageInfo imageInfo,
+                                UniformBufferObject uniformBufferObject,
+                                const std::function<void(void*)>& writeInputPixels,
+                                const std::function<void(void*)>& readOutputPixels,
+                                ParameterBlock parameterBlock,
+                                const RenderProgressCallback& progressCallback,
+                                uint64_t inputHash)
+{
+    // With nothing to fall back on, the first frames have to wait for the GPU
+    if (gpuState == GpuStarting && cpuKernel == CpuKernelNone)
+    {
+        waitForGpuSetUp();
+    }
+
+    // The program checks again under its own lock, so a frame that loses the output to another in between
+    // only uploads as usual
+    bool isInputResident = inputHash != 0 && inputHash == getResidentOutputHash(imageInfo);
+
+    // Taken before the decision, so the frames that warm up the GPU also grow the CPU's pool
+    auto cpuFrame = isStrategyAvailable(CpuSimdStrategy) ? takeCpuFrame(imageInfo) : nullptr;
+
+    auto decision = chooseStrategy(imageInfo, isInputResident);
+    auto startTime = std::chrono::steady_clock::now();
+
+    try
+    {
+        switch (decision.strategy)
+        {
+            case CpuSimdStrategy:
+                processOnCpu(imageInfo, uniformBufferObject, *cpuFrame, writeInputPixels, readOutputPixels, progressCallback);
+                break;
+            default:
+                gpuProgram.process(imageInfo, uniformBufferObject, writeInputPixels, readOutputPixels, parameterBlock, progressCallback, inputHash);
+                break;
+        }
+    }
+    catch (...)
+    {
+        returnCpuFrame(std::move(cpuFrame));
+        throw;
+    }
+
+    returnCpuFrame(std::move(cpuFrame));
+
+    // A cancelled frame throws past this, so its partial time never reaches the cost model
+    auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    recordOutcome(imageInfo, decision, ms);
+}
+
+uint64_t ComputeDispatcher::getResidentOutputHash(ImageInfo imageInfo)
+{
+    return gpuState == GpuReady ? gpuProgram.getResidentOutputHash(imageInfo) : 0;
+}
+
+void ComputeDispatcher::processSweep(ImageInfo imageInfo,
+                                     const std::vector<UniformBufferObject>& variants,
+                                     const std::function<void(void*)>& writeInputPixels,
+                                     const std::function<void(size_t, void*)>& readVariantPixels,
+                                     ParameterBlock parameterBlock,
+                                     const RenderProgressCallback& progressCallback)
+{
+    if (gpuState == GpuStarting && cpuKernel == CpuKernelNone)
+    {
+        waitForGpuSetUp();
+    }
+
+    if (isStrategyAvailable(GpuRoundTripStrategy))
+    {
+        gpuProgram.processSweep(imageInfo, variants, writeInputPixels, readVariantPixels, parameterBlock, progressCallback);
+        return;
+    }
+
+    TRACE_ZONE("ComputeDispatcher::processSweepOnCpu");
+
+    std::vector<char> inputPixels(imageInfo.size());
+    std::vector<char> outputPixels(imageInfo.size());
+
+    // The input copy, then a render and an output copy per variant
+    auto stepCount = 1 + 2 * variants.size();
+    uint64_t stepsDone = 0;
+    auto poll = [&]() {
+        stepsDone += 1;
+        if (progressCallback && !progressCallback(stepsDone, stepCount))
+        {
+            throw RenderCancelledError();
+        }
+    };
+
+    writeInputPixels(inputPixels.data());
+    poll();
+
+    for (size_t variant = 0; variant < variants.size(); ++variant)
+    {
+        CpuKernels::process(cpuKernel, imageInfo, variants[variant], inputPixels.data(), outputPixels.data());
+        poll();
+        readVariantPixels(variant, outputPixels.data());
+        poll();
+    }
+}
+
+// Only allocates when more frames are in flight than ever before, or a frame is bigger than its buffers
+std::unique_ptr<ComputeDispatcher::CpuFrameBuffers> ComputeDispatcher::takeCpuFrame(ImageInfo imageInfo)
+{
+    std::unique_ptr<CpuFrameBuffers> frame;
+
+    {
+        std::lock_guard<std::mutex> lock(cpuFramesMutex);
+
+        if (freeCpuFrames.empty())
+        {
+            frame = std::make_unique<CpuFrameBuffers>();
+            cpuFrameCount += 1;
+
+            // So that every frame can be returned without growing the free list
+            freeCpuFrames.reserve(cpuFrameCount);
+        }
+        else
+        {
+            frame = std::move(freeCpuFrames.back());
+            freeCpuFrames.pop_back();
+        }
+    }
+
+    // Never shrunk, so one smaller frame doesn't make the next full-size one allocate again
+    if (frame->inputPixels.size() < imageInfo.size())
+    {
+        frame->inputPixels.resize(imageInfo.size());
+        frame->outputPixels.resize(imageInfo.size());
+    }
+
+    return frame;
+}
+
+void ComputeDispatcher::returnCpuFrame(std::unique_ptr<CpuFrameBuffers> frame)
+{
+    if (frame)
+    {
+        std::lock_guard<std::mutex> lock(cpuFramesMutex);
+        freeCpuFrames.push_back(std::move(frame));
+    }
+}
+
+void ComputeDispatcher::processOnCpu(ImageInfo imageInfo,
+                                     UniformBufferObject uniformBufferObject,
+                                     CpuFrameBuffers& frame,
+                                     const std::function<void(void*)>& writeInputPixels,
+                                     const std::function<void(void*)>& readOutputPixels,
+                                     const RenderProgressCallback& progressCallback)
+{
+    TRACE_ZONE("ComputeDispatcher::processOnCpu");
+
+    auto inputPixels = frame.inputPixels.data();
+    auto outputPixels = frame.outputPixels.data();
+
+    // Polled between the three steps, like the GPU path between its submissions
+    auto poll = [&](uint64_t stepsDone) {
+        if (progressCallback && !progressCallback(stepsDone, 3))
+        {
+            throw RenderCancelledError();
+        }
+    };
+
+    writeInputPixels(inputPixels);
+    poll(1);
+    CpuKernels::process(cpuKernel, imageInfo, uniformBufferObject, inputPixels, outputPixels);
+    poll(2);
+    readOutputPixels(outputPixels);
+    poll(3);
+}
+
+// MARK: - Scheduling
+
+bool ComputeDispatcher::isStrategyAvailable(ComputeStrategy strategy) const
+{
+    switch (strategy)
+    {
+        case GpuRoundTripStrategy:
+            return gpuState == GpuReady;
+        case CpuSimdStrategy:
+            return cpuKernel != CpuKernelNone;
+        default:
+            return false;
+    }
+}
+
+ComputeDispatcher::Decision ComputeDispatcher::chooseStrategy(ImageInfo imageInfo, bool isInputResident)
+{
+    Decision decision {
+        .strategy = GpuRoundTripStrategy,
+        .reason = OnlyAvailableReason,
+        .estimatesMs = {},
+    };
+
+    // Not counted as the GPU being unavailable: once it's ready, frames are scheduled as usual
+    if (gpuState == GpuStarting && isStrategyAvailable(CpuSimdStrategy))
+    {
+        decision.strategy = CpuSimdStrategy;
+        decision.reason = GpuStartingReason;
+        return decision;
+    }
+
+    if (!isStrategyAvailable(GpuRoundTripStrategy) || !isStrategyAvailable(CpuSimdStrategy))
+    {
+        decision.strategy = isStrategyAvailable(GpuRoundTripStrategy) ? GpuRoundTripStrategy : CpuSimdStrategy;
+        return decision;
+    }
+
+    std::lock_guard<std::mutex> lock(schedulingMutex);
+
+    auto pixelCount = getPixelCount(imageInfo);
+    std::array<const CostModel*, ComputeStrategyCount> models{};
+
+    for (size_t i = 0; i < ComputeStrategyCount; ++i)
+    {
+        auto model = costModels.find(std::forward_as_tuple(kernelId, imageInfo.pixelFormat, static_cast<ComputeStrategy>(i)));
+        if (model != costModels.end())
+        {
+            models[i] = &model->second;
+            decision.estimatesMs[i] = model->second.estimateMs(pixelCount);
+        }
+    }
+
+    if (forcedStrategy.has_value())
+    {
+        decision.strategy = *forcedStrategy;
+        decision.reason = ForcedReason;
+        return decision;
+    }
+
+    if (isInputResident)
+    {
+        decision.strategy = GpuRoundTripStrategy;
+        decision.reason = ResidentInputReason;
+        return decision;
+    }
+
+    auto& gpuEstimate = decision.estimatesMs[GpuRoundTripStrategy];
+    auto& cpuEstimate = decision.estimatesMs[CpuSimdStrategy];
+
+    if (!gpuEstimate.has_value() && !cpuEstimate.has_value())
+    {
+        decision.strategy = pixelCount <= cpuFirstPixelLimit ? CpuSimdStrategy : GpuRoundTripStrategy;
+        decision.reason = ColdStartReason;
+        return decision;
+    }
+
+    // A strategy that has never run for this kernel and format gets the next frame, so both have a model
+    if (!gpuEstimate.has_value() || !cpuEstimate.has_value())
+    {
+        decision.strategy = gpuEstimate.has_value() ? CpuSimdStrategy : GpuRoundTripStrategy;
+        decision.reason = UntriedReason;
+        return decision;
+    }
+
+    auto& history = histories[{ imageInfo.pixelFormat, CostModel::getSizeBucket(pixelCount) }];
+
+    auto fastest = *cpuEstimate < *gpuEstimate ? CpuSimdStrategy : GpuRoundTripStrategy;
+
+    // Hysteresis, so two strategies that are about as fast as each other don't alternate every frame
+    if (history.lastStrategy.has_value() && *history.lastStrategy != fastest)
+    {
+        auto currentMs = *decision.estimatesMs[*history.lastStrategy];
+        if (*decision.estimatesMs[fastest] > currentMs * (1.0 - switchMargin))
+        {
+            fastest = *history.lastStrategy;
+        }
+    }
+
+    auto runnerUp = fastest == CpuSimdStrategy ? GpuRoundTripStrategy : CpuSimdStrategy;
+    auto slowdown = *decision.estimatesMs[runnerUp] / std::max(*decision.estimatesMs[fastest], 1e-3);
+
+    // The runner-up's estimate here is only extrapolated; measure it unless a real fit says it's hopeless
+    if (models[runnerUp]->getSampleCount(pixelCount) == 0
+        && (!models[runnerUp]->hasSizeFit() || slowdown <= maxUntriedSlowdown))
+    {
+        decision.strategy = runnerUp;
+        decision.reason = UntriedReason;
+        return decision;
+    }
+
+    auto interval = static_cast<uint32_t>(std::min<double>(maxProbeInterval, probeInterval * std::max(1.0, slowdown)));
+
+    if (++history.framesSinceProbe >= interval)
+    {
+        history.framesSinceProbe = 0;
+        decision.strategy = runnerUp;
+        decision.reason = ProbeReason;
+        return decision;
+    }
+
+    decision.strategy = fastest;
+    decision.reason = FastestReason;
+    return decision;
+}
+
+void ComputeDispatcher::recordOutcome(ImageInfo imageInfo, const Decision& decision, double ms)
+{
+    std::lock_guard<std::mutex> lock(schedulingMutex);
+
+    // Found by reference to kernelId; the key only copies it the first time
+    auto model = costModels.find(std::forward_as_tuple(kernelId, imageInfo.pixelFormat, decision.strategy));
+    if (model == costModels.end())
+    {
+        model = costModels.emplace(CostModelKey { kernelId, imageInfo.pixelFormat, decision.strategy }, CostModel {}).first;
+    }
+
+    // Without its upload a resident frame would make the GPU look faster than it is for every other frame
+    if (decision.reason != ResidentInputReason)
+    {
+        model->second.addSample(getPixelCount(imageInfo), ms);
+    }
+
+    auto& history = histories[{ imageInfo.pixelFormat, CostModel::getSizeBucket(getPixelCount(imageInfo)) }];
+
+    // Steady state is the same strategy for the same reason frame after frame; only the changes are worth a line
+    bool isRepeat = decision.reason != ProbeReason
+        && history.lastStrategy == decision.strategy
+        && history.lastReason == decision.reason;
+
+    if (isRepeat)
+    {
+        history.repeatsSinceLogged += 1;
+    }
+    else
+    {
+        appendDecisionToLog(imageInfo, decision, ms, history.repeatsSinceLogged);
+        history.repeatsSinceLogged = 0;
+    }
+
+    // A probe is a one-off; the strategy the size is actually running on hasn't changed
+    if (decision.reason != ProbeReason)
+    {
+        history.lastStrategy = decision.strategy;
+        history.lastReason = decision.reason;
+    }
+}
+
+void ComputeDispatcher::setForcedStrategy(std::optional<ComputeStrategy> strategy)
+{
+    // Which strategies are available isn't known until a background setUp is done
+    waitForGpuSetUp();
+
+    if (strategy.has_value() && !isStrategyAvailable(*strategy))
+    {
+        throw std::runtime_error(std::string("The ") + getComputeStrategyName(*strategy) + " strategy isn't available");
+    }
+
+    std::lock_guard<std::mutex> lock(schedulingMutex);
+    forcedStrategy = strategy;
+}
+
+// MARK: - Decision Log
+
+const char* ComputeDispatcher::getDecisionReasonName(DecisionReason reason)
+{
+    switch (reason)
+    {
+        case OnlyAvailableReason:
+            return "onlyAvailable";
+        case GpuStartingReason:
+            return "gpuStarting";
+        case ForcedReason:
+            return "forced";
+        case ColdStartReason:
+            return "coldStart";
+        case UntriedReason:
+            return "untried";
+        case FastestReason:
+            return "fastest";
+        case ProbeReason:
+            return "probe";
+        case ResidentInputReason:
+            return "residentInput";
+    }
+
+    return "unknown";
+}
+
+void ComputeDispatcher::setDecisionLogPath(const std::string& logPath)
+{
+    std::lock_guard<std::mutex> lock(schedulingMutex);
+
+    if (decisionLog.is_open())
+    {
+        decisionLog.close();
+    }
+
+    // A farm node with a read-only plugin folder simply doesn't get a log
+    if (!logPath.empty())
+    {
+        decisionLog.open(logPath, std::ios::app);
+    }
+}
+
+// Called with schedulingMutex held
+void ComputeDispatcher::appendDecisionToLog(ImageInfo imageInfo, const Decision& decision, double ms, uint64_t repeats)
+{
+    if (!decisionLog.is_open())
+    {
+        return;
+    }
+
+    auto timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    decisionLog << "{\"timeMs\":" << timeMs
+                << ",\"kernel\":\"" << kernelId << "\""
+                << ",\"pixelFormat\":\"" << getPixelFormatName(imageInfo.pixelFormat) << "\""
+                << ",\"width\":" << imageInfo.width
+                << ",\"height\":" << imageInfo.height
+                << ",\"strategy\":\"" << getComputeStrategyName(decision.strategy) << "\""
+                << ",\"device\":\"" << deviceNames[decision.strategy] << "\""
+                << ",\"reason\":\"" << getDecisionReasonName(decision.reason) << "\""
+                << ",\"estimatesMs\":{";
+
+    for (size_t i = 0; i < ComputeStrategyCount; ++i)
+    {
+        decisionLog << (i == 0 ? "" : ",") << "\"" << getComputeStrategyName(static_cast<ComputeStrategy>(i)) << "\":";
+
+        if (decision.estimatesMs[i].has_value())
+        {
+            decisionLog << *decision.estimatesMs[i];
+        }
+        else
+        {
+            decisionLog << "null";
+        }
+    }
+
+    decisionLog << "}"
+                << ",\"measuredMs\":" << ms
+                << ",\"repeatsSinceLastLine\":" << repeats
+                << "}\n";
+
+    // So a crash or a killed render doesn't lose the lines before it
+    decisionLog.flush();
+}
+
+// MARK: - Accessors
+
+VulkanComputeProgram& ComputeDispatcher::getGpuProgram()
+{
+    return gpuProgram;
+}
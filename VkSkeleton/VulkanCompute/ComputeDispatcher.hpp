@@ -0,0 +1,196 @@
+//
+//  ComputeDispatcher.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/12/21.
+//
+
+#ifndef ComputeDispatcher_hpp
+#define ComputeDispatcher_hpp
+
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "CostModel.hpp"
+#include "CpuKernels.hpp"
+#include "VulkanComputeDataTypes.hpp"
+#include "VulkanComputeProgram.hpp"
+
+// The ways a frame can be rendered
+enum ComputeStrategy : size_t {
+    GpuRoundTripStrategy    = 0,    // upload, dispatch and read back through VulkanComputeProgram
+    CpuSimdStrategy         = 1,    // CpuKernels across the TaskScheduler pool
+    ComputeStrategyCount,
+};
+
+const char* getComputeStrategyName(ComputeStrategy strategy);
+
+// Renders each frame with whichever available strategy its cost models predict is fastest for that kernel,
+// frame size, pixel format and device. The models are trained from every frame's measured time, and the
+// runner-up is re-probed every so often so they stay current. Falls back to the CPU for good when there
+// is no usable Vulkan device.
+class ComputeDispatcher
+{
+public:
+
+    // With no timings for either strategy, frames up to this many pixels start out on the CPU
+    static const uint64_t cpuFirstPixelLimit = 512 * 512;
+
+    // Every this many frames of a size and format, the runner-up gets one frame. The interval is stretched
+    // by how much slower the runner-up is predicted to be, so probing costs about the same fraction of
+    // render time however bad the runner-up is, up to maxProbeInterval.
+    static const uint32_t probeInterval = 64;
+    static const uint32_t maxProbeInterval = 4096;
+
+    // A size keeps the strategy it's on until the other is predicted to be this much faster
+    static constexpr double switchMargin = 0.1;
+
+    // A strategy that hasn't run at a size yet gets one frame there, unless a fit across several
+    // sizes predicts it to be more than this many times slower than the fastest
+    static constexpr double maxUntriedSlowdown = 4.0;
+
+    // Throws only if neither strategy can run the kernel
+    void setUp(std::string shaderFilePath);
+    void setUp(std::vector<PointwiseKernel> pointwiseKernels);
+
+    // Returns straight away and creates the Vulkan objects on a background thread, so loading the plugin
+    // doesn't wait for the driver. Frames render on the CPU until the GPU is ready; a kernel with no CPU
+    // version waits for it instead, and gets setUp's exception if it can't run at all.
+    void setUpInBackground(std::string shaderFilePath);
+
+    // Waits for a background setUp to finish first
+    void tearDown();
+
+    // Same contract as VulkanComputeProgram::process. The CPU kernels ignore the parameter block. A frame
+    // whose inputHash matches the GPU's resident output goes to the GPU whatever the cost models say, since
+    // it skips the upload they were trained with.
+    void process(ImageInfo imageInfo,
+                 UniformBufferObject uniformBufferObject,
+                 const std::function<void(void*)>& writeInputPixels,
+                 const std::function<void(void*)>& readOutputPixels,
+                 ParameterBlock parameterBlock = {},
+                 const RenderProgressCallback& progressCallback = {},
+                 uint64_t inputHash = 0);
+
+    // VulkanComputeProgram::getResidentOutputHash, or 0 while the GPU isn't ready. Worth hashing the input
+    // for process only if this isn't 0.
+    uint64_t getResidentOutputHash(ImageInfo imageInfo);
+
+    // Same contract as VulkanComputeProgram::processSweep. On the GPU whenever it's ready, since the cost
+    // models only know single frames; otherwise the CPU renders each variant from one copy of the input.
+    void processSweep(ImageInfo imageInfo,
+                      const std::vector<UniformBufferObject>& variants,
+                      const std::function<void(void*)>& writeInputPixels,
+                      const std::function<void(size_t, void*)>& readVariantPixels,
+                      ParameterBlock parameterBlock = {},
+                      const RenderProgressCallback& progressCallback = {});
+
+    // Pins every frame to one strategy, for verification and benchmarks. nullopt goes back to choosing.
+    void setForcedStrategy(std::optional<ComputeStrategy> strategy);
+
+    bool isStrategyAvailable(ComputeStrategy strategy) const;
+
+    // Appends a JSON line for every decision that isn't a repeat of the last one for its size and format:
+    // cold starts, switches, probes and forced frames, each with the estimates it was made from and the
+    // time it actually took. The file is opened here and kept open, so logging a frame doesn't allocate.
+    // An empty path, or one that can't be opened, disables logging.
+    void setDecisionLogPath(const std::string& logPath);
+
+    // For the GPU-only features: metrics, GPU timings, frame capture
+    VulkanComputeProgram& getGpuProgram();
+
+private:
+
+    enum GpuState {
+        GpuUnavailable,
+        GpuStarting,            // a background setUp is still running
+        GpuReady,
+    };
+
+    enum DecisionReason {
+        OnlyAvailableReason,    // the other strategy can't run this kernel
+        GpuStartingReason,      // the GPU isn't set up yet
+        ForcedReason,
+        ColdStartReason,        // no timings at all yet, so frame size alone
+        UntriedReason,          // no timings for this strategy at this size yet
+        FastestReason,
+        ProbeReason,            // the runner-up, to keep its model current
+        ResidentInputReason,    // the input is the GPU's last output, still on the device
+    };
+
+    static const char* getDecisionReasonName(DecisionReason reason);
+
+    struct Decision {
+        ComputeStrategy                                         strategy;
+        DecisionReason                                          reason;
+        std::array<std::optional<double>, ComputeStrategyCount> estimatesMs;
+    };
+
+    // What was last decided for frames of one size bucket and format, for probing and for the log
+    struct DecisionHistory {
+        std::optional<ComputeStrategy>  lastStrategy;
+        std::optional<DecisionReason>   lastReason;
+        uint32_t                        framesSinceProbe    = 0;
+        uint64_t                        repeatsSinceLogged  = 0;
+    };
+
+    // A CPU frame's input and output pixels
+    struct CpuFrameBuffers {
+        std::vector<char>   inputPixels;
+        std::vector<char>   outputPixels;
+    };
+
+    // Kernel, pixel format and device (the strategy stands in for the device; there's one of each)
+    using CostModelKey = std::tuple<std::string, PixelFormat, ComputeStrategy>;
+    using HistoryKey = std::pair<PixelFormat, uint32_t>;
+
+    VulkanComputeProgram                    gpuProgram;
+    std::atomic<GpuState>                   gpuState{GpuUnavailable};
+    std::shared_future<void>                gpuSetUp;
+    CpuKernel                               cpuKernel       = CpuKernelNone;
+    std::string                             kernelId;
+
+    std::mutex                              schedulingMutex;
+    std::array<std::string, ComputeStrategyCount> deviceNames;
+    std::optional<ComputeStrategy>          forcedStrategy;
+    std::map<CostModelKey, CostModel, std::less<>> costModels;  // looked up without copying kernelId
+    std::map<HistoryKey, DecisionHistory>   histories;
+    std::ofstream                           decisionLog;
+
+    // One CpuFrameBuffers per frame in flight, at the most there have been at once. Every frame takes one
+    // while the CPU could run it, whichever strategy it goes to, so the warm-up frames grow the pool and a
+    // probe or switch to the CPU later finds its buffers already sized.
+    std::mutex                              cpuFramesMutex;
+    std::vector<std::unique_ptr<CpuFrameBuffers>> freeCpuFrames;
+    size_t                                  cpuFrameCount   = 0;    // free and taken
+
+    void setUpGpu(std::function<void()> setUpGpuProgram);
+    void setDeviceName(ComputeStrategy strategy, const std::string& deviceName);
+    void waitForGpuSetUp();
+
+    Decision chooseStrategy(ImageInfo imageInfo, bool isInputResident);
+    void recordOutcome(ImageInfo imageInfo, const Decision& decision, double ms);
+    void appendDecisionToLog(ImageInfo imageInfo, const Decision& decision, double ms, uint64_t repeats);
+
+    std::unique_ptr<CpuFrameBuffers> takeCpuFrame(ImageInfo imageInfo);
+    void returnCpuFrame(std::unique_ptr<CpuFrameBuffers> frame);
+
+    void processOnCpu(ImageInfo imageInfo,
+                      UniformBufferObject uniformBufferObject,
+                      CpuFrameBuffers& frame,
+                      const std::function<void(void*)>& writeInputPixels,
+                      const std::function<void(void*)>& readOutputPixels,
+                      const RenderProgressCallback& progressCallback);
+};
+
+#endif /* ComputeDispatcher_hpp */
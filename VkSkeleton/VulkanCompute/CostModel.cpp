@@ -0,0 +1,92 @@
+//
+//  CostModel.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/13/21.
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include "CostModel.hpp"
+
+// Below this the fit can't tell the fixed cost from the per-pixel cost (all samples the same size)
+static const double minSizeVariance = 1e-6;
+
+void CostModel::addSample(uint64_t pixelCount, double ms)
+{
+    auto& bucket = buckets[getSizeBucket(pixelCount)];
+
+    bucket.averageMs = bucket.sampleCount == 0
+        ? ms
+        : (1.0 - bucketSmoothing) * bucket.averageMs + bucketSmoothing * ms;
+    bucket.sampleCount += 1;
+
+    auto x = static_cast<double>(pixelCount) * 1e-6;
+
+    sumWeight = fitForgetting * sumWeight + 1.0;
+    sumX = fitForgetting * sumX + x;
+    sumY = fitForgetting * sumY + ms;
+    sumXX = fitForgetting * sumXX + x * x;
+    sumXY = fitForgetting * sumXY + x * ms;
+}
+
+std::optional<double> CostModel::estimateMs(uint64_t pixelCount) const
+{
+    auto bucket = buckets.find(getSizeBucket(pixelCount));
+    if (bucket != buckets.end() && bucket->second.sampleCount > 0)
+    {
+        return bucket->second.averageMs;
+    }
+
+    if (sumWeight <= 0.0)
+    {
+        return std::nullopt;
+    }
+
+    auto x = static_cast<double>(pixelCount) * 1e-6;
+    auto meanX = sumX / sumWeight;
+    auto meanY = sumY / sumWeight;
+    auto varianceX = sumXX / sumWeight - meanX * meanX;
+
+    // Only one size seen so far: assume the time is all per-pixel and scale it
+    if (varianceX < minSizeVariance)
+    {
+        return meanX > 0.0 ? meanY * x / meanX : meanY;
+    }
+
+    auto msPerMegapixel = (sumXY / sumWeight - meanX * meanY) / varianceX;
+    auto fixedMs = meanY - msPerMegapixel * meanX;
+
+    // A noisy fit can come out with a negative slope or intercept; neither is physical
+    return std::max(0.0, fixedMs) + std::max(0.0, msPerMegapixel) * x;
+}
+
+uint32_t CostModel::getSampleCount(uint64_t pixelCount) const
+{
+    auto bucket = buckets.find(getSizeBucket(pixelCount));
+    return bucket != buckets.end() ? bucket->second.sampleCount : 0;
+}
+
+bool CostModel::hasSizeFit() const
+{
+    if (sumWeight <= 0.0)
+    {
+        return false;
+    }
+
+    auto meanX = sumX / sumWeight;
+    return sumXX / sumWeight - meanX * meanX >= minSizeVariance;
+}
+
+uint32_t CostModel::getSizeBucket(uint64_t pixelCount)
+{
+    uint32_t bucket = 0;
+    while (pixelCount > 1)
+    {
+        pixelCount >>= 1;
+        bucket += 1;
+    }
+
+    return bucket;
+}
@@ -0,0 +1,61 @@
+//
+//  CostModel.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/13/21.
+//
+
+#ifndef CostModel_hpp
+#define CostModel_hpp
+
+#include <map>
+#include <optional>
+#include <stdint.h>
+
+// Online estimate of how long one way of rendering takes, for one kernel and pixel format on one device.
+// Trained from measured frame times, newest samples weighted most, so it follows changes in load.
+//
+// Sizes that have been rendered are estimated from their own log2 pixel count bucket. Sizes that haven't
+// are estimated from a line fitted through every bucket, fixed cost plus cost per megapixel, which is what
+// lets the scheduler make a sensible first call on a frame size it has never seen.
+class CostModel
+{
+public:
+
+    // Weight of the newest frame in a bucket's running average
+    static constexpr double bucketSmoothing = 0.2;
+
+    // Every older sample's weight in the line fit is multiplied by this on each new one
+    static constexpr double fitForgetting = 0.95;
+
+    void addSample(uint64_t pixelCount, double ms);
+
+    std::optional<double> estimateMs(uint64_t pixelCount) const;
+
+    // Frames measured in pixelCount's bucket
+    uint32_t getSampleCount(uint64_t pixelCount) const;
+
+    // Whether the samples span enough sizes to tell fixed cost from per-pixel cost.
+    // Until they do, estimates for unmeasured sizes are rough proportional guesses.
+    bool hasSizeFit() const;
+
+    static uint32_t getSizeBucket(uint64_t pixelCount);
+
+private:
+
+    struct Bucket {
+        double      averageMs   = 0.0;
+        uint32_t    sampleCount = 0;
+    };
+
+    std::map<uint32_t, Bucket>  buckets;
+
+    // Weighted least squares sums of ms against megapixels
+    double                      sumWeight   = 0.0;
+    double                      sumX        = 0.0;
+    double                      sumY        = 0.0;
+    double                      sumXX       = 0.0;
+    double                      sumXY       = 0.0;
+};
+
+#endif /* CostModel_hpp */
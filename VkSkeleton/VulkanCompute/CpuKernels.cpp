@@ -0,0 +1,392 @@
+//
+//  CpuKernels.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/12/21.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CPU_KERNELS_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CPU_KERNELS_NEON 1
+#endif
+
+#include "CpuKernels.hpp"
+
+#include "TaskScheduler.hpp"
+#include "TraceUtils.hpp"
+
+// MARK: - Float4
+
+// One pixel, in the same channel order as the buffer (which is also the shader's vec4 order)
+struct Float4 {
+#if CPU_KERNELS_SSE2
+    __m128 v;
+#elif CPU_KERNELS_NEON
+    float32x4_t v;
+#else
+    float v[4];
+#endif
+};
+
+#if CPU_KERNELS_SSE2
+
+static inline Float4 set4(float a, float b, float c, float d) { return { _mm_setr_ps(a, b, c, d) }; }
+static inline Float4 splat4(float a) { return { _mm_set1_ps(a) }; }
+static inline Float4 operator+(Float4 a, Float4 b) { return { _mm_add_ps(a.v, b.v) }; }
+static inline Float4 operator-(Float4 a, Float4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+static inline Float4 operator*(Float4 a, Float4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+static inline Float4 abs4(Float4 a) { return { _mm_andnot_ps(_mm_set1_ps(-0.f), a.v) }; }
+static inline Float4 clamp01(Float4 a) { return { _mm_min_ps(_mm_max_ps(a.v, _mm_setzero_ps()), _mm_set1_ps(1.f)) }; }
+
+static inline Float4 load4(const float* p) { return { _mm_loadu_ps(p) }; }
+static inline void store4(float* p, Float4 a) { _mm_storeu_ps(p, a.v); }
+
+static inline Float4 load4(const uint8_t* p)
+{
+    int32_t word;
+    memcpy(&word, p, sizeof(word));
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(word);
+    __m128i dwords = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+    return { _mm_mul_ps(_mm_cvtepi32_ps(dwords), _mm_set1_ps(1.f / 255.f)) };
+}
+
+static inline void store4(uint8_t* p, Float4 a)
+{
+    __m128i dwords = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(clamp01(a).v, _mm_set1_ps(255.f)), _mm_set1_ps(0.5f)));
+    __m128i words = _mm_packs_epi32(dwords, dwords);
+    int32_t word = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+    memcpy(p, &word, sizeof(word));
+}
+
+static inline Float4 load4(const uint16_t* p)
+{
+    __m128i words = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+    __m128i dwords = _mm_unpacklo_epi16(words, _mm_setzero_si128());
+    return { _mm_mul_ps(_mm_cvtepi32_ps(dwords), _mm_set1_ps(1.f / 65535.f)) };
+}
+
+static inline void store4(uint16_t* p, Float4 a)
+{
+    __m128i dwords = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(clamp01(a).v, _mm_set1_ps(65535.f)), _mm_set1_ps(0.5f)));
+
+    // SSE2 only has a signed 32 -> 16 bit pack, so shift into signed range and back
+    __m128i shifted = _mm_sub_epi32(dwords, _mm_set1_epi32(32768));
+    __m128i words = _mm_xor_si128(_mm_packs_epi32(shifted, shifted), _mm_set1_epi16(static_cast<short>(0x8000)));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(p), words);
+}
+
+#elif CPU_KERNELS_NEON
+
+static inline Float4 set4(float a, float b, float c, float d) { float f[4] = { a, b, c, d }; return { vld1q_f32(f) }; }
+static inline Float4 splat4(float a) { return { vdupq_n_f32(a) }; }
+static inline Float4 operator+(Float4 a, Float4 b) { return { vaddq_f32(a.v, b.v) }; }
+static inline Float4 operator-(Float4 a, Float4 b) { return { vsubq_f32(a.v, b.v) }; }
+static inline Float4 operator*(Float4 a, Float4 b) { return { vmulq_f32(a.v, b.v) }; }
+static inline Float4 abs4(Float4 a) { return { vabsq_f32(a.v) }; }
+static inline Float4 clamp01(Float4 a) { return { vminq_f32(vmaxq_f32(a.v, vdupq_n_f32(0.f)), vdupq_n_f32(1.f)) }; }
+
+static inline Float4 load4(const float* p) { return { vld1q_f32(p) }; }
+static inline void store4(float* p, Float4 a) { vst1q_f32(p, a.v); }
+
+static inline Float4 load4(const uint8_t* p)
+{
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    uint16x8_t words = vmovl_u8(vcreate_u8(word));
+    return { vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(words))), 1.f / 255.f) };
+}
+
+static inline void store4(uint8_t* p, Float4 a)
+{
+    uint32x4_t dwords = vcvtq_u32_f32(vaddq_f32(vmulq_n_f32(clamp01(a).v, 255.f), vdupq_n_f32(0.5f)));
+    uint16x4_t words = vmovn_u32(dwords);
+    uint8x8_t bytes = vmovn_u16(vcombine_u16(words, words));
+    uint32_t word = vget_lane_u32(vreinterpret_u32_u8(bytes), 0);
+    memcpy(p, &word, sizeof(word));
+}
+
+static inline Float4 load4(const uint16_t* p)
+{
+    return { vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vld1_u16(p))), 1.f / 65535.f) };
+}
+
+static inline void store4(uint16_t* p, Float4 a)
+{
+    uint32x4_t dwords = vcvtq_u32_f32(vaddq_f32(vmulq_n_f32(clamp01(a).v, 65535.f), vdupq_n_f32(0.5f)));
+    vst1_u16(p, vmovn_u32(dwords));
+}
+
+#else
+
+template <typename Function>
+static inline Float4 map4(Float4 a, Float4 b, Function fn)
+{
+    return { { fn(a.v[0], b.v[0]), fn(a.v[1], b.v[1]), fn(a.v[2], b.v[2]), fn(a.v[3], b.v[3]) } };
+}
+
+static inline Float4 set4(float a, float b, float c, float d) { return { { a, b, c, d } }; }
+static inline Float4 splat4(float a) { return { { a, a, a, a } }; }
+static inline Float4 operator+(Float4 a, Float4 b) { return map4(a, b, [](float x, float y) { return x + y; }); }
+static inline Float4 operator-(Float4 a, Float4 b) { return map4(a, b, [](float x, float y) { return x - y; }); }
+static inline Float4 operator*(Float4 a, Float4 b) { return map4(a, b, [](float x, float y) { return x * y; }); }
+static inline Float4 abs4(Float4 a) { return map4(a, a, [](float x, float) { return std::fabs(x); }); }
+static inline Float4 clamp01(Float4 a) { return map4(a, a, [](float x, float) { return std::min(std::max(x, 0.f), 1.f); }); }
+
+static inline Float4 load4(const float* p) { return { { p[0], p[1], p[2], p[3] } }; }
+static inline void store4(float* p, Float4 a) { memcpy(p, a.v, sizeof(a.v)); }
+
+template <typename Channel, int maxValue>
+static inline Float4 loadUnorm4(const Channel* p)
+{
+    const float scale = 1.f / static_cast<float>(maxValue);
+    return { { p[0] * scale, p[1] * scale, p[2] * scale, p[3] * scale } };
+}
+
+template <typename Channel, int maxValue>
+static inline void storeUnorm4(Channel* p, Float4 a)
+{
+    a = clamp01(a);
+    for (int i = 0; i < 4; ++i)
+    {
+        p[i] = static_cast<Channel>(a.v[i] * static_cast<float>(maxValue) + 0.5f);
+    }
+}
+
+static inline Float4 load4(const uint8_t* p) { return loadUnorm4<uint8_t, 255>(p); }
+static inline void store4(uint8_t* p, Float4 a) { storeUnorm4<uint8_t, 255>(p, a); }
+static inline Float4 load4(const uint16_t* p) { return loadUnorm4<uint16_t, 65535>(p); }
+static inline void store4(uint16_t* p, Float4 a) { storeUnorm4<uint16_t, 65535>(p, a); }
+
+#endif
+
+static inline Float4 lerp4(Float4 a, Float4 b, float t)
+{
+    return a + (b - a) * splat4(t);
+}
+
+// MARK: - Threading
+
+// Bands smaller than this cost more to hand to the pool than they save
+static const size_t minPixelsPerBand = 16 * 1024;
+
+// The warp gathers from a scaled copy of wherever the pixel is, so square tiles keep the taps in cache
+static const uint32_t warpTileSize = 64;
+
+// MARK: - Kernels
+
+// shaders/simple.comp: abs(vec4(0, pivot, pivot, pivot) - color), sampled at texel centers so color is exactly the input pixel
+template <typename Channel>
+static void invert(ImageInfo imageInfo, UniformBufferObject ubo, const void* inputPixels, void* outputPixels)
+{
+    auto input = static_cast<const Channel*>(inputPixels);
+    auto output = static_cast<Channel*>(outputPixels);
+    auto pivot = set4(0.f, ubo.pivot, ubo.pivot, ubo.pivot);
+
+    auto processRows = [&](uint32_t top, uint32_t bottom) {
+        auto begin = static_cast<size_t>(top) * imageInfo.width * 4;
+        auto end = static_cast<size_t>(bottom) * imageInfo.width * 4;
+
+        for (size_t i = begin; i < end; i += 4)
+        {
+            store4(output + i, abs4(pivot - load4(input + i)));
+        }
+    };
+
+    TaskScheduler::parallelForRows(imageInfo.width, imageInfo.height, minPixelsPerBand, std::cref(processRows));
+}
+
+// texture() through the VK_FILTER_LINEAR / CLAMP_TO_EDGE sampler, uv normalized
+template <typename Channel>
+static inline Float4 sampleBilinear(const Channel* input, uint32_t width, uint32_t height, float u, float v)
+{
+    float x = u * static_cast<float>(width) - 0.5f;
+    float y = v * static_cast<float>(height) - 0.5f;
+
+    float x0f = std::floor(x);
+    float y0f = std::floor(y);
+    float fx = x - x0f;
+    float fy = y - y0f;
+
+    auto maxX = static_cast<int64_t>(width) - 1;
+    auto maxY = static_cast<int64_t>(height) - 1;
+
+    auto x0 = std::clamp(static_cast<int64_t>(x0f), int64_t(0), maxX);
+    auto x1 = std::clamp(static_cast<int64_t>(x0f) + 1, int64_t(0), maxX);
+    auto y0 = std::clamp(static_cast<int64_t>(y0f), int64_t(0), maxY);
+    auto y1 = std::clamp(static_cast<int64_t>(y0f) + 1, int64_t(0), maxY);
+
+    auto row0 = input + static_cast<size_t>(y0) * width * 4;
+    auto row1 = input + static_cast<size_t>(y1) * width * 4;
+
+    auto top = lerp4(load4(row0 + x0 * 4), load4(row0 + x1 * 4), fx);
+    auto bottom = lerp4(load4(row1 + x0 * 4), load4(row1 + x1 * 4), fx);
+
+    return lerp4(top, bottom, fy);
+}
+
+// texture() through the VK_FILTER_NEAREST sampler that draft quality frames read the input with
+template <typename Channel>
+static inline Float4 sampleNearest(const Channel* input, uint32_t width, uint32_t height, float u, float v)
+{
+    auto x = std::clamp(static_cast<int64_t>(std::floor(u * static_cast<float>(width))), int64_t(0), static_cast<int64_t>(width) - 1);
+    auto y = std::clamp(static_cast<int64_t>(std::floor(v * static_cast<float>(height))), int64_t(0), static_cast<int64_t>(height) - 1);
+
+    return load4(input + (static_cast<size_t>(y) * width + static_cast<size_t>(x)) * 4);
+}
+
+// shaders/invert.comp: pulls every pixel along the line from the center to the nearest edge
+template <typename Channel>
+static void radialWarp(ImageInfo imageInfo, UniformBufferObject ubo, const void* inputPixels, void* outputPixels)
+{
+    auto input = static_cast<const Channel*>(inputPixels);
+    auto output = static_cast<Channel*>(outputPixels);
+
+    const float sx = static_cast<float>(imageInfo.width);
+    const float sy = static_cast<float>(imageInfo.height);
+    const float cx = 0.5f * sx;
+    const float cy = 0.5f * sy;
+    const float aspect = sx / sy;
+    const bool isDraftQuality = ubo.isDraftQuality != 0;
+
+    auto processTile = [&](uint32_t left, uint32_t top, uint32_t right, uint32_t bottom) {
+        for (uint32_t y = top; y < bottom; ++y)
+        {
+            auto outputRow = output + static_cast<size_t>(y) * imageInfo.width * 4;
+            float cpy = static_cast<float>(y) - cy;
+
+            for (uint32_t x = left; x < right; ++x)
+            {
+                float cpx = static_cast<float>(x) - cx;
+                float l_cp = std::sqrt(cpx * cpx + cpy * cpy);
+
+                // The hole in the middle is one full-resolution pixel across at any downsample factor
+                float hx = cpx / ubo.downsampleX;
+                float hy = cpy / ubo.downsampleY;
+
+                if (hx * hx + hy * hy < 1.f)
+                {
+                    store4(outputRow + x * 4, splat4(0.f));
+                    continue;
+                }
+
+                // aspect-corrected cp
+                float ax = cpx;
+                float ay = cpy * aspect;
+
+                // nearest edge point, same quadrant tests in the same order as the shader
+                float npx, npy;
+                if (std::fabs(ax) <= ay)
+                {
+                    npx = cy * (cpx / cpy);
+                    npy = cy;
+                }
+                else if (std::fabs(ay) <= -ax)
+                {
+                    npx = -cx;
+                    npy = -cx * (cpy / cpx);
+                }
+                else if (std::fabs(ax) <= -ay)
+                {
+                    npx = -cy * (cpx / cpy);
+                    npy = -cy;
+                }
+                else
+                {
+                    npx = cx;
+                    npy = cx * (cpy / cpx);
+                }
+
+                float t = std::fabs(ubo.pivot - l_cp / std::sqrt(npx * npx + npy * npy));
+
+                float u = (cx + npx * t) / sx;
+                float v = (cy + npy * t) / sy;
+
+                store4(outputRow + x * 4, isDraftQuality
+                       ? sampleNearest(input, imageInfo.width, imageInfo.height, u, v)
+                       : sampleBilinear(input, imageInfo.width, imageInfo.height, u, v));
+            }
+        }
+    };
+
+    if (static_cast<size_t>(imageInfo.width) * imageInfo.height < minPixelsPerBand)
+    {
+        processTile(0, 0, imageInfo.width, imageInfo.height);
+        return;
+    }
+
+    TaskScheduler::parallelForTiles(imageInfo.width, imageInfo.height, warpTileSize, std::cref(processTile));
+}
+
+template <typename Channel>
+static void processWithChannel(CpuKernel kernel, ImageInfo imageInfo, UniformBufferObject ubo, const void* input, void* output)
+{
+    switch (kernel)
+    {
+        case CpuKernelInvert:
+            invert<Channel>(imageInfo, ubo, input, output);
+            break;
+        case CpuKernelRadialWarp:
+            radialWarp<Channel>(imageInfo, ubo, input, output);
+            break;
+        case CpuKernelNone:
+            break;
+    }
+}
+
+// MARK: - Public
+
+CpuKernel CpuKernels::getKernelForShader(const std::string& shaderFilePath)
+{
+    auto fileName = shaderFilePath.substr(shaderFilePath.find_last_of("/\\") + 1);
+
+    if (fileName == "simple.comp")
+    {
+        return CpuKernelInvert;
+    }
+    if (fileName == "invert.comp")
+    {
+        return CpuKernelRadialWarp;
+    }
+
+    return CpuKernelNone;
+}
+
+CpuKernel CpuKernels::getKernelForChain(const std::vector<PointwiseKernel>& pointwiseKernels)
+{
+    if (pointwiseKernels.size() == 1 && pointwiseKernels[0].name == "invert")
+    {
+        return CpuKernelInvert;
+    }
+
+    return CpuKernelNone;
+}
+
+void CpuKernels::process(CpuKernel kernel,
+                         ImageInfo imageInfo,
+                         UniformBufferObject uniformBufferObject,
+                         const void* inputPixels,
+                         void* outputPixels)
+{
+    TRACE_ZONE("CpuKernels::process");
+
+    switch (imageInfo.pixelFormat)
+    {
+        case ARGB32:
+            processWithChannel<uint8_t>(kernel, imageInfo, uniformBufferObject, inputPixels, outputPixels);
+            break;
+        case ARGB64:
+            processWithChannel<uint16_t>(kernel, imageInfo, uniformBufferObject, inputPixels, outputPixels);
+            break;
+        case ARGB128:
+            processWithChannel<float>(kernel, imageInfo, uniformBufferObject, inputPixels, outputPixels);
+            break;
+    }
+}
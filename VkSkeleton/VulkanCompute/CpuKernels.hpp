@@ -0,0 +1,44 @@
+//
+//  CpuKernels.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/12/21.
+//
+
+#ifndef CpuKernels_hpp
+#define CpuKernels_hpp
+
+#include <string>
+#include <vector>
+
+#include "VulkanComputeDataTypes.hpp"
+
+// CPU versions of the shipped shaders, for when there's no Vulkan device or the frame is too small
+// to be worth the GPU round trips. Pixels are packed rows, exactly like VulkanComputeProgram's buffers.
+enum CpuKernel {
+    CpuKernelNone,
+    CpuKernelInvert,        // shaders/simple.comp, PointwiseKernels::invert
+    CpuKernelRadialWarp,    // shaders/invert.comp
+};
+
+namespace CpuKernels
+{
+
+// The kernel with the same math as a shader file, or CpuKernelNone if it has no CPU version
+CpuKernel getKernelForShader(const std::string& shaderFilePath);
+
+// Only chains that are exactly one kernel with a CPU version are supported
+CpuKernel getKernelForChain(const std::vector<PointwiseKernel>& pointwiseKernels);
+
+// Splits the rows across threads and processes them with 4-wide SIMD, one pixel per vector.
+// Sampling matches the VK_FILTER_LINEAR / CLAMP_TO_EDGE input sampler (VK_FILTER_NEAREST for draft quality),
+// and stores round like UNORM.
+void process(CpuKernel kernel,
+             ImageInfo imageInfo,
+             UniformBufferObject uniformBufferObject,
+             const void* inputPixels,
+             void* outputPixels);
+
+}
+
+#endif /* CpuKernels_hpp */
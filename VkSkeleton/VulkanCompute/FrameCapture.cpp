@@ -0,0 +1,348 @@
+//
+//  FrameCapture.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/11/21.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__APPLE__) || defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FRAME_CAPTURE_USE_MMAP 1
+#endif
+
+#include "FrameCapture.hpp"
+
+using namespace FrameCaptureFormat;
+
+static uint64_t alignUp(uint64_t size)
+{
+    return (size + alignment - 1) & ~static_cast<uint64_t>(alignment - 1);
+}
+
+// MARK: - Writer
+
+FrameCaptureWriter::~FrameCaptureWriter()
+{
+    close();
+}
+
+void FrameCaptureWriter::open(const std::string& path, uint32_t sampleInterval)
+{
+    close();
+
+    if (path.empty())
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(fileMutex);
+
+    file = fopen(path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        throw std::runtime_error("Could not create capture file " + path);
+    }
+
+    FrameCaptureFileHeader fileHeader{};
+    memcpy(fileHeader.magic, fileMagic, sizeof(fileMagic));
+    fileHeader.version = version;
+    fileHeader.recordHeaderSize = sizeof(FrameCaptureRecordHeader);
+
+    if (fwrite(&fileHeader, sizeof(fileHeader), 1, file) != 1)
+    {
+        fclose(file);
+        file = nullptr;
+        throw std::runtime_error("Could not write capture file " + path);
+    }
+
+    this->sampleInterval = sampleInterval;
+    renderCount = 0;
+    capturedFrameCount = 0;
+    isOpen = true;
+}
+
+void FrameCaptureWriter::close()
+{
+    isOpen = false;
+
+    std::lock_guard<std::mutex> lock(fileMutex);
+
+    if (file != nullptr)
+    {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+void FrameCaptureWriter::requestCapture(uint32_t frameCount)
+{
+    requestedFrameCount.fetch_add(frameCount, std::memory_order_relaxed);
+}
+
+bool FrameCaptureWriter::shouldCapture()
+{
+    if (!isOpen.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+
+    // Requested frames go first, one per render until they run out
+    auto requested = requestedFrameCount.load(std::memory_order_relaxed);
+    while (requested > 0)
+    {
+        if (requestedFrameCount.compare_exchange_weak(requested, requested - 1, std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+
+    auto interval = sampleInterval.load(std::memory_order_relaxed);
+    auto count = renderCount.fetch_add(1, std::memory_order_relaxed);
+
+    return interval > 0 && count % interval == 0;
+}
+
+CapturedFrame FrameCaptureWriter::capture(const std::string& kernelId,
+                                          ImageInfo imageInfo,
+                                          UniformBufferObject uniformBufferObject,
+                                          ParameterBlock parameterBlock,
+                                          const void* pixels)
+{
+    CapturedFrame frame{};
+    auto& header = frame.header;
+
+    header.magic = recordMagic;
+    header.pixelFormat = static_cast<uint32_t>(imageInfo.pixelFormat);
+    header.width = imageInfo.width;
+    header.height = imageInfo.height;
+    header.captureTimeNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+
+    header.parameterBlockOffset = sizeof(FrameCaptureRecordHeader);
+    header.parameterBlockSize = parameterBlock.data != nullptr ? parameterBlock.size : 0;
+    header.pixelsOffset = header.parameterBlockOffset + alignUp(header.parameterBlockSize);
+    header.pixelsSize = imageInfo.size();
+    header.recordSize = header.pixelsOffset + alignUp(header.pixelsSize);
+
+    header.uniformsSize = sizeof(UniformBufferObject);
+    memcpy(header.uniforms, &uniformBufferObject, sizeof(UniformBufferObject));
+
+    // Always leaves a terminating zero
+    strncpy(header.kernelId, kernelId.c_str(), kernelIdSize - 1);
+
+    auto parameterBytes = static_cast<const char*>(parameterBlock.data);
+    frame.parameterBlock.assign(parameterBytes, parameterBytes + header.parameterBlockSize);
+
+    auto pixelBytes = static_cast<const char*>(pixels);
+    frame.pixels.assign(pixelBytes, pixelBytes + header.pixelsSize);
+
+    return frame;
+}
+
+void FrameCaptureWriter::write(const CapturedFrame& frame)
+{
+    static const char padding[alignment] = {};
+
+    std::lock_guard<std::mutex> lock(fileMutex);
+
+    if (file == nullptr)
+    {
+        return;
+    }
+
+    const auto& header = frame.header;
+    auto parameterPadding = alignUp(header.parameterBlockSize) - header.parameterBlockSize;
+    auto pixelPadding = alignUp(header.pixelsSize) - header.pixelsSize;
+
+    bool isWritten = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(frame.parameterBlock.data(), 1, frame.parameterBlock.size(), file) == frame.parameterBlock.size()
+        && fwrite(padding, 1, parameterPadding, file) == parameterPadding
+        && fwrite(frame.pixels.data(), 1, frame.pixels.size(), file) == frame.pixels.size()
+        && fwrite(padding, 1, pixelPadding, file) == pixelPadding
+        && fflush(file) == 0;
+
+    if (!isWritten)
+    {
+        // The reader drops a truncated last record, so the file stays usable up to here
+        isOpen = false;
+        fclose(file);
+        file = nullptr;
+        return;
+    }
+
+    capturedFrameCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t FrameCaptureWriter::getCapturedFrameCount() const
+{
+    return capturedFrameCount.load(std::memory_order_relaxed);
+}
+
+// MARK: - Reader
+
+FrameCaptureReader::FrameCaptureReader(const std::string& path)
+{
+#ifdef FRAME_CAPTURE_USE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Could not open capture file " + path);
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("Capture file " + path + " is empty");
+    }
+
+    mappedSize = static_cast<size_t>(fileStat.st_size);
+    mappedData = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (mappedData == MAP_FAILED)
+    {
+        mappedData = nullptr;
+        throw std::runtime_error("Could not map capture file " + path);
+    }
+
+    try
+    {
+        parse(static_cast<const char*>(mappedData), mappedSize);
+    }
+    catch (...)
+    {
+        munmap(mappedData, mappedSize);
+        throw;
+    }
+#else
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream.is_open())
+    {
+        throw std::runtime_error("Could not open capture file " + path);
+    }
+
+    fileContents.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    parse(fileContents.data(), fileContents.size());
+#endif
+}
+
+FrameCaptureReader::~FrameCaptureReader()
+{
+#ifdef FRAME_CAPTURE_USE_MMAP
+    if (mappedData != nullptr)
+    {
+        munmap(mappedData, mappedSize);
+    }
+#endif
+}
+
+// Checks a record against the bytes left in the file before anything points into it. Each offset and
+// size is compared on its own against what's left, so a corrupt file can't wrap a sum around, and a
+// record can't be shorter than its header, so the reader always moves on.
+static bool isValidRecord(const FrameCaptureRecordHeader& header, size_t bytesLeft)
+{
+    if (header.magic != recordMagic
+        || header.recordSize < sizeof(FrameCaptureRecordHeader)
+        || header.recordSize % alignment != 0
+        || header.recordSize > bytesLeft)
+    {
+        return false;
+    }
+
+    if (header.parameterBlockOffset < sizeof(FrameCaptureRecordHeader)
+        || header.parameterBlockOffset > header.pixelsOffset
+        || header.parameterBlockSize > header.pixelsOffset - header.parameterBlockOffset
+        || header.pixelsOffset > header.recordSize
+        || header.pixelsSize > header.recordSize - header.pixelsOffset)
+    {
+        return false;
+    }
+
+    switch (header.pixelFormat)
+    {
+        case ARGB32:
+        case ARGB64:
+        case ARGB128:
+            break;
+        default:
+            return false;
+    }
+
+    // The width and height are 32 bits each, so only the pixel size needs dividing out to avoid overflow
+    return header.pixelsSize % header.pixelFormat == 0
+        && header.pixelsSize / header.pixelFormat == static_cast<uint64_t>(header.width) * header.height;
+}
+
+void FrameCaptureReader::parse(const char* data, size_t size)
+{
+    FrameCaptureFileHeader fileHeader;
+
+    if (size < sizeof(fileHeader))
+    {
+        throw std::runtime_error("Not a capture file");
+    }
+
+    memcpy(&fileHeader, data, sizeof(fileHeader));
+
+    if (memcmp(fileHeader.magic, fileMagic, sizeof(fileMagic)) != 0)
+    {
+        throw std::runtime_error("Not a capture file");
+    }
+
+    if (fileHeader.version != version || fileHeader.recordHeaderSize != sizeof(FrameCaptureRecordHeader))
+    {
+        throw std::runtime_error("Unsupported capture file version " + std::to_string(fileHeader.version));
+    }
+
+    size_t offset = sizeof(fileHeader);
+
+    while (offset + sizeof(FrameCaptureRecordHeader) <= size)
+    {
+        // Record headers sit on 64 byte boundaries in the mapping, so they can be read in place
+        auto header = reinterpret_cast<const FrameCaptureRecordHeader*>(data + offset);
+
+        // A truncated or corrupt record ends the file; the frames before it are still replayed
+        if (!isValidRecord(*header, size - offset))
+        {
+            break;
+        }
+
+        Frame frame {
+            .kernelId = std::string(header->kernelId, strnlen(header->kernelId, kernelIdSize)),
+            .imageInfo = {
+                .width = header->width,
+                .height = header->height,
+                .pixelFormat = static_cast<PixelFormat>(header->pixelFormat),
+            },
+            .uniformBufferObject = {},
+            .parameterBlock = {
+                .data = header->parameterBlockSize > 0 ? data + offset + header->parameterBlockOffset : nullptr,
+                .size = static_cast<size_t>(header->parameterBlockSize),
+            },
+            .pixels = data + offset + header->pixelsOffset,
+            .captureTimeNs = header->captureTimeNs,
+        };
+
+        memcpy(&frame.uniformBufferObject,
+               header->uniforms,
+               std::min<size_t>(header->uniformsSize, sizeof(UniformBufferObject)));
+
+        frames.push_back(frame);
+        offset += header->recordSize;
+    }
+}
+
+const std::vector<FrameCaptureReader::Frame>& FrameCaptureReader::getFrames() const
+{
+    return frames;
+}
@@ -0,0 +1,160 @@
+//
+//  FrameCapture.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/11/21.
+//
+//  Render inputs written to disk so a production frame can be replayed through
+//  VulkanComputeProgram anywhere, without AE or the original project.
+//
+//  File layout, little endian, every block starting on a 64 byte boundary so a
+//  mapped file can be handed to process() in place:
+//
+//      FrameCaptureFileHeader
+//      FrameCaptureRecordHeader, parameter block bytes, input pixels    (repeated)
+//
+
+#ifndef FrameCapture_hpp
+#define FrameCapture_hpp
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "VulkanComputeDataTypes.hpp"
+
+namespace FrameCaptureFormat
+{
+
+const char      fileMagic[8]    = { 'V', 'K', 'S', 'K', 'C', 'A', 'P', '\0' };
+const uint32_t  version         = 1;
+const uint32_t  recordMagic     = 0x52464b56; // "VKFR"
+const size_t    alignment       = 64;
+
+// Room for a shader file name or a chain of fused kernel names
+const size_t    kernelIdSize    = 64;
+
+// Every Vulkan device guarantees 128 bytes of push constants, so the UBO never outgrows this
+const size_t    uniformsSize    = 128;
+
+}
+
+struct FrameCaptureFileHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    recordHeaderSize;
+    uint8_t     reserved[48];
+};
+
+struct FrameCaptureRecordHeader {
+    uint32_t    magic;
+    uint32_t    pixelFormat;
+    uint32_t    width;
+    uint32_t    height;
+
+    // Offset from this header to the next one
+    uint64_t    recordSize;
+    uint64_t    captureTimeNs;
+
+    // Offsets are from the start of this header
+    uint64_t    parameterBlockOffset;
+    uint64_t    parameterBlockSize;
+    uint64_t    pixelsOffset;
+    uint64_t    pixelsSize;
+
+    uint32_t    uniformsSize;
+    uint8_t     reserved[60];
+
+    char        kernelId[FrameCaptureFormat::kernelIdSize];
+    uint8_t     uniforms[FrameCaptureFormat::uniformsSize];
+};
+
+static_assert(sizeof(FrameCaptureFileHeader) == FrameCaptureFormat::alignment, "File header must stay one block");
+static_assert(sizeof(FrameCaptureRecordHeader) % FrameCaptureFormat::alignment == 0, "Record header must stay block aligned");
+static_assert(sizeof(UniformBufferObject) <= FrameCaptureFormat::uniformsSize, "UniformBufferObject no longer fits a capture record");
+
+// One render's inputs, copied out of the mapped input buffer while the render holds its lock
+struct CapturedFrame {
+    FrameCaptureRecordHeader    header;
+    std::vector<char>           parameterBlock;
+    std::vector<char>           pixels;
+};
+
+// Appends sampled or requested renders to a capture file. Safe to call from every render thread.
+class FrameCaptureWriter
+{
+public:
+
+    ~FrameCaptureWriter();
+
+    // Starts a new capture file, capturing one render in every sampleInterval (0 for only requested
+    // renders). An empty path stops capturing. Throws if the file can't be created.
+    void open(const std::string& path, uint32_t sampleInterval);
+    void close();
+
+    // Captures the next frameCount renders regardless of the sample interval
+    void requestCapture(uint32_t frameCount);
+
+    // Called once per render; true if this render should be captured
+    bool shouldCapture();
+
+    CapturedFrame capture(const std::string& kernelId,
+                          ImageInfo imageInfo,
+                          UniformBufferObject uniformBufferObject,
+                          ParameterBlock parameterBlock,
+                          const void* pixels);
+
+    // Capturing stops for good after the first failed write, so a full disk costs one frame's worth of time
+    void write(const CapturedFrame& frame);
+
+    uint64_t getCapturedFrameCount() const;
+
+private:
+    std::mutex              fileMutex;
+    FILE*                   file                = nullptr;
+
+    std::atomic<bool>       isOpen{false};
+    std::atomic<uint32_t>   sampleInterval{0};
+    std::atomic<uint64_t>   renderCount{0};
+    std::atomic<uint32_t>   requestedFrameCount{0};
+    std::atomic<uint64_t>   capturedFrameCount{0};
+};
+
+// A capture file mapped into memory. Frames point straight into the mapping.
+class FrameCaptureReader
+{
+public:
+
+    struct Frame {
+        std::string             kernelId;
+        ImageInfo               imageInfo;
+        UniformBufferObject     uniformBufferObject;
+        ParameterBlock          parameterBlock;
+        const void*             pixels;
+        uint64_t                captureTimeNs;
+    };
+
+    // Throws if the file can't be mapped or isn't a capture file. A truncated last record is dropped.
+    explicit FrameCaptureReader(const std::string& path);
+    ~FrameCaptureReader();
+
+    FrameCaptureReader(const FrameCaptureReader&) = delete;
+    FrameCaptureReader& operator=(const FrameCaptureReader&) = delete;
+
+    const std::vector<Frame>& getFrames() const;
+
+private:
+    void*                   mappedData          = nullptr;
+    size_t                  mappedSize          = 0;
+
+    // Used instead of a mapping where mmap isn't available
+    std::vector<char>       fileContents;
+
+    std::vector<Frame>      frames;
+
+    void parse(const char* data, size_t size);
+};
+
+#endif /* FrameCapture_hpp */
@@ -0,0 +1,96 @@
+//
+//  GpuTimingStats.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/6/21.
+//
+
+#include <algorithm>
+
+#include "GpuTimingStats.hpp"
+
+// MARK: - Record
+
+void GpuTimingStats::record(ImageInfo imageInfo,
+                            std::array<double, GpuStageCount> stageMs,
+                            uint64_t shaderInvocations)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto& window = windows[{imageInfo.width, imageInfo.height, imageInfo.pixelFormat}];
+
+    for (size_t stage = 0; stage < GpuStageCount; ++stage)
+    {
+        window.samples[stage][window.nextIndex] = stageMs[stage];
+    }
+
+    window.nextIndex = (window.nextIndex + 1) % windowSize;
+    window.sampleCount += 1;
+    window.shaderInvocations = shaderInvocations;
+}
+
+// MARK: - Reports
+
+// Nearest-rank percentile of an already sorted list
+static double percentile(const std::vector<double>& sortedSamples, double p)
+{
+    auto rank = static_cast<size_t>(p * static_cast<double>(sortedSamples.size() - 1) + 0.5);
+    return sortedSamples[rank];
+}
+
+static GpuStageStats getStageStats(const std::array<double, GpuTimingStats::windowSize>& samples, size_t count, uint64_t totalCount)
+{
+    std::vector<double> sortedSamples(samples.begin(), samples.begin() + count);
+    std::sort(sortedSamples.begin(), sortedSamples.end());
+
+    double sum = 0.0;
+    for (auto sample : sortedSamples)
+    {
+        sum += sample;
+    }
+
+    return {
+        .sampleCount = totalCount,
+        .meanMs = sum / static_cast<double>(count),
+        .p50Ms = percentile(sortedSamples, 0.50),
+        .p90Ms = percentile(sortedSamples, 0.90),
+        .p99Ms = percentile(sortedSamples, 0.99),
+        .maxMs = sortedSamples.back(),
+    };
+}
+
+std::vector<GpuTimingReport> GpuTimingStats::getReports()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<GpuTimingReport> reports;
+    reports.reserve(windows.size());
+
+    for (const auto& [key, window] : windows)
+    {
+        auto count = static_cast<size_t>(std::min<uint64_t>(window.sampleCount, windowSize));
+
+        GpuTimingReport report {
+            .width = std::get<0>(key),
+            .height = std::get<1>(key),
+            .pixelFormat = std::get<2>(key),
+            .stages = {},
+            .shaderInvocations = window.shaderInvocations,
+        };
+
+        for (size_t stage = 0; stage < GpuStageCount; ++stage)
+        {
+            report.stages[stage] = getStageStats(window.samples[stage], count, window.sampleCount);
+        }
+
+        reports.push_back(report);
+    }
+
+    return reports;
+}
+
+void GpuTimingStats::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    windows.clear();
+}
@@ -0,0 +1,77 @@
+//
+//  GpuTimingStats.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/6/21.
+//
+
+#ifndef GpuTimingStats_hpp
+#define GpuTimingStats_hpp
+
+#include <array>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "VulkanComputeDataTypes.hpp"
+
+enum GpuStage : size_t {
+    Upload      = 0,    // input buffer -> input image
+    Dispatch    = 1,    // compute shader
+    Readback    = 2,    // output image -> output buffer
+    GpuStageCount,
+};
+
+struct GpuStageStats {
+    uint64_t    sampleCount;
+    double      meanMs;
+    double      p50Ms;
+    double      p90Ms;
+    double      p99Ms;
+    double      maxMs;
+};
+
+struct GpuTimingReport {
+    uint32_t        width;
+    uint32_t        height;
+    PixelFormat     pixelFormat;
+
+    std::array<GpuStageStats, GpuStageCount> stages;
+
+    // Compute shader invocations in the most recent frame, 0 if pipeline statistics are unsupported
+    uint64_t        shaderInvocations;
+};
+
+// Rolling GPU stage timings, bucketed by image size and pixel format.
+class GpuTimingStats
+{
+public:
+
+    // Number of most recent frames the percentiles are computed over, per bucket
+    static const size_t windowSize = 128;
+
+    void record(ImageInfo imageInfo,
+                std::array<double, GpuStageCount> stageMs,
+                uint64_t shaderInvocations);
+
+    std::vector<GpuTimingReport> getReports();
+
+    void reset();
+
+private:
+
+    struct Window {
+        std::array<std::array<double, windowSize>, GpuStageCount> samples;
+        size_t      nextIndex           = 0;
+        uint64_t    sampleCount         = 0;
+        uint64_t    shaderInvocations   = 0;
+    };
+
+    using Key = std::tuple<uint32_t, uint32_t, PixelFormat>;
+
+    std::mutex              mutex;
+    std::map<Key, Window>   windows;
+};
+
+#endif /* GpuTimingStats_hpp */
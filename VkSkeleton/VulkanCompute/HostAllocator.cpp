@@ -0,0 +1,350 @@
+//
+//  HostAllocator.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include "HostAllocator.hpp"
+
+const char* getHostAllocationScopeName(VkSystemAllocationScope scope)
+{
+    switch (scope)
+    {
+        case VK_SYSTEM_ALLOCATION_SCOPE_COMMAND:
+            return "command";
+        case VK_SYSTEM_ALLOCATION_SCOPE_OBJECT:
+            return "object";
+        case VK_SYSTEM_ALLOCATION_SCOPE_CACHE:
+            return "cache";
+        case VK_SYSTEM_ALLOCATION_SCOPE_DEVICE:
+            return "device";
+        case VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE:
+            return "instance";
+        default:
+            return "unknown";
+    }
+}
+
+// MARK: - Blocks
+
+// Just in front of every pointer handed to the driver, so a free knows where the block came from
+struct BlockHeader {
+    uint64_t    size;           // what the driver asked for
+    uint32_t    offset;         // from the start of the block to the pointer
+    uint8_t     sizeClass;      // or largeSizeClass for the system heap
+    uint8_t     scope;
+};
+
+const size_t headerSize = 16;
+const uint8_t largeSizeClass = 0xff;
+
+static_assert(sizeof(BlockHeader) <= headerSize, "BlockHeader has to fit in front of a 16-byte aligned pointer");
+
+static BlockHeader* getHeader(void* memory)
+{
+    return reinterpret_cast<BlockHeader*>(static_cast<char*>(memory) - headerSize);
+}
+
+static size_t getBlockSize(size_t sizeClass)
+{
+    return HostAllocator::smallestBlockSize << sizeClass;
+}
+
+// MARK: - Set Up
+
+HostAllocator::HostAllocator()
+: callbacks {
+    .pUserData = this,
+    .pfnAllocation = allocationFunction,
+    .pfnReallocation = reallocationFunction,
+    .pfnFree = freeFunction,
+    .pfnInternalAllocation = internalAllocationNotification,
+    .pfnInternalFree = internalFreeNotification,
+}
+{
+}
+
+HostAllocator::~HostAllocator()
+{
+    for (auto chunk : chunks)
+    {
+        ::operator delete(chunk, std::align_val_t(chunkSize));
+    }
+}
+
+void HostAllocator::setLimit(uint64_t limitBytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    this->limitBytes = limitBytes;
+}
+
+// MARK: - Allocation
+
+void* HostAllocator::allocate(size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (limitBytes != 0 && liveBytes + size > limitBytes)
+    {
+        failedAllocations += 1;
+        return nullptr;
+    }
+
+    // The header goes in the first alignment bytes of the block. Blocks are aligned to their own size, which
+    // is at least offset + size, so the pointer that far in is aligned as asked.
+    auto offset = std::max(alignment, headerSize);
+    auto blockBytes = offset + size;
+
+    char* block = nullptr;
+    uint8_t sizeClass = largeSizeClass;
+
+    if (blockBytes <= largestBlockSize)
+    {
+        sizeClass = 0;
+        while (getBlockSize(sizeClass) < blockBytes)
+        {
+            ++sizeClass;
+        }
+
+        block = static_cast<char*>(takeBlock(sizeClass));
+    }
+    else
+    {
+        block = static_cast<char*>(::operator new(blockBytes, std::align_val_t(offset), std::nothrow));
+    }
+
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+
+    auto memory = block + offset;
+    *getHeader(memory) = {
+        .size = size,
+        .offset = static_cast<uint32_t>(offset),
+        .sizeClass = sizeClass,
+        .scope = static_cast<uint8_t>(scope),
+    };
+
+    recordAllocation(scope, size);
+
+    return memory;
+}
+
+void* HostAllocator::reallocate(void* original, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    if (original == nullptr)
+    {
+        return allocate(size, alignment, scope);
+    }
+
+    if (size == 0)
+    {
+        free(original);
+        return nullptr;
+    }
+
+    auto header = getHeader(original);
+    auto originalSize = header->size;
+
+    // Grown or shrunk in place while it still fits its block, which is most reallocations of small arrays
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        bool fitsInBlock = header->sizeClass != largeSizeClass
+            && alignment <= header->offset
+            && header->offset + size <= getBlockSize(header->sizeClass);
+
+        if (fitsInBlock && (limitBytes == 0 || liveBytes - originalSize + size <= limitBytes))
+        {
+            recordFree(static_cast<VkSystemAllocationScope>(header->scope), originalSize);
+            recordAllocation(scope, size);
+
+            header->size = size;
+            header->scope = static_cast<uint8_t>(scope);
+
+            return original;
+        }
+    }
+
+    // The original is left as it was if this fails
+    auto memory = allocate(size, alignment, scope);
+    if (memory != nullptr)
+    {
+        memcpy(memory, original, std::min<size_t>(size, originalSize));
+        free(original);
+    }
+
+    return memory;
+}
+
+void HostAllocator::free(void* memory)
+{
+    if (memory == nullptr)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto header = *getHeader(memory);
+    auto block = static_cast<char*>(memory) - header.offset;
+
+    recordFree(static_cast<VkSystemAllocationScope>(header.scope), header.size);
+
+    if (header.sizeClass == largeSizeClass)
+    {
+        ::operator delete(block, std::align_val_t(header.offset));
+        return;
+    }
+
+    *reinterpret_cast<void**>(block) = freeLists[header.sizeClass];
+    freeLists[header.sizeClass] = block;
+}
+
+// A free block of the size class, carving a new chunk into blocks of that size if there are none left.
+// Chunks are aligned to their size, so every block in one is aligned to its own.
+void* HostAllocator::takeBlock(size_t sizeClass)
+{
+    if (freeLists[sizeClass] == nullptr)
+    {
+        auto chunk = static_cast<char*>(::operator new(chunkSize, std::align_val_t(chunkSize), std::nothrow));
+        if (chunk == nullptr)
+        {
+            return nullptr;
+        }
+
+        // Called from inside the driver, where nothing may throw
+        try
+        {
+            chunks.push_back(chunk);
+        }
+        catch (const std::bad_alloc&)
+        {
+            ::operator delete(chunk, std::align_val_t(chunkSize));
+            return nullptr;
+        }
+
+        // Back to front, so the blocks come out in address order
+        auto blockSize = getBlockSize(sizeClass);
+        for (size_t end = chunkSize; end >= blockSize; end -= blockSize)
+        {
+            void* block = chunk + end - blockSize;
+            *static_cast<void**>(block) = freeLists[sizeClass];
+            freeLists[sizeClass] = block;
+        }
+    }
+
+    auto block = freeLists[sizeClass];
+    freeLists[sizeClass] = *static_cast<void**>(block);
+
+    return block;
+}
+
+// MARK: - Statistics
+
+void HostAllocator::recordAllocation(VkSystemAllocationScope scope, uint64_t bytes)
+{
+    auto& stats = scopes[scope];
+    stats.allocations += 1;
+    stats.liveAllocations += 1;
+    stats.liveBytes += bytes;
+    stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+
+    liveBytes += bytes;
+}
+
+void HostAllocator::recordFree(VkSystemAllocationScope scope, uint64_t bytes)
+{
+    auto& stats = scopes[scope];
+    stats.liveAllocations -= 1;
+    stats.liveBytes -= bytes;
+
+    liveBytes -= bytes;
+}
+
+uint64_t HostAllocator::checkForLeaks(const std::string& owner)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    leakedAllocations = 0;
+    for (const auto& stats : scopes)
+    {
+        leakedAllocations += stats.liveAllocations;
+    }
+
+#ifndef NDEBUG
+    if (leakedAllocations > 0)
+    {
+        std::cerr << owner << " leaked " << leakedAllocations << " host allocations (" << liveBytes << " bytes)" << std::endl;
+    }
+#endif
+
+    return leakedAllocations;
+}
+
+HostAllocationSnapshot HostAllocator::getSnapshot()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return {
+        .scopes = scopes,
+        .arenaBytes = chunks.size() * chunkSize,
+        .limitBytes = limitBytes,
+        .failedAllocations = failedAllocations,
+        .leakedAllocations = leakedAllocations,
+    };
+}
+
+// MARK: - Callbacks
+
+void* VKAPI_PTR HostAllocator::allocationFunction(void* userData,
+                                                  size_t size,
+                                                  size_t alignment,
+                                                  VkSystemAllocationScope scope)
+{
+    return static_cast<HostAllocator*>(userData)->allocate(size, alignment, scope);
+}
+
+void* VKAPI_PTR HostAllocator::reallocationFunction(void* userData,
+                                                    void* original,
+                                                    size_t size,
+                                                    size_t alignment,
+                                                    VkSystemAllocationScope scope)
+{
+    return static_cast<HostAllocator*>(userData)->reallocate(original, size, alignment, scope);
+}
+
+void VKAPI_PTR HostAllocator::freeFunction(void* userData, void* memory)
+{
+    static_cast<HostAllocator*>(userData)->free(memory);
+}
+
+void VKAPI_PTR HostAllocator::internalAllocationNotification(void* userData,
+                                                             size_t size,
+                                                             VkInternalAllocationType /* type */,
+                                                             VkSystemAllocationScope scope)
+{
+    auto allocator = static_cast<HostAllocator*>(userData);
+
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    allocator->scopes[scope].internalBytes += size;
+}
+
+void VKAPI_PTR HostAllocator::internalFreeNotification(void* userData,
+                                                       size_t size,
+                                                       VkInternalAllocationType /* type */,
+                                                       VkSystemAllocationScope scope)
+{
+    auto allocator = static_cast<HostAllocator*>(userData);
+
+    std::lock_guard<std::mutex> lock(allocator->mutex);
+    allocator->scopes[scope].internalBytes -= size;
+}
@@ -0,0 +1,103 @@
+//
+//  HostAllocator.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#ifndef HostAllocator_hpp
+#define HostAllocator_hpp
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// One per VkSystemAllocationScope: COMMAND is what command recording allocates, OBJECT what lives as long as
+// a created object, and CACHE, DEVICE and INSTANCE what lives as long as those
+const size_t HostAllocationScopeCount = VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+
+const char* getHostAllocationScopeName(VkSystemAllocationScope scope);
+
+struct HostAllocationScopeStats {
+    uint64_t    allocations;        // allocation and reallocation calls, so this counts churn
+    uint64_t    liveAllocations;
+    uint64_t    liveBytes;
+    uint64_t    peakBytes;
+    uint64_t    internalBytes;      // the driver's own executable memory, which it only reports
+};
+
+struct HostAllocationSnapshot {
+    std::array<HostAllocationScopeStats, HostAllocationScopeCount> scopes;
+    uint64_t    arenaBytes;         // chunks the pools carve their blocks from, never given back
+    uint64_t    limitBytes;         // 0 for no limit
+    uint64_t    failedAllocations;  // refused because of the limit
+    uint64_t    leakedAllocations;  // still live at the last leak check
+};
+
+// The host memory the driver allocates for the objects created with getCallbacks(), instead of the
+// system heap, so it can be counted and capped.
+//
+// Allocations up to largestBlockSize come out of per-size free lists carved from chunkSize chunks, which
+// are kept once made, so recreating the same objects (a resize, re-recording a command buffer) reuses the
+// same blocks. Anything larger goes straight to the system heap. Safe to call from any thread.
+class HostAllocator
+{
+public:
+    static constexpr size_t smallestBlockSize   = 64;
+    static constexpr size_t largestBlockSize    = 4096;
+    static constexpr size_t chunkSize           = 64 * 1024;
+
+    HostAllocator();
+    ~HostAllocator();
+
+    HostAllocator(const HostAllocator&) = delete;
+    HostAllocator& operator=(const HostAllocator&) = delete;
+
+    // For every vkCreate, vkAllocate, vkDestroy and vkFree of the objects this allocator owns. An object has
+    // to be destroyed with the allocator it was created with, and before the allocator is.
+    const VkAllocationCallbacks* getCallbacks() const { return &callbacks; }
+
+    // Allocations that would take the live bytes over limitBytes fail, so the vkCreate* that asked for them
+    // returns VK_ERROR_OUT_OF_HOST_MEMORY. 0 for no limit.
+    void setLimit(uint64_t limitBytes);
+
+    // Once everything made with the callbacks has been destroyed: returns how many allocations are still
+    // live, and names owner on stderr in debug builds if there are any.
+    uint64_t checkForLeaks(const std::string& owner);
+
+    HostAllocationSnapshot getSnapshot();
+
+private:
+    static constexpr size_t sizeClassCount = 7;     // 64 through 4096 bytes
+
+    std::mutex                                  mutex;
+
+    VkAllocationCallbacks                       callbacks;
+    std::array<void*, sizeClassCount>           freeLists{};
+    std::vector<void*>                          chunks;
+
+    std::array<HostAllocationScopeStats, HostAllocationScopeCount> scopes{};
+    uint64_t                                    liveBytes           = 0;
+    uint64_t                                    limitBytes          = 0;
+    uint64_t                                    failedAllocations   = 0;
+    uint64_t                                    leakedAllocations   = 0;
+
+    void* allocate(size_t size, size_t alignment, VkSystemAllocationScope scope);
+    void* reallocate(void* original, size_t size, size_t alignment, VkSystemAllocationScope scope);
+    void free(void* memory);
+
+    void* takeBlock(size_t sizeClass);
+    void recordAllocation(VkSystemAllocationScope scope, uint64_t bytes);
+    void recordFree(VkSystemAllocationScope scope, uint64_t bytes);
+
+    static void* VKAPI_PTR allocationFunction(void* userData, size_t size, size_t alignment, VkSystemAllocationScope scope);
+    static void* VKAPI_PTR reallocationFunction(void* userData, void* original, size_t size, size_t alignment, VkSystemAllocationScope scope);
+    static void VKAPI_PTR freeFunction(void* userData, void* memory);
+    static void VKAPI_PTR internalAllocationNotification(void* userData, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+    static void VKAPI_PTR internalFreeNotification(void* userData, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+};
+
+#endif /* HostAllocator_hpp */
@@ -0,0 +1,113 @@
+//
+//  KernelFusion.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/4/21.
+//
+
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include "KernelFusion.hpp"
+
+#include "ShaderCompilerUtils.hpp"
+
+// MARK: - Built-in Pointwise Kernels
+
+const PointwiseKernel PointwiseKernels::invert {
+    .name = "invert",
+    .functionBody = R"(
+    vec4 pivot = vec4(0.0, vec3(ubo.pivot));
+    return abs(pivot - color);
+)",
+};
+
+// MARK: - Shader Generation
+
+// The descriptor layout is reflected from the compiled SPIR-V like any other kernel's, but the Uniforms
+// struct must still match the UniformBufferObject struct in VulkanComputeDataTypes.hpp. Each layer's is
+// read from LayerUniforms into ubo before the kernels run, so their bodies don't need to know about layers.
+const char* fusedShaderHeader = R"(#version 450
+
+layout (set = 0, binding = 0) uniform sampler2DArray inputSampler;
+
+layout (set = 0, binding = 1) writeonly uniform image2DArray outputImage;
+
+struct Uniforms {
+    float pivot;
+    float downsampleX;
+    float downsampleY;
+    uint isDraftQuality;
+};
+
+layout (std430, set = 0, binding = 2) readonly buffer LayerUniforms {
+    Uniforms layers[];
+} layerUniforms;
+
+Uniforms ubo;
+)";
+
+std::string KernelFusion::generateFusedShaderSource(const std::vector<PointwiseKernel>& kernels)
+{
+    std::ostringstream source;
+
+    source << fusedShaderHeader;
+
+    // Each kernel becomes its own function so that local variable names can't collide.
+    for (size_t i = 0; i < kernels.size(); ++i)
+    {
+        source << "\n// " << kernels[i].name << "\n";
+        source << "vec4 kernel" << i << "(vec4 color)\n{" << kernels[i].functionBody << "}\n";
+    }
+
+    source << "\nvoid main()\n{\n";
+    source << "    ivec3 xyz = ivec3(gl_GlobalInvocationID);\n";
+    source << "    ubo = layerUniforms.layers[xyz.z];\n";
+    source << "    vec4 color = texelFetch(inputSampler, xyz, 0);\n";
+
+    for (size_t i = 0; i < kernels.size(); ++i)
+    {
+        source << "    color = kernel" << i << "(color);\n";
+    }
+
+    source << "    imageStore(outputImage, xyz, color);\n";
+    source << "}\n";
+
+    return source.str();
+}
+
+// MARK: - Shader Cache
+
+static std::mutex                                   fusedShaderCacheMutex;
+static std::map<std::string, std::vector<char>>     fusedShaderCache;
+
+std::vector<char> KernelFusion::getFusedShaderCode(const std::vector<PointwiseKernel>& kernels)
+{
+    if (kernels.empty())
+    {
+        throw std::runtime_error("Cannot fuse an empty kernel chain!");
+    }
+
+    auto source = generateFusedShaderSource(kernels);
+
+    // Keyed by the generated source, so two kernels that share a name but not a body never collide.
+    std::lock_guard<std::mutex> lock(fusedShaderCacheMutex);
+
+    auto cached = fusedShaderCache.find(source);
+    if (cached != fusedShaderCache.end())
+    {
+        return cached->second;
+    }
+
+    std::string sourceName = "fused";
+    for (const auto& kernel : kernels)
+    {
+        sourceName += "_" + kernel.name;
+    }
+
+    auto code = ShaderCompilerUtils::compileComputeShader(source, sourceName + ".comp");
+    fusedShaderCache.emplace(source, code);
+
+    return code;
+}
@@ -0,0 +1,36 @@
+//
+//  KernelFusion.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/4/21.
+//
+
+#ifndef KernelFusion_hpp
+#define KernelFusion_hpp
+
+#include <string>
+#include <vector>
+
+#include "VulkanComputeDataTypes.hpp"
+
+namespace PointwiseKernels
+{
+
+// Same math as shaders/simple.comp. That samples texel centers, so the fused shader's texelFetch reads the same color.
+extern const PointwiseKernel invert;
+
+}
+
+namespace KernelFusion
+{
+
+// GLSL source of a single compute shader that applies every kernel in the chain, in order,
+// with one texel read and one image store per pixel.
+std::string generateFusedShaderSource(const std::vector<PointwiseKernel>& kernels);
+
+// SPIR-V for the fused chain. Compiled on first use and cached for the lifetime of the process.
+std::vector<char> getFusedShaderCode(const std::vector<PointwiseKernel>& kernels);
+
+}
+
+#endif /* KernelFusion_hpp */
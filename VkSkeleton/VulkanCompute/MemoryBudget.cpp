@@ -0,0 +1,318 @@
+//
+//  MemoryBudget.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#include <algorithm>
+
+#include "MemoryBudget.hpp"
+
+#include "TraceUtils.hpp"
+
+const char* getMemoryCategoryName(MemoryCategory category)
+{
+    switch (category)
+    {
+        case FrameImageMemory:
+            return "frameImages";
+        case StagingBufferMemory:
+            return "stagingBuffers";
+        case ParameterBufferMemory:
+            return "parameterBuffers";
+        default:
+            return "unknown";
+    }
+}
+
+// MARK: - Set Up
+
+// The heap the first memory type with the category's property flags lives in, which is the one
+// VulkanUtils' allocate functions end up picking for it
+static uint32_t findHeapIndex(const VkPhysicalDeviceMemoryProperties& memoryProperties, VkMemoryPropertyFlags propertyFlags)
+{
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i)
+    {
+        if ((memoryProperties.memoryTypes[i].propertyFlags & propertyFlags) == propertyFlags)
+        {
+            return memoryProperties.memoryTypes[i].heapIndex;
+        }
+    }
+
+    return 0;
+}
+
+void MemoryBudget::initialize(VkInstance instance, VkPhysicalDevice physicalDevice, bool isBudgetExtensionEnabled)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    this->physicalDevice = physicalDevice;
+
+    // The instance is 1.0 with VK_KHR_get_physical_device_properties2, so this comes through the loader
+    if (isBudgetExtensionEnabled)
+    {
+        getMemoryProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceMemoryProperties2KHR>(
+            vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceMemoryProperties2KHR"));
+    }
+
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    heaps.clear();
+    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; ++i)
+    {
+        heaps.push_back({
+            .size = memoryProperties.memoryHeaps[i].size,
+            .budget = static_cast<uint64_t>(estimatedBudgetFraction * static_cast<double>(memoryProperties.memoryHeaps[i].size)),
+            .usage = 0,
+            .isDeviceLocal = (memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0,
+        });
+    }
+
+    auto hostVisibleFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    categoryHeapIndices[FrameImageMemory] = findHeapIndex(memoryProperties, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    categoryHeapIndices[StagingBufferMemory] = findHeapIndex(memoryProperties, hostVisibleFlags);
+    categoryHeapIndices[ParameterBufferMemory] = findHeapIndex(memoryProperties, hostVisibleFlags);
+
+    sample();
+}
+
+// MARK: - Caches
+
+MemoryBudget::CacheId MemoryBudget::registerCache(const std::string& name, std::function<bool()> evict)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    auto cacheId = nextCacheId++;
+    caches[cacheId] = {
+        .name = name,
+        .evict = evict,
+        .lastUseTick = ++tick,
+    };
+
+    return cacheId;
+}
+
+void MemoryBudget::unregisterCache(CacheId cacheId)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    caches.erase(cacheId);
+}
+
+void MemoryBudget::setUsage(CacheId cacheId, MemoryCategory category, uint64_t bytes)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    auto cache = caches.find(cacheId);
+    if (cache != caches.end())
+    {
+        cache->second.usage[category] = bytes;
+    }
+}
+
+void MemoryBudget::touch(CacheId cacheId)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    auto cache = caches.find(cacheId);
+    if (cache != caches.end())
+    {
+        cache->second.lastUseTick = ++tick;
+    }
+
+    sample();
+}
+
+// MARK: - Budget
+
+void MemoryBudget::sample()
+{
+    if (physicalDevice == VK_NULL_HANDLE)
+    {
+        return;
+    }
+
+    if (getMemoryProperties2 != nullptr)
+    {
+        VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
+            .pNext = nullptr,
+            .heapBudget = {},
+            .heapUsage = {},
+        };
+
+        VkPhysicalDeviceMemoryProperties2KHR memoryProperties {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+            .pNext = &budgetProperties,
+            .memoryProperties = {},
+        };
+
+        getMemoryProperties2(physicalDevice, &memoryProperties);
+
+        for (uint32_t i = 0; i < heaps.size(); ++i)
+        {
+            heaps[i].budget = budgetProperties.heapBudget[i];
+            heaps[i].usage = budgetProperties.heapUsage[i];
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i < heaps.size(); ++i)
+        {
+            heaps[i].usage = getTrackedUsage(i);
+        }
+    }
+}
+
+uint64_t MemoryBudget::getTrackedUsage(uint32_t heapIndex) const
+{
+    uint64_t total = 0;
+
+    for (const auto& [cacheId, cache] : caches)
+    {
+        for (size_t category = 0; category < MemoryCategoryCount; ++category)
+        {
+            if (categoryHeapIndices[category] == heapIndex)
+            {
+                total += cache.usage[category];
+            }
+        }
+    }
+
+    return total;
+}
+
+uint64_t MemoryBudget::getHeapUsage(uint32_t heapIndex) const
+{
+    // The driver's numbers only move when it's sampled again, ours move with every setUsage
+    return getMemoryProperties2 != nullptr ? heaps[heapIndex].usage : getTrackedUsage(heapIndex);
+}
+
+bool MemoryBudget::reserve(CacheId requester, MemoryCategory category, uint64_t bytes)
+{
+    TRACE_ZONE("MemoryBudget::reserve");
+
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    if (heaps.empty())
+    {
+        return true;
+    }
+
+    sample();
+
+    auto heapIndex = categoryHeapIndices[category];
+    auto fits = [&]() { return getHeapUsage(heapIndex) + bytes <= heaps[heapIndex].budget; };
+
+    // Each cache is asked at most once, whether it was busy or what it kept wasn't enough
+    std::set<CacheId> triedCacheIds { requester };
+
+    while (!fits())
+    {
+        if (!evictLeastRecentlyUsed(heapIndex, triedCacheIds))
+        {
+            overBudgetReservations += 1;
+            return false;
+        }
+
+        sample();
+    }
+
+    return true;
+}
+
+// Evicts the least recently used cache that holds memory in the heap, hasn't been tried yet and isn't busy.
+// Returns false if there's none left to evict.
+bool MemoryBudget::evictLeastRecentlyUsed(uint32_t heapIndex, std::set<CacheId>& triedCacheIds)
+{
+    std::vector<std::pair<uint64_t, CacheId>> candidates;
+
+    for (const auto& [cacheId, cache] : caches)
+    {
+        bool holdsMemoryInHeap = false;
+        for (size_t category = 0; category < MemoryCategoryCount; ++category)
+        {
+            holdsMemoryInHeap = holdsMemoryInHeap || (categoryHeapIndices[category] == heapIndex && cache.usage[category] > 0);
+        }
+
+        if (triedCacheIds.count(cacheId) == 0 && holdsMemoryInHeap)
+        {
+            candidates.push_back({ cache.lastUseTick, cacheId });
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end());
+
+    for (const auto& [lastUseTick, cacheId] : candidates)
+    {
+        triedCacheIds.insert(cacheId);
+
+        // Copied out, because the callback calls back into setUsage
+        auto evict = caches[cacheId].evict;
+        if (evict())
+        {
+            evictions += 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void MemoryBudget::evictAllExcept(CacheId requester)
+{
+    TRACE_ZONE("MemoryBudget::evictAllExcept");
+
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    std::vector<CacheId> cacheIds;
+    for (const auto& [cacheId, cache] : caches)
+    {
+        uint64_t cacheUsage = 0;
+        for (auto bytes : cache.usage)
+        {
+            cacheUsage += bytes;
+        }
+
+        if (cacheId != requester && cacheUsage > 0)
+        {
+            cacheIds.push_back(cacheId);
+        }
+    }
+
+    for (auto cacheId : cacheIds)
+    {
+        auto evict = caches[cacheId].evict;
+        if (evict())
+        {
+            evictions += 1;
+        }
+    }
+
+    sample();
+}
+
+MemoryBudgetSnapshot MemoryBudget::getSnapshot()
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    MemoryBudgetSnapshot snapshot {
+        .heaps = heaps,
+        .categoryUsage = {},
+        .isDriverReported = getMemoryProperties2 != nullptr,
+        .evictions = evictions,
+        .overBudgetReservations = overBudgetReservations,
+    };
+
+    for (const auto& [cacheId, cache] : caches)
+    {
+        for (size_t category = 0; category < MemoryCategoryCount; ++category)
+        {
+            snapshot.categoryUsage[category] += cache.usage[category];
+        }
+    }
+
+    return snapshot;
+}
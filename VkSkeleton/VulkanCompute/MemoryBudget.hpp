@@ -0,0 +1,113 @@
+//
+//  MemoryBudget.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#ifndef MemoryBudget_hpp
+#define MemoryBudget_hpp
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// What the engine's device memory is for
+enum MemoryCategory : size_t {
+    FrameImageMemory        = 0,    // device-local input and output images
+    StagingBufferMemory     = 1,    // host-visible upload and readback buffers
+    ParameterBufferMemory   = 2,    // host-visible parameter blocks
+    MemoryCategoryCount,
+};
+
+const char* getMemoryCategoryName(MemoryCategory category);
+
+struct MemoryHeapBudget {
+    uint64_t    size;
+    uint64_t    budget;     // how much of the heap this process can use right now
+    uint64_t    usage;      // how much of it this process is using
+    bool        isDeviceLocal;
+};
+
+struct MemoryBudgetSnapshot {
+    std::vector<MemoryHeapBudget>                   heaps;
+    std::array<uint64_t, MemoryCategoryCount>       categoryUsage;
+    bool                                            isDriverReported;   // VK_EXT_memory_budget, not the estimate
+    uint64_t                                        evictions;
+    uint64_t                                        overBudgetReservations;
+};
+
+// The device memory every engine cache holds, checked against what the device has left.
+//
+// With VK_EXT_memory_budget the budget and usage of each heap come from the driver, so memory other
+// applications take on a shared workstation counts against us. Without it the budget is estimated as a
+// fixed fraction of each heap, and the usage is only what the registered caches report.
+//
+// Caches register an evict callback and report their usage per category. Before a cache allocates, it
+// reserves the size here, and the least recently used other caches are evicted until it fits.
+class MemoryBudget
+{
+public:
+    using CacheId = uint64_t;
+
+    // Fraction of a heap the estimate assumes is ours when the driver doesn't report a budget
+    static constexpr double estimatedBudgetFraction = 0.8;
+
+    void initialize(VkInstance instance, VkPhysicalDevice physicalDevice, bool isBudgetExtensionEnabled);
+
+    // evict releases what the cache can rebuild and reports its new usage, or returns false straight away if
+    // it's busy (it's rendering, so it isn't a candidate anyway). It may be called from any thread that
+    // reserves, and must not reserve itself.
+    CacheId registerCache(const std::string& name, std::function<bool()> evict);
+    void unregisterCache(CacheId cacheId);
+
+    void setUsage(CacheId cacheId, MemoryCategory category, uint64_t bytes);
+
+    // Marks the cache as used now, and samples the heap budgets. Called once per frame.
+    void touch(CacheId cacheId);
+
+    // Evicts least recently used caches other than the requester until bytes of category fits in its heap.
+    // Returns false if it still doesn't fit with every other cache evicted; the allocation can still be tried.
+    // The result is advisory: callers go ahead and allocate either way, and handle the allocation failing.
+    bool reserve(CacheId requester, MemoryCategory category, uint64_t bytes);
+
+    // Evicts every other cache that isn't busy, for a retry after an allocation failed anyway
+    void evictAllExcept(CacheId requester);
+
+    MemoryBudgetSnapshot getSnapshot();
+
+private:
+    struct Cache {
+        std::string                                 name;
+        std::function<bool()>                       evict;
+        std::array<uint64_t, MemoryCategoryCount>   usage{};
+        uint64_t                                    lastUseTick = 0;
+    };
+
+    // Recursive, so an evict callback can report its usage from inside reserve
+    std::recursive_mutex                            mutex;
+
+    VkPhysicalDevice                                physicalDevice  = VK_NULL_HANDLE;
+    PFN_vkGetPhysicalDeviceMemoryProperties2KHR     getMemoryProperties2 = nullptr;
+    std::vector<MemoryHeapBudget>                   heaps;
+    std::array<uint32_t, MemoryCategoryCount>       categoryHeapIndices{};
+
+    std::map<CacheId, Cache>                        caches;
+    CacheId                                         nextCacheId     = 1;
+    uint64_t                                        tick            = 0;
+    uint64_t                                        evictions       = 0;
+    uint64_t                                        overBudgetReservations = 0;
+
+    void sample();
+    uint64_t getTrackedUsage(uint32_t heapIndex) const;
+    uint64_t getHeapUsage(uint32_t heapIndex) const;
+    bool evictLeastRecentlyUsed(uint32_t heapIndex, std::set<CacheId>& triedCacheIds);
+};
+
+#endif /* MemoryBudget_hpp */
@@ -0,0 +1,307 @@
+//
+//  RenderMetrics.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/8/21.
+//
+
+#include <chrono>
+#include <fstream>
+
+#include "RenderMetrics.hpp"
+
+static uint64_t getWallClockMs()
+{
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+// MARK: - Latency Histogram
+
+void LatencyHistogram::record(double ms)
+{
+    auto ns = static_cast<uint64_t>(ms * 1e6);
+    auto us = ns / 1000;
+    
+    size_t bucket = 0;
+    while (us > 1 && bucket < bucketCount - 1)
+    {
+        us >>= 1;
+        ++bucket;
+    }
+    
+    bucketCounts[bucket].fetch_add(1, std::memory_order_relaxed);
+    sampleCount.fetch_add(1, std::memory_order_relaxed);
+    totalNs.fetch_add(ns, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::getSnapshot() const
+{
+    Snapshot snapshot {
+        .bucketCounts = {},
+        .sampleCount = sampleCount.load(std::memory_order_relaxed),
+        .totalMs = static_cast<double>(totalNs.load(std::memory_order_relaxed)) * 1e-6,
+    };
+    
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        snapshot.bucketCounts[i] = bucketCounts[i].load(std::memory_order_relaxed);
+    }
+    
+    return snapshot;
+}
+
+double LatencyHistogram::Snapshot::getPercentileMs(double p) const
+{
+    uint64_t total = 0;
+    for (auto count : bucketCounts)
+    {
+        total += count;
+    }
+    
+    if (total == 0)
+    {
+        return 0.0;
+    }
+    
+    auto rank = static_cast<uint64_t>(p * static_cast<double>(total - 1)) + 1;
+    
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        seen += bucketCounts[i];
+        if (seen >= rank)
+        {
+            return static_cast<double>(2ULL << i) * 1e-3;
+        }
+    }
+    
+    return static_cast<double>(2ULL << (bucketCount - 1)) * 1e-3;
+}
+
+// MARK: - Recording
+
+void RenderMetrics::recordFrame(ImageInfo imageInfo, double renderMs, double lockWaitMs, bool isInputResident)
+{
+    switch (imageInfo.pixelFormat)
+    {
+        case ARGB32:
+            framesRenderedARGB32.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case ARGB64:
+            framesRenderedARGB64.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case ARGB128:
+            framesRenderedARGB128.fetch_add(1, std::memory_order_relaxed);
+            break;
+    }
+    
+    if (isInputResident)
+    {
+        residentInputFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        bytesUploaded.fetch_add(imageInfo.size(), std::memory_order_relaxed);
+    }
+    
+    bytesReadBack.fetch_add(imageInfo.size(), std::memory_order_relaxed);
+    
+    renderLatency.record(renderMs);
+    lockWait.record(lockWaitMs);
+}
+
+void RenderMetrics::recordResourceRegeneration()
+{
+    resourceRegenerations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RenderMetrics::recordResourceCacheHit()
+{
+    resourceCacheHits.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RenderMetrics::recordResourceEviction()
+{
+    resourceEvictions.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RenderMetrics::recordCancellation()
+{
+    cancellations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RenderMetrics::recordBatch(uint64_t frameCount)
+{
+    batches.fetch_add(1, std::memory_order_relaxed);
+    batchedFrames.fetch_add(frameCount, std::memory_order_relaxed);
+}
+
+void RenderMetrics::recordSweep(uint64_t variantCount, uint64_t dispatchCount)
+{
+    sweeps.fetch_add(1, std::memory_order_relaxed);
+    sweepVariants.fetch_add(variantCount, std::memory_order_relaxed);
+    sweepDispatches.fetch_add(dispatchCount, std::memory_order_relaxed);
+}
+
+void RenderMetrics::recordPipelineCreation()
+{
+    pipelineCreations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RenderMetrics::recordCommandBufferRecording(uint64_t count)
+{
+    commandBufferRecordings.fetch_add(count, std::memory_order_relaxed);
+}
+
+void RenderMetrics::setDeviceMemoryInUse(uint64_t bytes)
+{
+    deviceMemoryInUse.store(bytes, std::memory_order_relaxed);
+}
+
+RenderMetricsSnapshot RenderMetrics::getSnapshot() const
+{
+    return {
+        .framesRenderedARGB32 = framesRenderedARGB32.load(std::memory_order_relaxed),
+        .framesRenderedARGB64 = framesRenderedARGB64.load(std::memory_order_relaxed),
+        .framesRenderedARGB128 = framesRenderedARGB128.load(std::memory_order_relaxed),
+        .bytesUploaded = bytesUploaded.load(std::memory_order_relaxed),
+        .bytesReadBack = bytesReadBack.load(std::memory_order_relaxed),
+        .residentInputFrames = residentInputFrames.load(std::memory_order_relaxed),
+        .batches = batches.load(std::memory_order_relaxed),
+        .batchedFrames = batchedFrames.load(std::memory_order_relaxed),
+        .sweeps = sweeps.load(std::memory_order_relaxed),
+        .sweepVariants = sweepVariants.load(std::memory_order_relaxed),
+        .sweepDispatches = sweepDispatches.load(std::memory_order_relaxed),
+        .resourceRegenerations = resourceRegenerations.load(std::memory_order_relaxed),
+        .resourceCacheHits = resourceCacheHits.load(std::memory_order_relaxed),
+        .resourceEvictions = resourceEvictions.load(std::memory_order_relaxed),
+        .cancellations = cancellations.load(std::memory_order_relaxed),
+        .pipelineCreations = pipelineCreations.load(std::memory_order_relaxed),
+        .commandBufferRecordings = commandBufferRecordings.load(std::memory_order_relaxed),
+        .deviceMemoryInUse = deviceMemoryInUse.load(std::memory_order_relaxed),
+        .renderLatency = renderLatency.getSnapshot(),
+        .lockWait = lockWait.getSnapshot(),
+    };
+}
+
+// MARK: - JSON Lines Log
+
+void RenderMetrics::setLogPath(const std::string& logPath)
+{
+    std::lock_guard<std::mutex> lock(logMutex);
+    this->logPath = logPath;
+}
+
+void RenderMetrics::appendToLogIfDue()
+{
+    auto now = getWallClockMs();
+    auto last = lastLogTimeMs.load(std::memory_order_relaxed);
+    
+    // Only the thread that wins the exchange writes, everyone else goes straight back to rendering.
+    if (now - last < logIntervalMs || !lastLogTimeMs.compare_exchange_strong(last, now, std::memory_order_relaxed))
+    {
+        return;
+    }
+    
+    appendToLog();
+}
+
+static void writeHistogram(std::ofstream& file, const char* name, const LatencyHistogram::Snapshot& histogram)
+{
+    file << ",\"" << name << "\":{\"count\":" << histogram.sampleCount
+         << ",\"totalMs\":" << histogram.totalMs
+         << ",\"p50Ms\":" << histogram.getPercentileMs(0.50)
+         << ",\"p90Ms\":" << histogram.getPercentileMs(0.90)
+         << ",\"p99Ms\":" << histogram.getPercentileMs(0.99)
+         << "}";
+}
+
+void RenderMetrics::appendToLog()
+{
+    std::lock_guard<std::mutex> lock(logMutex);
+    
+    if (logPath.empty())
+    {
+        return;
+    }
+    
+    // A farm node with a read-only plugin folder simply doesn't get a log
+    std::ofstream file(logPath, std::ios::app);
+    if (!file.is_open())
+    {
+        return;
+    }
+    
+    auto snapshot = getSnapshot();
+    
+    file << "{\"timeMs\":" << getWallClockMs()
+         << ",\"framesRendered\":{\"ARGB32\":" << snapshot.framesRenderedARGB32
+         << ",\"ARGB64\":" << snapshot.framesRenderedARGB64
+         << ",\"ARGB128\":" << snapshot.framesRenderedARGB128 << "}"
+         << ",\"bytesUploaded\":" << snapshot.bytesUploaded
+         << ",\"bytesReadBack\":" << snapshot.bytesReadBack
+         << ",\"residentInputFrames\":" << snapshot.residentInputFrames
+         << ",\"batches\":" << snapshot.batches
+         << ",\"batchedFrames\":" << snapshot.batchedFrames
+         << ",\"sweeps\":" << snapshot.sweeps
+         << ",\"sweepVariants\":" << snapshot.sweepVariants
+         << ",\"sweepDispatches\":" << snapshot.sweepDispatches
+         << ",\"resourceRegenerations\":" << snapshot.resourceRegenerations
+         << ",\"resourceCacheHits\":" << snapshot.resourceCacheHits
+         << ",\"resourceEvictions\":" << snapshot.resourceEvictions
+         << ",\"cancellations\":" << snapshot.cancellations
+         << ",\"pipelineCreations\":" << snapshot.pipelineCreations
+         << ",\"commandBufferRecordings\":" << snapshot.commandBufferRecordings
+         << ",\"deviceMemoryInUse\":" << snapshot.deviceMemoryInUse;
+    
+    writeHistogram(file, "renderLatency", snapshot.renderLatency);
+    writeHistogram(file, "lockWait", snapshot.lockWait);
+    
+    file << "}\n";
+}
+
+static void writePhaseTimings(std::ofstream& file, const char* name, const std::vector<SetUpPhaseTiming>& timings)
+{
+    double totalMs = 0.0;
+    
+    file << ",\"" << name << "\":{";
+    for (size_t i = 0; i < timings.size(); ++i)
+    {
+        file << (i == 0 ? "" : ",") << "\"" << timings[i].name << "\":" << timings[i].ms;
+        totalMs += timings[i].ms;
+    }
+    file << "},\"" << name << "TotalMs\":" << totalMs;
+}
+
+void RenderMetrics::appendSetUpToLog(const std::string& kernelId,
+                                     const std::vector<SetUpPhaseTiming>& timings,
+                                     const std::vector<SetUpPhaseTiming>* contextTimings,
+                                     bool succeeded)
+{
+    std::lock_guard<std::mutex> lock(logMutex);
+    
+    if (logPath.empty())
+    {
+        return;
+    }
+    
+    std::ofstream file(logPath, std::ios::app);
+    if (!file.is_open())
+    {
+        return;
+    }
+    
+    file << "{\"timeMs\":" << getWallClockMs()
+         << ",\"setUp\":\"" << kernelId << "\""
+         << ",\"succeeded\":" << (succeeded ? "true" : "false");
+    
+    writePhaseTimings(file, "phasesMs", timings);
+    
+    if (contextTimings != nullptr)
+    {
+        writePhaseTimings(file, "contextPhasesMs", *contextTimings);
+    }
+    
+    file << "}\n";
+}
@@ -0,0 +1,130 @@
+//
+//  RenderMetrics.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/8/21.
+//
+
+#ifndef RenderMetrics_hpp
+#define RenderMetrics_hpp
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "VulkanComputeDataTypes.hpp"
+
+// Log2-bucketed microsecond histogram. Bucket i counts samples in [2^i, 2^(i+1)) µs,
+// bucket 0 also takes everything under 1 µs and the last bucket everything above.
+class LatencyHistogram
+{
+public:
+    static const size_t bucketCount = 32;
+    
+    struct Snapshot {
+        std::array<uint64_t, bucketCount> bucketCounts;
+        uint64_t    sampleCount;
+        double      totalMs;
+        
+        // Upper bound of the bucket the percentile falls into
+        double getPercentileMs(double p) const;
+    };
+    
+    void record(double ms);
+    
+    Snapshot getSnapshot() const;
+    
+private:
+    std::array<std::atomic<uint64_t>, bucketCount>  bucketCounts{};
+    std::atomic<uint64_t>                           sampleCount{0};
+    std::atomic<uint64_t>                           totalNs{0};
+};
+
+struct RenderMetricsSnapshot {
+    uint64_t    framesRenderedARGB32;
+    uint64_t    framesRenderedARGB64;
+    uint64_t    framesRenderedARGB128;
+    uint64_t    bytesUploaded;
+    uint64_t    bytesReadBack;
+    uint64_t    residentInputFrames;    // started from the previous output still on the GPU, so nothing uploaded
+    uint64_t    batches;                // dispatches that rendered more than one frame, one per layer
+    uint64_t    batchedFrames;          // frames rendered in those
+    uint64_t    sweeps;                 // one input rendered once per variant
+    uint64_t    sweepVariants;
+    uint64_t    sweepDispatches;
+    uint64_t    resourceRegenerations;
+    uint64_t    resourceCacheHits;
+    uint64_t    resourceEvictions;
+    uint64_t    cancellations;
+    uint64_t    pipelineCreations;
+    uint64_t    commandBufferRecordings;
+    uint64_t    deviceMemoryInUse;
+    
+    LatencyHistogram::Snapshot renderLatency;
+    LatencyHistogram::Snapshot lockWait;
+};
+
+// Always-on render counters. Every update is a relaxed atomic, so recording never blocks a render thread.
+class RenderMetrics
+{
+public:
+    
+    // How often appendToLogIfDue actually writes a line
+    static const uint64_t logIntervalMs = 60000;
+    
+    void recordFrame(ImageInfo imageInfo, double renderMs, double lockWaitMs, bool isInputResident = false);
+    void recordResourceRegeneration();
+    void recordResourceCacheHit();
+    void recordResourceEviction();
+    void recordCancellation();
+    void recordBatch(uint64_t frameCount);
+    void recordSweep(uint64_t variantCount, uint64_t dispatchCount);
+    void recordPipelineCreation();
+    void recordCommandBufferRecording(uint64_t count);
+    void setDeviceMemoryInUse(uint64_t bytes);
+    
+    RenderMetricsSnapshot getSnapshot() const;
+    
+    // Appends the current snapshot as one JSON line. An empty path disables logging.
+    void setLogPath(const std::string& logPath);
+    void appendToLogIfDue();
+    void appendToLog();
+    
+    // Appends one line with how long each step of a program's setUp took, and of the shared context's
+    // creation if that happened during it (contextTimings, or nullptr)
+    void appendSetUpToLog(const std::string& kernelId,
+                          const std::vector<SetUpPhaseTiming>& timings,
+                          const std::vector<SetUpPhaseTiming>* contextTimings,
+                          bool succeeded);
+    
+private:
+    std::atomic<uint64_t>   framesRenderedARGB32{0};
+    std::atomic<uint64_t>   framesRenderedARGB64{0};
+    std::atomic<uint64_t>   framesRenderedARGB128{0};
+    std::atomic<uint64_t>   bytesUploaded{0};
+    std::atomic<uint64_t>   bytesReadBack{0};
+    std::atomic<uint64_t>   residentInputFrames{0};
+    std::atomic<uint64_t>   batches{0};
+    std::atomic<uint64_t>   batchedFrames{0};
+    std::atomic<uint64_t>   sweeps{0};
+    std::atomic<uint64_t>   sweepVariants{0};
+    std::atomic<uint64_t>   sweepDispatches{0};
+    std::atomic<uint64_t>   resourceRegenerations{0};
+    std::atomic<uint64_t>   resourceCacheHits{0};
+    std::atomic<uint64_t>   resourceEvictions{0};
+    std::atomic<uint64_t>   cancellations{0};
+    std::atomic<uint64_t>   pipelineCreations{0};
+    std::atomic<uint64_t>   commandBufferRecordings{0};
+    std::atomic<uint64_t>   deviceMemoryInUse{0};
+    
+    LatencyHistogram        renderLatency;
+    LatencyHistogram        lockWait;
+    
+    std::mutex              logMutex;
+    std::string             logPath;
+    std::atomic<uint64_t>   lastLogTimeMs{0};
+};
+
+#endif /* RenderMetrics_hpp */
@@ -0,0 +1,601 @@
+//
+//  ShaderReflection.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+
+#include "ShaderReflection.hpp"
+
+// MARK: - SPIR-V Constants
+
+// Only the handful of opcodes, decorations and enums the layout depends on. See the SPIR-V specification, section 3.
+static const uint32_t spirvMagicNumber = 0x07230203;
+static const size_t spirvHeaderWordCount = 5;
+
+enum SpirvOp : uint32_t {
+    OpName                  = 5,
+    OpMemberName            = 6,
+    OpExecutionMode         = 16,
+    OpTypeBool              = 20,
+    OpTypeInt               = 21,
+    OpTypeFloat             = 22,
+    OpTypeVector            = 23,
+    OpTypeMatrix            = 24,
+    OpTypeImage             = 25,
+    OpTypeSampler           = 26,
+    OpTypeSampledImage      = 27,
+    OpTypeArray             = 28,
+    OpTypeRuntimeArray      = 29,
+    OpTypeStruct            = 30,
+    OpTypePointer           = 32,
+    OpConstant              = 43,
+    OpSpecConstantTrue      = 48,
+    OpSpecConstantFalse     = 49,
+    OpSpecConstant          = 50,
+    OpVariable              = 59,
+    OpDecorate              = 71,
+    OpMemberDecorate        = 72,
+};
+
+enum SpirvDecoration : uint32_t {
+    SpecIdDecoration        = 1,
+    BlockDecoration         = 2,
+    BufferBlockDecoration   = 3,
+    ArrayStrideDecoration   = 6,
+    MatrixStrideDecoration  = 7,
+    BindingDecoration       = 33,
+    DescriptorSetDecoration = 34,
+    OffsetDecoration        = 35,
+};
+
+enum SpirvStorageClass : uint32_t {
+    UniformConstantStorage  = 0,
+    UniformStorage          = 2,
+    PushConstantStorage     = 9,
+    StorageBufferStorage    = 12,
+};
+
+static const uint32_t localSizeExecutionMode = 17;
+static const uint32_t bufferImageDim = 5;
+static const uint32_t storageImageSampled = 2;
+
+// MARK: - Module
+
+using namespace ShaderReflection;
+
+namespace
+{
+
+struct Instruction {
+    SpirvOp                 op;
+    std::vector<uint32_t>   operands;
+};
+
+struct Variable {
+    uint32_t            id;
+    uint32_t            pointerTypeId;
+    SpirvStorageClass   storageClass;
+};
+
+struct SpecConstant {
+    uint32_t            id;
+    uint32_t            typeId;
+    uint32_t            defaultValue;
+};
+
+using MemberKey = std::pair<uint32_t, uint32_t>;
+
+// The parts of a module that describe its interface, indexed by result id
+struct Module {
+    std::map<uint32_t, std::string>                     names;
+    std::map<MemberKey, std::string>                    memberNames;
+    std::map<uint32_t, std::map<uint32_t, uint32_t>>    decorations;
+    std::map<MemberKey, std::map<uint32_t, uint32_t>>   memberDecorations;
+    std::map<uint32_t, Instruction>                     types;
+    std::map<uint32_t, uint32_t>                        constants;
+    std::vector<Variable>                               variables;
+    std::vector<SpecConstant>                           specConstants;
+    std::array<uint32_t, 3>                             localSize   = { 1, 1, 1 };
+
+    const Instruction& getType(uint32_t typeId) const;
+    std::optional<uint32_t> getDecoration(uint32_t id, uint32_t decoration) const;
+    std::optional<uint32_t> getMemberDecoration(uint32_t structId, uint32_t member, uint32_t decoration) const;
+    uint32_t getArrayLength(const Instruction& arrayType) const;
+
+    uint32_t getTypeSize(uint32_t typeId, std::optional<uint32_t> matrixStride) const;
+    std::string getTypeName(uint32_t typeId) const;
+    BlockLayout getBlockLayout(uint32_t structId) const;
+};
+
+}
+
+// Literal strings are packed four bytes to a word, nul terminated
+static std::string decodeString(const std::vector<uint32_t>& operands, size_t firstWord)
+{
+    std::string string;
+
+    for (size_t i = firstWord; i < operands.size(); ++i)
+    {
+        for (size_t byte = 0; byte < 4; ++byte)
+        {
+            auto c = static_cast<char>((operands[i] >> (8 * byte)) & 0xFF);
+            if (c == '\0')
+            {
+                return string;
+            }
+            string += c;
+        }
+    }
+
+    return string;
+}
+
+static Module parseModule(const std::vector<char>& spirvCode)
+{
+    if (spirvCode.size() % 4 != 0 || spirvCode.size() < spirvHeaderWordCount * 4)
+    {
+        throw std::runtime_error("Shader code is not SPIR-V!");
+    }
+
+    std::vector<uint32_t> words(spirvCode.size() / 4);
+    memcpy(words.data(), spirvCode.data(), spirvCode.size());
+
+    if (words[0] != spirvMagicNumber)
+    {
+        throw std::runtime_error("Shader code is not SPIR-V!");
+    }
+
+    Module module;
+
+    for (size_t i = spirvHeaderWordCount; i < words.size(); )
+    {
+        auto wordCount = words[i] >> 16;
+        auto op = static_cast<SpirvOp>(words[i] & 0xFFFF);
+
+        if (wordCount == 0 || i + wordCount > words.size())
+        {
+            throw std::runtime_error("Malformed SPIR-V instruction!");
+        }
+
+        std::vector<uint32_t> operands(words.begin() + i + 1, words.begin() + i + wordCount);
+        i += wordCount;
+
+        switch (op)
+        {
+            case OpName:
+                module.names[operands[0]] = decodeString(operands, 1);
+                break;
+            case OpMemberName:
+                module.memberNames[{ operands[0], operands[1] }] = decodeString(operands, 2);
+                break;
+            case OpExecutionMode:
+                if (operands[1] == localSizeExecutionMode && operands.size() >= 5)
+                {
+                    module.localSize = { operands[2], operands[3], operands[4] };
+                }
+                break;
+            case OpDecorate:
+                module.decorations[operands[0]][operands[1]] = operands.size() > 2 ? operands[2] : 0;
+                break;
+            case OpMemberDecorate:
+                module.memberDecorations[{ operands[0], operands[1] }][operands[2]] = operands.size() > 3 ? operands[3] : 0;
+                break;
+            case OpTypeBool:
+            case OpTypeInt:
+            case OpTypeFloat:
+            case OpTypeVector:
+            case OpTypeMatrix:
+            case OpTypeImage:
+            case OpTypeSampler:
+            case OpTypeSampledImage:
+            case OpTypeArray:
+            case OpTypeRuntimeArray:
+            case OpTypeStruct:
+            case OpTypePointer:
+                // Drop the result id, leaving only the type's own operands
+                module.types[operands[0]] = { op, std::vector<uint32_t>(operands.begin() + 1, operands.end()) };
+                break;
+            case OpConstant:
+                // Only 32-bit integer constants matter here, as array lengths
+                module.constants[operands[1]] = operands.size() > 2 ? operands[2] : 0;
+                break;
+            case OpSpecConstant:
+            case OpSpecConstantTrue:
+            case OpSpecConstantFalse:
+            {
+                auto defaultValue = op == OpSpecConstant ? (operands.size() > 2 ? operands[2] : 0) : (op == OpSpecConstantTrue ? 1 : 0);
+                module.constants[operands[1]] = defaultValue;
+                module.specConstants.push_back({
+                    .id = operands[1],
+                    .typeId = operands[0],
+                    .defaultValue = defaultValue,
+                });
+                break;
+            }
+            case OpVariable:
+                module.variables.push_back({
+                    .id = operands[1],
+                    .pointerTypeId = operands[0],
+                    .storageClass = static_cast<SpirvStorageClass>(operands[2]),
+                });
+                break;
+            default:
+                break;
+        }
+    }
+
+    return module;
+}
+
+// MARK: - Types
+
+const Instruction& Module::getType(uint32_t typeId) const
+{
+    auto type = types.find(typeId);
+    if (type == types.end())
+    {
+        throw std::runtime_error("SPIR-V refers to an unknown type!");
+    }
+
+    return type->second;
+}
+
+std::optional<uint32_t> Module::getDecoration(uint32_t id, uint32_t decoration) const
+{
+    auto idDecorations = decorations.find(id);
+    if (idDecorations == decorations.end())
+    {
+        return std::nullopt;
+    }
+
+    auto value = idDecorations->second.find(decoration);
+    return value != idDecorations->second.end() ? std::optional<uint32_t>(value->second) : std::nullopt;
+}
+
+std::optional<uint32_t> Module::getMemberDecoration(uint32_t structId, uint32_t member, uint32_t decoration) const
+{
+    auto memberDecoration = memberDecorations.find({ structId, member });
+    if (memberDecoration == memberDecorations.end())
+    {
+        return std::nullopt;
+    }
+
+    auto value = memberDecoration->second.find(decoration);
+    return value != memberDecoration->second.end() ? std::optional<uint32_t>(value->second) : std::nullopt;
+}
+
+uint32_t Module::getArrayLength(const Instruction& arrayType) const
+{
+    auto length = constants.find(arrayType.operands[1]);
+    if (length == constants.end())
+    {
+        throw std::runtime_error("SPIR-V array length is not a constant!");
+    }
+
+    return length->second;
+}
+
+uint32_t Module::getTypeSize(uint32_t typeId, std::optional<uint32_t> matrixStride) const
+{
+    const auto& type = getType(typeId);
+
+    switch (type.op)
+    {
+        case OpTypeBool:
+            return 4;
+        case OpTypeInt:
+        case OpTypeFloat:
+            return type.operands[0] / 8;
+        case OpTypeVector:
+            return type.operands[1] * getTypeSize(type.operands[0], std::nullopt);
+        case OpTypeMatrix:
+            return type.operands[1] * matrixStride.value_or(getTypeSize(type.operands[0], std::nullopt));
+        case OpTypeArray:
+        {
+            auto stride = getDecoration(typeId, ArrayStrideDecoration);
+            return getArrayLength(type) * stride.value_or(getTypeSize(type.operands[0], matrixStride));
+        }
+        case OpTypeRuntimeArray:
+            return 0;
+        case OpTypeStruct:
+        {
+            uint32_t size = 0;
+            for (uint32_t member = 0; member < type.operands.size(); ++member)
+            {
+                auto offset = getMemberDecoration(typeId, member, OffsetDecoration).value_or(size);
+                auto stride = getMemberDecoration(typeId, member, MatrixStrideDecoration);
+                size = std::max(size, offset + getTypeSize(type.operands[member], stride));
+            }
+            return size;
+        }
+        default:
+            return 0;
+    }
+}
+
+std::string Module::getTypeName(uint32_t typeId) const
+{
+    const auto& type = getType(typeId);
+
+    switch (type.op)
+    {
+        case OpTypeBool:
+            return "bool";
+        case OpTypeInt:
+            return type.operands[1] != 0 ? "int" : "uint";
+        case OpTypeFloat:
+            return type.operands[0] == 64 ? "double" : "float";
+        case OpTypeVector:
+        {
+            auto componentName = getTypeName(type.operands[0]);
+            auto prefix = componentName == "float" ? "" : componentName == "int" ? "i" : componentName == "uint" ? "u" : componentName == "double" ? "d" : "b";
+            return prefix + std::string("vec") + std::to_string(type.operands[1]);
+        }
+        case OpTypeMatrix:
+        {
+            auto rows = getType(type.operands[0]).operands[1];
+            auto columns = type.operands[1];
+            return "mat" + std::to_string(columns) + (rows == columns ? "" : "x" + std::to_string(rows));
+        }
+        case OpTypeArray:
+            return getTypeName(type.operands[0]) + "[" + std::to_string(getArrayLength(type)) + "]";
+        case OpTypeRuntimeArray:
+            return getTypeName(type.operands[0]) + "[]";
+        case OpTypeStruct:
+        {
+            auto name = names.find(typeId);
+            return name != names.end() && !name->second.empty() ? name->second : "struct";
+        }
+        default:
+            return "unknown";
+    }
+}
+
+BlockLayout Module::getBlockLayout(uint32_t structId) const
+{
+    const auto& type = getType(structId);
+
+    auto name = names.find(structId);
+
+    BlockLayout block {
+        .name = name != names.end() ? name->second : "",
+        .members = {},
+        .size = 0,
+        .runtimeArrayStride = 0,
+    };
+
+    for (uint32_t member = 0; member < type.operands.size(); ++member)
+    {
+        auto memberTypeId = type.operands[member];
+        auto memberName = memberNames.find({ structId, member });
+        auto offset = getMemberDecoration(structId, member, OffsetDecoration).value_or(block.size);
+        auto size = getTypeSize(memberTypeId, getMemberDecoration(structId, member, MatrixStrideDecoration));
+
+        if (getType(memberTypeId).op == OpTypeRuntimeArray)
+        {
+            block.runtimeArrayStride = getDecoration(memberTypeId, ArrayStrideDecoration)
+                .value_or(getTypeSize(getType(memberTypeId).operands[0], std::nullopt));
+        }
+
+        block.members.push_back({
+            .name = memberName != memberNames.end() ? memberName->second : "",
+            .typeName = getTypeName(memberTypeId),
+            .offset = offset,
+            .size = size,
+        });
+
+        block.size = std::max(block.size, offset + size);
+    }
+
+    return block;
+}
+
+// MARK: - Reflection
+
+// The descriptor a UniformConstant variable of this type needs
+static VkDescriptorType getResourceDescriptorType(const Instruction& type)
+{
+    switch (type.op)
+    {
+        case OpTypeSampledImage:
+            return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        case OpTypeSampler:
+            return VK_DESCRIPTOR_TYPE_SAMPLER;
+        case OpTypeImage:
+        {
+            // Operands: sampled type, dim, depth, arrayed, multisampled, sampled, format
+            auto isStorage = type.operands[5] == storageImageSampled;
+
+            if (type.operands[1] == bufferImageDim)
+            {
+                return isStorage ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+            }
+
+            return isStorage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+        }
+        default:
+            throw std::runtime_error("Unsupported SPIR-V resource type!");
+    }
+}
+
+static bool isArrayedImage(const Module& module, const Instruction& type)
+{
+    if (type.op == OpTypeSampledImage)
+    {
+        return isArrayedImage(module, module.getType(type.operands[0]));
+    }
+
+    return type.op == OpTypeImage && type.operands[3] != 0;
+}
+
+ShaderReflection::ShaderLayout ShaderReflection::reflect(const std::vector<char>& spirvCode)
+{
+    auto module = parseModule(spirvCode);
+
+    ShaderLayout layout {
+        .bindings = {},
+        .pushConstants = std::nullopt,
+        .parameterBlock = std::nullopt,
+        .layerUniforms = std::nullopt,
+        .specializationConstants = {},
+        .localSize = module.localSize,
+    };
+
+    for (const auto& variable : module.variables)
+    {
+        const auto& pointerType = module.getType(variable.pointerTypeId);
+        auto typeId = pointerType.operands[1];
+
+        if (variable.storageClass == PushConstantStorage)
+        {
+            layout.pushConstants = module.getBlockLayout(typeId);
+            continue;
+        }
+
+        if (variable.storageClass != UniformConstantStorage
+            && variable.storageClass != UniformStorage
+            && variable.storageClass != StorageBufferStorage)
+        {
+            continue;
+        }
+
+        // Arrays of descriptors are one binding with a descriptor count
+        uint32_t descriptorCount = 1;
+        if (module.getType(typeId).op == OpTypeArray)
+        {
+            descriptorCount = module.getArrayLength(module.getType(typeId));
+            typeId = module.getType(typeId).operands[0];
+        }
+        else if (module.getType(typeId).op == OpTypeRuntimeArray)
+        {
+            throw std::runtime_error("Runtime-sized descriptor arrays are not supported!");
+        }
+
+        VkDescriptorType descriptorType;
+        bool isArrayed = false;
+        bool isLayerUniforms = false;
+
+        if (variable.storageClass == UniformConstantStorage)
+        {
+            descriptorType = getResourceDescriptorType(module.getType(typeId));
+            isArrayed = isArrayedImage(module, module.getType(typeId));
+        }
+        else
+        {
+            // Before SPIR-V 1.3 storage buffers are Uniform blocks decorated BufferBlock
+            auto isStorageBuffer = variable.storageClass == StorageBufferStorage
+                || module.getDecoration(typeId, BufferBlockDecoration).has_value();
+
+            descriptorType = isStorageBuffer ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+
+            auto block = module.getBlockLayout(typeId);
+            isLayerUniforms = block.name == layerUniformsBlockName;
+
+            auto& slot = isLayerUniforms ? layout.layerUniforms : layout.parameterBlock;
+            if (slot.has_value())
+            {
+                throw std::runtime_error("Only one buffer block per shader is supported!");
+            }
+            slot = block;
+        }
+
+        auto name = module.names.find(variable.id);
+
+        layout.bindings.push_back({
+            .set = module.getDecoration(variable.id, DescriptorSetDecoration).value_or(0),
+            .binding = module.getDecoration(variable.id, BindingDecoration).value_or(0),
+            .descriptorType = descriptorType,
+            .descriptorCount = descriptorCount,
+            .name = name != module.names.end() ? name->second : "",
+            .isArrayed = isArrayed,
+            .isLayerUniforms = isLayerUniforms,
+        });
+    }
+
+    std::sort(layout.bindings.begin(), layout.bindings.end(), [](const auto& a, const auto& b)
+    {
+        return a.set != b.set ? a.set < b.set : a.binding < b.binding;
+    });
+
+    for (const auto& specConstant : module.specConstants)
+    {
+        auto constantId = module.getDecoration(specConstant.id, SpecIdDecoration);
+
+        // Without a SpecId it can't be set from outside, and wider types don't fit the 32-bit data the host passes
+        if (!constantId.has_value() || module.getTypeSize(specConstant.typeId, std::nullopt) != 4)
+        {
+            continue;
+        }
+
+        auto name = module.names.find(specConstant.id);
+
+        layout.specializationConstants.push_back({
+            .constantId = *constantId,
+            .name = name != module.names.end() ? name->second : "",
+            .typeName = module.getTypeName(specConstant.typeId),
+            .defaultValue = specConstant.defaultValue,
+        });
+    }
+
+    std::sort(layout.specializationConstants.begin(), layout.specializationConstants.end(), [](const auto& a, const auto& b)
+    {
+        return a.constantId < b.constantId;
+    });
+
+    return layout;
+}
+
+// MARK: - Lookup
+
+const ShaderReflection::BlockMember* ShaderReflection::BlockLayout::findMember(const std::string& memberName) const
+{
+    for (const auto& member : members)
+    {
+        if (member.name == memberName)
+        {
+            return &member;
+        }
+    }
+
+    return nullptr;
+}
+
+const ShaderReflection::DescriptorBinding* ShaderReflection::ShaderLayout::findBinding(VkDescriptorType descriptorType) const
+{
+    for (const auto& binding : bindings)
+    {
+        if (binding.descriptorType == descriptorType)
+        {
+            return &binding;
+        }
+    }
+
+    return nullptr;
+}
+
+const ShaderReflection::SpecializationConstant* ShaderReflection::ShaderLayout::findSpecializationConstant(const std::string& name) const
+{
+    for (const auto& specializationConstant : specializationConstants)
+    {
+        if (specializationConstant.name == name)
+        {
+            return &specializationConstant;
+        }
+    }
+
+    return nullptr;
+}
+
+uint32_t ShaderReflection::ShaderLayout::getBindingCount(VkDescriptorType descriptorType) const
+{
+    return static_cast<uint32_t>(std::count_if(bindings.begin(), bindings.end(), [&](const auto& binding)
+    {
+        return binding.descriptorType == descriptorType;
+    }));
+}
@@ -0,0 +1,84 @@
+//
+//  ShaderReflection.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#ifndef ShaderReflection_hpp
+#define ShaderReflection_hpp
+
+#include <array>
+#include <optional>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+namespace ShaderReflection
+{
+
+struct DescriptorBinding {
+    uint32_t            set;
+    uint32_t            binding;
+    VkDescriptorType    descriptorType;
+    uint32_t            descriptorCount;
+    std::string         name;
+    bool                isArrayed;          // an image with array layers: sampler2DArray, image2DArray
+    bool                isLayerUniforms;    // the LayerUniforms block rather than the parameter block
+};
+
+// One member of a push constant or buffer block, as the shader lays it out
+struct BlockMember {
+    std::string name;
+    std::string typeName;   // GLSL spelling: float, vec4, uint, mat4, float[16], float[] ...
+    uint32_t    offset;
+    uint32_t    size;       // 0 for a runtime-sized array, which is always the last member
+};
+
+struct BlockLayout {
+    std::string                 name;
+    std::vector<BlockMember>    members;
+
+    // Up to the end of the last fixed-size member, so the smallest buffer the shader can be given
+    uint32_t                    size;
+
+    // Byte stride of the trailing runtime-sized array, 0 if there isn't one
+    uint32_t                    runtimeArrayStride;
+
+    const BlockMember* findMember(const std::string& memberName) const;
+};
+
+// A `layout (constant_id = N) const` in the shader, settable per pipeline
+struct SpecializationConstant {
+    uint32_t    constantId;
+    std::string name;
+    std::string typeName;
+    uint32_t    defaultValue;   // the raw 32 bits; bools are 0 or 1
+};
+
+// The type name of a buffer block the engine fills with one UniformBufferObject per image layer, for
+// kernels whose layers each need their own: `readonly buffer LayerUniforms { Uniforms layers[]; }`
+const char* const layerUniformsBlockName = "LayerUniforms";
+
+// Everything about a compute shader's interface that the host has to build to match
+struct ShaderLayout {
+    std::vector<DescriptorBinding>  bindings;               // sorted by set, then binding
+    std::optional<BlockLayout>      pushConstants;
+    std::optional<BlockLayout>      parameterBlock;         // the buffer block, if the shader reads one
+    std::optional<BlockLayout>      layerUniforms;          // the LayerUniforms block, if the shader reads one
+    std::vector<SpecializationConstant> specializationConstants;   // 32-bit scalars and bools, by constant id
+    std::array<uint32_t, 3>         localSize;              // the workgroup size declared in the shader
+
+    const DescriptorBinding* findBinding(VkDescriptorType descriptorType) const;
+    uint32_t getBindingCount(VkDescriptorType descriptorType) const;
+    const SpecializationConstant* findSpecializationConstant(const std::string& name) const;
+};
+
+// Reads the layout straight out of the SPIR-V words. Throws if the code isn't SPIR-V, or uses a
+// descriptor the engine has no way to fill (runtime-sized descriptor arrays, more than one buffer block
+// besides LayerUniforms).
+ShaderLayout reflect(const std::vector<char>& spirvCode);
+
+}
+
+#endif /* ShaderReflection_hpp */
@@ -8,7 +8,10 @@
 #ifndef VulkanComputeDataTypes_h
 #define VulkanComputeDataTypes_h
 
+#include <functional>
 #include <map>
+#include <stdexcept>
+#include <string>
 #include <vulkan/vulkan.h>
 
 enum PixelFormat : size_t {
@@ -33,8 +36,49 @@ struct ImageLayoutTransitionInfo {
     VkPipelineStageFlags srcStageMask, dstStageMask;
 };
 
+// Small per-frame parameters, delivered to the shader through its LayerUniforms block, one per layer, or
+// as push constants to a kernel without one. Keep this within the 128 bytes every Vulkan device guarantees.
 struct UniformBufferObject {
     float pivot;
+
+    // The fraction of full resolution the frame is rendered at: 0.5 when AE previews at half resolution.
+    // Kernels scale anything measured in pixels (radii, offsets, footprints) by these, so a downsampled
+    // preview looks like the full-resolution render, only smaller.
+    float downsampleX       = 1.f;
+    float downsampleY       = 1.f;
+
+    // Nonzero for AE's draft quality. The input is then sampled with the nearest sampler, and kernels can
+    // declare `layout (constant_id = N) const bool isDraftQuality` to get a cheaper pipeline variant.
+    uint32_t isDraftQuality = 0;
+};
+
+// Large per-frame parameters (LUTs, curves, ...), delivered through the kernel's buffer block at whatever
+// binding it declares. VulkanComputeProgram::getShaderLayout describes the layout the kernel expects.
+struct ParameterBlock {
+    const void* data;
+    size_t size;
+};
+
+// Polled between the steps of a frame (each GPU submission and each host copy) with how many are done.
+// Returning false cancels the frame: process stops at the next step and throws RenderCancelledError.
+using RenderProgressCallback = std::function<bool(uint64_t stepsDone, uint64_t stepCount)>;
+
+// Nothing of a cancelled frame is left queued or half-done, so the next frame renders as usual
+struct RenderCancelledError : std::runtime_error {
+    RenderCancelledError() : std::runtime_error("Render cancelled") {}
+};
+
+// A kernel that maps each input pixel to one output pixel and nothing else.
+// functionBody is the GLSL body of `vec4 f(vec4 color)` and may read `ubo`.
+struct PointwiseKernel {
+    std::string name;
+    std::string functionBody;
+};
+
+// How long one step of creating the GPU objects took, for tracking cold-start time
+struct SetUpPhaseTiming {
+    std::string name;
+    double      ms;
 };
 
 #endif /* VulkanComputeDataTypes_h */
@@ -5,50 +5,192 @@
 //  Created by James Perlman on 10/23/21.
 //
 
-#include <set>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
 
 #include "VulkanComputeProgram.hpp"
 
+#include "ContentHash.hpp"
 #include "FileUtils.hpp"
-#include "VulkanDebugUtils.hpp"
+#include "KernelFusion.hpp"
+#include "TraceUtils.hpp"
 #include "VulkanUtils.hpp"
 
 // MARK: - Constructor
 using namespace VulkanUtils;
 
+// Timestamps written around each GPU stage of process()
+enum TimestampQuery : uint32_t {
+    UploadBegin,
+    UploadEnd,
+    DispatchBegin,
+    DispatchEnd,
+    ReadbackBegin,
+    ReadbackEnd,
+    TimestampQueryCount,
+};
+
+// Smallest parameter buffer made for a kernel that declares one, before any parameter block has been seen
+const VkDeviceSize minParameterBufferSize = 256;
+
+// Uploads and readbacks are split into bands of about this many pixels, one submission each, so a
+// cancelled frame stops within a band's worth of transfer instead of running to the end
+const uint64_t pixelsPerBand = 1024 * 1024;
+
+// How long an output stays a candidate for the next effect's input. A stack renders its effects one right
+// after the other; anything later is another frame, which would only waste a hash of its input.
+const auto residentOutputWindow = std::chrono::milliseconds(1000);
+
+// Hashing an output costs about as much as copying it, so it's only done every so often until the next
+// effect is seen to start from one, and then for every output for a while
+const uint32_t unchainedHashInterval = 16;
+const uint32_t chainedHashingFrames = 64;
+
+// A sweep renders as many variants per dispatch as fit in images of about this size, up to
+// maxBatchLayersLimit, so a sweep of large frames doesn't take every layer's worth of memory at once
+const uint64_t maxSweepImageBytes = 256 * 1024 * 1024;
+
 void VulkanComputeProgram::setUp(std::string shaderFilePath)
 {
     this->shaderFilePath = shaderFilePath;
-    createVulkanInstance();
-    createDebugMessenger();
-    assignPhysicalDevice();
-    createLogicalDevice();
-    createShaderModule();
-    createCommandPool();
-    createDescriptorPool();
-    createSamplers();
-    createUniformBuffer();
+    this->pointwiseKernels.clear();
+    this->kernelId = shaderFilePath.substr(shaderFilePath.find_last_of("/\\") + 1);
+    setUpPersistedObjects();
 }
 
-// MARK: - Destructor
+void VulkanComputeProgram::setUp(std::vector<PointwiseKernel> pointwiseKernels)
+{
+    this->shaderFilePath.clear();
+    this->pointwiseKernels = pointwiseKernels;
+    
+    this->kernelId.clear();
+    for (const auto& kernel : pointwiseKernels)
+    {
+        kernelId += (kernelId.empty() ? "" : "+") + kernel.name;
+    }
+    setUpPersistedObjects();
+}
 
-void VulkanComputeProgram::tearDown()
+void VulkanComputeProgram::setUpPersistedObjects()
+{
+    std::vector<SetUpPhaseTiming> timings;
+    bool isContextNew = false;
+    
+    try
+    {
+        // The instance, device, queue, samplers and pipeline cache are shared, this program only adds its own kernel.
+        // Acquiring costs the context's whole creation for the first program and next to nothing after that.
+        VulkanContext::runTimedPhase(timings, "acquireContext", [&]() { context = VulkanContext::acquire(&isContextNew); });
+        
+        physicalDevice = context->getPhysicalDevice();
+        logicalDevice = context->getLogicalDevice();
+        computeQueueFamilyIndex = context->getComputeQueueFamilyIndex();
+        timestampPeriod = context->getTimestampPeriod();
+        timestampMask = context->getTimestampMask();
+        isPipelineStatisticsSupported = context->getIsPipelineStatisticsSupported();
+        
+        // The frame resources are this program's cache: any program short of memory can evict them, and
+        // they're rebuilt on the next frame like after a size change
+        memoryCacheId = context->getMemoryBudget().registerCache(kernelId, [this]() { return evictImageResources(); });
+        
+        VulkanContext::runTimedPhase(timings, "shaderModule", [&]() { createShaderModule(); });
+        VulkanContext::runTimedPhase(timings, "commandPool", [&]() { createCommandPool(); });
+        VulkanContext::runTimedPhase(timings, "submitFence", [&]() { createSubmitFence(); });
+        VulkanContext::runTimedPhase(timings, "descriptorPool", [&]() { createDescriptorPool(); });
+        VulkanContext::runTimedPhase(timings, "descriptorSetLayout", [&]() { createDescriptorSetLayout(); });
+        VulkanContext::runTimedPhase(timings, "pipelineLayout", [&]() { createPipelineLayout(); });
+        VulkanContext::runTimedPhase(timings, "descriptorSet", [&]() { createDescriptorSet(); });
+        VulkanContext::runTimedPhase(timings, "queryPools", [&]() { createQueryPools(); });
+        VulkanContext::runTimedPhase(timings, "parameterBuffer", [&]()
+        {
+            if (shaderLayout.parameterBlock.has_value())
+            {
+                createParameterBuffer(std::max<VkDeviceSize>(minParameterBufferSize, shaderLayout.parameterBlock->size));
+                reportDeviceMemoryInUse();
+            }
+        });
+        VulkanContext::runTimedPhase(timings, "layerUniformsBuffer", [&]()
+        {
+            if (shaderLayout.layerUniforms.has_value())
+            {
+                createLayerUniformsBuffer();
+                reportDeviceMemoryInUse();
+            }
+        });
+        
+        // Every format's variant up front, in both qualities, so switching bit depth or toggling draft mode
+        // never compiles a pipeline on the render path
+        VulkanContext::runTimedPhase(timings, "pipelineVariants", [&]()
+        {
+            for (auto pixelFormat : { ARGB32, ARGB64, ARGB128 })
+            {
+                getPipelineVariant(pixelFormat, false);
+                getPipelineVariant(pixelFormat, true);
+            }
+        });
+    }
+    catch (...)
+    {
+        // Undo whatever was made before the failure, so a retry or a tearDown starts from nothing
+        if (context)
+        {
+            context->getMemoryBudget().unregisterCache(memoryCacheId);
+            destroyPersistedObjects();
+            context.reset();
+        }
+        
+        setUpTimings = timings;
+        metrics.appendSetUpToLog(kernelId, setUpTimings, nullptr, false);
+        throw;
+    }
+    
+    setUpTimings = timings;
+    metrics.appendSetUpToLog(kernelId, setUpTimings, isContextNew ? &context->getCreationTimings() : nullptr, true);
+}
+
+// Every destroy checks for and clears its own handles, so this also cleans up after a setUp that failed halfway.
+// The device outlives this program, so no stale handle may be left for a later setUp to destroy again.
+void VulkanComputeProgram::destroyPersistedObjects()
 {
     destroyDescriptorSet();
-    destroyPipeline();
+    destroyPipelineVariants();
     destroyPipelineLayout();
     destroyDescriptorSetLayout();
-    destroyImageViews();
-    destroyImageMemory();
-    destroyImages();
-    destroyUniformBuffer();
-    destroySamplers();
+    releaseImageResources();
+    destroyParameterBuffer();
+    destroyLayerUniformsBuffer();
+    destroyQueryPools();
     destroyDescriptorPool();
+    destroySubmitFence();
     destroyCommandPool();
     destroyShaderModule();
-    destroyLogicalDevice();
-    destroyDebugMessenger();
-    destroyVulkanInstance();
+}
+
+// MARK: - Destructor
+
+void VulkanComputeProgram::tearDown()
+{
+    metrics.appendToLog();
+    frameCapture.close();
+    
+    if (context)
+    {
+        // First, so no other program evicts from under the teardown
+        context->getMemoryBudget().unregisterCache(memoryCacheId);
+        destroyPersistedObjects();
+    }
+    
+    // Everything made with the callbacks is gone now, so anything still live is the driver's or ours leaking
+    hostAllocator.checkForLeaks(kernelId);
+    
+    imageInfo = {};
+    layerCount = 1;
+    isDraftQuality = false;
+    framePipeline = VK_NULL_HANDLE;
+    
+    context.reset();
 }
 
 // MARK: - Run
@@ -57,454 +199,769 @@ void VulkanComputeProgram::tearDown()
 
 void VulkanComputeProgram::process(ImageInfo imageInfo,
                                    UniformBufferObject uniformBufferObject,
-                                   std::function<void(void*)> writeInputPixels,
-                                   std::function<void(void*)> readOutputPixels)
+                                   const std::function<void(void*)>& writeInputPixels,
+                                   const std::function<void(void*)>& readOutputPixels,
+                                   ParameterBlock parameterBlock,
+                                   const RenderProgressCallback& progressCallback,
+                                   uint64_t inputHash)
 {
-    textureReadWriteMutex.lock();
+    TRACE_ZONE("VulkanComputeProgram::process");
     
-    regenerateImageBuffersIfNeeded(imageInfo);
-    updateUniformBuffer(uniformBufferObject);
+    auto processStartTime = std::chrono::steady_clock::now();
     
-    auto imageSize = imageInfo.size();
+    // Unlocks on its own if anything below throws
+    std::unique_lock<std::mutex> lock(textureReadWriteMutex, std::defer_lock);
+    
+    // Led by the first frame that finds another rendering and joined by the next ones like it until that
+    // frame is done, so a batch never waits any longer than its frames would have anyway. A frame that
+    // may start from the resident output isn't batched; it's the next effect in a stack, not another frame.
+    FrameBatch batch {};
+    bool isBatchLeader = false;
     
-    // write input image memory
-    void* inputPixels;
-    vkMapMemory(logicalDevice, inputBufferMemory, 0, imageSize, 0, &inputPixels);
-    writeInputPixels(inputPixels);
-    vkUnmapMemory(logicalDevice, inputBufferMemory);
+    if (inputHash == 0 && !lock.try_lock())
+    {
+        std::unique_lock<std::mutex> batchLock(batchMutex);
+        
+        BatchMember member {
+            .uniformBufferObject = uniformBufferObject,
+            .writeInputPixels = &writeInputPixels,
+            .readOutputPixels = &readOutputPixels,
+            .progressCallback = &progressCallback,
+            .isCancelled = false,
+        };
+        
+        if (openBatch != nullptr
+            && openBatch->memberCount < openBatch->layerCapacity
+            && isSameBatch(*openBatch, imageInfo, uniformBufferObject, parameterBlock))
+        {
+            auto layer = openBatch->memberCount++;
+            openBatch->members[layer] = member;
+            
+            auto batchStartTime = renderAsBatchMember(*openBatch, layer, batchLock);
+            batchLock.unlock();
+            
+            metrics.recordFrame(imageInfo,
+                                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - processStartTime).count(),
+                                std::chrono::duration<double, std::milli>(batchStartTime - processStartTime).count());
+            metrics.appendToLogIfDue();
+            return;
+        }
+        
+        if (openBatch == nullptr && isLayeredKernel && maxBatchLayers > 1)
+        {
+            batch.imageInfo = imageInfo;
+            batch.uniformBufferObject = uniformBufferObject;
+            batch.parameterBlock = parameterBlock;
+            batch.layerCapacity = maxBatchLayers;
+            batch.members[0] = member;
+            batch.memberCount = 1;
+            batch.phase = CollectingPhase;
+            
+            openBatch = &batch;
+            isBatchLeader = true;
+        }
+    }
     
-    copyInputBufferToImage();
+    if (!lock.owns_lock())
+    {
+        TRACE_ZONE("process/lockWait");
+        lock.lock();
+    }
     
-    // submit the compute queue and run the shader
-    executeShader();
+    if (isBatchLeader)
+    {
+        // Closed to new members as soon as the program is free. Alone, it's just a frame.
+        {
+            std::lock_guard<std::mutex> batchLock(batchMutex);
+            openBatch = nullptr;
+        }
+        
+        if (batch.memberCount > 1)
+        {
+            renderBatch(batch, processStartTime);
+            return;
+        }
+    }
     
-    copyOutputImageToBuffer();
+    auto lockAcquiredTime = std::chrono::steady_clock::now();
     
-    // map outbut buffer memory and read pixels
-    void* outputPixels;
-    vkMapMemory(logicalDevice, outputBufferMemory, 0, imageSize, 0, &outputPixels);
-    readOutputPixels(outputPixels);
-    vkUnmapMemory(logicalDevice, outputBufferMemory);
+    context->getMemoryBudget().touch(memoryCacheId);
+    regenerateImageBuffersIfNeeded(imageInfo, 1);
+    updateParameterBuffer(parameterBlock);
+    updateLayerUniforms(&uniformBufferObject, 1);
+    setDraftQuality(uniformBufferObject.isDraftQuality != 0);
     
-    textureReadWriteMutex.unlock();
-}
-
-// Set or reset GPU memory if needed
-
-void VulkanComputeProgram::regenerateImageBuffersIfNeeded(ImageInfo imageInfo)
-{
-    if (imageInfo.width != this->imageInfo.width
-        || imageInfo.height != this->imageInfo.height
-        || imageInfo.pixelFormat != this->imageInfo.pixelFormat)
+    // Checked again now that no other frame can overwrite the output image. Resources regenerated above
+    // have already dropped the hash.
+    bool isInputResident = inputHash != 0 && inputHash == getResidentOutputHash(imageInfo);
+    if (isInputResident)
     {
-        this->imageInfo = imageInfo;
+        framesToHash = chainedHashingFrames;
+    }
+    
+    // The host copies, every upload band (or the one copy of the resident output), the dispatch and every
+    // readback band
+    beginProgress(progressCallback, (isInputResident ? 1 : getBandCount()) + getBandCount() + 3);
+    
+    auto imageSize = imageInfo.size();
+    
+    std::optional<CapturedFrame> capturedFrame;
+    
+    // write input image memory. A frame that starts from the resident output isn't captured: its input
+    // never reaches the host.
+    if (isInputResident)
+    {
+        TRACE_ZONE("process/copyResidentOutputToInput");
+        submitCommandBuffer(chainCommandBuffer);
+    }
+    else
+    {
+        TRACE_ZONE("process/writeInputPixels");
+        void* inputPixels;
+        VK_ASSERT_SUCCESS(vkMapMemory(logicalDevice, inputBufferMemory, 0, imageSize, 0, &inputPixels),
+                          "Failed to map input buffer!");
         
-        // destroy objects that need to be recreated
-        destroyPipeline();
-        destroyPipelineLayout();
-        destroyDescriptorSet();
-        destroyDescriptorSetLayout();
-        destroyImageViews();
-        destroyImageMemory();
-        destroyImages();
-        destroyImageBufferMemory();
-        destroyImageBuffers();
-        
-        // recreate objects
-        createImageBuffers();
-        createImageBufferMemory();
-        bindBufferMemory();
-        createImages();
-        createImageMemory();
-        bindImageMemory();
-        createImageViews();
-        createDescriptorSetLayout();
-        createDescriptorSet();
-        createPipelineLayout();
-        createPipeline();
+        // The caller's copy throws when AE cancels the frame, and the capture when it runs out of memory;
+        // either way the next frame maps again
+        try
+        {
+            writeInputPixels(inputPixels);
+            
+            // Copied while still mapped; the file write waits until the lock is released
+            if (frameCapture.shouldCapture())
+            {
+                TRACE_ZONE("process/captureFrame");
+                capturedFrame = frameCapture.capture(kernelId, imageInfo, uniformBufferObject, parameterBlock, inputPixels);
+            }
+        }
+        catch (...)
+        {
+            vkUnmapMemory(logicalDevice, inputBufferMemory);
+            throw;
+        }
         
-        // prepare for computations
-        transitionImageLayouts();
-        updateDescriptorSet();
+        vkUnmapMemory(logicalDevice, inputBufferMemory);
     }
-}
-
-// MARK: - Update Uniform Buffer Object
-void VulkanComputeProgram::updateUniformBuffer(UniformBufferObject uniformBufferObject)
-{
-    auto bufferSize = sizeof(uniformBufferObject);
     
-    void* uniformBufferData;
-    vkMapMemory(logicalDevice,
-                uniformBufferMemory,
-                0,
-                bufferSize,
-                0,
-                &uniformBufferData);
+    // Every step leaves the images in the layouts the next frame starts from, so a cancelled frame can stop
+    // after any of them. Nothing is queued ahead: each submission is waited for before the next is made.
+    reportProgress();
+    throwIfCancelled();
+    
+    if (!isInputResident)
+    {
+        TRACE_ZONE("process/copyInputBufferToImage");
+        copyInputBufferToImage();
+    }
     
-    memcpy(uniformBufferData, &uniformBufferObject, bufferSize);
+    throwIfCancelled();
     
-    vkUnmapMemory(logicalDevice, uniformBufferMemory);
-}
-
-// MARK: - Vulkan Instance
-
-const std::vector<const char*> baseInstanceExtensions = {
-    VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
-};
-
-std::vector<const char*> getRequiredInstanceExtensionNames()
-{
-    std::vector<const char*> extensions(baseInstanceExtensions.begin(), baseInstanceExtensions.end());
+    // From here the output image no longer holds what the hash was taken of
+    setResidentOutputHash(0);
     
-    if (VulkanDebugUtils::isValidationEnabled())
+    // submit the compute queue and run the shader
     {
-        extensions.emplace_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+        TRACE_ZONE("process/executeShader");
+        executeShader(uniformBufferObject, 1);
     }
     
-    return extensions;
-}
-
-void VulkanComputeProgram::createVulkanInstance()
-{
-    if (VulkanDebugUtils::isValidationEnabled() && !VulkanDebugUtils::isValidationSupported())
+    reportProgress();
+    throwIfCancelled();
+    
     {
-        throw std::runtime_error("Validation layers requested, but not available!");
+        TRACE_ZONE("process/copyOutputImageToBuffer");
+        copyOutputImageToBuffer();
     }
     
-    VkApplicationInfo appInfo {
-        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
-        .pApplicationName = "Hello Triangle",
-        .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
-        .pEngineName = "No Engine",
-        .engineVersion = VK_MAKE_VERSION(1, 0, 0),
-        .apiVersion = VK_API_VERSION_1_0,
-    };
+    throwIfCancelled();
+    
+    // map outbut buffer memory and read pixels
+    {
+        TRACE_ZONE("process/readOutputPixels");
+        void* outputPixels;
+        VK_ASSERT_SUCCESS(vkMapMemory(logicalDevice, outputBufferMemory, 0, imageSize, 0, &outputPixels),
+                          "Failed to map output buffer!");
+        
+        try
+        {
+            readOutputPixels(outputPixels);
+        }
+        catch (...)
+        {
+            vkUnmapMemory(logicalDevice, outputBufferMemory);
+            throw;
+        }
+        
+        // The same bytes that just went to the caller, so the next effect's input hashes alike
+        if (shouldHashOutput())
+        {
+            TRACE_ZONE("process/hashOutput");
+            auto rowBytes = static_cast<size_t>(imageInfo.pixelFormat) * imageInfo.width;
+            setResidentOutputHash(ContentHash::hashRows(outputPixels, rowBytes, rowBytes, imageInfo.height));
+        }
+        
+        vkUnmapMemory(logicalDevice, outputBufferMemory);
+    }
     
-    auto requiredExtensionNames = getRequiredInstanceExtensionNames();
+    reportProgress();
+    recordGpuTimings();
     
-    VkInstanceCreateInfo createInfo {
-        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-        .pApplicationInfo = &appInfo,
-        .enabledExtensionCount = static_cast<uint32_t>(requiredExtensionNames.size()),
-        .ppEnabledExtensionNames = requiredExtensionNames.data(),
-    };
+    lock.unlock();
     
-    // Add a debugger to the instance, if enabled.
-    auto debugCreateInfo = VulkanDebugUtils::getDebugMessengerCreateInfo();
+    auto processEndTime = std::chrono::steady_clock::now();
     
-    if (VulkanDebugUtils::isValidationEnabled())
-    {
-        createInfo.enabledLayerCount = static_cast<uint32_t>(VulkanDebugUtils::validationLayers.size());
-        createInfo.ppEnabledLayerNames = VulkanDebugUtils::validationLayers.data();
-        createInfo.pNext = &debugCreateInfo;
-    } else
+    if (capturedFrame.has_value())
     {
-        createInfo.enabledLayerCount = 0;
+        TRACE_ZONE("process/writeCapturedFrame");
+        frameCapture.write(*capturedFrame);
     }
     
-    // Create the instance!
-    VK_ASSERT_SUCCESS(vkCreateInstance(&createInfo, nullptr, &instance),
-                      "failed to create Vulkan instance!");
+    metrics.recordFrame(imageInfo,
+                        std::chrono::duration<double, std::milli>(processEndTime - processStartTime).count(),
+                        std::chrono::duration<double, std::milli>(lockAcquiredTime - processStartTime).count(),
+                        isInputResident);
+    metrics.appendToLogIfDue();
 }
 
-void VulkanComputeProgram::destroyVulkanInstance()
-{
-    vkDestroyInstance(instance, nullptr);
-}
+// MARK: - GPU Timing Stats
 
-
-// MARK: - Debug Messenger
-void VulkanComputeProgram::createDebugMessenger()
+std::vector<GpuTimingReport> VulkanComputeProgram::getGpuTimingStats()
 {
-    if (!VulkanDebugUtils::isValidationEnabled())
-    {
-        return;
-    }
-    
-    auto createInfo = VulkanDebugUtils::getDebugMessengerCreateInfo();
-    VK_ASSERT_SUCCESS(VulkanDebugUtils::createDebugUtilsMessengerEXT(instance, &createInfo, nullptr, &debugMessenger),
-                      "Failed to set up debug messenger!");
+    return gpuTimingStats.getReports();
 }
 
-void VulkanComputeProgram::destroyDebugMessenger()
+void VulkanComputeProgram::resetGpuTimingStats()
 {
-    if (!VulkanDebugUtils::isValidationEnabled())
-    {
-        return;
-    }
-    
-    VulkanDebugUtils::destroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
+    gpuTimingStats.reset();
 }
 
-// MARK: - Physical Device
+// MARK: - Metrics
 
-const std::vector<const char*> deviceExtensions = {
-    "VK_KHR_portability_subset",
-};
+RenderMetricsSnapshot VulkanComputeProgram::getMetricsSnapshot()
+{
+    return metrics.getSnapshot();
+}
 
-const std::vector<const char*> requiredDeviceExtensions = {
-    // No special extensions for compute
-};
+void VulkanComputeProgram::setMetricsLogPath(const std::string& logPath)
+{
+    metrics.setLogPath(logPath);
+}
 
-bool isPhysicalDeviceExtensionSupportAdequate(VkPhysicalDevice device)
+// The device allocations this program currently holds in one category
+uint64_t VulkanComputeProgram::getDeviceMemoryInUse(MemoryCategory category)
 {
-    if (requiredDeviceExtensions.size() == 0)
-    {
-        return true;
-    }
+    uint64_t total = 0;
     
-    // Fetch all device extension properties.
-    uint32_t extensionPropertiesCount;
-    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionPropertiesCount, nullptr);
-    
-    std::vector<VkExtensionProperties> deviceExtensionProperties(extensionPropertiesCount);
-    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionPropertiesCount, deviceExtensionProperties.data());
+    auto addBuffer = [&](VkBuffer buffer) {
+        if (buffer != VK_NULL_HANDLE)
+        {
+            VkMemoryRequirements memoryRequirements;
+            vkGetBufferMemoryRequirements(logicalDevice, buffer, &memoryRequirements);
+            total += memoryRequirements.size;
+        }
+    };
     
-    // Create a set from the requiredExtensionNames vector.
-    std::set<const char*> requiredExtensionSet(requiredDeviceExtensions.begin(), requiredDeviceExtensions.end());
+    auto addImage = [&](VkImage image) {
+        if (image != VK_NULL_HANDLE)
+        {
+            VkMemoryRequirements memoryRequirements;
+            vkGetImageMemoryRequirements(logicalDevice, image, &memoryRequirements);
+            total += memoryRequirements.size;
+        }
+    };
     
-    // Iterate through the deviceExtensionProperties, removing device extension names from the requiredExtensionNamesSet.
-    for (const auto& extension : deviceExtensionProperties)
+    switch (category)
     {
-        requiredExtensionSet.erase(extension.extensionName);
+        case FrameImageMemory:
+            addImage(inputImage);
+            addImage(outputImage);
+            break;
+        case StagingBufferMemory:
+            addBuffer(inputBuffer);
+            addBuffer(outputBuffer);
+            break;
+        case ParameterBufferMemory:
+            addBuffer(parameterBuffer);
+            addBuffer(layerUniformsBuffer);
+            break;
+        default:
+            break;
     }
     
-    // If requiredExtensionNamesSet is empty, then the device fully supports all required extensions.
-    return requiredExtensionSet.empty();
+    return total;
 }
 
-std::optional<uint32_t> getComputeQueueFamilyIndex(VkPhysicalDevice physicalDevice)
+// Tells the memory budget and the metrics what this program holds now
+void VulkanComputeProgram::reportDeviceMemoryInUse()
 {
-    uint32_t queueFamilyPropertiesCount = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, nullptr);
-    
-    std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyPropertiesCount);
-    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, queueFamilyProperties.data());
+    uint64_t total = 0;
     
-    for (uint32_t i = 0; i < queueFamilyPropertiesCount; ++i)
+    for (size_t category = 0; category < MemoryCategoryCount; ++category)
     {
-        if (queueFamilyProperties[i].queueFlags & VK_QUEUE_COMPUTE_BIT)
-        {
-            return i;
-        }
-        
-        ++i;
+        auto bytes = getDeviceMemoryInUse(static_cast<MemoryCategory>(category));
+        context->getMemoryBudget().setUsage(memoryCacheId, static_cast<MemoryCategory>(category), bytes);
+        total += bytes;
     }
     
-    return NULL;
+    metrics.setDeviceMemoryInUse(total);
 }
 
-bool isPhysicalDeviceSuitable(VkPhysicalDevice device)
+MemoryBudgetSnapshot VulkanComputeProgram::getMemoryBudgetSnapshot()
 {
-    // TODO: Check for optimal device, not just the first one with the Compute capability.
-    VkPhysicalDeviceProperties properties;
-    vkGetPhysicalDeviceProperties(device, &properties);
-    
-    VkPhysicalDeviceFeatures features;
-    vkGetPhysicalDeviceFeatures(device, &features);
-    
-    auto allRequiredExtensionsSupported = isPhysicalDeviceExtensionSupportAdequate(device);
-    
-    auto computeQueueFamilyIndex = getComputeQueueFamilyIndex(device);
-    
-    return allRequiredExtensionsSupported && computeQueueFamilyIndex.has_value();
+    return context ? context->getMemoryBudget().getSnapshot() : MemoryBudgetSnapshot{};
 }
 
-void VulkanComputeProgram::assignPhysicalDevice()
+HostAllocationSnapshot VulkanComputeProgram::getHostAllocationSnapshot()
 {
-    // Find out how many devices there are.
-    uint32_t physicalDeviceCount = 0;
-    vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, nullptr);
-    
-    // No devices? Throw an error. :(
-    if (physicalDeviceCount == 0)
-    {
-        throw std::runtime_error("Failed to find any GPUs with Vulkan support!");
-    }
-    
-    // Fetch all of the physical devices
-    std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
-    vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices.data());
+    return hostAllocator.getSnapshot();
+}
+
+void VulkanComputeProgram::setHostMemoryLimit(uint64_t limitBytes)
+{
+    hostAllocator.setLimit(limitBytes);
+}
+
+// Set or reset GPU memory if needed
+
+// layerCount is how many layers the frame needs at least. More are kept until the size or format changes, so
+// single frames between batches don't shrink the images only for the next batch to grow them again.
+void VulkanComputeProgram::regenerateImageBuffersIfNeeded(ImageInfo imageInfo, uint32_t layerCount)
+{
+    TRACE_ZONE("VulkanComputeProgram::regenerateImageBuffersIfNeeded");
     
-    for (const auto& device : physicalDevices)
+    if (imageInfo.width != this->imageInfo.width
+        || imageInfo.height != this->imageInfo.height
+        || imageInfo.pixelFormat != this->imageInfo.pixelFormat
+        || layerCount > this->layerCount)
     {
+        // destroy objects that need to be recreated. The pipelines and the descriptor set don't depend on the
+        // image size, so they're kept; the set is only pointed at the new images.
+        releaseImageResources();
+        
+        this->imageInfo = imageInfo;
+        this->layerCount = layerCount;
+        framePipeline = VK_NULL_HANDLE;
+        
+        // Make room before allocating: other programs' least recently used frame resources go first.
+        // The reservations are advisory. False only means nothing else was left to evict, so the allocation
+        // is tried anyway and a real failure is handled by the retry below.
+        auto& memoryBudget = context->getMemoryBudget();
+        memoryBudget.reserve(memoryCacheId, FrameImageMemory, 2 * imageInfo.size() * layerCount);
+        memoryBudget.reserve(memoryCacheId, StagingBufferMemory, 2 * imageInfo.size() * layerCount);
         
-        // TODO: Find the most suitable device, not just the first
-        if (isPhysicalDeviceSuitable(device))
+        try
         {
-            physicalDevice = device;
-            break;
+            createImageResources();
+        }
+        catch (const std::runtime_error&)
+        {
+            // The budget is only as good as the driver's numbers. Evict every other program and try once more.
+            releaseImageResources();
+            memoryBudget.evictAllExcept(memoryCacheId);
+            
+            try
+            {
+                createImageResources();
+            }
+            catch (...)
+            {
+                // Leave nothing half-made for the next frame to mistake for a cache hit
+                releaseImageResources();
+                this->imageInfo = {};
+                this->layerCount = 1;
+                reportDeviceMemoryInUse();
+                throw;
+            }
         }
+        
+        // prepare for computations
+        transitionImageLayouts();
+        updateDescriptorSet();
+        recordTransferCommands();
+        
+        metrics.recordResourceRegeneration();
+        reportDeviceMemoryInUse();
     }
-    
-    if (physicalDevice == VK_NULL_HANDLE)
+    else
+    {
+        metrics.recordResourceCacheHit();
+    }
+}
+
+// Draft frames read the input through the nearest sampler instead of the linear one
+void VulkanComputeProgram::setDraftQuality(bool isDraftQuality)
+{
+    if (isDraftQuality != this->isDraftQuality)
     {
-        throw std::runtime_error("Failed to find a suitable GPU!");
+        this->isDraftQuality = isDraftQuality;
+        framePipeline = VK_NULL_HANDLE;
+        updateDescriptorSet();
     }
-    computeQueueFamilyIndex = getComputeQueueFamilyIndex(physicalDevice).value();
 }
 
-// MARK: - Logical Device
+// MARK: - Frame Capture
 
-void VulkanComputeProgram::createLogicalDevice()
+void VulkanComputeProgram::setFrameCapturePath(const std::string& capturePath, uint32_t sampleInterval)
 {
-    float queuePriority = 1.0f;
-    
-    VkDeviceQueueCreateInfo deviceQueueCreateInfo {
-        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        .queueFamilyIndex = computeQueueFamilyIndex,
-        .queueCount = 1,
-        .pQueuePriorities = &queuePriority,
-    };
-    
-    VkPhysicalDeviceFeatures deviceFeatures {
-        .shaderStorageImageWriteWithoutFormat = VK_TRUE,
-    };
-    
-    VkDeviceCreateInfo deviceCreateInfo {
-        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .pQueueCreateInfos = &deviceQueueCreateInfo,
-        .queueCreateInfoCount = 1,
-        .pEnabledFeatures = &deviceFeatures,
-        .enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size()),
-        .ppEnabledExtensionNames = deviceExtensions.data(),
-    };
+    frameCapture.open(capturePath, sampleInterval);
+}
+
+void VulkanComputeProgram::requestFrameCapture(uint32_t frameCount)
+{
+    frameCapture.requestCapture(frameCount);
+}
+
+// MARK: - Shader Layout
+
+const ShaderReflection::ShaderLayout& VulkanComputeProgram::getShaderLayout()
+{
+    return shaderLayout;
+}
+
+uint32_t VulkanComputeProgram::getPushConstantSize()
+{
+    return shaderLayout.pushConstants.has_value() ? shaderLayout.pushConstants->size : 0;
+}
+
+// MARK: - Set Up Timings
+
+std::vector<SetUpPhaseTiming> VulkanComputeProgram::getSetUpTimings()
+{
+    return setUpTimings;
+}
+
+// MARK: - Device Info
+
+std::string VulkanComputeProgram::getDeviceName()
+{
+    return context ? context->getDeviceName() : std::string();
+}
+
+// MARK: - Update Parameter Buffer
+
+// The parameter buffer stays mapped for the lifetime of the program, so this is a plain memcpy.
+// It only gets reallocated when a frame brings a larger parameter block than any before it.
+void VulkanComputeProgram::updateParameterBuffer(ParameterBlock parameterBlock)
+{
+    if (parameterBlock.size == 0)
+    {
+        return;
+    }
     
-    if (VulkanDebugUtils::isValidationEnabled())
+    if (!shaderLayout.parameterBlock.has_value())
     {
-        deviceCreateInfo.enabledLayerCount = static_cast<uint32_t>(VulkanDebugUtils::validationLayers.size());
-        deviceCreateInfo.ppEnabledLayerNames = VulkanDebugUtils::validationLayers.data();
-    } else
+        throw std::runtime_error("Kernel " + kernelId + " was given a parameter block but doesn't declare a buffer for it");
+    }
+    
+    if (parameterBlock.size < shaderLayout.parameterBlock->size)
     {
-        deviceCreateInfo.enabledLayerCount = 0;
+        throw std::runtime_error("Parameter block is smaller than kernel " + kernelId + " reads");
     }
     
-    VK_ASSERT_SUCCESS(vkCreateDevice(physicalDevice, &deviceCreateInfo, nullptr, &logicalDevice),
-                      "Failed to create logical device!");
+    if (parameterBlock.size > parameterBufferSize)
+    {
+        destroyParameterBuffer();
+        createParameterBuffer(potGTE(parameterBlock.size));
+        
+        // Before the first frame, or after an eviction, there are no images to point the rest of the set at
+        if (outputImageView != VK_NULL_HANDLE)
+        {
+            updateDescriptorSet();
+        }
+        
+        reportDeviceMemoryInUse();
+    }
     
-    vkGetDeviceQueue(logicalDevice, computeQueueFamilyIndex, 0, &computeQueue);
+    memcpy(parameterBufferData, parameterBlock.data, parameterBlock.size);
 }
 
-void VulkanComputeProgram::destroyLogicalDevice()
+// Mapped for the lifetime of the program like the parameter buffer. Nothing to do for a kernel that
+// doesn't declare LayerUniforms.
+void VulkanComputeProgram::updateLayerUniforms(const UniformBufferObject* layers, uint32_t layerCount)
 {
-    vkDestroyDevice(logicalDevice, nullptr);
+    if (layerUniformsData != nullptr)
+    {
+        memcpy(layerUniformsData, layers, sizeof(UniformBufferObject) * layerCount);
+    }
 }
 
 // MARK: - Command Pool
 
 void VulkanComputeProgram::createCommandPool()
 {
+    // The frame's dispatch buffer is recorded again in place when its push constants change
     VkCommandPoolCreateInfo createInfo {
         .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
         .pNext = nullptr,
-        .flags = 0,
+        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
         .queueFamilyIndex = computeQueueFamilyIndex,
     };
     
-    VK_ASSERT_SUCCESS(vkCreateCommandPool(logicalDevice, &createInfo, nullptr, &commandPool),
+    VK_ASSERT_SUCCESS(vkCreateCommandPool(logicalDevice, &createInfo, allocator, &commandPool),
                       "Failed to create command pool!");
 }
 
 void VulkanComputeProgram::destroyCommandPool()
 {
-    vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
+    if (commandPool == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
+    vkDestroyCommandPool(logicalDevice, commandPool, allocator);
+    commandPool = VK_NULL_HANDLE;
 }
 
-// MARK: - Descriptor Pools
-void VulkanComputeProgram::createDescriptorPool()
+// MARK: - Submit Fence
+
+void VulkanComputeProgram::createSubmitFence()
 {
-    VkDescriptorPoolSize inputPoolSize {
-        .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .descriptorCount = 1,
+    VkFenceCreateInfo createInfo {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
     };
     
-    VkDescriptorPoolSize outputPoolSize {
-        .type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-        .descriptorCount = 1,
-    };
+    VK_ASSERT_SUCCESS(vkCreateFence(logicalDevice, &createInfo, allocator, &submitFence),
+                      "Failed to create submit fence!");
+}
+
+void VulkanComputeProgram::destroySubmitFence()
+{
+    if (submitFence == VK_NULL_HANDLE)
+    {
+        return;
+    }
     
-    VkDescriptorPoolSize uniformPoolSize {
-        .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        .descriptorCount = 1,
-    };
+    vkDestroyFence(logicalDevice, submitFence, allocator);
+    submitFence = VK_NULL_HANDLE;
+}
+
+// MARK: - Descriptor Pools
+void VulkanComputeProgram::createDescriptorPool()
+{
+    // One set, so one descriptor of each type per binding
+    std::map<VkDescriptorType, uint32_t> descriptorCounts;
+    for (const auto& binding : shaderLayout.bindings)
+    {
+        descriptorCounts[binding.descriptorType] += binding.descriptorCount;
+    }
     
-    VkDescriptorPoolSize poolSizes[3] = {
-        inputPoolSize,
-        outputPoolSize,
-        uniformPoolSize,
-    };
+    std::vector<VkDescriptorPoolSize> poolSizes;
+    for (const auto& [descriptorType, descriptorCount] : descriptorCounts)
+    {
+        poolSizes.push_back({
+            .type = descriptorType,
+            .descriptorCount = descriptorCount,
+        });
+    }
     
     VkDescriptorPoolCreateInfo createInfo {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
         .pNext = nullptr,
         .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
         .maxSets = 1,
-        .poolSizeCount = 3,
-        .pPoolSizes = poolSizes,
+        .poolSizeCount = static_cast<uint32_t>(poolSizes.size()),
+        .pPoolSizes = poolSizes.data(),
     };
     
     VK_ASSERT_SUCCESS(vkCreateDescriptorPool(logicalDevice,
                                              &createInfo,
-                                             nullptr,
+                                             allocator,
                                              &descriptorPool),
                       "Failed to create descriptor pool!");
 }
 
 void VulkanComputeProgram::destroyDescriptorPool()
 {
-    vkDestroyDescriptorPool(logicalDevice, descriptorPool, nullptr);
+    if (descriptorPool == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
+    vkDestroyDescriptorPool(logicalDevice, descriptorPool, allocator);
+    descriptorPool = VK_NULL_HANDLE;
 }
 
-// MARK: - Samplers
+// MARK: - Query Pools
 
-void VulkanComputeProgram::createSamplers()
+void VulkanComputeProgram::createQueryPools()
 {
-    createSampler(logicalDevice, VK_FILTER_LINEAR, inputSampler);
-    createSampler(logicalDevice, VK_FILTER_NEAREST, outputSampler);
+    if (timestampMask != 0)
+    {
+        VkQueryPoolCreateInfo timestampCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = TimestampQueryCount,
+            .pipelineStatistics = 0,
+        };
+        
+        VK_ASSERT_SUCCESS(vkCreateQueryPool(logicalDevice, &timestampCreateInfo, allocator, &timestampQueryPool),
+                          "Failed to create timestamp query pool!");
+    }
+    
+    if (isPipelineStatisticsSupported)
+    {
+        VkQueryPoolCreateInfo statisticsCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS,
+            .queryCount = 1,
+            .pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT,
+        };
+        
+        VK_ASSERT_SUCCESS(vkCreateQueryPool(logicalDevice, &statisticsCreateInfo, allocator, &statisticsQueryPool),
+                          "Failed to create pipeline statistics query pool!");
+    }
 }
 
-void VulkanComputeProgram::destroySamplers()
+void VulkanComputeProgram::destroyQueryPools()
 {
-    vkDestroySampler(logicalDevice, inputSampler, nullptr);
-    vkDestroySampler(logicalDevice, outputSampler, nullptr);
+    if (timestampQueryPool != VK_NULL_HANDLE)
+    {
+        vkDestroyQueryPool(logicalDevice, timestampQueryPool, allocator);
+    }
+    
+    if (statisticsQueryPool != VK_NULL_HANDLE)
+    {
+        vkDestroyQueryPool(logicalDevice, statisticsQueryPool, allocator);
+    }
+    
+    timestampQueryPool = statisticsQueryPool = VK_NULL_HANDLE;
 }
 
-// MARK: - Uniform Buffers
+// MARK: - Parameter Buffer
 
-void VulkanComputeProgram::createUniformBuffer()
+void VulkanComputeProgram::createParameterBuffer(VkDeviceSize bufferSize)
 {
-    VkDeviceSize bufferSize = sizeof(UniformBufferObject);
+    // Advisory, and not retried: this buffer is tiny next to the frame images the reservation may evict,
+    // so a false result only means the budget is already spent elsewhere. If the device really is out of
+    // memory, allocateBufferMemory throws.
+    context->getMemoryBudget().reserve(memoryCacheId, ParameterBufferMemory, bufferSize);
     
     createBuffer(physicalDevice,
-                              logicalDevice,
-                              bufferSize,
-                              VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                              computeQueueFamilyIndex,
-                              uniformBuffer);
+                 logicalDevice,
+                 allocator,
+                 bufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                 computeQueueFamilyIndex,
+                 parameterBuffer);
     
     allocateBufferMemory(physicalDevice,
-                                      logicalDevice,
-                                      bufferSize,
-                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                                      uniformBuffer,
-                                      uniformBufferMemory);
+                         logicalDevice,
+                         allocator,
+                         bufferSize,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         parameterBuffer,
+                         parameterBufferMemory);
+    
+    vkBindBufferMemory(logicalDevice,
+                       parameterBuffer,
+                       parameterBufferMemory,
+                       0);
+    
+    vkMapMemory(logicalDevice,
+                parameterBufferMemory,
+                0,
+                bufferSize,
+                0,
+                &parameterBufferData);
+    
+    parameterBufferSize = bufferSize;
+}
+
+void VulkanComputeProgram::destroyParameterBuffer()
+{
+    if (parameterBuffer == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
+    // A failed create can leave the buffer without memory, or the memory unmapped
+    if (parameterBufferData != nullptr)
+    {
+        vkUnmapMemory(logicalDevice, parameterBufferMemory);
+    }
+    
+    vkFreeMemory(logicalDevice,
+                 parameterBufferMemory,
+                 allocator);
+    
+    vkDestroyBuffer(logicalDevice,
+                    parameterBuffer,
+                    allocator);
+    
+    parameterBuffer = VK_NULL_HANDLE;
+    parameterBufferMemory = VK_NULL_HANDLE;
+    parameterBufferData = nullptr;
+    parameterBufferSize = 0;
+}
+
+// MARK: - Layer Uniforms Buffer
+
+// Room for every layer an image can have, so it's never regrown
+void VulkanComputeProgram::createLayerUniformsBuffer()
+{
+    VkDeviceSize bufferSize = sizeof(UniformBufferObject) * maxBatchLayersLimit;
+    
+    createBuffer(physicalDevice,
+                 logicalDevice,
+                 allocator,
+                 bufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                 computeQueueFamilyIndex,
+                 layerUniformsBuffer);
+    
+    allocateBufferMemory(physicalDevice,
+                         logicalDevice,
+                         allocator,
+                         bufferSize,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         layerUniformsBuffer,
+                         layerUniformsBufferMemory);
     
     vkBindBufferMemory(logicalDevice,
-                       uniformBuffer,
-                       uniformBufferMemory,
+                       layerUniformsBuffer,
+                       layerUniformsBufferMemory,
                        0);
+    
+    void* data;
+    vkMapMemory(logicalDevice,
+                layerUniformsBufferMemory,
+                0,
+                bufferSize,
+                0,
+                &data);
+    
+    layerUniformsData = static_cast<UniformBufferObject*>(data);
 }
 
-void VulkanComputeProgram::destroyUniformBuffer()
+void VulkanComputeProgram::destroyLayerUniformsBuffer()
 {
+    if (layerUniformsBuffer == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
+    if (layerUniformsData != nullptr)
+    {
+        vkUnmapMemory(logicalDevice, layerUniformsBufferMemory);
+    }
+    
     vkFreeMemory(logicalDevice,
-                 uniformBufferMemory,
-                 nullptr);
+                 layerUniformsBufferMemory,
+                 allocator);
     
     vkDestroyBuffer(logicalDevice,
-                    uniformBuffer,
-                    nullptr);
+                    layerUniformsBuffer,
+                    allocator);
+    
+    layerUniformsBuffer = VK_NULL_HANDLE;
+    layerUniformsBufferMemory = VK_NULL_HANDLE;
+    layerUniformsData = nullptr;
 }
 
 // MARK: - --- EPHEMERAL OBJECTS ---
@@ -512,33 +969,184 @@ void VulkanComputeProgram::destroyUniformBuffer()
 // MARK: - Shader Module
 void VulkanComputeProgram::createShaderModule()
 {
-    auto computeShaderCode = FileUtils::readFile(shaderFilePath);
+    // Fused pointwise chains are generated and compiled at runtime, everything else ships as SPIR-V.
+    auto computeShaderCode = pointwiseKernels.empty()
+        ? FileUtils::readFile(shaderFilePath)
+        : KernelFusion::getFusedShaderCode(pointwiseKernels);
+    
     VkShaderModuleCreateInfo createInfo {
         .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
         .codeSize = computeShaderCode.size(),
         .pCode = reinterpret_cast<const uint32_t*>(computeShaderCode.data()),
     };
     
+    // Everything the host builds around the shader (descriptors, push constants, parameter buffer) follows from this
+    shaderLayout = ShaderReflection::reflect(computeShaderCode);
+    validateShaderLayout();
+    
+    isLayeredKernel = shaderLayout.findBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)->isArrayed;
+    
     VK_ASSERT_SUCCESS(vkCreateShaderModule(logicalDevice,
                                            &createInfo,
-                                           nullptr,
+                                           allocator,
                                            &shaderModule),
                       "Failed to create shader module!");
 }
 
+// Resources are matched to bindings by descriptor type, so each type the engine fills may appear only once
+void VulkanComputeProgram::validateShaderLayout()
+{
+    auto fail = [&](const std::string& problem)
+    {
+        throw std::runtime_error("Kernel " + kernelId + " " + problem);
+    };
+    
+    for (const auto& binding : shaderLayout.bindings)
+    {
+        if (binding.set != 0)
+        {
+            fail("uses descriptor set " + std::to_string(binding.set) + ", only set 0 is bound");
+        }
+        
+        if (binding.descriptorCount != 1)
+        {
+            fail("declares an array of descriptors at binding " + std::to_string(binding.binding));
+        }
+        
+        switch (binding.descriptorType)
+        {
+            case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+            case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+            case VK_DESCRIPTOR_TYPE_SAMPLER:
+            case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+            case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+            case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+                break;
+            default:
+                fail("declares a descriptor type the engine can't fill at binding " + std::to_string(binding.binding));
+        }
+    }
+    
+    if (shaderLayout.getBindingCount(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE) != 1)
+    {
+        fail("must declare exactly one storage image, the output");
+    }
+    
+    if (shaderLayout.getBindingCount(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER)
+        + shaderLayout.getBindingCount(VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE) > 1
+        || shaderLayout.getBindingCount(VK_DESCRIPTOR_TYPE_SAMPLER) > 1)
+    {
+        fail("declares more than one input image or sampler");
+    }
+    
+    // Both images are made with the same layers, and viewed as arrays only if the output is one
+    auto inputImage = shaderLayout.findBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    if (inputImage == nullptr)
+    {
+        inputImage = shaderLayout.findBinding(VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE);
+    }
+    
+    if (inputImage != nullptr && inputImage->isArrayed != shaderLayout.findBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)->isArrayed)
+    {
+        fail("declares only one of its input and output images as an array");
+    }
+    
+    if (shaderLayout.pushConstants.has_value() && shaderLayout.pushConstants->size > sizeof(UniformBufferObject))
+    {
+        fail("has push constants larger than UniformBufferObject");
+    }
+    
+    // Filled straight from an array of UniformBufferObject, one per layer of the images
+    if (shaderLayout.layerUniforms.has_value())
+    {
+        if (shaderLayout.layerUniforms->size != 0 || shaderLayout.layerUniforms->runtimeArrayStride != sizeof(UniformBufferObject))
+        {
+            fail("declares LayerUniforms as something other than a runtime-sized array of UniformBufferObject");
+        }
+        
+        if (!shaderLayout.findBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)->isArrayed)
+        {
+            fail("declares LayerUniforms but not its images as arrays");
+        }
+    }
+}
+
 void VulkanComputeProgram::destroyShaderModule()
 {
-    vkDestroyShaderModule(logicalDevice, shaderModule, nullptr);
+    if (shaderModule == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
+    vkDestroyShaderModule(logicalDevice, shaderModule, allocator);
+    shaderModule = VK_NULL_HANDLE;
+}
+
+// MARK: - Image Resources
+
+void VulkanComputeProgram::createImageResources()
+{
+    createImageBuffers();
+    createImageBufferMemory();
+    bindBufferMemory();
+    createImages();
+    createImageMemory();
+    bindImageMemory();
+    createImageViews();
+}
+
+// Safe on a partly made set: everything not yet created is still VK_NULL_HANDLE
+void VulkanComputeProgram::releaseImageResources()
+{
+    freeFrameCommandBuffers();
+    destroyImageViews();
+    destroyImageMemory();
+    destroyImages();
+    destroyImageBufferMemory();
+    destroyImageBuffers();
+    
+    inputBuffer = outputBuffer = VK_NULL_HANDLE;
+    inputBufferMemory = outputBufferMemory = VK_NULL_HANDLE;
+    inputImage = outputImage = VK_NULL_HANDLE;
+    inputImageMemory = outputImageMemory = VK_NULL_HANDLE;
+    inputImageView = outputImageView = VK_NULL_HANDLE;
+    
+    setResidentOutputHash(0);
+}
+
+// The memory budget's evict callback, called from whichever render thread ran short. A program that's
+// rendering right now is skipped rather than waited for, so two programs evicting each other can't deadlock.
+bool VulkanComputeProgram::evictImageResources()
+{
+    std::unique_lock<std::mutex> lock(textureReadWriteMutex, std::try_to_lock);
+    
+    if (!lock.owns_lock())
+    {
+        return false;
+    }
+    
+    TRACE_ZONE("VulkanComputeProgram::evictImageResources");
+    
+    releaseImageResources();
+    imageInfo = {};
+    layerCount = 1;
+    
+    metrics.recordResourceEviction();
+    reportDeviceMemoryInUse();
+    
+    return true;
 }
 
 // MARK: - Image Buffers
 
+// Layers one after the other, each as tightly packed as a single frame's
 void VulkanComputeProgram::createImageBuffers()
 {
-    auto bufferSize = static_cast<VkDeviceSize>(imageInfo.size());
+    auto bufferSize = static_cast<VkDeviceSize>(imageInfo.size()) * layerCount;
     
     createBuffer(physicalDevice,
                               logicalDevice,
+                              allocator,
                               bufferSize,
                               VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                               computeQueueFamilyIndex,
@@ -546,6 +1154,7 @@ void VulkanComputeProgram::createImageBuffers()
     
     createBuffer(physicalDevice,
                               logicalDevice,
+                              allocator,
                               bufferSize,
                               VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                               computeQueueFamilyIndex,
@@ -554,20 +1163,21 @@ void VulkanComputeProgram::createImageBuffers()
 
 void VulkanComputeProgram::destroyImageBuffers()
 {
-    vkDestroyBuffer(logicalDevice, inputBuffer, nullptr);
-    vkDestroyBuffer(logicalDevice, outputBuffer, nullptr);
+    vkDestroyBuffer(logicalDevice, inputBuffer, allocator);
+    vkDestroyBuffer(logicalDevice, outputBuffer, allocator);
 }
 
 // MARK: - Image Buffer Memory
 
 void VulkanComputeProgram::createImageBufferMemory()
 {
-    auto memorySize = static_cast<VkDeviceSize>(imageInfo.size());
+    auto memorySize = static_cast<VkDeviceSize>(imageInfo.size()) * layerCount;
     
     VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
     
     allocateBufferMemory(physicalDevice,
                                       logicalDevice,
+                                      allocator,
                                       memorySize,
                                       memoryFlags,
                                       inputBuffer,
@@ -575,6 +1185,7 @@ void VulkanComputeProgram::createImageBufferMemory()
     
     allocateBufferMemory(physicalDevice,
                                       logicalDevice,
+                                      allocator,
                                       memorySize,
                                       memoryFlags,
                                       outputBuffer,
@@ -583,8 +1194,8 @@ void VulkanComputeProgram::createImageBufferMemory()
 
 void VulkanComputeProgram::destroyImageBufferMemory()
 {
-    vkFreeMemory(logicalDevice, inputBufferMemory, nullptr);
-    vkFreeMemory(logicalDevice, outputBufferMemory, nullptr);
+    vkFreeMemory(logicalDevice, inputBufferMemory, allocator);
+    vkFreeMemory(logicalDevice, outputBufferMemory, allocator);
 }
 
 // MARK: - Bind Buffer Memory
@@ -601,21 +1212,25 @@ void VulkanComputeProgram::createImages()
 {
     // create input image
     createImage(logicalDevice,
+                             allocator,
                              imageInfo,
-                             VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                             layerCount,
+                             VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
                              inputImage);
     
     // create output image
     createImage(logicalDevice,
+                             allocator,
                              imageInfo,
+                             layerCount,
                              VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
                              outputImage);
 }
 
 void VulkanComputeProgram::destroyImages()
 {
-    vkDestroyImage(logicalDevice, inputImage, nullptr);
-    vkDestroyImage(logicalDevice, outputImage, nullptr);
+    vkDestroyImage(logicalDevice, inputImage, allocator);
+    vkDestroyImage(logicalDevice, outputImage, allocator);
 }
 
 // MARK: - Image Memory
@@ -624,14 +1239,14 @@ void VulkanComputeProgram::createImageMemory()
 {
     VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
     
-    allocateImageMemory(physicalDevice, logicalDevice, imageInfo, memoryFlags, inputImage, inputImageMemory);
-    allocateImageMemory(physicalDevice, logicalDevice, imageInfo, memoryFlags, outputImage, outputImageMemory);
+    allocateImageMemory(physicalDevice, logicalDevice, allocator, imageInfo, memoryFlags, inputImage, inputImageMemory);
+    allocateImageMemory(physicalDevice, logicalDevice, allocator, imageInfo, memoryFlags, outputImage, outputImageMemory);
 }
 
 void VulkanComputeProgram::destroyImageMemory()
 {
-    vkFreeMemory(logicalDevice, inputImageMemory, nullptr);
-    vkFreeMemory(logicalDevice, outputImageMemory, nullptr);
+    vkFreeMemory(logicalDevice, inputImageMemory, allocator);
+    vkFreeMemory(logicalDevice, outputImageMemory, allocator);
 }
 
 // MARK: - Bind Image Memory
@@ -648,74 +1263,71 @@ void VulkanComputeProgram::createImageViews()
 {
     VkFormat format = getImageFormat(imageInfo);
     
+    // What the shader declares: a kernel written for single images gets plain 2D views of one layer
+    auto viewType = isLayeredKernel ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
+    
     createImageView(logicalDevice,
+                                 allocator,
                                  format,
+                                 viewType,
+                                 layerCount,
                                  inputImage,
                                  inputImageView);
     
     createImageView(logicalDevice,
+                                 allocator,
                                  format,
+                                 viewType,
+                                 layerCount,
                                  outputImage,
                                  outputImageView);
 }
 
 void VulkanComputeProgram::destroyImageViews()
 {
-    vkDestroyImageView(logicalDevice, inputImageView, nullptr);
-    vkDestroyImageView(logicalDevice, outputImageView, nullptr);
+    vkDestroyImageView(logicalDevice, inputImageView, allocator);
+    vkDestroyImageView(logicalDevice, outputImageView, allocator);
 }
 
 // MARK: - Descriptor Set Layout
 void VulkanComputeProgram::createDescriptorSetLayout()
 {
-    VkDescriptorSetLayoutBinding inputLayoutBinding {
-        .binding = 0,
-        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .descriptorCount = 1,
-        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
-        .pImmutableSamplers = nullptr,
-    };
-    
-    VkDescriptorSetLayoutBinding outputLayoutBinding {
-        .binding = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-        .descriptorCount = 1,
-        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
-        .pImmutableSamplers = nullptr,
-    };
-    
-    VkDescriptorSetLayoutBinding uniformLayoutBinding {
-        .binding = 2,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        .descriptorCount = 1,
-        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
-        .pImmutableSamplers = nullptr,
-    };
-    
-    VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[3] = {
-        inputLayoutBinding,
-        outputLayoutBinding,
-        uniformLayoutBinding,
-    };
+    std::vector<VkDescriptorSetLayoutBinding> descriptorSetLayoutBindings;
+    for (const auto& binding : shaderLayout.bindings)
+    {
+        descriptorSetLayoutBindings.push_back({
+            .binding = binding.binding,
+            .descriptorType = binding.descriptorType,
+            .descriptorCount = binding.descriptorCount,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = nullptr,
+        });
+    }
     
     VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
         .pNext = nullptr,
         .flags = 0,
-        .bindingCount = 3,
-        .pBindings = descriptorSetLayoutBindings,
+        .bindingCount = static_cast<uint32_t>(descriptorSetLayoutBindings.size()),
+        .pBindings = descriptorSetLayoutBindings.data(),
     };
     
     VK_ASSERT_SUCCESS(vkCreateDescriptorSetLayout(logicalDevice,
                                                   &descriptorSetLayoutCreateInfo,
-                                                  nullptr,
+                                                  allocator,
                                                   &descriptorSetLayout),
                       "Failed to create descriptor set layout!");
 }
 
 void VulkanComputeProgram::destroyDescriptorSetLayout()
 {
-    vkDestroyDescriptorSetLayout(logicalDevice, descriptorSetLayout, nullptr);
+    if (descriptorSetLayout == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
+    vkDestroyDescriptorSetLayout(logicalDevice, descriptorSetLayout, allocator);
+    descriptorSetLayout = VK_NULL_HANDLE;
 }
 
 // MARK: - Descriptor Set
@@ -736,13 +1348,26 @@ void VulkanComputeProgram::createDescriptorSet()
 
 void VulkanComputeProgram::destroyDescriptorSet()
 {
+    if (descriptorSet == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
     vkFreeDescriptorSets(logicalDevice, descriptorPool, 1, &descriptorSet);
+    descriptorSet = VK_NULL_HANDLE;
 }
 
 // MARK: - Pipeline Layout
 
 void VulkanComputeProgram::createPipelineLayout()
 {
+    // Per-frame parameters are pushed straight into the command buffer, as much of them as the shader declares
+    VkPushConstantRange pushConstantRange {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = getPushConstantSize(),
+    };
+    
     // Create pipeline layout
     VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
@@ -750,23 +1375,101 @@ void VulkanComputeProgram::createPipelineLayout()
         .flags = 0,
         .setLayoutCount = 1,
         .pSetLayouts = &descriptorSetLayout,
-        .pushConstantRangeCount = 0,
-        .pPushConstantRanges = nullptr,
+        .pushConstantRangeCount = pushConstantRange.size > 0 ? 1u : 0u,
+        .pPushConstantRanges = &pushConstantRange,
     };
     
-    VK_ASSERT_SUCCESS(vkCreatePipelineLayout(logicalDevice, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout),
+    VK_ASSERT_SUCCESS(vkCreatePipelineLayout(logicalDevice, &pipelineLayoutCreateInfo, allocator, &pipelineLayout),
                       "Failed to create pipeline layout!");
 }
 
 void VulkanComputeProgram::destroyPipelineLayout()
 {
-    vkDestroyPipelineLayout(logicalDevice, pipelineLayout, nullptr);
+    if (pipelineLayout == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
+    vkDestroyPipelineLayout(logicalDevice, pipelineLayout, allocator);
+    pipelineLayout = VK_NULL_HANDLE;
 }
 
 // MARK: - Compute Pipeline
 
-void VulkanComputeProgram::createPipeline()
+// The values of the shader's specialization constants, in the order it declares them, for one pixel format
+// and quality. Constants the engine knows by name follow the frame; the rest take their override or the
+// shader's default.
+std::vector<uint32_t> VulkanComputeProgram::getSpecializationValues(PixelFormat pixelFormat, bool isDraftQuality)
+{
+    std::vector<uint32_t> values;
+    
+    for (const auto& specializationConstant : shaderLayout.specializationConstants)
+    {
+        auto value = specializationConstant.defaultValue;
+        
+        if (specializationConstant.name == "bitsPerChannel")
+        {
+            value = static_cast<uint32_t>(pixelFormat) * 2;
+        }
+        else if (specializationConstant.name == "isFloatFormat")
+        {
+            value = pixelFormat == ARGB128 ? 1 : 0;
+        }
+        else if (specializationConstant.name == "isDraftQuality")
+        {
+            value = isDraftQuality ? 1 : 0;
+        }
+        
+        auto override = specializationOverrides.find(specializationConstant.name);
+        if (override != specializationOverrides.end())
+        {
+            value = override->second;
+        }
+        
+        values.push_back(value);
+    }
+    
+    return values;
+}
+
+VkPipeline VulkanComputeProgram::getPipelineVariant(PixelFormat pixelFormat, bool isDraftQuality)
+{
+    auto key = PipelineVariantKey(pixelFormat, getSpecializationValues(pixelFormat, isDraftQuality));
+    
+    auto variant = pipelineVariants.find(key);
+    if (variant != pipelineVariants.end())
+    {
+        return variant->second;
+    }
+    
+    TRACE_ZONE("VulkanComputeProgram::createPipeline");
+    
+    auto pipeline = createPipeline(key.second);
+    pipelineVariants[key] = pipeline;
+    metrics.recordPipelineCreation();
+    
+    return pipeline;
+}
+
+VkPipeline VulkanComputeProgram::createPipeline(const std::vector<uint32_t>& specializationValues)
 {
+    std::vector<VkSpecializationMapEntry> mapEntries;
+    for (size_t i = 0; i < specializationValues.size(); ++i)
+    {
+        mapEntries.push_back({
+            .constantID = shaderLayout.specializationConstants[i].constantId,
+            .offset = static_cast<uint32_t>(i * sizeof(uint32_t)),
+            .size = sizeof(uint32_t),
+        });
+    }
+    
+    VkSpecializationInfo specializationInfo {
+        .mapEntryCount = static_cast<uint32_t>(mapEntries.size()),
+        .pMapEntries = mapEntries.data(),
+        .dataSize = specializationValues.size() * sizeof(uint32_t),
+        .pData = specializationValues.data(),
+    };
+    
     // Create shader stage
     VkPipelineShaderStageCreateInfo pipelineShaderStageCreateInfo {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
@@ -775,7 +1478,7 @@ void VulkanComputeProgram::createPipeline()
         .stage = VK_SHADER_STAGE_COMPUTE_BIT,
         .module = shaderModule,
         .pName = "main",
-        .pSpecializationInfo = nullptr,
+        .pSpecializationInfo = mapEntries.empty() ? nullptr : &specializationInfo,
     };
     
     // Create pipeline
@@ -789,13 +1492,28 @@ void VulkanComputeProgram::createPipeline()
         .basePipelineIndex = 0,
     };
     
-    VK_ASSERT_SUCCESS(vkCreateComputePipelines(logicalDevice, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &pipeline),
+    VkPipeline pipeline;
+    VK_ASSERT_SUCCESS(vkCreateComputePipelines(logicalDevice, context->getPipelineCache(), 1, &pipelineCreateInfo, allocator, &pipeline),
                       "Failed to create compute pipeline!");
+    
+    return pipeline;
+}
+
+void VulkanComputeProgram::destroyPipelineVariants()
+{
+    for (const auto& [key, pipeline] : pipelineVariants)
+    {
+        vkDestroyPipeline(logicalDevice, pipeline, allocator);
+    }
+    
+    pipelineVariants.clear();
 }
 
-void VulkanComputeProgram::destroyPipeline()
+void VulkanComputeProgram::setSpecializationConstant(const std::string& name, uint32_t value)
 {
-    vkDestroyPipeline(logicalDevice, pipeline, nullptr);
+    std::lock_guard<std::mutex> lock(textureReadWriteMutex);
+    specializationOverrides[name] = value;
+    framePipeline = VK_NULL_HANDLE;
 }
 
 // MARK: - Transition Image Layouts
@@ -803,89 +1521,771 @@ void VulkanComputeProgram::destroyPipeline()
 void VulkanComputeProgram::transitionImageLayout(VkImage& image, ImageLayoutTransitionInfo transitionInfo)
 {
     submitComputeQueue([&](VkCommandBuffer& commandBuffer) {
-        VkImageMemoryBarrier barrier {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            .pNext = nullptr,
-            .srcAccessMask = transitionInfo.srcAccessMask,
-            .dstAccessMask = transitionInfo.dstAccessMask,
-            .oldLayout = transitionInfo.oldLayout,
-            .newLayout = transitionInfo.newLayout,
-            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .image = image,
-            .subresourceRange = {
-                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                .baseMipLevel = 0,
-                .levelCount = 1,
-                .baseArrayLayer = 0,
-                .layerCount = 1,
-            },
-        };
-        
-        vkCmdPipelineBarrier(commandBuffer,
-                             transitionInfo.srcStageMask,
-                             transitionInfo.dstStageMask,
-                             0,
-                             0, nullptr,
-                             0, nullptr,
-                             1, &barrier);
+        recordImageLayoutTransition(commandBuffer, image, transitionInfo);
     });
 }
 
+void VulkanComputeProgram::recordImageLayoutTransition(VkCommandBuffer& commandBuffer,
+                                                       VkImage& image,
+                                                       const ImageLayoutTransitionInfo& transitionInfo,
+                                                       uint32_t baseLayer,
+                                                       uint32_t layerCount)
+{
+    VkImageMemoryBarrier barrier {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .pNext = nullptr,
+        .srcAccessMask = transitionInfo.srcAccessMask,
+        .dstAccessMask = transitionInfo.dstAccessMask,
+        .oldLayout = transitionInfo.oldLayout,
+        .newLayout = transitionInfo.newLayout,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        // Every layer by default. Only a sweep's upload moves some on their own, and it brings them back
+        // into line before it ends, so between submissions all of them rest in the same layout.
+        .subresourceRange = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel = 0,
+            .levelCount = 1,
+            .baseArrayLayer = baseLayer,
+            .layerCount = layerCount,
+        },
+    };
+    
+    vkCmdPipelineBarrier(commandBuffer,
+                         transitionInfo.srcStageMask,
+                         transitionInfo.dstStageMask,
+                         0,
+                         0, nullptr,
+                         0, nullptr,
+                         1, &barrier);
+}
+
 void VulkanComputeProgram::transitionImageLayouts()
 {
     // transition input image to shader readable
     transitionImageLayout(inputImage, {
         .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
         .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .srcStageMask = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-        .dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
         .srcAccessMask = VK_ACCESS_NONE_KHR,
         .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        .srcStageMask = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
     });
     
     // transition output image to shader writeable
     transitionImageLayout(outputImage, {
         .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
         .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-        .srcStageMask = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-        .dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
         .srcAccessMask = VK_ACCESS_NONE_KHR,
         .dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .srcStageMask = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
     });
 }
 
-// MARK: - Copy buffer to image
-void VulkanComputeProgram::copyInputBufferToImage()
+// MARK: - Progress
+
+void VulkanComputeProgram::beginProgress(const RenderProgressCallback& progressCallback, uint64_t stepCount)
 {
-    transitionImageLayout(inputImage, {
-        .oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .srcStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
-        .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-    });
+    this->progressCallback = &progressCallback;
+    progressStepsDone = 0;
+    progressStepCount = stepCount;
+    isFrameCancelled = false;
+}
+
+// Counts one step done and polls the callback, which is what decides whether the frame goes on
+void VulkanComputeProgram::reportProgress()
+{
+    progressStepsDone += 1;
     
-    submitComputeQueue([&](VkCommandBuffer& commandBuffer) {
-        VkBufferImageCopy region = {
-            .bufferOffset = 0,
-            .bufferRowLength = 0,
-            .bufferImageHeight = 0,
-            .imageSubresource = {
-                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                .mipLevel = 0,
+    if (!isFrameCancelled && *progressCallback && !(*progressCallback)(progressStepsDone, progressStepCount))
+    {
+        isFrameCancelled = true;
+    }
+}
+
+void VulkanComputeProgram::throwIfCancelled()
+{
+    if (isFrameCancelled)
+    {
+        metrics.recordCancellation();
+        throw RenderCancelledError();
+    }
+}
+
+// MARK: - Bands
+
+uint32_t VulkanComputeProgram::getBandCount()
+{
+    auto pixelCount = static_cast<uint64_t>(imageInfo.width) * imageInfo.height;
+    auto bandCount = (pixelCount + pixelsPerBand - 1) / pixelsPerBand;
+    
+    return static_cast<uint32_t>(std::clamp<uint64_t>(bandCount, 1, std::max<uint32_t>(imageInfo.height, 1)));
+}
+
+// Whole rows, so each band is one contiguous range of the tightly packed buffer
+VkBufferImageCopy VulkanComputeProgram::getBandRegion(uint32_t band, uint32_t bandCount)
+{
+    auto top = static_cast<uint32_t>(static_cast<uint64_t>(imageInfo.height) * band / bandCount);
+    auto bottom = static_cast<uint32_t>(static_cast<uint64_t>(imageInfo.height) * (band + 1) / bandCount);
+    
+    return {
+        .bufferOffset = static_cast<VkDeviceSize>(top) * imageInfo.width * imageInfo.pixelFormat,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .mipLevel = 0,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        },
+        .imageOffset = {0, static_cast<int32_t>(top), 0},
+        .imageExtent = {
+            imageInfo.width,
+            bottom - top,
+            1,
+        },
+    };
+}
+
+// MARK: - Frame Command Buffers
+
+VkCommandBuffer createCommandBuffer(VkDevice& logicalDevice, VkCommandPool& commandPool)
+{
+    VkCommandBufferAllocateInfo allocInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .pNext = nullptr,
+        .commandPool = commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+    
+    VkCommandBuffer commandBuffer;
+    VK_ASSERT_SUCCESS(vkAllocateCommandBuffers(logicalDevice, &allocInfo, &commandBuffer),
+                      "Failed to allocate command buffer!");
+    
+    return commandBuffer;
+}
+
+void destroyCommandBuffer(VkDevice& logicalDevice, VkCommandPool& commandPool, VkCommandBuffer& commandBuffer)
+{
+    vkFreeCommandBuffers(logicalDevice, commandPool, 1, &commandBuffer);
+}
+
+// The layouts the images rest in between frames, and the ones the transfers need
+const ImageLayoutTransitionInfo uploadBeginTransition {
+    .oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
+    .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .srcStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+};
+
+const ImageLayoutTransitionInfo uploadEndTransition {
+    .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+    .srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+};
+
+const ImageLayoutTransitionInfo readbackBeginTransition {
+    .oldLayout = VK_IMAGE_LAYOUT_GENERAL,
+    .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+    .srcStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+};
+
+const ImageLayoutTransitionInfo readbackEndTransition {
+    .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+    .srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+};
+
+// Records every upload and readback band against the current images and buffers. Nothing in them changes
+// until the images are recreated, so each frame only resubmits them.
+void VulkanComputeProgram::recordTransferCommands()
+{
+    TRACE_ZONE("VulkanComputeProgram::recordTransferCommands");
+    
+    auto bandCount = getBandCount();
+    
+    for (uint32_t band = 0; band < bandCount; ++band)
+    {
+        uploadCommandBuffers.push_back(createCommandBuffer(logicalDevice, commandPool));
+        recordCommandBuffer(uploadCommandBuffers.back(), 0, [&](VkCommandBuffer& commandBuffer) {
+            // Every frame starts here, so this is where the queries from the previous frame get reset.
+            if (band == 0)
+            {
+                if (timestampQueryPool != VK_NULL_HANDLE)
+                {
+                    vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, TimestampQueryCount);
+                }
+                
+                if (statisticsQueryPool != VK_NULL_HANDLE)
+                {
+                    vkCmdResetQueryPool(commandBuffer, statisticsQueryPool, 0, 1);
+                }
+                
+                writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, UploadBegin);
+                recordImageLayoutTransition(commandBuffer, inputImage, uploadBeginTransition);
+            }
+            
+            auto region = getBandRegion(band, bandCount);
+            
+            vkCmdCopyBufferToImage(commandBuffer,
+                                   inputBuffer,
+                                   inputImage,
+                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                   1,
+                                   &region);
+            
+            if (band == bandCount - 1)
+            {
+                recordImageLayoutTransition(commandBuffer, inputImage, uploadEndTransition);
+                writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, UploadEnd);
+            }
+        });
+        
+        readbackCommandBuffers.push_back(createCommandBuffer(logicalDevice, commandPool));
+        recordCommandBuffer(readbackCommandBuffers.back(), 0, [&](VkCommandBuffer& commandBuffer) {
+            if (band == 0)
+            {
+                writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, ReadbackBegin);
+                recordImageLayoutTransition(commandBuffer, outputImage, readbackBeginTransition);
+            }
+            
+            auto region = getBandRegion(band, bandCount);
+            
+            vkCmdCopyImageToBuffer(commandBuffer,
+                                   outputImage,
+                                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                   outputBuffer,
+                                   1,
+                                   &region);
+            
+            if (band == bandCount - 1)
+            {
+                recordImageLayoutTransition(commandBuffer, outputImage, readbackEndTransition);
+                writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, ReadbackEnd);
+            }
+        });
+    }
+    
+    // Only submitted when a frame is cancelled between bands, to put the image back in its resting layout
+    uploadRestoreCommandBuffer = createCommandBuffer(logicalDevice, commandPool);
+    recordCommandBuffer(uploadRestoreCommandBuffer, 0, [&](VkCommandBuffer& commandBuffer) {
+        recordImageLayoutTransition(commandBuffer, inputImage, uploadEndTransition);
+    });
+    
+    readbackRestoreCommandBuffer = createCommandBuffer(logicalDevice, commandPool);
+    recordCommandBuffer(readbackRestoreCommandBuffer, 0, [&](VkCommandBuffer& commandBuffer) {
+        recordImageLayoutTransition(commandBuffer, outputImage, readbackEndTransition);
+    });
+    
+    // Submitted instead of the upload bands when the input is the previous output. Starts a frame like the
+    // first band does and leaves both images in their resting layouts, so the rest of the frame is unchanged.
+    chainCommandBuffer = createCommandBuffer(logicalDevice, commandPool);
+    recordCommandBuffer(chainCommandBuffer, 0, [&](VkCommandBuffer& commandBuffer) {
+        if (timestampQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, TimestampQueryCount);
+        }
+        
+        if (statisticsQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdResetQueryPool(commandBuffer, statisticsQueryPool, 0, 1);
+        }
+        
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, UploadBegin);
+        recordImageLayoutTransition(commandBuffer, inputImage, uploadBeginTransition);
+        recordImageLayoutTransition(commandBuffer, outputImage, readbackBeginTransition);
+        
+        VkImageCopy region {
+            .srcSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
                 .baseArrayLayer = 0,
                 .layerCount = 1,
             },
-            .imageOffset = {0, 0, 0},
-            .imageExtent = {
-                imageInfo.width,
-                imageInfo.height,
-                1,
+            .srcOffset = { 0, 0, 0 },
+            .dstSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
             },
+            .dstOffset = { 0, 0, 0 },
+            .extent = { imageInfo.width, imageInfo.height, 1 },
         };
         
+        vkCmdCopyImage(commandBuffer,
+                       outputImage,
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       inputImage,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       1,
+                       &region);
+        
+        recordImageLayoutTransition(commandBuffer, inputImage, uploadEndTransition);
+        recordImageLayoutTransition(commandBuffer, outputImage, readbackEndTransition);
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, UploadEnd);
+    });
+    
+    metrics.recordCommandBufferRecording(2 * bandCount + 3);
+}
+
+// Safe to call with nothing recorded
+void VulkanComputeProgram::freeFrameCommandBuffers()
+{
+    std::vector<VkCommandBuffer> commandBuffers;
+    commandBuffers.insert(commandBuffers.end(), uploadCommandBuffers.begin(), uploadCommandBuffers.end());
+    commandBuffers.insert(commandBuffers.end(), readbackCommandBuffers.begin(), readbackCommandBuffers.end());
+    
+    for (auto commandBuffer : { uploadRestoreCommandBuffer,
+                                readbackRestoreCommandBuffer,
+                                dispatchCommandBuffer,
+                                chainCommandBuffer,
+                                batchUploadCommandBuffer,
+                                batchReadbackCommandBuffer,
+                                sweepUploadCommandBuffer })
+    {
+        if (commandBuffer != VK_NULL_HANDLE)
+        {
+            commandBuffers.push_back(commandBuffer);
+        }
+    }
+    
+    if (!commandBuffers.empty())
+    {
+        vkFreeCommandBuffers(logicalDevice,
+                             commandPool,
+                             static_cast<uint32_t>(commandBuffers.size()),
+                             commandBuffers.data());
+    }
+    
+    uploadCommandBuffers.clear();
+    readbackCommandBuffers.clear();
+    uploadRestoreCommandBuffer = readbackRestoreCommandBuffer = dispatchCommandBuffer = chainCommandBuffer = VK_NULL_HANDLE;
+    batchUploadCommandBuffer = batchReadbackCommandBuffer = sweepUploadCommandBuffer = VK_NULL_HANDLE;
+    recordedBatchLayerCount = recordedSweepLayerCount = 0;
+    recordedPipeline = VK_NULL_HANDLE;
+}
+
+// MARK: - Resident Output
+
+uint64_t VulkanComputeProgram::getResidentOutputHash(ImageInfo imageInfo)
+{
+    std::lock_guard<std::mutex> lock(residentOutputMutex);
+    
+    bool isMatch = residentOutputHash != 0
+        && imageInfo.width == residentOutputImageInfo.width
+        && imageInfo.height == residentOutputImageInfo.height
+        && imageInfo.pixelFormat == residentOutputImageInfo.pixelFormat
+        && std::chrono::steady_clock::now() - residentOutputTime < residentOutputWindow;
+    
+    return isMatch ? residentOutputHash : 0;
+}
+
+// Called with textureReadWriteMutex held, 0 once the output image changes or goes away
+void VulkanComputeProgram::setResidentOutputHash(uint64_t hash)
+{
+    std::lock_guard<std::mutex> lock(residentOutputMutex);
+    
+    residentOutputHash = hash;
+    residentOutputImageInfo = imageInfo;
+    residentOutputTime = std::chrono::steady_clock::now();
+}
+
+// Every output while a stack has recently been seen chaining, one in unchainedHashInterval otherwise
+bool VulkanComputeProgram::shouldHashOutput()
+{
+    if (framesToHash > 0)
+    {
+        framesToHash -= 1;
+        framesSinceHashed = 0;
+        return true;
+    }
+    
+    if (++framesSinceHashed >= unchainedHashInterval)
+    {
+        framesSinceHashed = 0;
+        return true;
+    }
+    
+    return false;
+}
+
+// MARK: - Batches
+
+void VulkanComputeProgram::setMaxBatchLayers(uint32_t layerCount)
+{
+    std::lock_guard<std::mutex> batchLock(batchMutex);
+    
+    maxBatchLayers = std::clamp<uint32_t>(layerCount, 1, maxBatchLayersLimit);
+}
+
+// Everything the one dispatch shares: the pipeline, the push constants and the parameter buffer. Each layer
+// reads its own uniforms from LayerUniforms, so a kernel that takes nothing as push constants only needs the
+// frames to agree on isDraftQuality, which picks the pipeline and sampler. An animated pivot still batches.
+bool VulkanComputeProgram::isSameBatch(const FrameBatch& batch,
+                                       ImageInfo imageInfo,
+                                       const UniformBufferObject& uniformBufferObject,
+                                       ParameterBlock parameterBlock)
+{
+    bool isSameUniforms = shaderLayout.layerUniforms.has_value() && getPushConstantSize() == 0
+        ? uniformBufferObject.isDraftQuality == batch.uniformBufferObject.isDraftQuality
+        : std::memcmp(&uniformBufferObject, &batch.uniformBufferObject, sizeof(UniformBufferObject)) == 0;
+    
+    return imageInfo.width == batch.imageInfo.width
+        && imageInfo.height == batch.imageInfo.height
+        && imageInfo.pixelFormat == batch.imageInfo.pixelFormat
+        && isSameUniforms
+        && parameterBlock.size == batch.parameterBlock.size
+        && (parameterBlock.size == 0 || std::memcmp(parameterBlock.data, batch.parameterBlock.data, parameterBlock.size) == 0);
+}
+
+// Called with batchLock held, on the member's own thread, so its copies and progress callback run where AE
+// expects them. Returns when the batch took the program; throws if its own frame failed or was cancelled.
+std::chrono::steady_clock::time_point VulkanComputeProgram::renderAsBatchMember(FrameBatch& batch,
+                                                                               uint32_t layer,
+                                                                               std::unique_lock<std::mutex>& batchLock)
+{
+    TRACE_ZONE("VulkanComputeProgram::renderAsBatchMember");
+    
+    auto& member = batch.members[layer];
+    auto layerSize = batch.imageInfo.size();
+    
+    // The leader waits for every member to be done before the batch goes out of scope
+    auto leave = [&]() {
+        batch.membersDone += 1;
+        batchCondition.notify_all();
+    };
+    
+    {
+        TRACE_ZONE("process/batchWait");
+        batchCondition.wait(batchLock, [&]() { return batch.phase != CollectingPhase; });
+    }
+    
+    auto batchStartTime = std::chrono::steady_clock::now();
+    
+    if (batch.phase == FailedPhase)
+    {
+        auto error = batch.error;
+        leave();
+        std::rethrow_exception(error);
+    }
+    
+    std::exception_ptr error;
+    
+    batchLock.unlock();
+    
+    try
+    {
+        TRACE_ZONE("process/writeInputPixels");
+        (*member.writeInputPixels)(batch.inputPixels + layer * layerSize);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    
+    // Polled once the copy is done, like a single frame's first step
+    bool isCancelled = error == nullptr && *member.progressCallback && !(*member.progressCallback)(1, 2);
+    
+    batchLock.lock();
+    
+    member.isCancelled = error != nullptr || isCancelled;
+    batch.membersWritten += 1;
+    batchCondition.notify_all();
+    
+    if (member.isCancelled)
+    {
+        leave();
+        
+        if (error != nullptr)
+        {
+            std::rethrow_exception(error);
+        }
+        
+        metrics.recordCancellation();
+        throw RenderCancelledError();
+    }
+    
+    batchCondition.wait(batchLock, [&]() { return batch.phase == OutputMappedPhase || batch.phase == FailedPhase; });
+    
+    if (batch.phase == FailedPhase)
+    {
+        error = batch.error;
+        leave();
+        std::rethrow_exception(error);
+    }
+    
+    batchLock.unlock();
+    
+    try
+    {
+        TRACE_ZONE("process/readOutputPixels");
+        (*member.readOutputPixels)(batch.outputPixels + layer * layerSize);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    
+    batchLock.lock();
+    leave();
+    
+    if (error != nullptr)
+    {
+        std::rethrow_exception(error);
+    }
+    
+    return batchStartTime;
+}
+
+// Called with textureReadWriteMutex held by the leader, whose own frame is layer 0. The batch only fails as a
+// whole if the GPU work does; a member whose own copy throws or that's cancelled only loses its layer.
+void VulkanComputeProgram::renderBatch(FrameBatch& batch, std::chrono::steady_clock::time_point processStartTime)
+{
+    TRACE_ZONE("VulkanComputeProgram::renderBatch");
+    
+    auto batchStartTime = std::chrono::steady_clock::now();
+    
+    auto imageInfo = batch.imageInfo;
+    auto layerCount = batch.memberCount;
+    auto layerSize = imageInfo.size();
+    auto& leader = batch.members[0];
+    
+    std::exception_ptr leaderError;
+    bool isInputMapped = false;
+    bool isOutputMapped = false;
+    
+    try
+    {
+        context->getMemoryBudget().touch(memoryCacheId);
+        regenerateImageBuffersIfNeeded(imageInfo, batch.layerCapacity);
+        updateParameterBuffer(batch.parameterBlock);
+        setDraftQuality(batch.uniformBufferObject.isDraftQuality != 0);
+        
+        // Every member's own, so the layers of an animated parameter each render their own frame
+        std::array<UniformBufferObject, maxBatchLayersLimit> layerUniforms;
+        for (uint32_t layer = 0; layer < layerCount; ++layer)
+        {
+            layerUniforms[layer] = batch.members[layer].uniformBufferObject;
+        }
+        updateLayerUniforms(layerUniforms.data(), layerCount);
+        
+        // Batched frames aren't captured: a capture replays one frame at a time
+        void* inputPixels;
+        VK_ASSERT_SUCCESS(vkMapMemory(logicalDevice, inputBufferMemory, 0, layerSize * layerCount, 0, &inputPixels),
+                          "Failed to map input buffer!");
+        isInputMapped = true;
+        
+        {
+            std::lock_guard<std::mutex> batchLock(batchMutex);
+            batch.inputPixels = static_cast<char*>(inputPixels);
+            batch.phase = InputMappedPhase;
+            batchCondition.notify_all();
+        }
+        
+        try
+        {
+            TRACE_ZONE("process/writeInputPixels");
+            (*leader.writeInputPixels)(inputPixels);
+        }
+        catch (...)
+        {
+            leaderError = std::current_exception();
+        }
+        
+        bool isLeaderCancelled = leaderError == nullptr && *leader.progressCallback && !(*leader.progressCallback)(1, 2);
+        
+        uint32_t liveMemberCount = 0;
+        {
+            std::unique_lock<std::mutex> batchLock(batchMutex);
+            leader.isCancelled = leaderError != nullptr || isLeaderCancelled;
+            batch.membersWritten += 1;
+            
+            TRACE_ZONE("process/batchWait");
+            batchCondition.wait(batchLock, [&]() { return batch.membersWritten == batch.memberCount; });
+            
+            for (uint32_t layer = 0; layer < layerCount; ++layer)
+            {
+                liveMemberCount += batch.members[layer].isCancelled ? 0 : 1;
+            }
+        }
+        
+        vkUnmapMemory(logicalDevice, inputBufferMemory);
+        isInputMapped = false;
+        
+        // Every member that's left is waiting for the output
+        if (liveMemberCount > 0)
+        {
+            // The output image won't hold the resident output any more, and the chained copy only knows layer 0
+            setResidentOutputHash(0);
+            
+            recordBatchTransferCommands(layerCount);
+            
+            {
+                TRACE_ZONE("process/copyInputBufferToImage");
+                submitCommandBuffer(batchUploadCommandBuffer);
+            }
+            
+            {
+                TRACE_ZONE("process/executeShader");
+                executeShader(batch.uniformBufferObject, layerCount);
+            }
+            
+            {
+                TRACE_ZONE("process/copyOutputImageToBuffer");
+                submitCommandBuffer(batchReadbackCommandBuffer);
+            }
+            
+            void* outputPixels;
+            VK_ASSERT_SUCCESS(vkMapMemory(logicalDevice, outputBufferMemory, 0, layerSize * layerCount, 0, &outputPixels),
+                              "Failed to map output buffer!");
+            isOutputMapped = true;
+            
+            {
+                std::lock_guard<std::mutex> batchLock(batchMutex);
+                batch.outputPixels = static_cast<char*>(outputPixels);
+                batch.phase = OutputMappedPhase;
+                batchCondition.notify_all();
+            }
+            
+            if (!leader.isCancelled)
+            {
+                try
+                {
+                    TRACE_ZONE("process/readOutputPixels");
+                    (*leader.readOutputPixels)(outputPixels);
+                }
+                catch (...)
+                {
+                    leaderError = std::current_exception();
+                }
+            }
+        }
+        
+        {
+            std::unique_lock<std::mutex> batchLock(batchMutex);
+            batchCondition.wait(batchLock, [&]() { return batch.membersDone == batch.memberCount - 1; });
+        }
+        
+        if (isOutputMapped)
+        {
+            vkUnmapMemory(logicalDevice, outputBufferMemory);
+            isOutputMapped = false;
+        }
+        
+        if (isLeaderCancelled)
+        {
+            metrics.recordCancellation();
+            leaderError = std::make_exception_ptr(RenderCancelledError());
+        }
+    }
+    catch (...)
+    {
+        // The members may still be copying, so the buffers stay mapped until they're done
+        failBatch(batch);
+        
+        if (isInputMapped)
+        {
+            vkUnmapMemory(logicalDevice, inputBufferMemory);
+        }
+        
+        if (isOutputMapped)
+        {
+            vkUnmapMemory(logicalDevice, outputBufferMemory);
+        }
+        
+        throw;
+    }
+    
+    metrics.recordBatch(layerCount);
+    
+    if (leaderError != nullptr)
+    {
+        std::rethrow_exception(leaderError);
+    }
+    
+    metrics.recordFrame(imageInfo,
+                        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - processStartTime).count(),
+                        std::chrono::duration<double, std::milli>(batchStartTime - processStartTime).count());
+    metrics.appendToLogIfDue();
+}
+
+// Hands the current exception to every member and waits until none of them is using the batch any more
+void VulkanComputeProgram::failBatch(FrameBatch& batch)
+{
+    std::unique_lock<std::mutex> batchLock(batchMutex);
+    
+    batch.error = std::current_exception();
+    batch.phase = FailedPhase;
+    batchCondition.notify_all();
+    
+    batchCondition.wait(batchLock, [&]() { return batch.membersDone == batch.memberCount - 1; });
+}
+
+// Like the first and last band of a single frame's transfers, but over layerCount layers at once. Recorded
+// again only when a batch of another size comes along.
+void VulkanComputeProgram::recordBatchTransferCommands(uint32_t layerCount)
+{
+    if (batchUploadCommandBuffer != VK_NULL_HANDLE && layerCount == recordedBatchLayerCount)
+    {
+        return;
+    }
+    
+    TRACE_ZONE("VulkanComputeProgram::recordBatchTransferCommands");
+    
+    if (batchUploadCommandBuffer == VK_NULL_HANDLE)
+    {
+        batchUploadCommandBuffer = createCommandBuffer(logicalDevice, commandPool);
+        batchReadbackCommandBuffer = createCommandBuffer(logicalDevice, commandPool);
+    }
+    
+    // The buffer holds the layers one after the other, tightly packed
+    VkBufferImageCopy region {
+        .bufferOffset = 0,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .mipLevel = 0,
+            .baseArrayLayer = 0,
+            .layerCount = layerCount,
+        },
+        .imageOffset = {0, 0, 0},
+        .imageExtent = {
+            imageInfo.width,
+            imageInfo.height,
+            1,
+        },
+    };
+    
+    recordCommandBuffer(batchUploadCommandBuffer, 0, [&](VkCommandBuffer& commandBuffer) {
+        if (timestampQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, TimestampQueryCount);
+        }
+        
+        if (statisticsQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdResetQueryPool(commandBuffer, statisticsQueryPool, 0, 1);
+        }
+        
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, UploadBegin);
+        recordImageLayoutTransition(commandBuffer, inputImage, uploadBeginTransition);
+        
         vkCmdCopyBufferToImage(commandBuffer,
                                inputBuffer,
                                inputImage,
@@ -893,180 +2293,415 @@ void VulkanComputeProgram::copyInputBufferToImage()
                                1,
                                &region);
         
+        recordImageLayoutTransition(commandBuffer, inputImage, uploadEndTransition);
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, UploadEnd);
     });
     
-    transitionImageLayout(inputImage, {
-        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
-        .dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+    recordCommandBuffer(batchReadbackCommandBuffer, 0, [&](VkCommandBuffer& commandBuffer) {
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, ReadbackBegin);
+        recordImageLayoutTransition(commandBuffer, outputImage, readbackBeginTransition);
+        
+        vkCmdCopyImageToBuffer(commandBuffer,
+                               outputImage,
+                               VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                               outputBuffer,
+                               1,
+                               &region);
+        
+        recordImageLayoutTransition(commandBuffer, outputImage, readbackEndTransition);
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, ReadbackEnd);
+        
+        // Nothing reads a batch's timings, and a sweep dispatches again after this without another upload to
+        // reset the queries it writes
+        if (timestampQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, TimestampQueryCount);
+        }
+        
+        if (statisticsQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdResetQueryPool(commandBuffer, statisticsQueryPool, 0, 1);
+        }
     });
+    
+    recordedBatchLayerCount = layerCount;
+    metrics.recordCommandBufferRecording(2);
 }
-// MARK: - Copy image to buffer
 
-void VulkanComputeProgram::copyOutputImageToBuffer()
+// MARK: - Sweeps
+
+void VulkanComputeProgram::processSweep(ImageInfo imageInfo,
+                                        const std::vector<UniformBufferObject>& variants,
+                                        const std::function<void(void*)>& writeInputPixels,
+                                        const std::function<void(size_t, void*)>& readVariantPixels,
+                                        ParameterBlock parameterBlock,
+                                        const RenderProgressCallback& progressCallback)
 {
-    transitionImageLayout(outputImage, {
-        .oldLayout = VK_IMAGE_LAYOUT_GENERAL,
+    TRACE_ZONE("VulkanComputeProgram::processSweep");
+    
+    if (variants.empty())
+    {
+        return;
+    }
+    
+    // The quality picks the pipeline and the sampler, which every layer of a dispatch shares
+    auto isDraft = variants[0].isDraftQuality != 0;
+    for (const auto& variant : variants)
+    {
+        if ((variant.isDraftQuality != 0) != isDraft)
+        {
+            throw std::runtime_error("Every variant of a sweep has to be of the same quality");
+        }
+    }
+    
+    std::lock_guard<std::mutex> lock(textureReadWriteMutex);
+    
+    // Without per-layer uniforms every layer of a dispatch would render the same variant
+    uint32_t layersPerDispatch = 1;
+    if (layerUniformsBuffer != VK_NULL_HANDLE)
+    {
+        auto layersInBudget = std::max<uint64_t>(1, maxSweepImageBytes / imageInfo.size());
+        layersPerDispatch = static_cast<uint32_t>(std::min<uint64_t>({ variants.size(), maxBatchLayersLimit, layersInBudget }));
+    }
+    
+    auto dispatchCount = (variants.size() + layersPerDispatch - 1) / layersPerDispatch;
+    
+    context->getMemoryBudget().touch(memoryCacheId);
+    regenerateImageBuffersIfNeeded(imageInfo, layersPerDispatch);
+    updateParameterBuffer(parameterBlock);
+    setDraftQuality(isDraft);
+    
+    // The input copy and its upload, then a dispatch, a readback and the output copies per dispatch
+    beginProgress(progressCallback, 2 + 3 * dispatchCount);
+    
+    auto imageSize = imageInfo.size();
+    
+    {
+        TRACE_ZONE("processSweep/writeInputPixels");
+        void* inputPixels;
+        VK_ASSERT_SUCCESS(vkMapMemory(logicalDevice, inputBufferMemory, 0, imageSize, 0, &inputPixels),
+                          "Failed to map input buffer!");
+        
+        // The caller's copy can throw (AE runs out of memory, the effect is cancelled); the next frame maps again
+        try
+        {
+            writeInputPixels(inputPixels);
+        }
+        catch (...)
+        {
+            vkUnmapMemory(logicalDevice, inputBufferMemory);
+            throw;
+        }
+        
+        vkUnmapMemory(logicalDevice, inputBufferMemory);
+    }
+    
+    reportProgress();
+    throwIfCancelled();
+    
+    // The output image won't hold the resident output any more
+    setResidentOutputHash(0);
+    
+    // Once for the whole sweep: the dispatches only write the output image
+    {
+        TRACE_ZONE("processSweep/copyInputBufferToImage");
+        recordSweepUploadCommands(layersPerDispatch);
+        submitCommandBuffer(sweepUploadCommandBuffer);
+    }
+    
+    reportProgress();
+    throwIfCancelled();
+    
+    for (size_t first = 0; first < variants.size(); first += layersPerDispatch)
+    {
+        auto layerCount = static_cast<uint32_t>(std::min<size_t>(layersPerDispatch, variants.size() - first));
+        
+        // The push constants are the first layer's, which is all a kernel without LayerUniforms renders
+        updateLayerUniforms(&variants[first], layerCount);
+        
+        {
+            TRACE_ZONE("processSweep/executeShader");
+            executeShader(variants[first], layerCount);
+        }
+        
+        reportProgress();
+        throwIfCancelled();
+        
+        {
+            TRACE_ZONE("processSweep/copyOutputImageToBuffer");
+            recordBatchTransferCommands(layerCount);
+            submitCommandBuffer(batchReadbackCommandBuffer);
+        }
+        
+        reportProgress();
+        throwIfCancelled();
+        
+        {
+            TRACE_ZONE("processSweep/readOutputPixels");
+            void* outputPixels;
+            VK_ASSERT_SUCCESS(vkMapMemory(logicalDevice, outputBufferMemory, 0, imageSize * layerCount, 0, &outputPixels),
+                              "Failed to map output buffer!");
+            
+            try
+            {
+                for (uint32_t layer = 0; layer < layerCount; ++layer)
+                {
+                    readVariantPixels(first + layer, static_cast<char*>(outputPixels) + layer * imageSize);
+                }
+            }
+            catch (...)
+            {
+                vkUnmapMemory(logicalDevice, outputBufferMemory);
+                throw;
+            }
+            
+            vkUnmapMemory(logicalDevice, outputBufferMemory);
+        }
+        
+        reportProgress();
+        throwIfCancelled();
+    }
+    
+    metrics.recordSweep(variants.size(), dispatchCount);
+    metrics.appendToLogIfDue();
+}
+
+// The input goes from the buffer to layer 0 and from there to the other layers, on the GPU, so it crosses
+// the bus once however many layers there are
+void VulkanComputeProgram::recordSweepUploadCommands(uint32_t layerCount)
+{
+    if (sweepUploadCommandBuffer != VK_NULL_HANDLE && layerCount == recordedSweepLayerCount)
+    {
+        return;
+    }
+    
+    TRACE_ZONE("VulkanComputeProgram::recordSweepUploadCommands");
+    
+    if (sweepUploadCommandBuffer == VK_NULL_HANDLE)
+    {
+        sweepUploadCommandBuffer = createCommandBuffer(logicalDevice, commandPool);
+    }
+    
+    // Layer 0 while the others are copied from it
+    const ImageLayoutTransitionInfo fanOutBeginTransition {
+        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
         .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        .srcStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
-        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
         .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-    });
+        .srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+    };
     
-    submitComputeQueue([&](VkCommandBuffer& commandBuffer) {
-        VkBufferImageCopy region = {
-            .bufferOffset = 0,
-            .bufferRowLength = 0,
-            .bufferImageHeight = 0,
-            .imageSubresource = {
+    const ImageLayoutTransitionInfo fanOutEndTransition {
+        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        .srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    };
+    
+    auto region = getBandRegion(0, 1);
+    
+    std::vector<VkImageCopy> fanOutRegions;
+    for (uint32_t layer = 1; layer < layerCount; ++layer)
+    {
+        fanOutRegions.push_back({
+            .srcSubresource = {
                 .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
                 .mipLevel = 0,
                 .baseArrayLayer = 0,
                 .layerCount = 1,
             },
-            .imageOffset = {0, 0, 0},
-            .imageExtent = {
-                imageInfo.width,
-                imageInfo.height,
-                1,
+            .srcOffset = { 0, 0, 0 },
+            .dstSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
+                .baseArrayLayer = layer,
+                .layerCount = 1,
             },
-        };
+            .dstOffset = { 0, 0, 0 },
+            .extent = { imageInfo.width, imageInfo.height, 1 },
+        });
+    }
+    
+    recordCommandBuffer(sweepUploadCommandBuffer, 0, [&](VkCommandBuffer& commandBuffer) {
+        if (timestampQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, TimestampQueryCount);
+        }
         
-        vkCmdCopyImageToBuffer(commandBuffer,
-                               outputImage,
-                               VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                               outputBuffer,
+        if (statisticsQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdResetQueryPool(commandBuffer, statisticsQueryPool, 0, 1);
+        }
+        
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, UploadBegin);
+        recordImageLayoutTransition(commandBuffer, inputImage, uploadBeginTransition);
+        
+        vkCmdCopyBufferToImage(commandBuffer,
+                               inputBuffer,
+                               inputImage,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                                1,
                                &region);
         
+        if (fanOutRegions.empty())
+        {
+            recordImageLayoutTransition(commandBuffer, inputImage, uploadEndTransition);
+        }
+        else
+        {
+            recordImageLayoutTransition(commandBuffer, inputImage, fanOutBeginTransition, 0, 1);
+            
+            vkCmdCopyImage(commandBuffer,
+                           inputImage,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           inputImage,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           static_cast<uint32_t>(fanOutRegions.size()),
+                           fanOutRegions.data());
+            
+            recordImageLayoutTransition(commandBuffer, inputImage, fanOutEndTransition, 0, 1);
+            recordImageLayoutTransition(commandBuffer, inputImage, uploadEndTransition, 1);
+        }
+        
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, UploadEnd);
     });
     
-    transitionImageLayout(outputImage, {
-        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-        .srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
-        .dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-        .srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
-    });
+    recordedSweepLayerCount = layerCount;
+    metrics.recordCommandBufferRecording(1);
+}
+
+// MARK: - Copy buffer to image
+
+void VulkanComputeProgram::copyInputBufferToImage()
+{
+    submitTransferBands(uploadCommandBuffers, uploadRestoreCommandBuffer);
+}
+
+// MARK: - Copy image to buffer
+
+void VulkanComputeProgram::copyOutputImageToBuffer()
+{
+    submitTransferBands(readbackCommandBuffers, readbackRestoreCommandBuffer);
 }
+
+// Stops early once the frame is cancelled. The first band moves the image out of its resting layout and the
+// last moves it back, so a frame stopped in between submits the restore buffer instead.
+void VulkanComputeProgram::submitTransferBands(const std::vector<VkCommandBuffer>& bandCommandBuffers,
+                                               VkCommandBuffer restoreCommandBuffer)
+{
+    size_t band = 0;
+    for (; band < bandCommandBuffers.size() && !isFrameCancelled; ++band)
+    {
+        submitCommandBuffer(bandCommandBuffers[band]);
+        reportProgress();
+    }
+    
+    if (band > 0 && band < bandCommandBuffers.size())
+    {
+        submitCommandBuffer(restoreCommandBuffer);
+    }
+}
+
 // MARK: - Update Descriptor Set
 
 void VulkanComputeProgram::updateDescriptorSet()
 {
-    // update the descriptor sets with input/output buffer info
-    
-    // Input
-    
+    // Each binding gets the resource its type stands for; validateShaderLayout made sure that's unambiguous
     VkDescriptorImageInfo inputImageInfo {
-        .sampler = inputSampler,
+        .sampler = isDraftQuality ? context->getNearestSampler() : context->getLinearSampler(),
         .imageView = inputImageView,
         .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
     };
     
-    VkWriteDescriptorSet inputWriteDescriptorSet {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .pNext = nullptr,
-        .dstSet = descriptorSet,
-        .dstBinding = 0,
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .pImageInfo = &inputImageInfo,
-        .pBufferInfo = nullptr,
-        .pTexelBufferView = nullptr,
-    };
-    
-    // Output
-    
     VkDescriptorImageInfo outputImageInfo {
-        .sampler = outputSampler,
+        .sampler = context->getNearestSampler(),
         .imageView = outputImageView,
         .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
     };
     
-    VkWriteDescriptorSet outputWriteDescriptorSet {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .pNext = nullptr,
-        .dstSet = descriptorSet,
-        .dstBinding = 1,
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-        .pImageInfo = &outputImageInfo,
-        .pBufferInfo = nullptr,
-        .pTexelBufferView = nullptr,
+    VkDescriptorBufferInfo parameterBufferInfo {
+        .buffer = parameterBuffer,
+        .offset = 0,
+        .range = parameterBufferSize,
     };
     
-    // Uniforms
-    
-    VkDescriptorBufferInfo uniformBufferInfo {
-        .buffer = uniformBuffer,
+    VkDescriptorBufferInfo layerUniformsBufferInfo {
+        .buffer = layerUniformsBuffer,
         .offset = 0,
-        .range = sizeof(UniformBufferObject),
+        .range = VK_WHOLE_SIZE,
     };
     
-    VkWriteDescriptorSet uniformWriteDescriptorSet {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .pNext = nullptr,
-        .dstSet = descriptorSet,
-        .dstBinding = 2,
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        .pImageInfo = nullptr,
-        .pBufferInfo = &uniformBufferInfo,
-        .pTexelBufferView = nullptr,
-    };
+    std::vector<VkWriteDescriptorSet> writeDescriptorSets;
+    for (const auto& binding : shaderLayout.bindings)
+    {
+        VkWriteDescriptorSet writeDescriptorSet {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = descriptorSet,
+            .dstBinding = binding.binding,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = binding.descriptorType,
+            .pImageInfo = nullptr,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        };
+        
+        switch (binding.descriptorType)
+        {
+            case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+                writeDescriptorSet.pImageInfo = &outputImageInfo;
+                break;
+            case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+            case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+                writeDescriptorSet.pBufferInfo = binding.isLayerUniforms ? &layerUniformsBufferInfo : &parameterBufferInfo;
+                break;
+            default:
+                // The input image, with its sampler, or either one on its own
+                writeDescriptorSet.pImageInfo = &inputImageInfo;
+                break;
+        }
+        
+        writeDescriptorSets.push_back(writeDescriptorSet);
+    }
     
-    VkWriteDescriptorSet writeDescriptorSet[3] = {
-        inputWriteDescriptorSet,
-        outputWriteDescriptorSet,
-        uniformWriteDescriptorSet,
-    };
+    vkUpdateDescriptorSets(logicalDevice,
+                           static_cast<uint32_t>(writeDescriptorSets.size()),
+                           writeDescriptorSets.data(),
+                           0,
+                           nullptr);
     
-    vkUpdateDescriptorSets(logicalDevice, 3, writeDescriptorSet, 0, nullptr);
+    // Updating a bound set invalidates the recorded dispatch
+    recordedPipeline = VK_NULL_HANDLE;
 }
 
 
 // MARK: - Submit Compute Queue
 
-VkCommandBuffer createCommandBuffer(VkDevice& logicalDevice, VkCommandPool& commandPool)
+// For one-off work outside the frame, like the layout transitions of new images
+void VulkanComputeProgram::submitComputeQueue(std::function<void(VkCommandBuffer&)> recordCommands)
 {
-    VkCommandBufferAllocateInfo allocInfo {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .pNext = nullptr,
-        .commandPool = commandPool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1,
-    };
+    auto commandBuffer = createCommandBuffer(logicalDevice, commandPool);
     
-    VkCommandBuffer commandBuffer;
-    VK_ASSERT_SUCCESS(vkAllocateCommandBuffers(logicalDevice, &allocInfo, &commandBuffer),
-                      "Failed to allocate command buffer!");
+    recordCommandBuffer(commandBuffer, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, recordCommands);
+    submitCommandBuffer(commandBuffer);
     
-    return commandBuffer;
-}
-
-void destroyCommandBuffer(VkDevice& logicalDevice, VkCommandPool& commandPool, VkCommandBuffer& commandBuffer)
-{
-    vkFreeCommandBuffers(logicalDevice, commandPool, 1, &commandBuffer);
+    // Cleanup
+    destroyCommandBuffer(logicalDevice, commandPool, commandBuffer);
 }
 
-void VulkanComputeProgram::submitComputeQueue(std::function<void(VkCommandBuffer&)> recordCommands)
+// Begins, records and ends. A buffer that was recorded before is reset first, which the command pool allows.
+void VulkanComputeProgram::recordCommandBuffer(VkCommandBuffer commandBuffer,
+                                               VkCommandBufferUsageFlags usageFlags,
+                                               std::function<void(VkCommandBuffer&)> recordCommands)
 {
-    auto commandBuffer = createCommandBuffer(logicalDevice, commandPool);
-    
-    // Begin, record, and end command buffer.
-    
     VkCommandBufferBeginInfo beginInfo {
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
         .pNext = nullptr,
-        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        .flags = usageFlags,
         .pInheritanceInfo = nullptr,
     };
     
@@ -1077,10 +2712,12 @@ void VulkanComputeProgram::submitComputeQueue(std::function<void(VkCommandBuffer
     
     VK_ASSERT_SUCCESS(vkEndCommandBuffer(commandBuffer),
                       "Failed to end command buffer!");
-    
-    // Submit compute queue
-    
-    // TODO: Use semaphores and fences
+}
+
+// Submits and waits. Each submission finishes before the next is made, so a reusable buffer is never pending
+// when it's submitted again.
+void VulkanComputeProgram::submitCommandBuffer(VkCommandBuffer commandBuffer)
+{
     VkSubmitInfo submitInfo {
         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
         .pNext = nullptr,
@@ -1093,23 +2730,150 @@ void VulkanComputeProgram::submitComputeQueue(std::function<void(VkCommandBuffer
         .pSignalSemaphores = nullptr,
     };
     
-    VK_ASSERT_SUCCESS(vkQueueSubmit(computeQueue, 1, &submitInfo, VK_NULL_HANDLE),
-                      "Failed to submit compute queue!");
+    // Other programs share the queue, so wait for this submission only
+    context->submit(submitInfo, submitFence);
     
-    VK_ASSERT_SUCCESS(vkQueueWaitIdle(computeQueue),
-                      "Failed to wait for compute queue idle!");
+    VK_ASSERT_SUCCESS(vkWaitForFences(logicalDevice, 1, &submitFence, VK_TRUE, UINT64_MAX),
+                      "Failed to wait for compute queue submission!");
     
-    // Cleanup
-    destroyCommandBuffer(logicalDevice, commandPool, commandBuffer);
+    VK_ASSERT_SUCCESS(vkResetFences(logicalDevice, 1, &submitFence),
+                      "Failed to reset submit fence!");
 }
 
 // MARK: - Execute Shader
 
-void VulkanComputeProgram::executeShader()
+// Over the first layerCount layers, gl_GlobalInvocationID.z being the layer
+void VulkanComputeProgram::executeShader(UniformBufferObject uniformBufferObject, uint32_t layerCount)
 {
-    submitComputeQueue([&](VkCommandBuffer& commandBuffer) {
+    recordDispatchIfNeeded(uniformBufferObject, layerCount);
+    submitCommandBuffer(dispatchCommandBuffer);
+}
+
+// The push constants are part of the recording, so the dispatch is recorded again when they change, as well
+// as when the pipeline variant or the layer count changes or the descriptor set is updated (which invalidates
+// the recording). A frame that only changes pixels replays the last one.
+void VulkanComputeProgram::recordDispatchIfNeeded(UniformBufferObject uniformBufferObject, uint32_t layerCount)
+{
+    // Looked up again only when the format, the quality or an override changes: building the key allocates
+    if (framePipeline == VK_NULL_HANDLE)
+    {
+        framePipeline = getPipelineVariant(imageInfo.pixelFormat, isDraftQuality);
+    }
+    
+    auto pipeline = framePipeline;
+    
+    if (dispatchCommandBuffer != VK_NULL_HANDLE
+        && pipeline == recordedPipeline
+        && layerCount == recordedDispatchLayerCount
+        && std::memcmp(&uniformBufferObject, &recordedUniformBufferObject, getPushConstantSize()) == 0)
+    {
+        return;
+    }
+    
+    TRACE_ZONE("VulkanComputeProgram::recordDispatch");
+    
+    if (dispatchCommandBuffer == VK_NULL_HANDLE)
+    {
+        dispatchCommandBuffer = createCommandBuffer(logicalDevice, commandPool);
+    }
+    
+    recordCommandBuffer(dispatchCommandBuffer, 0, [&](VkCommandBuffer& commandBuffer) {
         vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
         vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
-        vkCmdDispatch(commandBuffer, imageInfo.width, imageInfo.height, 1);
+        if (getPushConstantSize() > 0)
+        {
+            vkCmdPushConstants(commandBuffer,
+                               pipelineLayout,
+                               VK_SHADER_STAGE_COMPUTE_BIT,
+                               0,
+                               getPushConstantSize(),
+                               &uniformBufferObject);
+        }
+        
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, DispatchBegin);
+        
+        if (statisticsQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdBeginQuery(commandBuffer, statisticsQueryPool, 0, 0);
+        }
+        
+        // One invocation per pixel. The shipped kernels use a 1x1 workgroup and read the image size from gl_NumWorkGroups.
+        const auto& localSize = shaderLayout.localSize;
+        vkCmdDispatch(commandBuffer,
+                      (imageInfo.width + localSize[0] - 1) / localSize[0],
+                      (imageInfo.height + localSize[1] - 1) / localSize[1],
+                      (layerCount + localSize[2] - 1) / localSize[2]);
+        
+        if (statisticsQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdEndQuery(commandBuffer, statisticsQueryPool, 0);
+        }
+        
+        writeTimestamp(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, DispatchEnd);
     });
+    
+    recordedPipeline = pipeline;
+    recordedUniformBufferObject = uniformBufferObject;
+    recordedDispatchLayerCount = layerCount;
+    metrics.recordCommandBufferRecording(1);
+}
+
+// MARK: - GPU Timestamps
+
+void VulkanComputeProgram::writeTimestamp(VkCommandBuffer& commandBuffer, VkPipelineStageFlagBits stage, uint32_t query)
+{
+    if (timestampQueryPool == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
+    vkCmdWriteTimestamp(commandBuffer, stage, timestampQueryPool, query);
+}
+
+// Reads back this frame's queries. The queue is already idle by the time this is called, so nothing waits.
+void VulkanComputeProgram::recordGpuTimings()
+{
+    if (timestampQueryPool == VK_NULL_HANDLE)
+    {
+        return;
+    }
+    
+    uint64_t timestamps[TimestampQueryCount];
+    VK_ASSERT_SUCCESS(vkGetQueryPoolResults(logicalDevice,
+                                            timestampQueryPool,
+                                            0,
+                                            TimestampQueryCount,
+                                            sizeof(timestamps),
+                                            timestamps,
+                                            sizeof(uint64_t),
+                                            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT),
+                      "Failed to read timestamp queries!");
+    
+    uint64_t shaderInvocations = 0;
+    if (statisticsQueryPool != VK_NULL_HANDLE)
+    {
+        VK_ASSERT_SUCCESS(vkGetQueryPoolResults(logicalDevice,
+                                                statisticsQueryPool,
+                                                0,
+                                                1,
+                                                sizeof(shaderInvocations),
+                                                &shaderInvocations,
+                                                sizeof(uint64_t),
+                                                VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT),
+                          "Failed to read pipeline statistics query!");
+    }
+    
+    // timestampPeriod is in nanoseconds per tick
+    auto elapsedMs = [&](uint32_t begin, uint32_t end) {
+        auto ticks = (timestamps[end] - timestamps[begin]) & timestampMask;
+        return static_cast<double>(ticks) * static_cast<double>(timestampPeriod) * 1e-6;
+    };
+    
+    gpuTimingStats.record(imageInfo,
+                          {
+                              elapsedMs(UploadBegin, UploadEnd),
+                              elapsedMs(DispatchBegin, DispatchEnd),
+                              elapsedMs(ReadbackBegin, ReadbackEnd),
+                          },
+                          shaderInvocations);
 }
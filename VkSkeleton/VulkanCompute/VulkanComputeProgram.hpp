@@ -8,43 +8,168 @@
 #ifndef VulkanComputeProgram_hpp
 #define VulkanComputeProgram_hpp
 
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
 #include <vector>
 #include <vulkan/vulkan.h>
 
+#include "FrameCapture.hpp"
+#include "GpuTimingStats.hpp"
+#include "HostAllocator.hpp"
+#include "MemoryBudget.hpp"
+#include "RenderMetrics.hpp"
+#include "ShaderReflection.hpp"
 #include "VulkanComputeDataTypes.hpp"
+#include "VulkanContext.hpp"
 
+// One kernel on the process-wide VulkanContext: its shader, pipeline, descriptors and images
 class VulkanComputeProgram
 {
 public:
     
+    // Most frames setMaxBatchLayers can allow in one batch
+    static const uint32_t maxBatchLayersLimit = 8;
+    
     void setUp(std::string shaderFilePath);
+    
+    // Runs the whole chain of pointwise kernels as one fused dispatch.
+    void setUp(std::vector<PointwiseKernel> pointwiseKernels);
     void tearDown();
     
+    // progressCallback is polled between every submission and host copy; if it returns false the frame
+    // stops there and RenderCancelledError is thrown.
+    //
+    // inputHash is the ContentHash of the input pixels, or 0 if the caller didn't hash them. If it matches
+    // getResidentOutputHash, the previous output is copied to the input on the GPU and writeInputPixels is
+    // never called.
     void process(ImageInfo imageInfo,
                  UniformBufferObject uniformBufferObject,
-                 std::function<void(void*)> writeInputPixels,
-                 std::function<void(void*)> readOutputPixels);
+                 const std::function<void(void*)>& writeInputPixels,
+                 const std::function<void(void*)>& readOutputPixels,
+                 ParameterBlock parameterBlock = {},
+                 const RenderProgressCallback& progressCallback = {},
+                 uint64_t inputHash = 0);
+    
+    // The ContentHash of the last output, which is still in the output image, if it's of the same size and
+    // format and recent enough to be the input of the next effect in a stack; 0 otherwise. Cheap, and never
+    // waits for a frame in progress.
+    uint64_t getResidentOutputHash(ImageInfo imageInfo);
+    
+    // Frames of the same size, format and parameters that call process while another frame is rendering
+    // are rendered together once it's done: one upload, one dispatch and one readback for up to layerCount
+    // frames, each in its own layer of arrayed images. Every caller still copies its own pixels on its own
+    // thread. Only kernels that declare their images as arrays (sampler2DArray and image2DArray, with the
+    // layer in gl_GlobalInvocationID.z) are batched. A kernel that reads its UniformBufferObject from
+    // LayerUniforms and has no push constants batches frames whose uniforms differ, as long as they agree on
+    // isDraftQuality; any other kernel only batches identical ones. 1 turns batching off; the default is 4.
+    void setMaxBatchLayers(uint32_t layerCount);
+    
+    // Renders one input once per variant, for previews of the same frame at several settings. The input is
+    // uploaded once and copied to every layer on the GPU. A kernel that declares LayerUniforms reads each
+    // layer's UniformBufferObject from it and renders up to maxBatchLayersLimit variants per dispatch; any
+    // other kernel renders one variant per dispatch from the same upload. readVariantPixels gets each
+    // variant's output with its index, in order. The variants have to agree on isDraftQuality.
+    void processSweep(ImageInfo imageInfo,
+                      const std::vector<UniformBufferObject>& variants,
+                      const std::function<void(void*)>& writeInputPixels,
+                      const std::function<void(size_t, void*)>& readVariantPixels,
+                      ParameterBlock parameterBlock = {},
+                      const RenderProgressCallback& progressCallback = {});
+    
+    // GPU time spent uploading, dispatching and reading back, per image size and format.
+    // Empty if the compute queue doesn't support timestamps.
+    std::vector<GpuTimingReport> getGpuTimingStats();
+    void resetGpuTimingStats();
+    
+    // Always-on counters and latency histograms, also appended as JSON lines to the metrics log if one is set.
+    RenderMetricsSnapshot getMetricsSnapshot();
+    void setMetricsLogPath(const std::string& logPath);
+    
+    // Writes the inputs of one render in every sampleInterval (0 for only requested renders) to a capture
+    // file that vkskeleton_replay can play back. An empty path stops capturing.
+    void setFrameCapturePath(const std::string& capturePath, uint32_t sampleInterval);
+    void requestFrameCapture(uint32_t frameCount);
+    
+    // The kernel's interface as reflected from its SPIR-V, which every descriptor, the push constant range
+    // and the parameter buffer are built from. parameterBlock describes what process's ParameterBlock holds.
+    const ShaderReflection::ShaderLayout& getShaderLayout();
+    
+    // Overrides a specialization constant, by name, in every pipeline variant from the next frame on.
+    // The shader can also declare `uint bitsPerChannel`, `bool isFloatFormat` and `bool isDraftQuality`,
+    // which follow the frame's pixel format and quality unless overridden here.
+    void setSpecializationConstant(const std::string& name, uint32_t value);
+    
+    // Each step of the last setUp, in order, up to the one that threw if it failed. The shared context's own
+    // creation only shows up as acquireContext, and only for the program that happened to create it.
+    std::vector<SetUpPhaseTiming> getSetUpTimings();
+    
+    // As the driver reports it, empty until setUp has found a device
+    std::string getDeviceName();
+    
+    // Device memory across every program on the shared context: each heap's budget and usage, and what the
+    // engine holds per category. Empty until setUp has found a device.
+    MemoryBudgetSnapshot getMemoryBudgetSnapshot();
+    
+    // The host memory the driver allocated for this program, per allocation scope: OBJECT for the objects
+    // it created, COMMAND for recording its command buffers. Live counts should drop to zero at tearDown,
+    // which checks them and records what's left as leakedAllocations.
+    HostAllocationSnapshot getHostAllocationSnapshot();
+    
+    // Caps the driver's host memory for this program. Creating an object past it fails like running out of
+    // host memory. 0 for no limit.
+    void setHostMemoryLimit(uint64_t limitBytes);
     
 private:
-    // Persisted objects
-    VkInstance                  instance;
-    VkDebugUtilsMessengerEXT    debugMessenger;
-    uint32_t                    computeQueueFamilyIndex;
+    // Shared objects, held for as long as the program is set up. The handles are copied out of the context.
+    std::shared_ptr<VulkanContext> context;
+    uint32_t                    computeQueueFamilyIndex     = 0;
     VkPhysicalDevice            physicalDevice              = VK_NULL_HANDLE;
-    VkDevice                    logicalDevice;
-    VkQueue                     computeQueue;
+    VkDevice                    logicalDevice               = VK_NULL_HANDLE;
+    float                       timestampPeriod             = 0.f;
+    uint64_t                    timestampMask               = 0;
+    bool                        isPipelineStatisticsSupported = false;
+    
+    // Every object this program creates goes through its own allocator, so its numbers are its own
+    HostAllocator               hostAllocator;
+    const VkAllocationCallbacks* allocator                  = hostAllocator.getCallbacks();
+    
+    // Persisted objects
     std::string                 shaderFilePath;
-    VkShaderModule              shaderModule;
-    VkCommandPool               commandPool;
-    VkDescriptorPool            descriptorPool;
-    VkSampler                   inputSampler;
-    VkSampler                   outputSampler;
-    VkBuffer                    uniformBuffer               = VK_NULL_HANDLE;
-    VkDeviceMemory              uniformBufferMemory         = VK_NULL_HANDLE;
+    std::vector<PointwiseKernel> pointwiseKernels;
+    std::string                 kernelId;
+    MemoryBudget::CacheId       memoryCacheId               = 0;
+    VkShaderModule              shaderModule                = VK_NULL_HANDLE;
+    ShaderReflection::ShaderLayout shaderLayout;
+    VkCommandPool               commandPool                 = VK_NULL_HANDLE;
+    VkFence                     submitFence                 = VK_NULL_HANDLE;
+    VkDescriptorPool            descriptorPool              = VK_NULL_HANDLE;
+    VkQueryPool                 timestampQueryPool          = VK_NULL_HANDLE;
+    VkQueryPool                 statisticsQueryPool         = VK_NULL_HANDLE;
+    VkBuffer                    parameterBuffer             = VK_NULL_HANDLE;
+    VkDeviceMemory              parameterBufferMemory       = VK_NULL_HANDLE;
+    VkDeviceSize                parameterBufferSize         = 0;
+    void*                       parameterBufferData         = nullptr;
+    VkBuffer                    layerUniformsBuffer         = VK_NULL_HANDLE;   // maxBatchLayersLimit layers
+    VkDeviceMemory              layerUniformsBufferMemory   = VK_NULL_HANDLE;
+    UniformBufferObject*        layerUniformsData           = nullptr;
+    
+    VkDescriptorSetLayout       descriptorSetLayout         = VK_NULL_HANDLE;
+    VkPipelineLayout            pipelineLayout              = VK_NULL_HANDLE;
+    VkDescriptorSet             descriptorSet               = VK_NULL_HANDLE;
+    
+    // Pipelines of this kernel, one per pixel format and set of specialization constant values.
+    // Built for every format at setUp and kept until tearDown.
+    using PipelineVariantKey = std::pair<PixelFormat, std::vector<uint32_t>>;
+    std::map<PipelineVariantKey, VkPipeline> pipelineVariants;
+    std::map<std::string, uint32_t> specializationOverrides;
     
     // Ephemeral objects
     VkBuffer                    inputBuffer                 = VK_NULL_HANDLE;
@@ -59,47 +184,130 @@ private:
     VkDeviceMemory              outputImageMemory           = VK_NULL_HANDLE;
     VkImageView                 outputImageView             = VK_NULL_HANDLE;
     
-    VkDescriptorSetLayout       descriptorSetLayout         = VK_NULL_HANDLE;
-    VkPipelineLayout            pipelineLayout              = VK_NULL_HANDLE;
-    VkPipeline                  pipeline                    = VK_NULL_HANDLE;
-    VkDescriptorSet             descriptorSet               = VK_NULL_HANDLE;
+    // The frame's command buffers, recorded with the images and replayed every frame. The dispatch is
+    // recorded again when its pipeline, push constants or descriptor set change.
+    std::vector<VkCommandBuffer> uploadCommandBuffers;      // one per band
+    std::vector<VkCommandBuffer> readbackCommandBuffers;    // one per band
+    VkCommandBuffer             uploadRestoreCommandBuffer  = VK_NULL_HANDLE;
+    VkCommandBuffer             readbackRestoreCommandBuffer = VK_NULL_HANDLE;
+    VkCommandBuffer             dispatchCommandBuffer       = VK_NULL_HANDLE;
+    VkCommandBuffer             chainCommandBuffer          = VK_NULL_HANDLE;   // output image to input image
+    VkCommandBuffer             batchUploadCommandBuffer    = VK_NULL_HANDLE;   // every layer of a batch at once
+    VkCommandBuffer             batchReadbackCommandBuffer  = VK_NULL_HANDLE;
+    uint32_t                    recordedBatchLayerCount     = 0;
+    VkCommandBuffer             sweepUploadCommandBuffer    = VK_NULL_HANDLE;   // one input to every layer
+    uint32_t                    recordedSweepLayerCount     = 0;
+    uint32_t                    recordedDispatchLayerCount  = 0;
+    VkPipeline                  framePipeline               = VK_NULL_HANDLE;   // the variant for imageInfo and isDraftQuality
+    VkPipeline                  recordedPipeline            = VK_NULL_HANDLE;
+    UniformBufferObject         recordedUniformBufferObject {};
     
     // Synchronization
     std::mutex textureReadWriteMutex;
     
+    // What the output image holds, for the next effect in a stack to start from. Behind its own mutex so
+    // SmartRender can ask before hashing its input without waiting for another frame's render.
+    std::mutex residentOutputMutex;
+    uint64_t residentOutputHash = 0;
+    ImageInfo residentOutputImageInfo {};
+    std::chrono::steady_clock::time_point residentOutputTime;
+    uint32_t framesToHash = 0;          // left of the run of outputs hashed after the last chained frame
+    uint32_t framesSinceHashed = 0;
+    
+    enum BatchPhase {
+        CollectingPhase,        // taking members until the leader gets the program
+        InputMappedPhase,       // every member writes its layer of the input buffer
+        OutputMappedPhase,      // every member reads its layer of the output buffer
+        FailedPhase,            // the batch itself failed; every member gets error
+    };
+    
+    // One frame of a batch, pointing at the arguments of the process call waiting for it
+    struct BatchMember {
+        UniformBufferObject                 uniformBufferObject;    // its layer of LayerUniforms
+        const std::function<void(void*)>*   writeInputPixels;
+        const std::function<void(void*)>*   readOutputPixels;
+        const RenderProgressCallback*       progressCallback;
+        bool                                isCancelled;        // or its own copy threw; its layer is skipped
+    };
+    
+    // Lives on the stack of the process call that leads it, which doesn't return until every member is done
+    // with it. Only touched with batchMutex held, apart from each member's own layer of the mapped buffers.
+    struct FrameBatch {
+        ImageInfo                           imageInfo;
+        UniformBufferObject                 uniformBufferObject;    // the leader's: the pipeline and push constants
+        ParameterBlock                      parameterBlock;
+        uint32_t                            layerCapacity;
+        std::array<BatchMember, maxBatchLayersLimit> members;
+        uint32_t                            memberCount;
+        uint32_t                            membersWritten;     // including the leader
+        uint32_t                            membersDone;        // not including the leader
+        BatchPhase                          phase;
+        char*                               inputPixels;
+        char*                               outputPixels;
+        std::exception_ptr                  error;
+    };
+    
+    std::mutex                  batchMutex;
+    std::condition_variable     batchCondition;
+    FrameBatch*                 openBatch                   = nullptr;
+    uint32_t                    maxBatchLayers              = 4;
+    bool                        isLayeredKernel             = false;    // its images are arrays
+    uint32_t                    layerCount                  = 1;        // of the images and buffers
+    
     // Compute info
     ImageInfo imageInfo;
+    bool isDraftQuality = false;    // which sampler the descriptor set reads the input through
     
-    // Convenience methods
-    void regenerateImageBuffersIfNeeded(ImageInfo imageInfo);
-    void updateUniformBuffer(UniformBufferObject uniformBufferObject);
-    
-    // Object management methods
-    void createVulkanInstance();
-    void destroyVulkanInstance();
+    // Progress of the frame in process. The callback is process's own argument, only valid while it runs.
+    const RenderProgressCallback* progressCallback = nullptr;
+    uint64_t progressStepsDone = 0;
+    uint64_t progressStepCount = 0;
+    bool isFrameCancelled = false;
     
-    void createDebugMessenger();
-    void destroyDebugMessenger();
+    // Profiling
+    std::vector<SetUpPhaseTiming> setUpTimings;
+    GpuTimingStats gpuTimingStats;
+    RenderMetrics metrics;
+    FrameCaptureWriter frameCapture;
     
-    void assignPhysicalDevice();
+    // Convenience methods
+    void regenerateImageBuffersIfNeeded(ImageInfo imageInfo, uint32_t layerCount);
+    void setDraftQuality(bool isDraftQuality);
+    void updateParameterBuffer(ParameterBlock parameterBlock);
+    void updateLayerUniforms(const UniformBufferObject* layers, uint32_t layerCount);
+    uint64_t getDeviceMemoryInUse(MemoryCategory category);
+    void reportDeviceMemoryInUse();
     
-    void createLogicalDevice();
-    void destroyLogicalDevice();
+    // Object management methods
+    void setUpPersistedObjects();
+    void destroyPersistedObjects();
     
     void createShaderModule();
     void destroyShaderModule();
+    void validateShaderLayout();
+    uint32_t getPushConstantSize();
     
     void createCommandPool();
     void destroyCommandPool();
     
+    void createSubmitFence();
+    void destroySubmitFence();
+    
     void createDescriptorPool();
     void destroyDescriptorPool();
     
-    void createSamplers();
-    void destroySamplers();
+    void createQueryPools();
+    void destroyQueryPools();
+    
+    void createParameterBuffer(VkDeviceSize bufferSize);
+    void destroyParameterBuffer();
+    
+    void createLayerUniformsBuffer();
+    void destroyLayerUniformsBuffer();
     
-    void createUniformBuffer();
-    void destroyUniformBuffer();
+    void createImageResources();
+    void releaseImageResources();
+    bool evictImageResources();
     
     void createImageBuffers();
     void destroyImageBuffers();
@@ -129,20 +337,63 @@ private:
     void createPipelineLayout();
     void destroyPipelineLayout();
     
-    void createPipeline();
-    void destroyPipeline();
+    std::vector<uint32_t> getSpecializationValues(PixelFormat pixelFormat, bool isDraftQuality);
+    VkPipeline getPipelineVariant(PixelFormat pixelFormat, bool isDraftQuality);
+    VkPipeline createPipeline(const std::vector<uint32_t>& specializationValues);
+    void destroyPipelineVariants();
     
     void updateDescriptorSet();
     
     void transitionImageLayout(VkImage& image, ImageLayoutTransitionInfo transitionInfo);
+    void recordImageLayoutTransition(VkCommandBuffer& commandBuffer,
+                                     VkImage& image,
+                                     const ImageLayoutTransitionInfo& transitionInfo,
+                                     uint32_t baseLayer = 0,
+                                     uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS);
     void transitionImageLayouts();
     
+    void beginProgress(const RenderProgressCallback& progressCallback, uint64_t stepCount);
+    void reportProgress();
+    void throwIfCancelled();
+    
+    uint32_t getBandCount();
+    VkBufferImageCopy getBandRegion(uint32_t band, uint32_t bandCount);
+    
+    void recordTransferCommands();
+    void freeFrameCommandBuffers();
+    
+    void setResidentOutputHash(uint64_t hash);
+    bool shouldHashOutput();
+    
+    bool isSameBatch(const FrameBatch& batch,
+                     ImageInfo imageInfo,
+                     const UniformBufferObject& uniformBufferObject,
+                     ParameterBlock parameterBlock);
+    std::chrono::steady_clock::time_point renderAsBatchMember(FrameBatch& batch,
+                                                              uint32_t layer,
+                                                              std::unique_lock<std::mutex>& batchLock);
+    void renderBatch(FrameBatch& batch, std::chrono::steady_clock::time_point processStartTime);
+    void failBatch(FrameBatch& batch);
+    void recordBatchTransferCommands(uint32_t layerCount);
+    
+    void recordSweepUploadCommands(uint32_t layerCount);
+    
     void copyInputBufferToImage();
     void copyOutputImageToBuffer();
+    void submitTransferBands(const std::vector<VkCommandBuffer>& bandCommandBuffers,
+                             VkCommandBuffer restoreCommandBuffer);
     
     void submitComputeQueue(std::function<void(VkCommandBuffer&)> recordCommands);
+    void recordCommandBuffer(VkCommandBuffer commandBuffer,
+                             VkCommandBufferUsageFlags usageFlags,
+                             std::function<void(VkCommandBuffer&)> recordCommands);
+    void submitCommandBuffer(VkCommandBuffer commandBuffer);
+    
+    void executeShader(UniformBufferObject uniformBufferObject, uint32_t layerCount);
+    void recordDispatchIfNeeded(UniformBufferObject uniformBufferObject, uint32_t layerCount);
     
-    void executeShader();
+    void writeTimestamp(VkCommandBuffer& commandBuffer, VkPipelineStageFlagBits stage, uint32_t query);
+    void recordGpuTimings();
     
 };
 
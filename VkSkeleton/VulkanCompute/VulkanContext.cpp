@@ -0,0 +1,456 @@
+//
+//  VulkanContext.cpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#include <chrono>
+#include <cstring>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include "VulkanContext.hpp"
+
+#include "TraceUtils.hpp"
+#include "VulkanDebugUtils.hpp"
+#include "VulkanUtils.hpp"
+
+// MARK: - Shared Instance
+
+// Weak, so the context lives exactly as long as some program holds it
+static std::mutex sharedContextMutex;
+static std::weak_ptr<VulkanContext> sharedContext;
+
+std::shared_ptr<VulkanContext> VulkanContext::acquire(bool* wasCreated)
+{
+    std::lock_guard<std::mutex> lock(sharedContextMutex);
+
+    auto context = sharedContext.lock();
+    if (wasCreated != nullptr)
+    {
+        *wasCreated = !context;
+    }
+
+    if (!context)
+    {
+        TRACE_ZONE("VulkanContext::create");
+        context = std::make_shared<VulkanContext>();
+        sharedContext = context;
+    }
+
+    return context;
+}
+
+// MARK: - Constructor
+
+VulkanContext::VulkanContext()
+{
+    try
+    {
+        runTimedPhase(creationTimings, "instance", [&]() { createVulkanInstance(); });
+        runTimedPhase(creationTimings, "debugMessenger", [&]() { createDebugMessenger(); });
+        runTimedPhase(creationTimings, "physicalDevice", [&]() { assignPhysicalDevice(); });
+        runTimedPhase(creationTimings, "logicalDevice", [&]() { createLogicalDevice(); });
+        runTimedPhase(creationTimings, "pipelineCache", [&]() { createPipelineCache(); });
+        runTimedPhase(creationTimings, "samplers", [&]() { createSamplers(); });
+        runTimedPhase(creationTimings, "memoryBudget", [&]() { memoryBudget.initialize(instance, physicalDevice, isMemoryBudgetSupported); });
+    } catch (...)
+    {
+        destroyAll();
+        throw;
+    }
+}
+
+void VulkanContext::runTimedPhase(std::vector<SetUpPhaseTiming>& timings,
+                                  const char* name,
+                                  const std::function<void()>& step)
+{
+    TRACE_ZONE(name);
+
+    auto startTime = std::chrono::steady_clock::now();
+    step();
+    auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+
+    timings.push_back({ .name = name, .ms = ms });
+}
+
+// MARK: - Destructor
+
+VulkanContext::~VulkanContext()
+{
+    destroyAll();
+}
+
+void VulkanContext::destroyAll()
+{
+    if (logicalDevice != VK_NULL_HANDLE)
+    {
+        destroySamplers();
+        destroyPipelineCache();
+        destroyLogicalDevice();
+    }
+
+    if (instance != VK_NULL_HANDLE)
+    {
+        destroyDebugMessenger();
+        destroyVulkanInstance();
+    }
+
+    hostAllocator.checkForLeaks("VulkanContext");
+}
+
+// MARK: - Submit
+
+void VulkanContext::submit(const VkSubmitInfo& submitInfo, VkFence fence)
+{
+    std::lock_guard<std::mutex> lock(queueMutex);
+
+    VK_ASSERT_SUCCESS(vkQueueSubmit(computeQueue, 1, &submitInfo, fence),
+                      "Failed to submit compute queue!");
+}
+
+// MARK: - Vulkan Instance
+
+const std::vector<const char*> baseInstanceExtensions = {
+    VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
+};
+
+static std::vector<const char*> getRequiredInstanceExtensionNames()
+{
+    std::vector<const char*> extensions(baseInstanceExtensions.begin(), baseInstanceExtensions.end());
+
+    if (VulkanDebugUtils::isValidationEnabled())
+    {
+        extensions.emplace_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    }
+
+    return extensions;
+}
+
+void VulkanContext::createVulkanInstance()
+{
+    if (VulkanDebugUtils::isValidationEnabled() && !VulkanDebugUtils::isValidationSupported())
+    {
+        throw std::runtime_error("Validation layers requested, but not available!");
+    }
+
+    VkApplicationInfo appInfo {
+        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        .pApplicationName = "Hello Triangle",
+        .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
+        .pEngineName = "No Engine",
+        .engineVersion = VK_MAKE_VERSION(1, 0, 0),
+        .apiVersion = VK_API_VERSION_1_0,
+    };
+
+    auto requiredExtensionNames = getRequiredInstanceExtensionNames();
+
+    VkInstanceCreateInfo createInfo {
+        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pApplicationInfo = &appInfo,
+        .enabledExtensionCount = static_cast<uint32_t>(requiredExtensionNames.size()),
+        .ppEnabledExtensionNames = requiredExtensionNames.data(),
+    };
+
+    // Add a debugger to the instance, if enabled.
+    auto debugCreateInfo = VulkanDebugUtils::getDebugMessengerCreateInfo();
+
+    if (VulkanDebugUtils::isValidationEnabled())
+    {
+        createInfo.enabledLayerCount = static_cast<uint32_t>(VulkanDebugUtils::validationLayers.size());
+        createInfo.ppEnabledLayerNames = VulkanDebugUtils::validationLayers.data();
+        createInfo.pNext = &debugCreateInfo;
+    } else
+    {
+        createInfo.enabledLayerCount = 0;
+    }
+
+    // Create the instance!
+    VK_ASSERT_SUCCESS(vkCreateInstance(&createInfo, hostAllocator.getCallbacks(), &instance),
+                      "failed to create Vulkan instance!");
+}
+
+void VulkanContext::destroyVulkanInstance()
+{
+    vkDestroyInstance(instance, hostAllocator.getCallbacks());
+    instance = VK_NULL_HANDLE;
+}
+
+
+// MARK: - Debug Messenger
+void VulkanContext::createDebugMessenger()
+{
+    if (!VulkanDebugUtils::isValidationEnabled())
+    {
+        return;
+    }
+
+    auto createInfo = VulkanDebugUtils::getDebugMessengerCreateInfo();
+    VK_ASSERT_SUCCESS(VulkanDebugUtils::createDebugUtilsMessengerEXT(instance, &createInfo, hostAllocator.getCallbacks(), &debugMessenger),
+                      "Failed to set up debug messenger!");
+}
+
+void VulkanContext::destroyDebugMessenger()
+{
+    if (!VulkanDebugUtils::isValidationEnabled() || debugMessenger == VK_NULL_HANDLE)
+    {
+        return;
+    }
+
+    VulkanDebugUtils::destroyDebugUtilsMessengerEXT(instance, debugMessenger, hostAllocator.getCallbacks());
+    debugMessenger = VK_NULL_HANDLE;
+}
+
+// MARK: - Physical Device
+
+// Enabled whenever the device advertises them. MoltenVK requires the portability subset, lavapipe doesn't have it.
+// The memory budget lets MemoryBudget see what other applications are using; it falls back to an estimate without.
+const std::vector<const char*> deviceExtensions = {
+    "VK_KHR_portability_subset",
+    VK_EXT_MEMORY_BUDGET_EXTENSION_NAME,
+};
+
+const std::vector<const char*> requiredDeviceExtensions = {
+    // No special extensions for compute
+};
+
+static bool isPhysicalDeviceExtensionSupportAdequate(VkPhysicalDevice device)
+{
+    if (requiredDeviceExtensions.size() == 0)
+    {
+        return true;
+    }
+
+    // Fetch all device extension properties.
+    uint32_t extensionPropertiesCount;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionPropertiesCount, nullptr);
+
+    std::vector<VkExtensionProperties> deviceExtensionProperties(extensionPropertiesCount);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionPropertiesCount, deviceExtensionProperties.data());
+
+    // Create a set from the requiredExtensionNames vector.
+    std::set<const char*> requiredExtensionSet(requiredDeviceExtensions.begin(), requiredDeviceExtensions.end());
+
+    // Iterate through the deviceExtensionProperties, removing device extension names from the requiredExtensionNamesSet.
+    for (const auto& extension : deviceExtensionProperties)
+    {
+        requiredExtensionSet.erase(extension.extensionName);
+    }
+
+    // If requiredExtensionNamesSet is empty, then the device fully supports all required extensions.
+    return requiredExtensionSet.empty();
+}
+
+static std::optional<uint32_t> findComputeQueueFamilyIndex(VkPhysicalDevice physicalDevice)
+{
+    uint32_t queueFamilyPropertiesCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, nullptr);
+
+    std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyPropertiesCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, queueFamilyProperties.data());
+
+    for (uint32_t i = 0; i < queueFamilyPropertiesCount; ++i)
+    {
+        if (queueFamilyProperties[i].queueFlags & VK_QUEUE_COMPUTE_BIT)
+        {
+            return i;
+        }
+
+        ++i;
+    }
+
+    return NULL;
+}
+
+static std::vector<const char*> getEnabledDeviceExtensionNames(VkPhysicalDevice device)
+{
+    uint32_t extensionPropertiesCount;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionPropertiesCount, nullptr);
+
+    std::vector<VkExtensionProperties> deviceExtensionProperties(extensionPropertiesCount);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionPropertiesCount, deviceExtensionProperties.data());
+
+    std::vector<const char*> enabledExtensionNames;
+    for (const auto& extensionName : deviceExtensions)
+    {
+        for (const auto& extension : deviceExtensionProperties)
+        {
+            if (strcmp(extension.extensionName, extensionName) == 0)
+            {
+                enabledExtensionNames.push_back(extensionName);
+                break;
+            }
+        }
+    }
+
+    return enabledExtensionNames;
+}
+
+static bool isPhysicalDeviceSuitable(VkPhysicalDevice device)
+{
+    // TODO: Check for optimal device, not just the first one with the Compute capability.
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device, &properties);
+
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(device, &features);
+
+    auto allRequiredExtensionsSupported = isPhysicalDeviceExtensionSupportAdequate(device);
+
+    auto computeQueueFamilyIndex = findComputeQueueFamilyIndex(device);
+
+    return allRequiredExtensionsSupported && computeQueueFamilyIndex.has_value();
+}
+
+void VulkanContext::assignPhysicalDevice()
+{
+    // Find out how many devices there are.
+    uint32_t physicalDeviceCount = 0;
+    vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, nullptr);
+
+    // No devices? Throw an error. :(
+    if (physicalDeviceCount == 0)
+    {
+        throw std::runtime_error("Failed to find any GPUs with Vulkan support!");
+    }
+
+    // Fetch all of the physical devices
+    std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
+    vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices.data());
+
+    for (const auto& device : physicalDevices)
+    {
+
+        // TODO: Find the most suitable device, not just the first
+        if (isPhysicalDeviceSuitable(device))
+        {
+            physicalDevice = device;
+            break;
+        }
+    }
+
+    if (physicalDevice == VK_NULL_HANDLE)
+    {
+        throw std::runtime_error("Failed to find a suitable GPU!");
+    }
+    computeQueueFamilyIndex = findComputeQueueFamilyIndex(physicalDevice).value();
+
+    // Timestamp support is per queue family, pipeline statistics are an optional device feature.
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(physicalDevice, &features);
+
+    uint32_t queueFamilyPropertiesCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, nullptr);
+
+    std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyPropertiesCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, queueFamilyProperties.data());
+
+    auto timestampValidBits = queueFamilyProperties[computeQueueFamilyIndex].timestampValidBits;
+
+    deviceName = properties.deviceName;
+    timestampPeriod = properties.limits.timestampPeriod;
+    timestampMask = timestampValidBits >= 64 ? ~0ULL : (1ULL << timestampValidBits) - 1;
+    isPipelineStatisticsSupported = features.pipelineStatisticsQuery == VK_TRUE;
+}
+
+// MARK: - Logical Device
+
+void VulkanContext::createLogicalDevice()
+{
+    float queuePriority = 1.0f;
+
+    VkDeviceQueueCreateInfo deviceQueueCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = computeQueueFamilyIndex,
+        .queueCount = 1,
+        .pQueuePriorities = &queuePriority,
+    };
+
+    VkPhysicalDeviceFeatures deviceFeatures {
+        .pipelineStatisticsQuery = isPipelineStatisticsSupported ? VK_TRUE : VK_FALSE,
+        .shaderStorageImageWriteWithoutFormat = VK_TRUE,
+    };
+
+    auto enabledExtensionNames = getEnabledDeviceExtensionNames(physicalDevice);
+
+    for (const auto& extensionName : enabledExtensionNames)
+    {
+        isMemoryBudgetSupported = isMemoryBudgetSupported || strcmp(extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0;
+    }
+
+    VkDeviceCreateInfo deviceCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .queueCreateInfoCount = 1,
+        .pQueueCreateInfos = &deviceQueueCreateInfo,
+        .enabledExtensionCount = static_cast<uint32_t>(enabledExtensionNames.size()),
+        .ppEnabledExtensionNames = enabledExtensionNames.data(),
+        .pEnabledFeatures = &deviceFeatures,
+    };
+
+    if (VulkanDebugUtils::isValidationEnabled())
+    {
+        deviceCreateInfo.enabledLayerCount = static_cast<uint32_t>(VulkanDebugUtils::validationLayers.size());
+        deviceCreateInfo.ppEnabledLayerNames = VulkanDebugUtils::validationLayers.data();
+    } else
+    {
+        deviceCreateInfo.enabledLayerCount = 0;
+    }
+
+    VK_ASSERT_SUCCESS(vkCreateDevice(physicalDevice, &deviceCreateInfo, hostAllocator.getCallbacks(), &logicalDevice),
+                      "Failed to create logical device!");
+
+    vkGetDeviceQueue(logicalDevice, computeQueueFamilyIndex, 0, &computeQueue);
+}
+
+void VulkanContext::destroyLogicalDevice()
+{
+    vkDestroyDevice(logicalDevice, hostAllocator.getCallbacks());
+    logicalDevice = VK_NULL_HANDLE;
+}
+
+// MARK: - Pipeline Cache
+
+// Every program's pipeline variants go through this one cache, so a kernel another effect already compiled
+// comes out of the driver's cache.
+// Pipeline caches are internally synchronized, so programs can use it from any thread.
+void VulkanContext::createPipelineCache()
+{
+    VkPipelineCacheCreateInfo createInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .initialDataSize = 0,
+        .pInitialData = nullptr,
+    };
+
+    VK_ASSERT_SUCCESS(vkCreatePipelineCache(logicalDevice, &createInfo, hostAllocator.getCallbacks(), &pipelineCache),
+                      "Failed to create pipeline cache!");
+}
+
+void VulkanContext::destroyPipelineCache()
+{
+    vkDestroyPipelineCache(logicalDevice, pipelineCache, hostAllocator.getCallbacks());
+    pipelineCache = VK_NULL_HANDLE;
+}
+
+// MARK: - Samplers
+
+void VulkanContext::createSamplers()
+{
+    VulkanUtils::createSampler(logicalDevice, hostAllocator.getCallbacks(), VK_FILTER_LINEAR, linearSampler);
+    VulkanUtils::createSampler(logicalDevice, hostAllocator.getCallbacks(), VK_FILTER_NEAREST, nearestSampler);
+}
+
+void VulkanContext::destroySamplers()
+{
+    vkDestroySampler(logicalDevice, linearSampler, hostAllocator.getCallbacks());
+    vkDestroySampler(logicalDevice, nearestSampler, hostAllocator.getCallbacks());
+    linearSampler = VK_NULL_HANDLE;
+    nearestSampler = VK_NULL_HANDLE;
+}
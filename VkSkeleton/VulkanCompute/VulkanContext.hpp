@@ -0,0 +1,125 @@
+//
+//  VulkanContext.hpp
+//  VkSkeleton
+//
+//  Created by James Perlman on 12/14/21.
+//
+
+#ifndef VulkanContext_hpp
+#define VulkanContext_hpp
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+#include "HostAllocator.hpp"
+#include "MemoryBudget.hpp"
+#include "VulkanComputeDataTypes.hpp"
+
+// The Vulkan instance, device, compute queue, samplers and pipeline cache, shared by every
+// VulkanComputeProgram in the process. Each program only adds its own shader, pipeline, pools and images,
+// so another effect or another kernel costs about what its images do instead of a whole device.
+//
+// Reference counted: the first acquire() creates the context, and it's destroyed when the last program
+// holding it tears down.
+class VulkanContext
+{
+public:
+
+    // Throws if there's no usable Vulkan device. wasCreated, if given, is set to whether this call created it.
+    static std::shared_ptr<VulkanContext> acquire(bool* wasCreated = nullptr);
+
+    VulkanContext();
+    ~VulkanContext();
+
+    VulkanContext(const VulkanContext&) = delete;
+    VulkanContext& operator=(const VulkanContext&) = delete;
+
+    // Runs one setup step as a trace zone and appends how long it took to timings.
+    // name must be a string literal, like a TRACE_ZONE name.
+    static void runTimedPhase(std::vector<SetUpPhaseTiming>& timings, const char* name, const std::function<void()>& step);
+
+    // Each step of creating this context, in order
+    const std::vector<SetUpPhaseTiming>& getCreationTimings() const { return creationTimings; }
+
+    VkPhysicalDevice getPhysicalDevice() const { return physicalDevice; }
+    VkDevice getLogicalDevice() const { return logicalDevice; }
+    uint32_t getComputeQueueFamilyIndex() const { return computeQueueFamilyIndex; }
+    VkPipelineCache getPipelineCache() const { return pipelineCache; }
+    VkSampler getLinearSampler() const { return linearSampler; }
+    VkSampler getNearestSampler() const { return nearestSampler; }
+
+    // MARK: - Device Info
+
+    const std::string& getDeviceName() const { return deviceName; }
+
+    // Nanoseconds per timestamp tick, and the bits of a timestamp that are valid (0 if there are none)
+    float getTimestampPeriod() const { return timestampPeriod; }
+    uint64_t getTimestampMask() const { return timestampMask; }
+
+    bool getIsPipelineStatisticsSupported() const { return isPipelineStatisticsSupported; }
+
+    // MARK: - Memory
+
+    // Every program's frame resources are registered here, so one effect can evict another's before the
+    // device runs out
+    MemoryBudget& getMemoryBudget() { return memoryBudget; }
+
+    // The driver's host memory for the instance, the device and the other shared objects. Each program
+    // creates its own objects with its own allocator.
+    HostAllocator& getHostAllocator() { return hostAllocator; }
+
+    // MARK: - Submit
+
+    // The queue needs external synchronization, so every program submits through here.
+    // Signals fence when the work is done; the caller waits on it, not on the whole queue.
+    void submit(const VkSubmitInfo& submitInfo, VkFence fence);
+
+private:
+    VkInstance                  instance                    = VK_NULL_HANDLE;
+    VkDebugUtilsMessengerEXT    debugMessenger              = VK_NULL_HANDLE;
+    VkPhysicalDevice            physicalDevice              = VK_NULL_HANDLE;
+    uint32_t                    computeQueueFamilyIndex     = 0;
+    std::string                 deviceName;
+    float                       timestampPeriod             = 0.f;
+    uint64_t                    timestampMask               = 0;
+    bool                        isPipelineStatisticsSupported = false;
+    bool                        isMemoryBudgetSupported     = false;
+    VkDevice                    logicalDevice               = VK_NULL_HANDLE;
+    VkQueue                     computeQueue                = VK_NULL_HANDLE;
+    VkPipelineCache             pipelineCache               = VK_NULL_HANDLE;
+    VkSampler                   linearSampler               = VK_NULL_HANDLE;
+    VkSampler                   nearestSampler              = VK_NULL_HANDLE;
+
+    std::mutex                  queueMutex;
+
+    MemoryBudget                memoryBudget;
+    HostAllocator               hostAllocator;
+
+    std::vector<SetUpPhaseTiming> creationTimings;
+
+    void createVulkanInstance();
+    void destroyVulkanInstance();
+
+    void createDebugMessenger();
+    void destroyDebugMessenger();
+
+    void assignPhysicalDevice();
+
+    void createLogicalDevice();
+    void destroyLogicalDevice();
+
+    void createPipelineCache();
+    void destroyPipelineCache();
+
+    void createSamplers();
+    void destroySamplers();
+
+    // Whatever has been created so far, in reverse order. Safe to call after a failed constructor step.
+    void destroyAll();
+};
+
+#endif /* VulkanContext_hpp */